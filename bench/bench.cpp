@@ -0,0 +1,850 @@
+// Benchmark suite for the shell, run with `make bench`
+// Prints one JSON document with latency percentiles per benchmark
+
+#include "shell.h"
+#include "builtins.h"
+#include "pipeline.h"
+#include "redirection.h"
+#include "autocomplete.h"
+#include "arena.h"
+#include "variables.h"
+#include "globbing.h"
+#include "textutils.h"
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <algorithm>
+#include <functional>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+
+using namespace std;
+
+struct BenchResult
+{
+    string name;
+    string unit;
+    vector<double> samples;
+    double bytes_per_sample = 0; // set for throughput benchmarks
+};
+
+static vector<BenchResult> results;
+static bool quick_mode = false;
+static string name_filter;
+static long sort_gb = 1;
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static bool selected(const string &name)
+{
+    return name_filter.empty() || name.find(name_filter) != string::npos;
+}
+
+// Times `samples` runs of `batch` calls each and records ns per call
+static void run_bench(const string &name, int samples, int batch, const function<void()> &body)
+{
+    if (!selected(name))
+    {
+        return;
+    }
+
+    if (quick_mode)
+    {
+        samples = max(5, samples / 10);
+    }
+
+    // Warm caches before measuring
+    for (int i = 0; i < batch; i++)
+    {
+        body();
+    }
+
+    BenchResult result;
+    result.name = name;
+    result.unit = "ns/op";
+    for (int s = 0; s < samples; s++)
+    {
+        double start = now_ns();
+        for (int i = 0; i < batch; i++)
+        {
+            body();
+        }
+        result.samples.push_back((now_ns() - start) / batch);
+    }
+    results.push_back(result);
+}
+
+static double percentile(const vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+    size_t index = (size_t)(p / 100.0 * (sorted.size() - 1) + 0.5);
+    return sorted[min(index, sorted.size() - 1)];
+}
+
+static void print_results()
+{
+    struct utsname uts;
+    uname(&uts);
+
+    cout << "{\n  \"suite\": \"shell-bench\",\n  \"timestamp\": " << time(nullptr)
+         << ",\n  \"kernel\": \"" << uts.release << "\",\n  \"machine\": \"" << uts.machine
+         << "\",\n  \"quick\": " << (quick_mode ? "true" : "false") << ",\n  \"benchmarks\": [\n";
+
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        BenchResult &r = results[i];
+        vector<double> sorted = r.samples;
+        sort(sorted.begin(), sorted.end());
+        double sum = 0;
+        for (double v : sorted)
+        {
+            sum += v;
+        }
+
+        char line[1024];
+        snprintf(line, sizeof(line),
+                 "    {\"name\": \"%s\", \"unit\": \"%s\", \"samples\": %zu, \"min\": %.1f, \"mean\": %.1f, "
+                 "\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f",
+                 r.name.c_str(), r.unit.c_str(), sorted.size(), sorted.front(), sum / sorted.size(),
+                 percentile(sorted, 50), percentile(sorted, 90), percentile(sorted, 99), sorted.back());
+        cout << line;
+        if (r.bytes_per_sample > 0)
+        {
+            // Median sample converted to throughput
+            snprintf(line, sizeof(line), ", \"mb_per_s_p50\": %.1f",
+                     r.bytes_per_sample / (1024.0 * 1024.0) / (percentile(sorted, 50) / 1e9));
+            cout << line;
+        }
+        cout << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    cout << "  ]\n}" << endl;
+}
+
+// Runs body with stdout sent to /dev/null so command output does not skew timings
+static void silenced(const function<void()> &body)
+{
+    cout.flush();
+    int saved = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+
+    body();
+
+    cout.flush();
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    (void)st;
+    (void)type;
+    (void)ftw;
+    return remove(path);
+}
+
+static string make_temp_dir()
+{
+    char templ[] = "/tmp/shell-bench-XXXXXX";
+    char *dir = mkdtemp(templ);
+    if (!dir)
+    {
+        perror("mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+    return dir;
+}
+
+static void create_files(const string &dir, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        string path = dir + "/file_" + to_string(i) + ".txt";
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd != -1)
+        {
+            close(fd);
+        }
+    }
+}
+
+// Balanced tree of directories with a few files at every level
+static void create_tree(const string &dir, int depth, int fanout, int files)
+{
+    create_files(dir, files);
+    if (depth == 0)
+    {
+        return;
+    }
+    for (int i = 0; i < fanout; i++)
+    {
+        string sub = dir + "/dir_" + to_string(i);
+        mkdir(sub.c_str(), 0755);
+        create_tree(sub, depth - 1, fanout, files);
+    }
+}
+
+static vector<char *> argv_of(vector<string> &words)
+{
+    vector<char *> args;
+    for (auto &word : words)
+    {
+        args.push_back(const_cast<char *>(word.c_str()));
+    }
+    return args;
+}
+
+static void micro_benchmarks()
+{
+    const string line = "cat < input.txt | grep -v pattern | sort -r | uniq -c > output.txt";
+
+    run_bench("micro/tokenize_with_redirection", 200, 1000, [&]()
+              {
+                  vector<char> buffer(line.begin(), line.end());
+                  buffer.push_back('\0');
+                  line_arena.reset();
+                  tokenize_with_redirection(buffer.data());
+              });
+
+    // Quoting and $ expansion on top of plain word splitting
+    set_variable("BENCH_DIR", "/tmp/bench dir");
+    const string expand_line = "cp \"$BENCH_DIR/in.txt\" ${HOME}/out.txt '$literal' $? $BENCH_DIR";
+    run_bench("micro/tokenize_with_expansion", 200, 1000, [&]()
+              {
+                  vector<char> buffer(expand_line.begin(), expand_line.end());
+                  buffer.push_back('\0');
+                  line_arena.reset();
+                  tokenize_with_redirection(buffer.data());
+              });
+
+    line_arena.reset();
+    vector<char> parse_buffer(line.begin(), line.end());
+    parse_buffer.push_back('\0');
+    vector<char *> tokens = tokenize_with_redirection(parse_buffer.data());
+    run_bench("micro/parse_pipeline", 200, 1000, [&]()
+              { parse_pipeline(tokens); });
+
+    vector<string> redir_words = {"sort", "-r", "-k", "2", "<", "in.txt", ">>", "out.txt"};
+    vector<char *> redir_args = argv_of(redir_words);
+    run_bench("micro/parse_redirection", 200, 1000, [&]()
+              { parse_redirection(redir_args); });
+
+    // Registry lookups of every builtin name and of command words that miss
+    const char *lookup_names[] = {"cd", "pwd", "echo", "ls", "exit", "history", "jobs", "set", "export", "test", "[",
+                                  "[[", "((", "true", ":", "read", "grep", "sort", "git", "make", "python3", "x"};
+    run_bench("micro/builtin_lookup", 200, 1000, [&]()
+              {
+                  int found = 0;
+                  for (const char *name : lookup_names)
+                  {
+                      found += find_builtin(name) != nullptr;
+                  }
+                  if (found != 16)
+                  {
+                      cerr << "builtin_lookup: " << found << " builtins found" << endl;
+                  }
+              });
+
+    run_bench("micro/command_name_generator", 100, 10, [&]()
+              {
+                  int state = 0;
+                  char *match;
+                  while ((match = command_name_generator("g", state++)) != nullptr)
+                  {
+                      free(match);
+                  }
+              });
+
+    run_bench("micro/get_prompt", 200, 100, [&]()
+              { get_prompt(); });
+}
+
+// Text file of short lines with a rare "needle" line, written as a repeated 1 MB block
+static void create_text_file(const string &path, long bytes)
+{
+    string block;
+    const char *words[] = {"alpha", "beta", "gamma", "delta", "epsilon", "zeta", "eta", "theta"};
+    unsigned seed = 42;
+    for (int line = 0; block.size() < (1 << 20); line++)
+    {
+        int count = 3 + (seed = seed * 1103515245 + 12345) % 8;
+        for (int w = 0; w < count; w++)
+        {
+            block += words[(seed = seed * 1103515245 + 12345) >> 16 & 7];
+            block += w + 1 < count ? ' ' : '\n';
+        }
+        if (line % 1000 == 0)
+        {
+            block += "needle in the haystack\n";
+        }
+    }
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        perror(path.c_str());
+        return;
+    }
+    for (long written = 0; written < bytes; written += block.size())
+    {
+        if (write(fd, block.data(), block.size()) != (ssize_t)block.size())
+        {
+            perror("write");
+            break;
+        }
+    }
+    close(fd);
+}
+
+// In-process cat/wc/grep -F/tail against coreutils on the same multi-GB file
+static void text_tool_benchmarks()
+{
+    const long bytes = quick_mode ? (64L << 20) : (2L << 30);
+    const vector<pair<string, string>> cases = {
+        {"cat_grep_wc", "cat FILE | grep -F needle | wc -l"},
+        {"wc_l", "wc -l FILE"},
+        {"grep_c", "grep -c -F needle FILE"},
+        {"tail_n", "tail -n 100 FILE"},
+    };
+
+    bool any = false;
+    for (const auto &entry : cases)
+    {
+        any = any || selected("macro/text_" + entry.first + "_builtin") || selected("macro/text_" + entry.first + "_coreutils");
+    }
+    if (!any)
+    {
+        return;
+    }
+
+    string dir = make_temp_dir();
+    string file = dir + "/text.txt";
+    create_text_file(file, bytes);
+    struct stat st;
+    double file_bytes = stat(file.c_str(), &st) == 0 ? st.st_size : bytes;
+
+    for (const auto &entry : cases)
+    {
+        // Output goes to a file, GNU grep stops at the first match when it sees /dev/null
+        string line = entry.second + " > " + dir + "/out.txt";
+        line.replace(line.find("FILE"), 4, file);
+        for (bool builtin : {true, false})
+        {
+            size_t before = results.size();
+            set_text_builtins(builtin);
+            run_bench("macro/text_" + entry.first + (builtin ? "_builtin" : "_coreutils"), 5, 1, [&]()
+                      {
+                          vector<char> buffer(line.begin(), line.end());
+                          buffer.push_back('\0');
+                          line_arena.reset();
+                          parse_and_execute(buffer.data());
+                      });
+            if (results.size() > before)
+            {
+                results.back().bytes_per_sample = file_bytes;
+            }
+        }
+    }
+    set_text_builtins(true);
+    nftw(dir.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+// Random "word number" lines, so sort has to move every line
+static void create_sort_file(const string &path, long bytes)
+{
+    const char *words[] = {"alpha", "beta", "gamma", "delta", "epsilon", "zeta", "eta", "theta"};
+    unsigned long long seed = 42;
+    string block;
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        perror(path.c_str());
+        return;
+    }
+    for (long written = 0; written < bytes; written += block.size())
+    {
+        block.clear();
+        while (block.size() < (1 << 20))
+        {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            block += words[seed >> 61];
+            block += to_string(seed >> 40 & 0xffff);
+            block += ' ';
+            block += to_string(seed >> 20 & 0xfffff);
+            block += '\n';
+        }
+        if (write(fd, block.data(), block.size()) != (ssize_t)block.size())
+        {
+            perror("write");
+            break;
+        }
+    }
+    close(fd);
+}
+
+// In-process external sort against coreutils sort under LC_ALL=C with the same buffer
+static void sort_benchmarks()
+{
+    const long bytes = quick_mode ? (64L << 20) : (sort_gb << 30);
+    const vector<pair<string, string>> cases = {
+        {"lines", "sort -S 512M FILE"},
+        {"numeric_key", "sort -S 512M -k2,2n FILE"},
+    };
+
+    bool any = false;
+    for (const auto &entry : cases)
+    {
+        any = any || selected("macro/sort_" + entry.first + "_builtin") || selected("macro/sort_" + entry.first + "_coreutils");
+    }
+    if (!any)
+    {
+        return;
+    }
+
+    string dir = make_temp_dir();
+    string file = dir + "/sort.txt";
+    create_sort_file(file, bytes);
+    struct stat st;
+    double file_bytes = stat(file.c_str(), &st) == 0 ? st.st_size : bytes;
+    set_variable("LC_ALL", "C", true);
+    set_variable("TMPDIR", dir, true);
+
+    for (const auto &entry : cases)
+    {
+        string line = entry.second + " > " + dir + "/out.txt";
+        line.replace(line.find("FILE"), 4, file);
+        for (bool builtin : {true, false})
+        {
+            size_t before = results.size();
+            set_text_builtins(builtin);
+            run_bench("macro/sort_" + entry.first + (builtin ? "_builtin" : "_coreutils"), 3, 1, [&]()
+                      {
+                          vector<char> buffer(line.begin(), line.end());
+                          buffer.push_back('\0');
+                          line_arena.reset();
+                          parse_and_execute(buffer.data());
+                      });
+            if (results.size() > before)
+            {
+                results.back().bytes_per_sample = file_bytes;
+            }
+        }
+    }
+    set_text_builtins(true);
+    unset_variable("TMPDIR");
+    unset_variable("LC_ALL");
+    nftw(dir.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static void macro_benchmarks()
+{
+    // Spawn latency: fork + exec + wait of a trivial external command
+    vector<string> true_words = {"true"};
+    run_bench("macro/spawn_latency", 200, 1, [&]()
+              {
+                  vector<char *> args = argv_of(true_words);
+                  args.push_back(nullptr);
+                  execute_command(args, false);
+              });
+
+    // Pipeline throughput through N cat stages
+    const long bytes = quick_mode ? (8L << 20) : (64L << 20);
+    for (int stages : {2, 4, 8})
+    {
+        string name = "macro/pipeline_throughput_" + to_string(stages) + "_stages";
+        if (!selected(name))
+        {
+            continue;
+        }
+
+        string line = "head -c " + to_string(bytes) + " /dev/zero";
+        for (int i = 1; i < stages; i++)
+        {
+            line += " | cat";
+        }
+        line += " > /dev/null";
+
+        // Measures process pipelines, the in-process text tools have their own benchmarks
+        size_t before = results.size();
+        set_text_builtins(false);
+        run_bench(name, 20, 1, [&]()
+                  {
+                      vector<char> buffer(line.begin(), line.end());
+                      buffer.push_back('\0');
+                      line_arena.reset();
+                      vector<char *> pipeline_tokens = tokenize_with_redirection(buffer.data());
+                      Pipeline pipeline = parse_pipeline(pipeline_tokens);
+                      execute_pipeline(pipeline);
+                  });
+        set_text_builtins(true);
+        if (results.size() > before)
+        {
+            results.back().bytes_per_sample = bytes;
+        }
+    }
+
+    // One output copied to three files: fan-out redirection against a tee process
+    if (selected("macro/fanout_redirect_3_files") || selected("macro/fanout_tee_3_files"))
+    {
+        string dir = make_temp_dir();
+        string source = "head -c " + to_string(bytes) + " /dev/zero";
+        const vector<pair<string, string>> cases = {
+            {"macro/fanout_redirect_3_files", source + " > " + dir + "/a > " + dir + "/b > " + dir + "/c"},
+            {"macro/fanout_tee_3_files", source + " | tee " + dir + "/a " + dir + "/b > " + dir + "/c"},
+        };
+        set_text_builtins(false); // head as a process, so the fork path is measured
+        for (const auto &entry : cases)
+        {
+            size_t before = results.size();
+            run_bench(entry.first, 20, 1, [&]()
+                      {
+                          vector<char> buffer(entry.second.begin(), entry.second.end());
+                          buffer.push_back('\0');
+                          line_arena.reset();
+                          parse_and_execute(buffer.data());
+                      });
+            if (results.size() > before)
+            {
+                results.back().bytes_per_sample = bytes;
+            }
+        }
+        set_text_builtins(true);
+        nftw(dir.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+
+    // 2>&1 handled by the shell against the sh -c wrapper scripts used before
+    if (selected("macro/stderr_dup_redirect") || selected("macro/stderr_dup_sh_c"))
+    {
+        string dir = make_temp_dir();
+        const vector<pair<string, string>> cases = {
+            {"macro/stderr_dup_redirect", "/bin/ls / /nonexistent > " + dir + "/out 2>&1"},
+            {"macro/stderr_dup_sh_c", "sh -c '/bin/ls / /nonexistent > " + dir + "/out 2>&1'"},
+        };
+        for (const auto &entry : cases)
+        {
+            run_bench(entry.first, 50, 1, [&]()
+                      {
+                          vector<char> buffer(entry.second.begin(), entry.second.end());
+                          buffer.push_back('\0');
+                          line_arena.reset();
+                          parse_and_execute(buffer.data());
+                      });
+        }
+        nftw(dir.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+
+    // $(pwd) answered in-process against a substitution that has to fork
+    for (const auto &entry : vector<pair<string, string>>{{"macro/cmdsubst_pwd_builtin", "BENCH_CWD=$(pwd)"},
+                                                          {"macro/cmdsubst_pwd_fork", "BENCH_CWD=$(/bin/pwd)"}})
+    {
+        run_bench(entry.first, 50, 20, [&]()
+                  {
+                      vector<char> buffer(entry.second.begin(), entry.second.end());
+                      buffer.push_back('\0');
+                      line_arena.reset();
+                      parse_and_execute(buffer.data());
+                  });
+    }
+
+    // A loop counter stepped by the cached in-process evaluator against forking expr
+    for (const auto &entry : vector<pair<string, string>>{{"macro/arith_let", "let BENCH_I=BENCH_I+1"},
+                                                          {"macro/arith_expansion", "BENCH_I=$((BENCH_I + 1))"},
+                                                          {"macro/arith_expr_fork", "BENCH_I=$(/usr/bin/expr $BENCH_I + 1)"}})
+    {
+        set_variable("BENCH_I", "0");
+        run_bench(entry.first, 50, 20, [&]()
+                  {
+                      vector<char> buffer(entry.second.begin(), entry.second.end());
+                      buffer.push_back('\0');
+                      line_arena.reset();
+                      parse_and_execute(buffer.data());
+                  });
+    }
+
+    // File tests sharing one stat in-process against forking /usr/bin/[
+    for (const auto &entry : vector<pair<string, string>>{{"macro/test_builtin", "[ -f /etc/passwd -a -r /etc/passwd -a -s /etc/passwd ]"},
+                                                          {"macro/test_fork", "/usr/bin/[ -f /etc/passwd -a -r /etc/passwd -a -s /etc/passwd ]"}})
+    {
+        run_bench(entry.first, 50, 20, [&]()
+                  {
+                      vector<char> buffer(entry.second.begin(), entry.second.end());
+                      buffer.push_back('\0');
+                      line_arena.reset();
+                      parse_and_execute(buffer.data());
+                  });
+    }
+
+    // A 100k-iteration loop of builtins run from its compiled form against handing it to sh
+    for (const auto &entry : vector<pair<string, string>>{{"macro/loop_100k_builtin", "i=0; while [ $i -lt 100000 ]; do i=$((i+1)); done"},
+                                                          {"macro/loop_100k_sh", "/bin/sh -c 'i=0; while [ $i -lt 100000 ]; do i=$((i+1)); done'"}})
+    {
+        run_bench(entry.first, 5, 1, [&]()
+                  {
+                      vector<char> buffer(entry.second.begin(), entry.second.end());
+                      buffer.push_back('\0');
+                      line_arena.reset();
+                      parse_semicolon_commands(buffer.data());
+                  });
+    }
+
+    // while read over a million-line file, redirected and through a pipe, against sh
+    const vector<string> read_names = {"macro/read_loop_file_builtin", "macro/read_loop_pipe_builtin", "macro/read_loop_file_sh", "macro/read_loop_pipe_sh"};
+    if (any_of(read_names.begin(), read_names.end(), [](const string &name) { return selected(name); }))
+    {
+        const long lines = quick_mode ? 100000 : 1000000;
+        string dir = make_temp_dir();
+        string path = dir + "/lines.txt";
+        string text;
+        for (long i = 0; i < lines; i++)
+        {
+            text += to_string(i) + " second field of the line\n";
+        }
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1 || write(fd, text.data(), text.size()) != (ssize_t)text.size())
+        {
+            perror("write");
+        }
+        close(fd);
+
+        string loop = "while read -r a b; do :; done";
+        const vector<string> commands = {loop + " < " + path, "/bin/cat " + path + " | " + loop,
+                                         "/bin/sh -c '" + loop + " < " + path + "'", "/bin/sh -c '/bin/cat " + path + " | " + loop + "'"};
+        for (size_t i = 0; i < read_names.size(); i++)
+        {
+            size_t before = results.size();
+            run_bench(read_names[i], 3, 1, [&]()
+                      {
+                          vector<char> buffer(commands[i].begin(), commands[i].end());
+                          buffer.push_back('\0');
+                          line_arena.reset();
+                          parse_semicolon_commands(buffer.data());
+                      });
+            if (results.size() > before)
+            {
+                results.back().bytes_per_sample = text.size();
+            }
+        }
+        nftw(dir.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+
+    // A log parser loaded with enable -f and run in-process against the same tool built
+    // as a program, alone and as the last stage after the in-process cat
+    const vector<string> loadable_names = {"macro/loadable_builtin", "macro/loadable_fork_exec",
+                                           "macro/loadable_stage_builtin", "macro/loadable_stage_fork_exec"};
+    if (any_of(loadable_names.begin(), loadable_names.end(), [](const string &name) { return selected(name); }))
+    {
+        string dir = make_temp_dir();
+        const string source = "examples/loadable/logstat.c";
+        string build = "cc -O2 -shared -fPIC -Iinclude " + source + " -o " + dir + "/logstat.so && " +
+                       "cc -O2 -DLOGSTAT_PROGRAM -Iinclude " + source + " -o " + dir + "/logstat";
+        if (system(build.c_str()) != 0)
+        {
+            cerr << "loadable: could not build " << source << ", run from the source tree with cc installed" << endl;
+        }
+        else
+        {
+            string log = dir + "/app.log";
+            string text;
+            const char *levels[] = {"INFO", "DEBUG", "WARN", "ERROR"};
+            for (int i = 0; i < 200; i++)
+            {
+                text += "2026-01-01T00:00:00 " + string(levels[i % 4]) + " request " + to_string(i) + " served\n";
+            }
+            int fd = open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd == -1 || write(fd, text.data(), text.size()) != (ssize_t)text.size())
+            {
+                perror("write");
+            }
+            close(fd);
+
+            const vector<string> commands = {"logstat " + log + " > /dev/null", dir + "/logstat " + log + " > /dev/null",
+                                             "cat " + log + " | logstat > /dev/null", "cat " + log + " | " + dir + "/logstat > /dev/null"};
+            auto run_line = [](const string &line)
+            {
+                vector<char> buffer(line.begin(), line.end());
+                buffer.push_back('\0');
+                line_arena.reset();
+                parse_and_execute(buffer.data());
+            };
+            run_line("enable -f " + dir + "/logstat.so logstat");
+            for (size_t i = 0; i < loadable_names.size(); i++)
+            {
+                run_bench(loadable_names[i], 50, 20, [&]()
+                          { run_line(commands[i]); });
+            }
+            run_line("enable -d logstat");
+        }
+        nftw(dir.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+
+    // Comparing two command outputs through <(...) pipes against temp files on disk
+    if (selected("macro/procsubst_cmp") || selected("macro/tempfile_cmp"))
+    {
+        string dir = make_temp_dir();
+        string source = "/usr/bin/head -c " + to_string(bytes) + " /dev/zero";
+        const vector<pair<string, vector<string>>> cases = {
+            {"macro/procsubst_cmp", {"/usr/bin/cmp <(" + source + ") <(" + source + ")"}},
+            {"macro/tempfile_cmp", {source + " > " + dir + "/a", source + " > " + dir + "/b",
+                                    "/usr/bin/cmp " + dir + "/a " + dir + "/b"}},
+        };
+        for (const auto &entry : cases)
+        {
+            size_t before = results.size();
+            run_bench(entry.first, 20, 1, [&]()
+                      {
+                          for (const string &line : entry.second)
+                          {
+                              vector<char> buffer(line.begin(), line.end());
+                              buffer.push_back('\0');
+                              line_arena.reset();
+                              parse_and_execute(buffer.data());
+                          }
+                      });
+            if (results.size() > before)
+            {
+                results.back().bytes_per_sample = 2 * bytes;
+            }
+        }
+        nftw(dir.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+
+    text_tool_benchmarks();
+    sort_benchmarks();
+
+    char original_cwd[PATH_MAX];
+    if (!getcwd(original_cwd, sizeof(original_cwd)))
+    {
+        perror("getcwd");
+        return;
+    }
+
+    // ls -l over a synthetic flat directory
+    string flat_dir = make_temp_dir();
+    create_files(flat_dir, quick_mode ? 500 : 5000);
+    vector<string> ls_words = {"ls", "-l", flat_dir};
+    vector<char *> ls_args = argv_of(ls_words);
+    run_bench("macro/ls_long_synthetic_dir", 20, 1, [&]()
+              { silenced([&]()
+                         { builtin_ls(ls_args); }); });
+
+    // Completion over the same directory
+    if (chdir(flat_dir.c_str()) == 0)
+    {
+        run_bench("macro/filename_completion", 50, 1, [&]()
+                  {
+                      int state = 0;
+                      char *match;
+                      while ((match = filename_generator("file_1", state++)) != nullptr)
+                      {
+                          free(match);
+                      }
+                  });
+
+        // Two patterns over the same directory, listed once per command
+        run_bench("macro/glob_synthetic_dir", 50, 1, [&]()
+                  {
+                      vector<string> matches;
+                      glob_reset_cache();
+                      glob_expand("file_1*.txt", matches);
+                      glob_expand("*_9?.txt", matches);
+                  });
+        chdir(original_cwd);
+    }
+    nftw(flat_dir.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+    // search over a synthetic tree, target missing so the whole tree is walked
+    string tree_dir = make_temp_dir();
+    create_tree(tree_dir, quick_mode ? 3 : 4, 6, 5);
+    if (chdir(tree_dir.c_str()) == 0)
+    {
+        vector<string> search_words = {"search", "no_such_entry"};
+        run_bench("macro/search_synthetic_tree", 20, 1, [&]()
+                  {
+                      vector<char *> args = argv_of(search_words);
+                      args.push_back(nullptr);
+                      silenced([&]()
+                               { handle_builtin(args); });
+                  });
+
+        run_bench("macro/globstar_synthetic_tree", 20, 1, [&]()
+                  {
+                      vector<string> matches;
+                      glob_reset_cache();
+                      glob_expand("**/file_1.txt", matches);
+                  });
+
+        // Ordered parallel ls -R over the same tree
+        vector<string> ls_recursive_words = {"ls", "-lR", "."};
+        vector<char *> ls_recursive_args = argv_of(ls_recursive_words);
+        run_bench("macro/ls_recursive_synthetic_tree", 20, 1, [&]()
+                  { silenced([&]()
+                             { builtin_ls(ls_recursive_args); }); });
+
+        // Parallel du against coreutils du over the same tree
+        string du_line = "du -s . > /dev/null";
+        for (bool builtin : {true, false})
+        {
+            set_text_builtins(builtin);
+            run_bench(string("macro/du_synthetic_tree_") + (builtin ? "builtin" : "coreutils"), 20, 1, [&]()
+                      {
+                          vector<char> buffer(du_line.begin(), du_line.end());
+                          buffer.push_back('\0');
+                          line_arena.reset();
+                          parse_and_execute(buffer.data());
+                      });
+        }
+        set_text_builtins(true);
+        chdir(original_cwd);
+    }
+    nftw(tree_dir.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+int main(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--quick") == 0)
+        {
+            quick_mode = true;
+        }
+        else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+        {
+            name_filter = argv[++i];
+        }
+        else if (strcmp(argv[i], "--sort-gb") == 0 && i + 1 < argc)
+        {
+            sort_gb = max(1L, atol(argv[++i]));
+        }
+        else
+        {
+            cerr << "usage: " << argv[0] << " [--quick] [--filter substring] [--sort-gb N]\n";
+            return EXIT_FAILURE;
+        }
+    }
+
+    char cwd[PATH_MAX];
+    shell_home_dir = getcwd(cwd, sizeof(cwd)) ? cwd : "/";
+    init_variables();
+
+    micro_benchmarks();
+    macro_benchmarks();
+    print_results();
+    return 0;
+}
@@ -0,0 +1,159 @@
+/* logstat [file ...]: counts the ERROR, WARN, INFO and DEBUG lines of a log, from the
+   files or stdin; LOGSTAT_FORMAT=json prints one JSON object instead of a table.
+
+   As a builtin:  cc -O2 -shared -fPIC -Iinclude examples/loadable/logstat.c -o logstat.so
+                  enable -f ./logstat.so logstat
+   As a program:  cc -O2 -DLOGSTAT_PROGRAM -Iinclude examples/loadable/logstat.c -o logstat */
+
+#define _GNU_SOURCE
+#include "shell_builtin.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char *const levels[] = {"ERROR", "WARN", "INFO", "DEBUG"};
+#define LEVEL_COUNT 4
+#define BLOCK_SIZE (64 * 1024)
+#define LINE_MAX_KEPT 4096 /* longer lines are matched on their first 4 KB */
+
+struct counts
+{
+    long level[LEVEL_COUNT];
+    long lines;
+};
+
+static void count_line(struct counts *counts, const char *line, size_t length)
+{
+    counts->lines++;
+    for (int i = 0; i < LEVEL_COUNT; i++)
+    {
+        if (memmem(line, length, levels[i], strlen(levels[i])))
+        {
+            counts->level[i]++;
+            return;
+        }
+    }
+}
+
+/* Reads fd to the end, counting whole lines; -1 on a read error or Ctrl+C */
+static int count_fd(const struct shell_builtin_context *context, int fd, struct counts *counts)
+{
+    char *block = malloc(BLOCK_SIZE);
+    char *partial = malloc(LINE_MAX_KEPT);
+    size_t kept = 0;
+    int result = 0;
+    if (!block || !partial)
+    {
+        free(block);
+        free(partial);
+        return -1;
+    }
+
+    for (;;)
+    {
+        ssize_t n = read(fd, block, BLOCK_SIZE);
+        if (n < 0 && errno == EINTR && !context->interrupted())
+        {
+            continue;
+        }
+        if (n <= 0 || context->interrupted())
+        {
+            result = n < 0 || context->interrupted() ? -1 : 0;
+            break;
+        }
+
+        const char *p = block;
+        const char *end = block + n;
+        const char *newline;
+        while ((newline = memchr(p, '\n', end - p)) != NULL)
+        {
+            if (kept > 0)
+            {
+                size_t take = (size_t)(newline - p) < LINE_MAX_KEPT - kept ? (size_t)(newline - p) : LINE_MAX_KEPT - kept;
+                memcpy(partial + kept, p, take);
+                count_line(counts, partial, kept + take);
+                kept = 0;
+            }
+            else
+            {
+                count_line(counts, p, newline - p);
+            }
+            p = newline + 1;
+        }
+        size_t take = (size_t)(end - p) < LINE_MAX_KEPT - kept ? (size_t)(end - p) : LINE_MAX_KEPT - kept;
+        memcpy(partial + kept, p, take);
+        kept += take;
+    }
+    if (kept > 0 && result == 0)
+    {
+        count_line(counts, partial, kept);
+    }
+    free(block);
+    free(partial);
+    return result;
+}
+
+static int logstat_run(const struct shell_builtin_context *context, int argc, char *const *argv)
+{
+    struct counts counts = {{0}, 0};
+    int status = 0;
+    if (argc < 2)
+    {
+        status = count_fd(context, context->in_fd, &counts) == 0 ? 0 : 1;
+    }
+    for (int i = 1; i < argc; i++)
+    {
+        int fd = open(argv[i], O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            dprintf(context->err_fd, "logstat: %s: %s\n", argv[i], strerror(errno));
+            status = 1;
+            continue;
+        }
+        if (count_fd(context, fd, &counts) != 0)
+        {
+            status = 1;
+        }
+        close(fd);
+    }
+
+    const char *format = context->get_variable("LOGSTAT_FORMAT");
+    if (format && strcmp(format, "json") == 0)
+    {
+        dprintf(context->out_fd, "{\"lines\": %ld, \"error\": %ld, \"warn\": %ld, \"info\": %ld, \"debug\": %ld}\n",
+                counts.lines, counts.level[0], counts.level[1], counts.level[2], counts.level[3]);
+    }
+    else
+    {
+        for (int i = 0; i < LEVEL_COUNT; i++)
+        {
+            dprintf(context->out_fd, "%-6s %ld\n", levels[i], counts.level[i]);
+        }
+        dprintf(context->out_fd, "%-6s %ld\n", "lines", counts.lines);
+    }
+    return status;
+}
+
+struct shell_builtin logstat_builtin = {SHELL_BUILTIN_ABI_VERSION, "logstat", logstat_run};
+
+#ifdef LOGSTAT_PROGRAM
+/* The same tool as a program, for comparing fork + exec against the builtin */
+static const char *program_get_variable(const char *name)
+{
+    return getenv(name);
+}
+
+static int program_interrupted(void)
+{
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct shell_builtin_context context = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, program_get_variable, program_interrupted};
+    return logstat_run(&context, argc, argv);
+}
+#endif
@@ -0,0 +1,46 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+using namespace std;
+
+// Bump allocator for data that lives until the next command line, such as the
+// expanded words handed to execvp; blocks are reused after reset
+class Arena
+{
+public:
+    explicit Arena(size_t block_size = 4096);
+
+    char *allocate(size_t size);
+    char *copy(const char *text, size_t length); // NUL-terminated copy
+    void reset();
+
+    // Position to roll back to once the words allocated after it are no longer used
+    struct Mark
+    {
+        size_t current;
+        size_t used;
+    };
+    Mark mark() const;
+    void rewind(const Mark &mark);
+
+private:
+    struct Block
+    {
+        unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    vector<Block> blocks;
+    size_t block_size;
+    size_t current = 0; // block being filled
+    size_t used = 0;    // bytes used in the current block
+};
+
+// Words of the command line being executed
+extern Arena line_arena;
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef ARITH_H
+#define ARITH_H
+
+#include <string>
+#include <vector>
+#include "registry.h"
+
+using namespace std;
+
+// Function declarations
+bool arith_evaluate(const string &expression, long long &result);
+int builtin_let(BuiltinArgs args);
+
+#endif
@@ -16,5 +16,7 @@ char *command_name_generator(const char *text, int state);
 char *filename_generator(const char *text, int state);
 char **shell_completion(const char *text, int start, int end);
 void setup_autocomplete();
+void build_command_index();
+void prewarm_completion_index();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,24 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <string>
+#include <vector>
+#include "redirection.h"
+
+using namespace std;
+
+// Function declarations
+bool parse_batch_prefix(vector<char *> &tokens);
+void batch_finish();
+bool batch_requested();
+bool exceeds_arg_max(char *const *argv, char *const *envp);
+void execute_batched(const RedirectionInfo &redir, bool background, char **envp, const string &command_text);
+int execute_batched_stage(char **argv, char **envp, const string &command_text);
+void set_auto_batch(bool enabled);
+bool set_batch_jobs(long jobs);
+bool set_batch_fixed(long fixed);
+bool get_auto_batch();
+long get_batch_jobs();
+long get_batch_fixed();
+
+#endif
@@ -3,13 +3,21 @@
 
 #include <vector>
 #include <string>
+#include "registry.h"
 
 // Function declarations for built-in commands
-void builtin_ls(const std::vector<std::string> &args);
-int builtin_cd(std::vector<char *> args);
-int builtin_pwd(std::vector<char *> args);
-int builtin_echo(std::vector<char *> args);
+int builtin_ls(BuiltinArgs args);
+int builtin_cd(BuiltinArgs args);
+int builtin_pwd(BuiltinArgs args);
+int builtin_echo(BuiltinArgs args);
+int builtin_pinfo(BuiltinArgs args);
+int builtin_search(BuiltinArgs args);
+int builtin_history(BuiltinArgs args);
+int builtin_set(BuiltinArgs args);
+int builtin_true(BuiltinArgs args);
+int builtin_false(BuiltinArgs args);
+int builtin_exit(BuiltinArgs args);
 void add_to_history(const string &command);
-bool handle_builtin(std::vector<char *> args);
+int handle_builtin(const std::vector<char *> &args);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,13 @@
+#ifndef CMDSUBST_H
+#define CMDSUBST_H
+
+#include <string>
+
+using namespace std;
+
+// Function declarations
+bool command_substitution(const string &command, string &out);
+void command_substitution_reset();
+bool command_substitution_ran();
+
+#endif
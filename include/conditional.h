@@ -0,0 +1,12 @@
+#ifndef CONDITIONAL_H
+#define CONDITIONAL_H
+
+#include <vector>
+#include "registry.h"
+
+using namespace std;
+
+// Function declarations
+int builtin_test(BuiltinArgs args);
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef DU_H
+#define DU_H
+
+#include <vector>
+
+using namespace std;
+
+// Function declarations
+bool du_builtin_supported(const vector<char *> &args);
+int builtin_du(vector<char *> args);
+
+#endif
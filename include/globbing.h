@@ -0,0 +1,13 @@
+#ifndef GLOBBING_H
+#define GLOBBING_H
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Function declarations
+bool glob_expand(const string &pattern, vector<string> &matches);
+void glob_reset_cache();
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef HEREDOC_H
+#define HEREDOC_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Here-document bodies are written straight into anonymous memfds and sealed,
+// so no temp files exist and a command only ever sees a read-only file
+struct HereDoc
+{
+    string delimiter;
+    bool strip_tabs = false; // <<- removes leading tabs from body lines
+    bool expand = true;      // unquoted delimiter, $ expansions apply when a command reads the body
+    int fd = -1;
+
+    HereDoc() = default;
+    HereDoc(const HereDoc &) = delete;
+    HereDoc &operator=(const HereDoc &) = delete;
+    ~HereDoc();
+};
+
+// Bodies in operator order, shared by the line and a compiled script that keeps them
+typedef vector<shared_ptr<HereDoc>> HereDocList;
+
+// Where parse_redirection takes the next body from
+struct HereDocCursor
+{
+    const HereDocList *bodies;
+    size_t next;
+};
+
+// Function declarations
+vector<size_t> heredoc_positions(const string &text);
+bool heredoc_scan_line(const string &line);
+bool heredoc_collecting();
+bool heredoc_feed_line(const char *line);
+void heredoc_finish_at_eof();
+void heredoc_abort();
+HereDocList heredoc_take_bodies(size_t count);
+HereDocCursor heredoc_select(HereDocCursor cursor);
+int heredoc_next_body();
+int heredoc_from_string(const string &text);
+string heredoc_path(int fd);
+void heredoc_release_temporaries();
+void heredoc_release();
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include "registry.h"
+
+using namespace std;
+
+// Lifecycle of a job in the job table
+enum class JobState
+{
+    Queued, // waiting for a free background slot
+    Running,
+    Stopped,
+    Done
+};
+
+// A background or suspended process group tracked by the shell
+struct Job
+{
+    int id = 0;
+    pid_t pgid = -1;
+    vector<pid_t> pids; // Processes that have not been reaped yet
+    pid_t last_pid = -1; // Last stage, its status is the job's status
+    string command;
+    JobState state = JobState::Running;
+    int status = 0;
+    bool notified = true; // false while a state change is waiting to be reported
+    int slot = 0;         // background slot held while running, see JobSlot in jobs.cpp
+    string launch_line;   // command line to start once a queued job gets a slot
+};
+
+// True when the shell owns a terminal and puts each job in its own process group
+extern bool job_control_enabled;
+
+// Function declarations
+void init_job_control();
+int job_signal_fd();
+void reap_children();
+bool has_pending_notifications();
+void print_job_notifications();
+int add_job(pid_t pgid, const vector<pid_t> &pids, const string &command, JobState state, int id = 0);
+int wait_for_foreground(pid_t pgid, const vector<pid_t> &pids, const string &command, int id = 0);
+void setup_child_process(pid_t pgid, bool foreground);
+void place_in_job_group(pid_t pid, pid_t pgid);
+bool reserve_background_slot(const string &command_line);
+void finish_background_launch();
+bool background_launch_quiet();
+void start_queued_jobs();
+bool set_max_jobs(long max_jobs);
+long get_max_jobs();
+int jobserver_poll_fd();
+int builtin_jobs(BuiltinArgs args);
+int builtin_fg(BuiltinArgs args);
+int builtin_bg(BuiltinArgs args);
+int builtin_wait(BuiltinArgs args);
+
+#endif
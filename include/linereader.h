@@ -0,0 +1,18 @@
+#ifndef LINEREADER_H
+#define LINEREADER_H
+
+#include <vector>
+#include "registry.h"
+
+using namespace std;
+
+// Function declarations
+int builtin_read(BuiltinArgs args);
+void read_buffer_save(int fd);
+void read_buffer_restore(int fd);
+void read_after_fork();
+bool read_ahead_select(bool enabled);
+void read_loop_begin();
+void read_loop_end();
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef LISTING_H
+#define LISTING_H
+
+#include <string>
+#include <sys/stat.h>
+
+using namespace std;
+
+// Function declarations
+string get_permissions(mode_t mode);
+string format_long_entry(int dir_fd, const char *path, const char *filename, const struct stat &st);
+void list_recursive(const string &path, bool show_all, bool long_format);
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef LOADABLE_H
+#define LOADABLE_H
+
+#include <string>
+#include <vector>
+#include "registry.h"
+
+using namespace std;
+
+// Function declarations
+int builtin_enable(BuiltinArgs args);
+const BuiltinDescriptor *find_loaded_builtin(const char *name);
+int run_loaded_builtin(BuiltinArgs args, int input_fd, int output_fd);
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <vector>
+#include "registry.h"
+
+using namespace std;
+
+// Function declarations
+int builtin_parallel(BuiltinArgs args);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef PATHCACHE_H
+#define PATHCACHE_H
+
+#include <string>
+#include "registry.h"
+
+using namespace std;
+
+// Index of a command name in the path cache; valid for the shell's lifetime, the name's
+// program is searched again after PATH changes
+typedef int CommandHandle;
+const CommandHandle NO_COMMAND = -1;
+
+// Function declarations
+CommandHandle command_handle(const string &name);
+CommandHandle command_select(CommandHandle handle);
+const char *command_program(const char *name);
+void path_changed();
+int builtin_hash(BuiltinArgs args);
+
+#endif
@@ -25,6 +25,5 @@ struct Pipeline
 // Function declarations
 Pipeline parse_pipeline(vector<char *> &args);
 void execute_pipeline(const Pipeline &pipeline);
-bool is_builtin_command(const string &cmd);
 
 #endif
\ No newline at end of file
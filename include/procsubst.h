@@ -0,0 +1,15 @@
+#ifndef PROCSUBST_H
+#define PROCSUBST_H
+
+#include <string>
+#include <spawn.h>
+
+using namespace std;
+
+// Function declarations
+string procsubst_start(const string &command, bool output);
+void procsubst_inherit();
+bool procsubst_spawn_actions(posix_spawn_file_actions_t *actions);
+void procsubst_finish(bool background);
+
+#endif
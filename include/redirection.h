@@ -3,23 +3,67 @@
 
 #include <string>
 #include <vector>
+#include <thread>
+#include <spawn.h>
 
 using namespace std;
 
+// One > or >> target
+struct OutputTarget
+{
+    string file;
+    bool append; // true for >>, false for >
+};
+
+// One step of a compiled redirection plan
+struct FdStep
+{
+    enum Kind
+    {
+        OPEN,  // open file with flags onto fd
+        DUP,   // make fd a copy of source
+        CLOSE, // close fd
+        FANOUT // point fd at a pipe copied into every target
+    };
+
+    Kind kind;
+    int fd;
+    int source = -1;              // DUP
+    int flags = 0;                // OPEN
+    string file;                  // OPEN
+    vector<OutputTarget> targets; // FANOUT
+};
+
 // Structure to hold redirection information
 struct RedirectionInfo
 {
-    bool has_input_redirect = false;
-    bool has_output_redirect = false;
-    bool output_append = false; // true for >>, false for >
+    bool has_input_redirect = false;  // the plan changes fd 0
+    bool has_output_redirect = false; // the plan changes fd 1
+    bool stdio_only = true;           // only files onto fd 0 and fd 1, described below
+    bool failed = false;              // a syntax error or ambiguous redirect, the command must not run
     string input_file;
-    string output_file;
-    vector<char *> clean_args; // Arguments without redirection operators
+    vector<OutputTarget> outputs; // in command line order, several fan the output out to all
+    vector<FdStep> steps;         // open/dup2/close sequence, applied in order
+    vector<int> touched;          // descriptors the steps replace
+    vector<char *> clean_args;    // Arguments without redirection operators
+};
+
+// Descriptors a builtin's redirection replaced, restored by restore_redirection
+struct SavedFds
+{
+    vector<pair<int, int>> saved; // fd and its saved copy, -1 when it was closed
+    vector<thread> pumps;         // fan-out pumps to join once the builtin's ends are closed
 };
 
 // Function declarations
 RedirectionInfo parse_redirection(vector<char *> &args);
+char *operator_word(const char *text, size_t length);
+bool is_operator_word(const char *word);
+bool is_redirection_word(const char *word);
 bool setup_redirection(const RedirectionInfo &redir);
-void restore_stdio(int saved_stdin, int saved_stdout);
+bool setup_builtin_redirection(const RedirectionInfo &redir, SavedFds &saved);
+void restore_redirection(SavedFds &saved);
+bool redirection_spawn_actions(const RedirectionInfo &redir, posix_spawn_file_actions_t *actions);
+int open_output_targets(const RedirectionInfo &redir, thread &pump);
 
-#endif
\ No newline at end of file
+#endif
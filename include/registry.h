@@ -0,0 +1,56 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// The words of a builtin call, viewed in place: nothing is copied. Indexing past the
+// last word gives nullptr, as with a NULL-terminated argv
+class BuiltinArgs
+{
+public:
+    BuiltinArgs(char *const *argv, size_t argc) : argv(argv), argc(argc) {}
+    BuiltinArgs(const vector<char *> &words) : argv(words.data()), argc(0)
+    {
+        while (argc < words.size() && words[argc] != nullptr)
+            argc++;
+    }
+
+    size_t size() const { return argc; }
+    bool empty() const { return argc == 0; }
+    char *operator[](size_t i) const { return i < argc ? argv[i] : nullptr; }
+    char *const *begin() const { return argv; }
+    char *const *end() const { return argv + argc; }
+
+private:
+    char *const *argv;
+    size_t argc;
+};
+
+typedef int (*BuiltinFunction)(BuiltinArgs args);
+
+enum BuiltinFlags : unsigned
+{
+    BUILTIN_MUTATES_SHELL = 1 << 0,   // changes the shell itself: directory, variables, jobs, control flow
+    BUILTIN_PIPELINE_SAFE = 1 << 1,   // may run forked as a pipeline stage
+    BUILTIN_BACKGROUND_SAFE = 1 << 2, // may run forked as a background job
+    BUILTIN_CAPTURE_SAFE = 1 << 3,    // prints only through cout, so $(...) runs it without a fork
+    BUILTIN_LOADED = 1 << 4           // from enable -f, takes its descriptors, so pipeline stages run it on a thread
+};
+
+struct BuiltinDescriptor
+{
+    const char *name;
+    BuiltinFunction run;
+    unsigned flags;
+};
+
+// Function declarations
+const BuiltinDescriptor *find_builtin(const char *name);
+bool is_builtin_command(const string &cmd);
+vector<string> builtin_command_names();
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <string>
+#include <vector>
+#include "registry.h"
+
+using namespace std;
+
+// Function declarations
+bool script_needed(const string &text);
+bool script_incomplete(const string &text);
+void run_script(const string &text);
+bool script_function_defined(const string &name);
+void script_call_function(const vector<char *> &args);
+int builtin_break(BuiltinArgs args);
+int builtin_return(BuiltinArgs args);
+
+#endif
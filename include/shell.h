@@ -3,6 +3,7 @@
 
 #include <string>
 #include <vector>
+#include "redirection.h"
 
 using namespace std;
 
@@ -14,8 +15,12 @@ extern string shell_home_dir;
 string get_prompt();
 vector<char *> tokenize_simple(char *command);
 vector<char *> tokenize_with_redirection(char *command);
+string expand_heredoc_text(const string &text);
 void execute_command(vector<char *> &args, bool background);
+void execute_redirected_command(const RedirectionInfo &redir, const string &command_text, bool background);
 void parse_and_execute(char *command_line);
 void parse_semicolon_commands(char *input);
+void execute_words(vector<char *> &words);
+void execute_background_line(const string &line);
 
 #endif
\ No newline at end of file
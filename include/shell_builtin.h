@@ -0,0 +1,39 @@
+#ifndef SHELL_BUILTIN_H
+#define SHELL_BUILTIN_H
+
+/* C interface of builtins loaded with enable -f lib.so name. The library exports
+   struct shell_builtin name_builtin; the shell calls run inside its own process, on a
+   thread when the builtin is a pipeline stage, so run reads in_fd, writes out_fd and
+   keeps no state another call could be using */
+
+#define SHELL_BUILTIN_ABI_VERSION 1
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+struct shell_builtin_context
+{
+    int in_fd;
+    int out_fd;
+    int err_fd;
+    /* Value of a shell variable, NULL when unset; valid until run returns */
+    const char *(*get_variable)(const char *name);
+    /* Nonzero once Ctrl+C was pressed, long loops should stop when it is */
+    int (*interrupted)(void);
+};
+
+struct shell_builtin
+{
+    int abi_version; /* SHELL_BUILTIN_ABI_VERSION the library was built with */
+    const char *name;
+    /* argv[0] is the name and argv[argc] is NULL; returns the exit status */
+    int (*run)(const struct shell_builtin_context *context, int argc, char *const *argv);
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef SORT_H
+#define SORT_H
+
+#include <string>
+#include <vector>
+#include "textutils.h"
+
+using namespace std;
+
+// Function declarations
+bool sort_builtin_supported(const vector<char *> &args);
+bool sort_reads_stdin(const vector<char *> &args);
+int run_sort(const vector<char *> &args, int input_fd, TextOutput &out);
+bool set_sort_buffer(const string &size);
+string get_sort_buffer();
+
+#endif
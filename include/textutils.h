@@ -0,0 +1,43 @@
+#ifndef TEXTUTILS_H
+#define TEXTUTILS_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+using namespace std;
+
+// Buffered writer on a raw fd for the text tools; a closed pipe just ends the output
+class TextOutput
+{
+public:
+    explicit TextOutput(int fd);
+    ~TextOutput();
+
+    bool write(const char *data, size_t size);
+    bool write(const string &text) { return write(text.data(), text.size()); }
+    bool write_line(const char *data, size_t size); // data and a '\n'
+    bool flush();
+    bool ok() const { return !failed; }
+
+private:
+    static const size_t OUTPUT_BUFFER = 64 * 1024;
+
+    bool write_all(const char *data, size_t size);
+
+    int fd;
+    string buffer;
+    bool failed = false;
+};
+
+// Function declarations
+bool is_text_builtin(const vector<char *> &args);
+bool text_builtin_reads_stdin(const vector<char *> &args);
+int run_text_builtin(const vector<char *> &args, int input_fd, int output_fd);
+void text_builtins_interrupt();
+void text_builtins_reset_interrupt();
+bool text_builtins_interrupted();
+void set_text_builtins(bool enabled);
+bool get_text_builtins();
+
+#endif
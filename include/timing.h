@@ -0,0 +1,45 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <string>
+#include <vector>
+#include <ctime>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+using namespace std;
+
+// Output formats of the time keyword
+enum class TimingFormat
+{
+    Table, // per-stage table plus totals
+    Posix, // time -p: real/user/sys only
+    Json   // time -j: machine-readable
+};
+
+// Cost of one pipeline stage, pid is -1 for builtins run inside the shell
+struct StageTiming
+{
+    string command;
+    pid_t pid = -1;
+    struct timespec started = {0, 0};
+    struct timespec finished = {0, 0};
+    struct rusage usage = {};
+    int status = 0;
+    bool done = false;
+};
+
+// Function declarations
+bool parse_time_prefix(vector<char *> &tokens);
+bool timing_active();
+void timing_stage_spawned(pid_t pid, const string &command);
+void timing_stage_reaped(pid_t pid, int status, const struct rusage &usage);
+void timing_builtin_begin(const string &command);
+void timing_builtin_end(int status);
+void timing_thread_start(StageTiming &stage, const string &command);
+void timing_thread_stop(StageTiming &stage, int status);
+int timing_reserve_stage(const string &command);
+void timing_fill_stage(int row, const StageTiming &stage);
+void timing_finish();
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <string>
+#include <cstdint>
+#include <sys/types.h>
+
+using namespace std;
+
+// Checked inline by every span so recording costs one branch when tracing is off
+extern bool trace_enabled;
+
+// One completed span in Chrome trace-event terms ("ph":"X")
+struct TraceEvent
+{
+    const char *name;
+    uint64_t start_us;
+    uint64_t duration_us;
+    int stage;
+    pid_t child;
+    string command;
+};
+
+// Function declarations
+bool trace_open(const string &path);
+void trace_close();
+const string &trace_path();
+void trace_flush();
+void trace_after_fork();
+uint64_t trace_now_us();
+void trace_record(const TraceEvent &event);
+
+// Records the lifetime of a scope as one span on the calling thread
+class TraceSpan
+{
+public:
+    explicit TraceSpan(const char *name, int stage = -1)
+    {
+        active = trace_enabled;
+        if (active)
+        {
+            event.name = name;
+            event.stage = stage;
+            event.child = -1;
+            event.start_us = trace_now_us();
+        }
+    }
+
+    ~TraceSpan()
+    {
+        finish();
+    }
+
+    // Tags the span with the command text, only copied while tracing
+    void command(const string &text)
+    {
+        if (active)
+        {
+            event.command = text;
+        }
+    }
+
+    void child(pid_t pid)
+    {
+        if (active)
+        {
+            event.child = pid;
+        }
+    }
+
+    // Ends the span early, e.g. right before execvp replaces the process
+    void finish()
+    {
+        if (active)
+        {
+            event.duration_us = trace_now_us() - event.start_us;
+            trace_record(event);
+            active = false;
+        }
+    }
+
+private:
+    bool active;
+    TraceEvent event;
+};
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef VARIABLES_H
+#define VARIABLES_H
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include "registry.h"
+
+using namespace std;
+
+// A variable's value before a NAME=value prefix replaced it
+struct SavedVariable
+{
+    string name;
+    bool was_set;
+    string value;
+};
+
+// Function declarations
+void init_variables();
+const char *get_variable(const string &name);
+bool set_variable(const string &name, const string &value, bool exported = false);
+void unset_variable(const string &name);
+char **exported_environ();
+void set_last_status(int exit_code);
+void set_last_status_from_wait(int status);
+int last_status();
+void set_last_background_pid(pid_t pid);
+bool expand_special_variable(char name, string &out);
+vector<string> set_positional_parameters(vector<string> parameters);
+bool is_assignment(const char *word);
+bool apply_assignments(vector<char *> &args, bool exported);
+char **apply_prefix_assignments(char **argv);
+vector<SavedVariable> apply_temporary_assignments(vector<char *> &args);
+void restore_variables(const vector<SavedVariable> &saved);
+int builtin_export(BuiltinArgs args);
+int builtin_unset(BuiltinArgs args);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef WALKER_H
+#define WALKER_H
+
+#include <string>
+#include <vector>
+#include <functional>
+
+using namespace std;
+
+// A directory handed to the visitor; fd is open for the duration of the call, or -1
+// with error set when the directory could not be opened or the walk was stopped
+struct WalkDir
+{
+    string path;
+    int fd;
+    int error;
+    int depth;
+    void *data; // whatever was passed when the directory was queued
+};
+
+// One entry of a listed directory; type is the d_type, DT_UNKNOWN when the filesystem
+// does not report it
+struct WalkEntry
+{
+    const char *name;
+    unsigned char type;
+};
+
+// Runs on the worker threads, once for every queued directory
+using WalkVisitor = function<void(const WalkDir &dir, const vector<WalkEntry> &entries)>;
+
+// Function declarations
+void walk_tree(const string &root, void *root_data, unsigned threads, const WalkVisitor &visit);
+void walk_descend(const WalkDir &parent, const char *name, void *data);
+void walk_stop();
+string walk_join(const string &dir, const char *name);
+unsigned walk_default_threads();
+
+#endif
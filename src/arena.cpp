@@ -0,0 +1,58 @@
+#include "arena.h"
+#include <cstring>
+
+using namespace std;
+
+Arena line_arena;
+
+Arena::Arena(size_t block_size) : block_size(block_size)
+{
+}
+
+char *Arena::allocate(size_t size)
+{
+    // Move on to the next block that fits, keeping earlier pointers valid
+    while (current < blocks.size() && used + size > blocks[current].size)
+    {
+        current++;
+        used = 0;
+    }
+
+    if (current == blocks.size())
+    {
+        size_t new_size = size > block_size ? size : block_size;
+        blocks.push_back({unique_ptr<char[]>(new char[new_size]), new_size});
+        used = 0;
+    }
+
+    char *result = blocks[current].data.get() + used;
+    used += size;
+    return result;
+}
+
+char *Arena::copy(const char *text, size_t length)
+{
+    char *result = allocate(length + 1);
+    memcpy(result, text, length);
+    result[length] = '\0';
+    return result;
+}
+
+Arena::Mark Arena::mark() const
+{
+    return {current, used};
+}
+
+// Everything allocated after mark becomes invalid
+void Arena::rewind(const Mark &mark)
+{
+    current = mark.current;
+    used = mark.used;
+}
+
+// Everything allocated so far becomes invalid, the blocks stay for the next line
+void Arena::reset()
+{
+    current = 0;
+    used = 0;
+}
@@ -0,0 +1,773 @@
+#include "arith.h"
+#include "variables.h"
+#include "trace.h"
+#include "cmdsubst.h"
+#include <iostream>
+#include <vector>
+#include <string>
+#include <memory>
+#include <unordered_map>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <climits>
+
+using namespace std;
+
+static const size_t ARITH_CACHE_LIMIT = 512; // compiled expressions kept before the cache is reset
+static const int ARITH_MAX_DEPTH = 64;       // variables whose values are expressions, nesting
+
+// One node of a compiled expression; operands are indices into the expression's node list
+struct ArithNode
+{
+    enum Kind
+    {
+        NUMBER,
+        VARIABLE,
+        SPECIAL,    // $?, $#, $1 ..., op is the parameter's character
+        COMMAND,    // $(command), run on each evaluation
+        UNARY,      // op applied to a
+        BINARY,     // a op b
+        AND,        // a && b
+        OR,         // a || b
+        CONDITION,  // a ? b : c
+        ASSIGN,     // name op= b, op is 0 for plain =
+        PRE_UPDATE, // ++name / --name, op is + or -
+        POST_UPDATE,
+        COMMA
+    };
+
+    Kind kind;
+    int op = 0; // operator character, or a two-character code from operator_code
+    int a = -1, b = -1, c = -1;
+    long long value = 0;
+    string name;
+};
+
+struct ArithExpression
+{
+    vector<ArithNode> nodes;
+    int root = -1;
+};
+
+static constexpr int operator_code(char first, char second)
+{
+    return first * 256 + second;
+}
+
+// Recursive descent over C precedence, from the comma operator down to primaries
+class ArithParser
+{
+public:
+    ArithParser(const string &text, ArithExpression &expression) : text(text), p(text.c_str()), expression(expression) {}
+
+    bool parse(string &error)
+    {
+        skip_blanks();
+        if (*p == '\0')
+        {
+            // An empty expression is 0
+            expression.root = add_number(0);
+            return true;
+        }
+        expression.root = parse_comma();
+        skip_blanks();
+        if (expression.root != -1 && *p != '\0')
+        {
+            fail("syntax error in expression");
+        }
+        error = this->error;
+        return error.empty();
+    }
+
+private:
+    void skip_blanks()
+    {
+        while (*p == ' ' || *p == '\t' || *p == '\n')
+            p++;
+    }
+
+    void fail(const string &message)
+    {
+        if (error.empty())
+        {
+            error = message + " (error token is \"" + string(p) + "\")";
+        }
+    }
+
+    int add(const ArithNode &node)
+    {
+        expression.nodes.push_back(node);
+        return (int)expression.nodes.size() - 1;
+    }
+
+    int add_number(long long value)
+    {
+        ArithNode node;
+        node.kind = ArithNode::NUMBER;
+        node.value = value;
+        return add(node);
+    }
+
+    int add_node(ArithNode::Kind kind, int op, int a, int b = -1, int c = -1)
+    {
+        ArithNode node;
+        node.kind = kind;
+        node.op = op;
+        node.a = a;
+        node.b = b;
+        node.c = c;
+        return add(node);
+    }
+
+    // Consumes op when it is next and not the start of a longer operator in reject
+    bool accept(const char *op, const char *reject = "")
+    {
+        skip_blanks();
+        size_t length = strlen(op);
+        if (strncmp(p, op, length) != 0 || (p[length] != '\0' && strchr(reject, p[length])))
+        {
+            return false;
+        }
+        p += length;
+        return true;
+    }
+
+    int parse_comma()
+    {
+        int left = parse_assignment();
+        while (left != -1 && accept(","))
+        {
+            int right = parse_assignment();
+            left = right == -1 ? -1 : add_node(ArithNode::COMMA, ',', left, right);
+        }
+        return left;
+    }
+
+    int parse_assignment()
+    {
+        static const char *const operators[] = {"<<=", ">>=", "**=", "+=", "-=", "*=", "/=", "%=", "&=", "^=", "|=", "="};
+        const char *start = p;
+        int left = parse_conditional();
+        if (left == -1)
+        {
+            return -1;
+        }
+        skip_blanks();
+        for (const char *op : operators)
+        {
+            size_t length = strlen(op);
+            if (strncmp(p, op, length) != 0 || (length == 1 && p[1] == '='))
+            {
+                continue;
+            }
+            if (expression.nodes[left].kind != ArithNode::VARIABLE)
+            {
+                p = start;
+                fail("attempted assignment to non-variable");
+                return -1;
+            }
+            p += length;
+            int right = parse_assignment();
+            if (right == -1)
+            {
+                return -1;
+            }
+            int code = length == 1 ? 0 : (length == 2 ? op[0] : operator_code(op[0], op[1]));
+            int node = add_node(ArithNode::ASSIGN, code, -1, right);
+            expression.nodes[node].name = expression.nodes[left].name;
+            return node;
+        }
+        return left;
+    }
+
+    int parse_conditional()
+    {
+        int condition = parse_binary(0);
+        if (condition == -1 || !accept("?"))
+        {
+            return condition;
+        }
+        int then_branch = parse_comma();
+        if (then_branch == -1)
+        {
+            return -1;
+        }
+        if (!accept(":"))
+        {
+            fail("`:' expected for conditional expression");
+            return -1;
+        }
+        int else_branch = parse_conditional();
+        return else_branch == -1 ? -1 : add_node(ArithNode::CONDITION, '?', condition, then_branch, else_branch);
+    }
+
+    // Binary operators by level, lowest first; reject lists the characters that make an
+    // operator the start of a different one (| of ||, = of ==, ...)
+    struct BinaryOperator
+    {
+        const char *text;
+        const char *reject;
+        int code;
+    };
+
+    int parse_binary(int level)
+    {
+        static const vector<vector<BinaryOperator>> levels = {
+            {{"||", "", operator_code('|', '|')}},
+            {{"&&", "", operator_code('&', '&')}},
+            {{"|", "|=", '|'}},
+            {{"^", "=", '^'}},
+            {{"&", "&=", '&'}},
+            {{"==", "", operator_code('=', '=')}, {"!=", "", operator_code('!', '=')}},
+            {{"<=", "", operator_code('<', '=')}, {">=", "", operator_code('>', '=')}, {"<", "<=", '<'}, {">", ">=", '>'}},
+            {{"<<", "=", operator_code('<', '<')}, {">>", "=", operator_code('>', '>')}},
+            {{"+", "+=", '+'}, {"-", "-=", '-'}},
+            {{"*", "*=", '*'}, {"/", "=", '/'}, {"%", "=", '%'}},
+        };
+        if (level == (int)levels.size())
+        {
+            return parse_power();
+        }
+
+        int left = parse_binary(level + 1);
+        while (left != -1)
+        {
+            const BinaryOperator *matched = nullptr;
+            for (const BinaryOperator &op : levels[level])
+            {
+                if (accept(op.text, op.reject))
+                {
+                    matched = &op;
+                    break;
+                }
+            }
+            if (!matched)
+            {
+                break;
+            }
+            int right = parse_binary(level + 1);
+            if (right == -1)
+            {
+                return -1;
+            }
+            ArithNode::Kind kind = matched->code == operator_code('&', '&')   ? ArithNode::AND
+                                   : matched->code == operator_code('|', '|') ? ArithNode::OR
+                                                                              : ArithNode::BINARY;
+            left = add_node(kind, matched->code, left, right);
+        }
+        return left;
+    }
+
+    // ** binds tighter than * and groups from the right
+    int parse_power()
+    {
+        int base = parse_unary();
+        if (base == -1 || !accept("**", "="))
+        {
+            return base;
+        }
+        int exponent = parse_power();
+        return exponent == -1 ? -1 : add_node(ArithNode::BINARY, operator_code('*', '*'), base, exponent);
+    }
+
+    int parse_unary()
+    {
+        skip_blanks();
+        if (accept("++") || accept("--"))
+        {
+            char op = p[-1];
+            int operand = parse_unary();
+            if (operand == -1)
+            {
+                return -1;
+            }
+            if (expression.nodes[operand].kind != ArithNode::VARIABLE)
+            {
+                fail("attempted assignment to non-variable");
+                return -1;
+            }
+            int node = add_node(ArithNode::PRE_UPDATE, op, -1);
+            expression.nodes[node].name = expression.nodes[operand].name;
+            return node;
+        }
+        for (char op : {'+', '-', '!', '~'})
+        {
+            if (*p == op && !(op == '!' && p[1] == '='))
+            {
+                p++;
+                int operand = parse_unary();
+                return operand == -1 ? -1 : add_node(ArithNode::UNARY, op, operand);
+            }
+        }
+        return parse_postfix();
+    }
+
+    int parse_postfix()
+    {
+        int operand = parse_primary();
+        if (operand == -1 || expression.nodes[operand].kind != ArithNode::VARIABLE)
+        {
+            return operand;
+        }
+        if (accept("++") || accept("--"))
+        {
+            int node = add_node(ArithNode::POST_UPDATE, p[-1], -1);
+            expression.nodes[node].name = expression.nodes[operand].name;
+            return node;
+        }
+        return operand;
+    }
+
+    int parse_primary()
+    {
+        skip_blanks();
+        if (*p == '(')
+        {
+            p++;
+            int inner = parse_comma();
+            if (inner != -1 && !accept(")"))
+            {
+                fail("missing `)'");
+                return -1;
+            }
+            return inner;
+        }
+        if (*p >= '0' && *p <= '9')
+        {
+            return parse_number();
+        }
+
+        if (p[0] == '$' && p[1] == '(')
+        {
+            return parse_command();
+        }
+
+        // NAME, $NAME or ${NAME}; special parameters such as $? and $1 are read when the
+        // expression runs, as the compiled form is cached
+        const char *start = p;
+        bool braced = false;
+        if (*p == '$')
+        {
+            p++;
+            string special;
+            if (*p != '{' && expand_special_variable(*p, special))
+            {
+                ArithNode node;
+                node.kind = ArithNode::SPECIAL;
+                node.op = *p++;
+                return add(node);
+            }
+            braced = *p == '{';
+            p += braced ? 1 : 0;
+        }
+        const char *name = p;
+        if (isalpha((unsigned char)*p) || *p == '_')
+        {
+            while (isalnum((unsigned char)*p) || *p == '_')
+                p++;
+        }
+        if (p == name || (braced && *p != '}'))
+        {
+            p = start;
+            fail("syntax error: operand expected");
+            return -1;
+        }
+        ArithNode node;
+        node.kind = ArithNode::VARIABLE;
+        node.name.assign(name, p - name);
+        p += braced ? 1 : 0;
+        return add(node);
+    }
+
+    // $(command) up to its matching ), skipping quoted text and nested parentheses
+    int parse_command()
+    {
+        const char *begin = p + 2;
+        const char *end = begin;
+        int depth = 1;
+        char quote_char = '\0';
+        for (; *end; end++)
+        {
+            if (quote_char)
+            {
+                if (*end == quote_char)
+                    quote_char = '\0';
+                else if (quote_char == '"' && *end == '\\' && end[1])
+                    end++;
+            }
+            else if (*end == '\\' && end[1])
+                end++;
+            else if (*end == '\'' || *end == '"')
+                quote_char = *end;
+            else if (*end == '(')
+                depth++;
+            else if (*end == ')' && --depth == 0)
+                break;
+        }
+        if (*end == '\0')
+        {
+            fail("missing `)'");
+            return -1;
+        }
+        ArithNode node;
+        node.kind = ArithNode::COMMAND;
+        node.name.assign(begin, end - begin);
+        p = end + 1;
+        return add(node);
+    }
+
+    // Decimal, 0x hexadecimal, 0 octal and base#digits with bases up to 64
+    int parse_number()
+    {
+        const char *start = p;
+        long long base = 10;
+        if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+        {
+            base = 16;
+            p += 2;
+        }
+        else if (p[0] == '0')
+        {
+            base = 8;
+        }
+        else
+        {
+            const char *q = p;
+            long long prefix = 0;
+            while (*q >= '0' && *q <= '9' && prefix <= 64)
+                prefix = prefix * 10 + (*q++ - '0');
+            if (*q == '#')
+            {
+                if (prefix < 2 || prefix > 64)
+                {
+                    fail("invalid arithmetic base");
+                    return -1;
+                }
+                base = prefix;
+                p = q + 1;
+            }
+        }
+
+        unsigned long long value = 0;
+        const char *digits = p;
+        while (isalnum((unsigned char)*p) || *p == '@' || *p == '_')
+        {
+            int digit;
+            char c = *p;
+            if (c >= '0' && c <= '9')
+                digit = c - '0';
+            else if (c >= 'a' && c <= 'z')
+                digit = c - 'a' + 10;
+            else if (c >= 'A' && c <= 'Z')
+                digit = c - 'A' + (base <= 36 ? 10 : 36);
+            else
+                digit = c == '@' ? 62 : 63;
+            if (digit >= base)
+            {
+                p = start;
+                fail("value too great for base");
+                return -1;
+            }
+            value = value * base + digit;
+            p++;
+        }
+        if (p == digits && base != 8)
+        {
+            p = start;
+            fail("invalid number");
+            return -1;
+        }
+        return add_number((long long)value);
+    }
+
+    const string &text;
+    const char *p;
+    ArithExpression &expression;
+    string error;
+};
+
+static bool arith_evaluate_at_depth(const string &text, long long &result, int depth, string &error);
+
+// Evaluates a compiled expression; variables are read and assigned as it goes
+class ArithEvaluator
+{
+public:
+    explicit ArithEvaluator(int depth) : depth(depth) {}
+
+    bool run(const ArithExpression &expression, long long &result)
+    {
+        this->expression = &expression;
+        result = evaluate(expression.root);
+        return error.empty();
+    }
+
+    string error;
+
+private:
+    long long variable(const string &name)
+    {
+        return number(name, get_variable(name));
+    }
+
+    // The value of a variable or command output as a number; text that is not a plain
+    // number is evaluated as an expression itself
+    long long number(const string &name, const char *value)
+    {
+        if (value == nullptr || *value == '\0')
+        {
+            return 0;
+        }
+        char *end;
+        long long plain = strtoll(value, &end, 10);
+        if (*end == '\0')
+        {
+            return plain;
+        }
+
+        long long result = 0;
+        if (depth >= ARITH_MAX_DEPTH)
+        {
+            fail(name + ": expression recursion level exceeded");
+        }
+        else if (!arith_evaluate_at_depth(value, result, depth + 1, error))
+        {
+            result = 0;
+        }
+        return result;
+    }
+
+    void assign(const string &name, long long value)
+    {
+        if (error.empty())
+        {
+            set_variable(name, to_string(value));
+        }
+    }
+
+    void fail(const string &message)
+    {
+        if (error.empty())
+        {
+            error = message;
+        }
+    }
+
+    long long apply(int op, long long a, long long b)
+    {
+        unsigned long long ua = a, ub = b;
+        switch (op)
+        {
+        case '+':
+            return (long long)(ua + ub);
+        case '-':
+            return (long long)(ua - ub);
+        case '*':
+            return (long long)(ua * ub);
+        case '/':
+        case '%':
+            if (b == 0)
+            {
+                fail("division by 0");
+                return 0;
+            }
+            if (a == LLONG_MIN && b == -1)
+            {
+                return op == '/' ? LLONG_MIN : 0;
+            }
+            return op == '/' ? a / b : a % b;
+        case operator_code('*', '*'):
+        {
+            if (b < 0)
+            {
+                fail("exponent less than 0");
+                return 0;
+            }
+            unsigned long long result = 1;
+            for (; b > 0; b >>= 1, ua *= ua)
+            {
+                if (b & 1)
+                    result *= ua;
+            }
+            return (long long)result;
+        }
+        case operator_code('<', '<'):
+            return (long long)(ua << (b & 63));
+        case operator_code('>', '>'):
+            return a >> (b & 63);
+        case '&':
+            return a & b;
+        case '|':
+            return a | b;
+        case '^':
+            return a ^ b;
+        case '<':
+            return a < b;
+        case '>':
+            return a > b;
+        case operator_code('<', '='):
+            return a <= b;
+        case operator_code('>', '='):
+            return a >= b;
+        case operator_code('=', '='):
+            return a == b;
+        case operator_code('!', '='):
+            return a != b;
+        }
+        return 0;
+    }
+
+    long long evaluate(int index)
+    {
+        const ArithNode &node = expression->nodes[index];
+        switch (node.kind)
+        {
+        case ArithNode::NUMBER:
+            return node.value;
+        case ArithNode::VARIABLE:
+            return variable(node.name);
+        case ArithNode::SPECIAL:
+        {
+            string special;
+            expand_special_variable((char)node.op, special);
+            return strtoll(special.c_str(), nullptr, 10);
+        }
+        case ArithNode::COMMAND:
+        {
+            string output;
+            if (!command_substitution(node.name, output))
+            {
+                fail("interrupted");
+                return 0;
+            }
+            return number("$(" + node.name + ")", output.c_str());
+        }
+        case ArithNode::UNARY:
+        {
+            long long value = evaluate(node.a);
+            switch (node.op)
+            {
+            case '-':
+                return (long long)(0ULL - (unsigned long long)value);
+            case '!':
+                return !value;
+            case '~':
+                return ~value;
+            }
+            return value;
+        }
+        case ArithNode::BINARY:
+        {
+            long long left = evaluate(node.a);
+            return apply(node.op, left, evaluate(node.b));
+        }
+        case ArithNode::AND:
+            return evaluate(node.a) && evaluate(node.b);
+        case ArithNode::OR:
+            return evaluate(node.a) || evaluate(node.b);
+        case ArithNode::CONDITION:
+            return evaluate(node.a) ? evaluate(node.b) : evaluate(node.c);
+        case ArithNode::ASSIGN:
+        {
+            long long value = evaluate(node.b);
+            if (node.op != 0)
+            {
+                value = apply(node.op, variable(node.name), value);
+            }
+            assign(node.name, value);
+            return value;
+        }
+        case ArithNode::PRE_UPDATE:
+        case ArithNode::POST_UPDATE:
+        {
+            long long old_value = variable(node.name);
+            long long new_value = apply(node.op, old_value, 1);
+            assign(node.name, new_value);
+            return node.kind == ArithNode::PRE_UPDATE ? new_value : old_value;
+        }
+        case ArithNode::COMMA:
+            evaluate(node.a);
+            return evaluate(node.b);
+        }
+        return 0;
+    }
+
+    const ArithExpression *expression = nullptr;
+    int depth;
+};
+
+// Compiled expressions by source text, so a loop body parses each expression once. Shared,
+// as a variable evaluated inside an expression may reset the cache under it
+static unordered_map<string, shared_ptr<ArithExpression>> compiled;
+
+static shared_ptr<ArithExpression> compile(const string &text, string &error)
+{
+    auto it = compiled.find(text);
+    if (it != compiled.end())
+    {
+        return it->second;
+    }
+
+    shared_ptr<ArithExpression> expression = make_shared<ArithExpression>();
+    ArithParser parser(text, *expression);
+    if (!parser.parse(error))
+    {
+        return nullptr;
+    }
+    if (compiled.size() >= ARITH_CACHE_LIMIT)
+    {
+        compiled.clear();
+    }
+    compiled.emplace(text, expression);
+    return expression;
+}
+
+static bool arith_evaluate_at_depth(const string &text, long long &result, int depth, string &error)
+{
+    shared_ptr<ArithExpression> expression = compile(text, error);
+    if (expression == nullptr)
+    {
+        return false;
+    }
+    ArithEvaluator evaluator(depth);
+    bool ok = evaluator.run(*expression, result);
+    if (!ok && error.empty())
+    {
+        error = evaluator.error;
+    }
+    return ok;
+}
+
+// $(( expression )), (( expression )) and let: 64-bit integer arithmetic with C operators;
+// false after printing the error
+bool arith_evaluate(const string &expression, long long &result)
+{
+    TraceSpan span("arith");
+    span.command(expression);
+    string error;
+    if (!arith_evaluate_at_depth(expression, result, 0, error))
+    {
+        cerr << "shell: " << expression << ": " << error << endl;
+        return false;
+    }
+    return true;
+}
+
+// let expr...: evaluates each argument, succeeds when the last one is not 0
+int builtin_let(BuiltinArgs args)
+{
+    if (args.size() < 2 || args[1] == nullptr)
+    {
+        cerr << "let: expression expected" << endl;
+        return 1;
+    }
+    long long result = 0;
+    for (size_t i = 1; i < args.size() && args[i] != nullptr; i++)
+    {
+        if (!arith_evaluate(args[i], result))
+        {
+            return 1;
+        }
+    }
+    return result != 0 ? 0 : 1;
+}
@@ -1,4 +1,5 @@
 #include "autocomplete.h"
+#include "registry.h"
 #include <iostream>
 #include <vector>
 #include <string>
@@ -7,19 +8,26 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <algorithm>
+#include <mutex>
+#include <thread>
 #include <readline/readline.h>
 #include <readline/history.h>
 
 using namespace std;
 
-// Built-in commands for autocomplete
-static const vector<string> builtin_commands = {
-    "cd", "pwd", "echo", "ls", "exit", "pinfo", "search", "history"};
+// Command words the shell handles itself besides the registered builtins
+static const vector<string> shell_commands = {"time", "batched", "du"};
 
 // Cache for PATH executables to avoid repeated filesystem access
 static vector<string> path_executables_cache;
 static bool cache_initialized = false;
 
+// Sorted, de-duplicated builtins + PATH executables, built on the first TAB or by
+// the prewarm thread; immutable once ready so lookups only need the first lock
+static vector<string> command_index;
+static bool command_index_ready = false;
+static mutex command_index_mutex;
+
 // Function to get all executables in PATH
 vector<string> get_path_executables()
 {
@@ -147,42 +155,53 @@ bool is_command_completion(const char *line_buffer, int start)
     return true; // this is command completion
 }
 
+// Builds the command index once, later callers return immediately
+void build_command_index()
+{
+    lock_guard<mutex> lock(command_index_mutex);
+    if (command_index_ready)
+    {
+        return;
+    }
+
+    vector<string> all_commands = builtin_command_names();
+    all_commands.insert(all_commands.end(), shell_commands.begin(), shell_commands.end());
+    vector<string> path_execs = get_path_executables();
+    all_commands.insert(all_commands.end(), path_execs.begin(), path_execs.end());
+
+    // Sort and remove duplicates
+    sort(all_commands.begin(), all_commands.end());
+    all_commands.erase(unique(all_commands.begin(), all_commands.end()), all_commands.end());
+
+    command_index.swap(all_commands);
+    command_index_ready = true;
+}
+
+// Scans PATH on a background thread so the first TAB does not pay for it
+void prewarm_completion_index()
+{
+    thread(build_command_index).detach();
+}
+
 // Generator function for command completion
 char *command_name_generator(const char *text, int state)
 {
-    static vector<string> all_commands;
     static size_t list_index;
     static size_t text_len;
 
     if (state == 0) // First call
     {
-        all_commands.clear();
-        list_index = 0;
+        build_command_index();
         text_len = strlen(text);
 
-        // Add built-in commands
-        for (const auto &cmd : builtin_commands)
-        {
-            all_commands.push_back(cmd);
-        }
-
-        // Add PATH executables
-        vector<string> path_execs = get_path_executables();
-        all_commands.insert(all_commands.end(), path_execs.begin(), path_execs.end());
-
-        // Sort and remove duplicates
-        sort(all_commands.begin(), all_commands.end());
-        all_commands.erase(unique(all_commands.begin(), all_commands.end()), all_commands.end());
+        // Matches are a contiguous range of the sorted index
+        list_index = lower_bound(command_index.begin(), command_index.end(), string(text)) - command_index.begin();
     }
 
     // Return matching commands
-    while (list_index < all_commands.size())
+    if (list_index < command_index.size() && command_index[list_index].compare(0, text_len, text) == 0)
     {
-        const string &cmd = all_commands[list_index++];
-        if (cmd.length() >= text_len && cmd.substr(0, text_len) == text)
-        {
-            return strdup(cmd.c_str());
-        }
+        return strdup(command_index[list_index++].c_str());
     }
 
     return nullptr;
@@ -252,6 +271,5 @@ void setup_autocomplete()
     // Don't use filename completion as the default fallback
     rl_completion_entry_function = nullptr;
 
-    // Initialize the PATH executables cache
-    get_path_executables();
+    // The PATH scan is deferred to the first TAB or prewarm_completion_index()
 }
\ No newline at end of file
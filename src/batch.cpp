@@ -0,0 +1,466 @@
+#include "batch.h"
+#include "jobs.h"
+#include "timing.h"
+#include "trace.h"
+#include "variables.h"
+#include "procsubst.h"
+#include <iostream>
+#include <vector>
+#include <string>
+#include <deque>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <unistd.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+using namespace std;
+
+// "batched [-j N] [-f N]" in front of the current command
+static bool prefix_active = false;
+static long prefix_jobs = 0;   // 0 uses the batch-jobs option
+static long prefix_fixed = -1; // -1 uses the batch-fixed option
+
+// Shell options: set -o auto-batch, set -o batch-jobs=N, set -o batch-fixed=N
+static bool auto_batch = false;
+static long batch_jobs = 1;
+static long batch_fixed = -1; // arguments after the command repeated in every batch, -1 until set
+
+// Same margin xargs leaves below ARG_MAX
+static const size_t ARG_HEADROOM = 2048;
+
+// Strips "batched [-j N] [-f N]" from the front of a command. -f gives the number of
+// arguments after the command that every batch repeats, such as the pattern of grep
+bool parse_batch_prefix(vector<char *> &tokens)
+{
+    if (tokens.empty() || tokens[0] == nullptr || strcmp(tokens[0], "batched") != 0)
+    {
+        return false;
+    }
+
+    size_t consumed = 1;
+    long jobs = 0;
+    long fixed = -1;
+    while (consumed < tokens.size() && tokens[consumed] != nullptr &&
+           (strncmp(tokens[consumed], "-j", 2) == 0 || strncmp(tokens[consumed], "-f", 2) == 0))
+    {
+        char option = tokens[consumed][1];
+        const char *value = tokens[consumed][2] ? tokens[consumed] + 2 : nullptr;
+        consumed++;
+        if (value == nullptr && consumed < tokens.size() && tokens[consumed] != nullptr)
+        {
+            value = tokens[consumed++];
+        }
+
+        char *end = nullptr;
+        long number = value ? strtol(value, &end, 10) : -1;
+        if (value == nullptr || *end != '\0' || number < (option == 'j' ? 1 : 0))
+        {
+            cerr << (option == 'j' ? "batched: -j requires a positive number\n" : "batched: -f requires a number of arguments\n");
+            tokens.clear();
+            return true;
+        }
+        (option == 'j' ? jobs : fixed) = number;
+    }
+
+    tokens.erase(tokens.begin(), tokens.begin() + consumed);
+    prefix_active = true;
+    prefix_jobs = jobs;
+    prefix_fixed = fixed;
+    return true;
+}
+
+void batch_finish()
+{
+    prefix_active = false;
+    prefix_jobs = 0;
+    prefix_fixed = -1;
+}
+
+bool batch_requested()
+{
+    return prefix_active || auto_batch;
+}
+
+// Bytes an argument takes in the new process image: the string and its pointer
+static size_t arg_bytes(const char *arg)
+{
+    return strlen(arg) + 1 + sizeof(char *);
+}
+
+static size_t vector_bytes(char *const *strings)
+{
+    size_t total = sizeof(char *); // NULL terminator
+    for (; strings && *strings; strings++)
+    {
+        total += arg_bytes(*strings);
+    }
+    return total;
+}
+
+static size_t arg_limit()
+{
+    long limit = sysconf(_SC_ARG_MAX);
+    if (limit <= 0)
+    {
+        limit = 128 * 1024;
+    }
+    return (size_t)limit - ARG_HEADROOM;
+}
+
+bool exceeds_arg_max(char *const *argv, char *const *envp)
+{
+    return vector_bytes(argv) + vector_bytes(envp) > arg_limit();
+}
+
+// Folds one batch's wait status into the overall status, using xargs' codes:
+// 123 a batch failed, 124 a batch exited 255, 125 killed by a signal, 126/127 not runnable
+static int batch_exit_code(int status)
+{
+    if (WIFSIGNALED(status))
+    {
+        return 125;
+    }
+
+    int code = WEXITSTATUS(status);
+    if (code == 0 || code == 126 || code == 127)
+    {
+        return code;
+    }
+    return code == 255 ? 124 : 123;
+}
+
+static int wait_for_batch(deque<pid_t> &running, bool &interrupted)
+{
+    pid_t pid = running.front();
+    running.pop_front();
+
+    int status = 0;
+    struct rusage usage;
+    while (wait4(pid, &status, 0, &usage) == -1)
+    {
+        if (errno != EINTR)
+        {
+            perror("wait4");
+            return 125;
+        }
+    }
+
+    timing_stage_reaped(pid, status, usage);
+    if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT)
+    {
+        interrupted = true;
+    }
+    return batch_exit_code(status);
+}
+
+// Batch children get the same signal state setup_child_process gives a forked child
+static bool init_spawn_attributes(posix_spawnattr_t *attributes)
+{
+    sigset_t defaults, empty;
+    sigemptyset(&defaults);
+    for (int sig : {SIGINT, SIGTSTP, SIGCHLD, SIGTTOU, SIGTTIN, SIGPIPE})
+    {
+        sigaddset(&defaults, sig);
+    }
+    sigemptyset(&empty);
+    return posix_spawnattr_setsigdefault(attributes, &defaults) == 0 && posix_spawnattr_setsigmask(attributes, &empty) == 0 &&
+           posix_spawnattr_setflags(attributes, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK) == 0;
+}
+
+// posix_spawn reports a failed open and a missing command alike, so on ENOENT the
+// plan's input files are checked to tell them apart. Returns the pid or -status
+static pid_t spawn_batch(char **argv, const RedirectionInfo &redir, const posix_spawn_file_actions_t &actions,
+                         const posix_spawnattr_t &attributes, char **envp)
+{
+    pid_t pid;
+    int error = posix_spawnp(&pid, argv[0], &actions, &attributes, argv, envp);
+    if (error == 0)
+    {
+        return pid;
+    }
+    if (error == ENOENT)
+    {
+        for (const FdStep &step : redir.steps)
+        {
+            if (step.kind == FdStep::OPEN && !(step.flags & O_CREAT) && access(step.file.c_str(), F_OK) == -1)
+            {
+                perror(("shell: " + step.file).c_str());
+                return -1;
+            }
+        }
+        cerr << argv[0] << ": command not found" << endl;
+        return -127;
+    }
+    cerr << argv[0] << ": " << strerror(error) << endl;
+    return -126;
+}
+
+// Plans with a fan-out need code in the child, see setup_redirection
+static pid_t fork_batch(char **argv, const RedirectionInfo &redir, char **envp)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        setup_child_process(getpgrp(), false);
+        procsubst_inherit();
+        if (!setup_redirection(redir))
+        {
+            _exit(1);
+        }
+        trace_flush();
+        execvpe(argv[0], argv, envp);
+        if (errno == ENOENT)
+        {
+            cerr << argv[0] << ": command not found" << endl;
+            _exit(127);
+        }
+        perror("execvp");
+        _exit(126);
+    }
+    if (pid < 0)
+    {
+        perror("fork");
+        return -125;
+    }
+    return pid;
+}
+
+// Runs fixed arguments + each batch, at most jobs at a time, and returns the combined status.
+// Children stay in the caller's process group so Ctrl+C reaches every batch
+static int run_batches(const vector<char *> &args, size_t fixed, const vector<pair<size_t, size_t>> &batches,
+                       const RedirectionInfo &redir, char **envp, long jobs, const string &command_text)
+{
+    deque<pid_t> running;
+    int result = 0;
+    bool interrupted = false;
+
+    // The same file actions and attributes serve every batch
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attributes;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attributes);
+    bool spawn = procsubst_spawn_actions(&actions) && redirection_spawn_actions(redir, &actions) && init_spawn_attributes(&attributes);
+
+    for (size_t b = 0; b < batches.size() && !interrupted; b++)
+    {
+        while ((long)running.size() >= jobs)
+        {
+            result = max(result, wait_for_batch(running, interrupted));
+        }
+        if (interrupted)
+        {
+            break;
+        }
+
+        vector<char *> argv(args.begin(), args.begin() + fixed);
+        argv.insert(argv.end(), args.begin() + batches[b].first, args.begin() + batches[b].second);
+        argv.push_back(nullptr);
+
+        TraceSpan fork_span("fork", (int)b);
+        fork_span.command(argv[0]);
+        pid_t pid = spawn ? spawn_batch(argv.data(), redir, actions, attributes, envp) : fork_batch(argv.data(), redir, envp);
+        if (pid < 0)
+        {
+            result = max(result, -pid);
+            break;
+        }
+        fork_span.child(pid);
+
+        timing_stage_spawned(pid, command_text + " [batch " + to_string(b + 1) + "/" + to_string(batches.size()) + "]");
+        running.push_back(pid);
+    }
+
+    while (!running.empty())
+    {
+        result = max(result, wait_for_batch(running, interrupted));
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributes);
+    return result;
+}
+
+static bool truncate_target(const string &file)
+{
+    int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        perror(("shell: " + file).c_str());
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+// Splits an argument list that is too big for one execve into xargs-style batches
+// and runs them, returning the combined status. The command name and as many arguments
+// as batched -f or set -o batch-fixed give are repeated in every batch; which arguments
+// belong to the command rather than the list cannot be told from the words
+static int run_split(const RedirectionInfo &redir, char **envp, const string &command_text)
+{
+    const vector<char *> &args = redir.clean_args;
+    size_t argc = 0;
+    while (argc < args.size() && args[argc] != nullptr)
+        argc++;
+
+    long fixed_arguments = prefix_fixed >= 0 ? prefix_fixed : batch_fixed;
+    if (fixed_arguments < 0)
+    {
+        cerr << "batched: " << args[0] << ": argument list too long; give the number of arguments every batch "
+             << "repeats with batched -f N or set -o batch-fixed=N\n";
+        return 126;
+    }
+    size_t fixed = min<size_t>(1 + fixed_arguments, argc);
+
+    size_t overhead = vector_bytes(envp) + sizeof(char *);
+    for (size_t i = 0; i < fixed; i++)
+    {
+        overhead += arg_bytes(args[i]);
+    }
+    if (overhead >= arg_limit())
+    {
+        cerr << "batched: command and environment alone exceed ARG_MAX\n";
+        return 126;
+    }
+    size_t budget = arg_limit() - overhead;
+
+    vector<pair<size_t, size_t>> batches;
+    size_t start = fixed, used = 0;
+    for (size_t i = fixed; i < argc; i++)
+    {
+        size_t cost = arg_bytes(args[i]);
+        if (cost > budget)
+        {
+            cerr << "batched: argument too long: " << string(args[i], 0, 40) << "...\n";
+            return 126;
+        }
+        if (used + cost > budget)
+        {
+            batches.push_back({start, i});
+            start = i;
+            used = 0;
+        }
+        used += cost;
+    }
+    batches.push_back({start, argc});
+
+    // > truncates once up front, every batch then appends
+    RedirectionInfo batch_redir = redir;
+    for (FdStep &step : batch_redir.steps)
+    {
+        if (step.kind == FdStep::OPEN && (step.flags & O_TRUNC))
+        {
+            if (!truncate_target(step.file))
+            {
+                return 1;
+            }
+            step.flags = (step.flags & ~O_TRUNC) | O_APPEND;
+        }
+        for (OutputTarget &output : step.targets)
+        {
+            if (!output.append && !truncate_target(output.file))
+            {
+                return 1;
+            }
+            output.append = true;
+        }
+    }
+
+    long jobs = prefix_jobs > 0 ? prefix_jobs : batch_jobs;
+    return run_batches(args, fixed, batches, batch_redir, envp, jobs, command_text);
+}
+
+// Simple command whose arguments exceed ARG_MAX
+void execute_batched(const RedirectionInfo &redir, bool background, char **envp, const string &command_text)
+{
+    TraceSpan span("batch");
+    span.command(command_text);
+
+    if (!background)
+    {
+        set_last_status(run_split(redir, envp, command_text));
+        return;
+    }
+
+    // In the background a child shell runs the batches and becomes the job
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        setup_child_process(0, false);
+        int result = run_split(redir, envp, command_text);
+        trace_flush();
+        _exit(result);
+    }
+    if (pid < 0)
+    {
+        perror("fork");
+        return;
+    }
+
+    place_in_job_group(pid, pid);
+    bool quiet = background_launch_quiet();
+    int job_id = add_job(pid, {pid}, command_text, JobState::Running);
+    if (!quiet)
+    {
+        cout << "[" << job_id << "] Background process started with PID: " << pid << endl;
+    }
+    set_last_background_pid(pid);
+    set_last_status(0);
+}
+
+// Pipeline stage, called in the already forked child whose stdio is set up
+int execute_batched_stage(char **argv, char **envp, const string &command_text)
+{
+    RedirectionInfo redir;
+    for (char **arg = argv; *arg; arg++)
+    {
+        redir.clean_args.push_back(*arg);
+    }
+    redir.clean_args.push_back(nullptr);
+    return run_split(redir, envp, command_text);
+}
+
+void set_auto_batch(bool enabled)
+{
+    auto_batch = enabled;
+}
+
+bool set_batch_jobs(long jobs)
+{
+    if (jobs <= 0)
+    {
+        return false;
+    }
+    batch_jobs = jobs;
+    return true;
+}
+
+bool set_batch_fixed(long fixed)
+{
+    if (fixed < -1)
+    {
+        return false;
+    }
+    batch_fixed = fixed;
+    return true;
+}
+
+bool get_auto_batch()
+{
+    return auto_batch;
+}
+
+long get_batch_jobs()
+{
+    return batch_jobs;
+}
+
+long get_batch_fixed()
+{
+    return batch_fixed;
+}
@@ -1,5 +1,19 @@
 #include "shell.h"
 #include "builtins.h"
+#include "jobs.h"
+#include "trace.h"
+#include "parallel.h"
+#include "variables.h"
+#include "batch.h"
+#include "textutils.h"
+#include "sort.h"
+#include "walker.h"
+#include "du.h"
+#include "listing.h"
+#include "arith.h"
+#include "conditional.h"
+#include "script.h"
+#include "linereader.h"
 #include <iostream>
 #include <vector>
 #include <string>
@@ -7,16 +21,16 @@
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <pwd.h>
-#include <grp.h>
 #include <ctime>
-#include <iomanip>
 #include <algorithm>
 #include <unistd.h>
 #include <limits.h>
 #include <cstdio>
 #include <sstream>
 #include <cstdlib>
+#include <atomic>
 
 using namespace std;
 
@@ -63,22 +77,6 @@ void add_to_history(const string &command)
     }
 }
 
-string get_permissions(mode_t mode)
-{
-    string perms(10, '-');
-    perms[0] = S_ISDIR(mode) ? 'd' : (S_ISLNK(mode) ? 'l' : '-');
-    perms[1] = (mode & S_IRUSR) ? 'r' : '-';
-    perms[2] = (mode & S_IWUSR) ? 'w' : '-';
-    perms[3] = (mode & S_IXUSR) ? 'x' : '-';
-    perms[4] = (mode & S_IRGRP) ? 'r' : '-';
-    perms[5] = (mode & S_IWGRP) ? 'w' : '-';
-    perms[6] = (mode & S_IXGRP) ? 'x' : '-';
-    perms[7] = (mode & S_IROTH) ? 'r' : '-';
-    perms[8] = (mode & S_IWOTH) ? 'w' : '-';
-    perms[9] = (mode & S_IXOTH) ? 'x' : '-';
-    return perms;
-}
-
 void print_long_format(const string &path, const char *filename)
 {
     if (!filename)
@@ -104,42 +102,8 @@ void print_long_format(const string &path, const char *filename)
         return;
     }
 
-    string perms = get_permissions(st.st_mode);
-    cout << perms << " " << setw(3) << st.st_nlink << " ";
-
-    struct passwd *pw = getpwuid(st.st_uid);
-    cout << setw(8) << (pw ? pw->pw_name : "unknown") << " ";
-
-    struct group *grp = getgrgid(st.st_gid);
-    cout << setw(8) << (grp ? grp->gr_name : "unknown") << " ";
-
-    cout << setw(8) << st.st_size << " ";
-
-    char timebuf[80];
-    struct tm *tm_info = localtime(&st.st_mtime);
-    if (tm_info)
-    {
-        strftime(timebuf, sizeof(timebuf), "%b %d %H:%M", tm_info);
-        cout << timebuf << " ";
-    }
-    else
-    {
-        cout << "??? ?? ??:?? ";
-    }
-
-    cout << filename;
-
-    if (S_ISLNK(st.st_mode))
-    {
-        char link_target[PATH_MAX];
-        ssize_t len = readlink(fullpath.c_str(), link_target, sizeof(link_target) - 1);
-        if (len != -1)
-        {
-            link_target[len] = '\0';
-            cout << " -> " << link_target;
-        }
-    }
-    cout << endl;
+    tzset();
+    cout << format_long_entry(AT_FDCWD, fullpath.c_str(), filename, st) << endl;
 }
 
 void list_directory(const string &path, bool show_all, bool long_format)
@@ -177,10 +141,11 @@ void list_directory(const string &path, bool show_all, bool long_format)
     }
 }
 
-void builtin_ls(const vector<string> &args)
+int builtin_ls(BuiltinArgs args)
 {
     bool show_all = false;
     bool long_format = false;
+    bool recursive = false;
     vector<string> paths;
 
     // Parse arguments
@@ -200,10 +165,14 @@ void builtin_ls(const vector<string> &args)
                 {
                     long_format = true;
                 }
+                else if (arg[j] == 'R')
+                {
+                    recursive = true;
+                }
                 else
                 {
                     cerr << "ls: invalid option -- '" << arg[j] << "'\n";
-                    return;
+                    return 2;
                 }
             }
         }
@@ -232,22 +201,31 @@ void builtin_ls(const vector<string> &args)
         }
     }
 
+    int status = 0;
     bool multi_dirs = paths.size() > 1;
     for (size_t i = 0; i < paths.size(); i++)
     {
-        if (multi_dirs)
+        struct stat st;
+        bool exists = stat(paths[i].c_str(), &st) == 0;
+
+        // -R prints a header for every directory, the operand included
+        if (multi_dirs && !(recursive && exists && S_ISDIR(st.st_mode)))
         {
             cout << paths[i] << ":" << endl;
         }
 
-        struct stat st;
-        if (stat(paths[i].c_str(), &st) == -1)
+        if (!exists)
         {
             perror(("ls: cannot access " + paths[i]).c_str());
+            status = 1;
             continue;
         }
 
-        if (S_ISDIR(st.st_mode))
+        if (S_ISDIR(st.st_mode) && recursive)
+        {
+            list_recursive(paths[i], show_all, long_format);
+        }
+        else if (S_ISDIR(st.st_mode))
         {
             list_directory(paths[i], show_all, long_format);
         }
@@ -278,9 +256,10 @@ void builtin_ls(const vector<string> &args)
             cout << endl;
         }
     }
+    return status;
 }
 
-int builtin_cd(vector<char *> args)
+int builtin_cd(BuiltinArgs args)
 {
     int argc = 0;
     while (argc < (int)args.size() && args[argc] != nullptr)
@@ -377,7 +356,7 @@ int builtin_cd(vector<char *> args)
     return 0;
 }
 
-int builtin_pwd(vector<char *> args)
+int builtin_pwd(BuiltinArgs args)
 {
     (void)args; // pwd ignores arguments
 
@@ -393,7 +372,7 @@ int builtin_pwd(vector<char *> args)
     return 0;
 }
 
-int builtin_echo(vector<char *> args)
+int builtin_echo(BuiltinArgs args)
 {
     int argc = 0;
     while (argc < (int)args.size() && args[argc] != nullptr)
@@ -430,7 +409,7 @@ string read_file(const string &filename)
     return content_stream.str();
 }
 
-int builtin_pinfo(vector<char *> args)
+int builtin_pinfo(BuiltinArgs args)
 {
     int argc = 0;
     while (argc < (int)args.size() && args[argc] != nullptr)
@@ -523,57 +502,47 @@ int builtin_pinfo(vector<char *> args)
     return 0;
 }
 
-// Helper function for recursive search
+// Helper function for recursive search; directories are listed in parallel on the
+// shared walker and the walk stops at the first match. Symlinked directories are not followed
 bool search_recursive(const string &path, const string &target, bool ignore_hidden = true)
 {
-    DIR *dir = opendir(path.c_str());
-    if (!dir)
-    {
-        return false;
-    }
-
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != nullptr)
-    {
-        string name = entry->d_name;
-
-        // Skip . and ..
-        if (name == "." || name == "..")
-        {
-            continue;
-        }
-
-        // Skip hidden files if requested
-        if (ignore_hidden && name[0] == '.')
-        {
-            continue;
-        }
-
-        // Check if this is the target
-        if (name == target)
-        {
-            closedir(dir);
-            return true;
-        }
-
-        // If it's a directory, search recursively
-        string full_path = path + "/" + name;
-        struct stat st;
-        if (stat(full_path.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
-        {
-            if (search_recursive(full_path, target, ignore_hidden))
-            {
-                closedir(dir);
-                return true;
-            }
-        }
-    }
-
-    closedir(dir);
-    return false;
+    atomic<bool> found(false);
+    walk_tree(path, nullptr, walk_default_threads(), [&](const WalkDir &dir, const vector<WalkEntry> &entries)
+              {
+                  if (dir.fd == -1 || found)
+                  {
+                      return;
+                  }
+                  for (const WalkEntry &entry : entries)
+                  {
+                      // Skip hidden files if requested
+                      if (ignore_hidden && entry.name[0] == '.')
+                      {
+                          continue;
+                      }
+                      if (target == entry.name)
+                      {
+                          found = true;
+                          walk_stop();
+                          return;
+                      }
+
+                      bool is_dir = entry.type == DT_DIR;
+                      if (entry.type == DT_UNKNOWN)
+                      {
+                          struct stat st;
+                          is_dir = fstatat(dir.fd, entry.name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+                      }
+                      if (is_dir)
+                      {
+                          walk_descend(dir, entry.name, nullptr);
+                      }
+                  }
+              });
+    return found;
 }
 
-int builtin_search(vector<char *> args)
+int builtin_search(BuiltinArgs args)
 {
     int argc = 0;
     while (argc < (int)args.size() && args[argc] != nullptr)
@@ -592,7 +561,7 @@ int builtin_search(vector<char *> args)
     return 0;
 }
 
-int builtin_history(vector<char *> args)
+int builtin_history(BuiltinArgs args)
 {
     int argc = 0;
     while (argc < (int)args.size() && args[argc] != nullptr)
@@ -629,69 +598,181 @@ int builtin_history(vector<char *> args)
     return 0;
 }
 
-bool handle_builtin(vector<char *> args)
+// Shell options: set -o name[=value] enables, set +o name disables, set -o lists
+int builtin_set(BuiltinArgs args)
 {
-    if (args.empty())
+    int argc = 0;
+    while (argc < (int)args.size() && args[argc] != nullptr)
+        argc++;
+
+    if (argc == 1 || (argc == 2 && strcmp(args[1], "-o") == 0))
     {
-        return true;
+        cout << "trace-file\t" << (trace_enabled ? trace_path() : "off") << endl;
+        cout << "max-jobs\t" << (get_max_jobs() > 0 ? to_string(get_max_jobs()) : "unlimited") << endl;
+        cout << "auto-batch\t" << (get_auto_batch() ? "on" : "off") << endl;
+        cout << "batch-jobs\t" << get_batch_jobs() << endl;
+        cout << "batch-fixed\t" << (get_batch_fixed() >= 0 ? to_string(get_batch_fixed()) : "unset") << endl;
+        cout << "text-builtins\t" << (get_text_builtins() ? "on" : "off") << endl;
+        cout << "sort-buffer\t" << get_sort_buffer() << endl;
+        return 0;
     }
 
-    if (args[0] == nullptr)
+    if (argc != 3 || (strcmp(args[1], "-o") != 0 && strcmp(args[1], "+o") != 0))
     {
-        return true;
+        cerr << "set: usage: set [-o name[=value]] [+o name]\n";
+        return -1;
     }
 
-    string cmd = args[0];
+    bool enable = args[1][0] == '-';
+    string option = args[2];
+    string value;
+    size_t eq = option.find('=');
+    if (eq != string::npos)
+    {
+        value = option.substr(eq + 1);
+        option = option.substr(0, eq);
+    }
 
-    // Add command to history (except history command itself)
-    if (cmd != "history" && args.size() > 0)
+    if (option == "trace-file")
     {
-        string full_cmd = cmd;
-        for (size_t i = 1; i < args.size() && args[i] != nullptr; i++)
+        if (!enable)
         {
-            full_cmd += " " + string(args[i]);
+            trace_close();
+            return 0;
         }
-        add_to_history(full_cmd);
+        if (value.empty())
+        {
+            cerr << "set: trace-file requires a path\n";
+            return -1;
+        }
+        return trace_open(value) ? 0 : -1;
     }
 
-    if (cmd == "cd")
+    if (option == "max-jobs")
     {
-        return builtin_cd(args) == 0;
+        if (!enable)
+        {
+            return set_max_jobs(0) ? 0 : -1;
+        }
+        char *end = nullptr;
+        long max_jobs = value.empty() ? -1 : strtol(value.c_str(), &end, 10);
+        if (max_jobs < 0 || *end != '\0')
+        {
+            cerr << "set: max-jobs requires a number, 0 for unlimited\n";
+            return -1;
+        }
+        return set_max_jobs(max_jobs) ? 0 : -1;
     }
-    if (cmd == "pwd")
+
+    if (option == "auto-batch")
     {
-        return builtin_pwd(args) == 0;
+        set_auto_batch(enable);
+        return 0;
     }
-    if (cmd == "echo")
+
+    if (option == "batch-jobs")
     {
-        return builtin_echo(args) == 0;
+        if (!enable)
+        {
+            set_batch_jobs(1);
+            return 0;
+        }
+        if (!set_batch_jobs(atol(value.c_str())))
+        {
+            cerr << "set: batch-jobs requires a positive number\n";
+            return -1;
+        }
+        return 0;
     }
-    if (cmd == "ls")
+
+    if (option == "batch-fixed")
     {
-        vector<string> str_args;
-        for (size_t i = 0; i < args.size() && args[i] != nullptr; ++i)
+        char *end = nullptr;
+        long fixed = !enable ? -1 : (value.empty() ? -2 : strtol(value.c_str(), &end, 10));
+        if ((end && *end != '\0') || !set_batch_fixed(fixed))
         {
-            str_args.push_back(string(args[i]));
+            cerr << "set: batch-fixed requires a number of arguments\n";
+            return -1;
         }
-        builtin_ls(str_args);
-        return true;
+        return 0;
     }
-    if (cmd == "pinfo")
+
+    if (option == "text-builtins")
     {
-        return builtin_pinfo(args) == 0;
+        set_text_builtins(enable);
+        return 0;
     }
-    if (cmd == "search")
+
+    if (option == "sort-buffer")
     {
-        return builtin_search(args) == 0;
+        if (!set_sort_buffer(enable ? value : ""))
+        {
+            cerr << "set: sort-buffer requires a size such as 512M\n";
+            return -1;
+        }
+        return 0;
     }
-    if (cmd == "history")
+
+    cerr << "set: " << option << ": invalid option name\n";
+    return -1;
+}
+
+int builtin_true(BuiltinArgs args)
+{
+    (void)args;
+    return 0;
+}
+
+int builtin_false(BuiltinArgs args)
+{
+    (void)args;
+    return 1;
+}
+
+// exit [n], with the last command's status by default
+int builtin_exit(BuiltinArgs args)
+{
+    exit(args.size() > 1 ? (int)(strtol(args[1], nullptr, 10) & 0xff) : last_status());
+}
+
+// Runs a builtin and returns its exit status; the -1 many builtins return on an error
+// is reported as 1
+int handle_builtin(const vector<char *> &args)
+{
+    if (args.empty() || args[0] == nullptr)
     {
-        return builtin_history(args) == 0;
+        return 0;
     }
-    if (cmd == "exit")
+
+    string cmd = args[0];
+
+    TraceSpan span("builtin");
+    span.command(cmd);
+
+    // Add command to history (except history command itself)
+    if (cmd != "history" && args.size() > 0)
     {
-        exit(0);
+        string full_cmd = cmd;
+        for (size_t i = 1; i < args.size() && args[i] != nullptr; i++)
+        {
+            full_cmd += " " + string(args[i]);
+        }
+        add_to_history(full_cmd);
     }
 
-    return false;
+    int status = 1;
+    const BuiltinDescriptor *builtin = find_builtin(args[0]);
+    if (builtin)
+    {
+        status = builtin->run(args);
+    }
+    else if (is_text_builtin(args))
+    {
+        status = run_text_builtin(args, STDIN_FILENO, STDOUT_FILENO);
+    }
+    else if (du_builtin_supported(args))
+    {
+        status = builtin_du(args);
+    }
+    return status < 0 ? 1 : status & 0xff;
 }
\ No newline at end of file
@@ -0,0 +1,197 @@
+#include "cmdsubst.h"
+#include "shell.h"
+#include "builtins.h"
+#include "registry.h"
+#include "jobs.h"
+#include "trace.h"
+#include "variables.h"
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+static const size_t CAPTURE_READ_SIZE = 64 * 1024;
+
+// Appends everything written to the stream to a string, for builtins run in-process
+class CaptureBuffer : public streambuf
+{
+public:
+    explicit CaptureBuffer(string &out) : out(out) {}
+
+protected:
+    int_type overflow(int_type c) override
+    {
+        if (c != traits_type::eof())
+        {
+            out += traits_type::to_char_type(c);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    streamsize xsputn(const char *s, streamsize n) override
+    {
+        out.append(s, n);
+        return n;
+    }
+
+private:
+    string &out;
+};
+
+// Builtins that only print and leave the shell as it is may run without a fork. The
+// command must be plain words, anything needing the tokenizer goes to the child
+static bool split_plain_builtin(const string &command, vector<string> &words)
+{
+    static const char *const special = "|&;<>()$`'\"\\*?[]~{}#=";
+    string word;
+    for (char c : command)
+    {
+        if (strchr(special, c))
+        {
+            return false;
+        }
+        if (c == ' ' || c == '\t' || c == '\n')
+        {
+            if (!word.empty())
+            {
+                words.push_back(word);
+                word.clear();
+            }
+            continue;
+        }
+        word += c;
+    }
+    if (!word.empty())
+    {
+        words.push_back(word);
+    }
+    const BuiltinDescriptor *builtin = words.empty() ? nullptr : find_builtin(words[0].c_str());
+    return builtin && (builtin->flags & BUILTIN_CAPTURE_SAFE);
+}
+
+static int run_builtin_captured(vector<string> &words, string &out)
+{
+    vector<char *> args;
+    for (string &word : words)
+    {
+        args.push_back(&word[0]);
+    }
+    args.push_back(nullptr);
+
+    cout.flush();
+    CaptureBuffer capture(out);
+    streambuf *previous = cout.rdbuf(&capture);
+    int result = find_builtin(args[0])->run(args);
+    cout.rdbuf(previous);
+    return result == 0 ? 0 : 1;
+}
+
+// Forks a child that runs command with stdout on a pipe and reads it all into out
+static int run_captured(const string &command, string &out)
+{
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1)
+    {
+        perror("shell: pipe");
+        return 1;
+    }
+
+    cout.flush();
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return 1;
+    }
+    if (pid == 0)
+    {
+        // Stays in the shell's process group, which owns the terminal while the line is
+        // expanded, so Ctrl+C reaches it and whatever it runs
+        job_control_enabled = false;
+        setup_child_process(0, false);
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[1]);
+
+        vector<char> buffer(command.begin(), command.end());
+        buffer.push_back('\0');
+        parse_semicolon_commands(buffer.data());
+        cout.flush();
+        trace_flush();
+        _exit(last_status());
+    }
+    close(fds[1]);
+
+    // Large reads straight into the string's spare capacity
+    size_t length = out.size();
+    while (true)
+    {
+        if (out.size() < length + CAPTURE_READ_SIZE)
+        {
+            out.resize(max(out.size() * 2, length + CAPTURE_READ_SIZE));
+        }
+        ssize_t n = read(fds[0], &out[length], out.size() - length);
+        if (n > 0)
+        {
+            length += n;
+        }
+        else if (n == 0 || errno != EINTR)
+        {
+            break;
+        }
+    }
+    out.resize(length);
+    close(fds[0]);
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+    {
+    }
+    if (WIFSIGNALED(status))
+    {
+        return 128 + WTERMSIG(status);
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+static bool substituted = false; // a substitution ran since the line was tokenized
+
+void command_substitution_reset()
+{
+    substituted = false;
+}
+
+// True when the words of the current command ran a substitution, whose status is then $?
+bool command_substitution_ran()
+{
+    return substituted;
+}
+
+// $(command) and `command`: appends the output without its trailing newlines and sets $?
+// to the command's status; false when the command was interrupted
+bool command_substitution(const string &command, string &out)
+{
+    TraceSpan span("cmdsubst");
+    span.command(command);
+
+    string captured;
+    vector<string> words;
+    int status = split_plain_builtin(command, words) ? run_builtin_captured(words, captured) : run_captured(command, captured);
+
+    size_t end = captured.find_last_not_of('\n');
+    captured.resize(end == string::npos ? 0 : end + 1);
+    out += captured;
+    set_last_status(status);
+    substituted = true;
+    return status != 128 + SIGINT;
+}
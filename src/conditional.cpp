@@ -0,0 +1,450 @@
+#include "conditional.h"
+#include "arith.h"
+#include "variables.h"
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <climits>
+#include <unordered_map>
+#include <fnmatch.h>
+#include <regex.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+// stat, lstat and access results of the paths tested by the current command line, so
+// [ -e f -a -r f ] or [[ -f f && -s f ]] asks the kernel once per path
+struct FileStatus
+{
+    bool stat_done = false;
+    bool stat_ok = false;
+    struct stat st;
+    bool lstat_done = false;
+    bool lstat_ok = false;
+    struct stat lst;
+    int access_checked = 0; // R_OK, W_OK and X_OK bits already asked for
+    int access_ok = 0;
+};
+
+static unordered_map<string, FileStatus> file_cache;
+
+
+static const struct stat *cached_stat(const string &path, bool follow)
+{
+    FileStatus &status = file_cache[path];
+    if (follow)
+    {
+        if (!status.stat_done)
+        {
+            status.stat_ok = stat(path.c_str(), &status.st) == 0;
+            status.stat_done = true;
+        }
+        return status.stat_ok ? &status.st : nullptr;
+    }
+    if (!status.lstat_done)
+    {
+        status.lstat_ok = lstat(path.c_str(), &status.lst) == 0;
+        status.lstat_done = true;
+    }
+    return status.lstat_ok ? &status.lst : nullptr;
+}
+
+// Permission for the effective ids, as test checks it; a path stat could not find is
+// not asked about again
+static bool cached_access(const string &path, int mode)
+{
+    FileStatus &status = file_cache[path];
+    if (status.stat_done && !status.stat_ok)
+    {
+        return false;
+    }
+    if (!(status.access_checked & mode))
+    {
+        if (faccessat(AT_FDCWD, path.c_str(), mode, AT_EACCESS) == 0)
+            status.access_ok |= mode;
+        status.access_checked |= mode;
+    }
+    return status.access_ok & mode;
+}
+
+static bool newer(const struct stat &a, const struct stat &b)
+{
+    return a.st_mtim.tv_sec != b.st_mtim.tv_sec ? a.st_mtim.tv_sec > b.st_mtim.tv_sec : a.st_mtim.tv_nsec > b.st_mtim.tv_nsec;
+}
+
+static bool is_unary_operator(const string &word)
+{
+    static const char *const operators = "abcdefghknoprstuvwxzGLNOS";
+    return word.size() == 2 && word[0] == '-' && strchr(operators, word[1]);
+}
+
+static bool is_binary_operator(const string &word, bool extended)
+{
+    static const char *const operators[] = {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef"};
+    for (const char *op : operators)
+    {
+        if (word == op)
+            return true;
+    }
+    return extended && word == "=~";
+}
+
+// Evaluates the words of test, [ ... ] and [[ ... ]]. [[ ]] words arrive in glob pattern
+// form, with quoted characters escaped, so == can tell a quoted * from a wildcard
+class TestParser
+{
+public:
+    TestParser(const char *name, const vector<string> &words, bool extended) : name(name), words(words), extended(extended) {}
+
+    // 0 true, 1 false, 2 usage error
+    int run()
+    {
+        bool result = extended || words.size() > 4 ? parse_full() : posix(0, words.size());
+        if (!error.empty())
+        {
+            cerr << "shell: " << name << ": " << error << endl;
+            return 2;
+        }
+        return result ? 0 : 1;
+    }
+
+private:
+    // The word with the escapes of the pattern form removed
+    string text(size_t index) const
+    {
+        const string &word = words[index];
+        if (!extended)
+        {
+            return word;
+        }
+        string plain;
+        for (size_t i = 0; i < word.size(); i++)
+        {
+            if (word[i] == '\\' && i + 1 < word.size())
+                i++;
+            plain += word[i];
+        }
+        return plain;
+    }
+
+    void fail(const string &message)
+    {
+        if (error.empty())
+            error = message;
+    }
+
+    // POSIX decides by the number of words up to four, so [ ! = x ] and [ -n ] work
+    bool posix(size_t begin, size_t count)
+    {
+        switch (count)
+        {
+        case 0:
+            return false;
+        case 1:
+            return !words[begin].empty();
+        case 2:
+            if (words[begin] == "!")
+                return words[begin + 1].empty();
+            if (is_unary_operator(words[begin]))
+                return unary(words[begin], begin + 1);
+            fail(words[begin] + ": unary operator expected");
+            return false;
+        case 3:
+            if (is_binary_operator(words[begin + 1], false))
+                return binary(begin, words[begin + 1], begin + 2);
+            if (words[begin] == "!")
+                return !posix(begin + 1, 2);
+            if (words[begin] == "(" && words[begin + 2] == ")")
+                return !words[begin + 1].empty();
+            fail(words[begin + 1] + ": binary operator expected");
+            return false;
+        default:
+            if (words[begin] == "!")
+                return !posix(begin + 1, 3);
+            if (words[begin] == "(" && words[begin + 3] == ")")
+                return posix(begin + 1, 2);
+            return parse_full();
+        }
+    }
+
+    bool parse_full()
+    {
+        position = 0;
+        bool result = parse_or();
+        if (error.empty() && position < words.size())
+        {
+            fail(text(position) + ": unexpected argument");
+        }
+        return result;
+    }
+
+    bool at(const char *word) const
+    {
+        return position < words.size() && words[position] == word;
+    }
+
+    bool parse_or()
+    {
+        bool result = parse_and();
+        while (error.empty() && (at(extended ? "||" : "-o")))
+        {
+            position++;
+            bool right = parse_and();
+            result = result || right;
+        }
+        return result;
+    }
+
+    bool parse_and()
+    {
+        bool result = parse_not();
+        while (error.empty() && (at(extended ? "&&" : "-a")))
+        {
+            position++;
+            bool right = parse_not();
+            result = result && right;
+        }
+        return result;
+    }
+
+    bool parse_not()
+    {
+        if (at("!") && !(position + 1 < words.size() && is_binary_operator(text(position + 1), extended)))
+        {
+            position++;
+            return !parse_not();
+        }
+        return parse_primary();
+    }
+
+    bool parse_primary()
+    {
+        if (position >= words.size())
+        {
+            fail("argument expected");
+            return false;
+        }
+        size_t left = position;
+        if (position + 2 < words.size() && is_binary_operator(text(position + 1), extended))
+        {
+            position += 3;
+            return binary(left, text(left + 1), left + 2);
+        }
+        if (at("("))
+        {
+            position++;
+            bool result = parse_or();
+            if (!at(")"))
+            {
+                fail("missing `)'");
+                return false;
+            }
+            position++;
+            return result;
+        }
+        if (is_unary_operator(words[position]) && position + 1 < words.size())
+        {
+            position += 2;
+            return unary(words[left], left + 1);
+        }
+        position++;
+        return !text(left).empty();
+    }
+
+    bool integer(size_t index, long long &value)
+    {
+        string word = text(index);
+        if (extended)
+        {
+            // [[ ]] compares arithmetic expressions
+            if (!arith_evaluate(word, value))
+            {
+                fail(word + ": integer expression expected");
+                return false;
+            }
+            return true;
+        }
+        const char *start = word.c_str();
+        while (*start == ' ' || *start == '\t')
+            start++;
+        char *end;
+        errno = 0;
+        value = strtoll(start, &end, 10);
+        while (*end == ' ' || *end == '\t')
+            end++;
+        if (end == start || *end != '\0' || errno == ERANGE)
+        {
+            fail(word + ": integer expression expected");
+            return false;
+        }
+        return true;
+    }
+
+    bool unary(const string &op, size_t index)
+    {
+        string operand = text(index);
+        char c = op[1];
+        if (c == 'n')
+            return !operand.empty();
+        if (c == 'z')
+            return operand.empty();
+        if (c == 'v')
+            return get_variable(operand) != nullptr;
+        if (c == 't')
+        {
+            long long fd;
+            return integer(index, fd) && fd >= 0 && fd <= INT_MAX && isatty((int)fd);
+        }
+        if (c == 'r' || c == 'w' || c == 'x')
+            return cached_access(operand, c == 'r' ? R_OK : (c == 'w' ? W_OK : X_OK));
+
+        const struct stat *st = cached_stat(operand, c != 'h' && c != 'L');
+        if (st == nullptr)
+            return false;
+        switch (c)
+        {
+        case 'a':
+        case 'e':
+            return true;
+        case 'b':
+            return S_ISBLK(st->st_mode);
+        case 'c':
+            return S_ISCHR(st->st_mode);
+        case 'd':
+            return S_ISDIR(st->st_mode);
+        case 'f':
+            return S_ISREG(st->st_mode);
+        case 'h':
+        case 'L':
+            return S_ISLNK(st->st_mode);
+        case 'p':
+            return S_ISFIFO(st->st_mode);
+        case 'S':
+            return S_ISSOCK(st->st_mode);
+        case 's':
+            return st->st_size > 0;
+        case 'g':
+            return st->st_mode & S_ISGID;
+        case 'u':
+            return st->st_mode & S_ISUID;
+        case 'k':
+            return st->st_mode & S_ISVTX;
+        case 'O':
+            return st->st_uid == geteuid();
+        case 'G':
+            return st->st_gid == getegid();
+        case 'N':
+            // Modified since it was last read
+            return st->st_mtim.tv_sec != st->st_atim.tv_sec ? st->st_mtim.tv_sec > st->st_atim.tv_sec : st->st_mtim.tv_nsec > st->st_atim.tv_nsec;
+        }
+        return false;
+    }
+
+    // =~ against an extended regular expression; escaped characters stay literal
+    bool regex_match(const string &subject, size_t index)
+    {
+        string pattern;
+        const string &word = words[index];
+        for (size_t i = 0; i < word.size(); i++)
+        {
+            if (word[i] == '\\' && i + 1 < word.size())
+            {
+                i++;
+                if (strchr("\\.[]()*+?{}|^$", word[i]))
+                    pattern += '\\';
+            }
+            pattern += word[i];
+        }
+        regex_t regex;
+        if (regcomp(&regex, pattern.c_str(), REG_EXTENDED | REG_NOSUB) != 0)
+        {
+            fail(pattern + ": invalid regular expression");
+            return false;
+        }
+        bool matched = regexec(&regex, subject.c_str(), 0, nullptr, 0) == 0;
+        regfree(&regex);
+        return matched;
+    }
+
+    bool binary(size_t left, const string &op, size_t right)
+    {
+        string a = text(left);
+        if (op == "=" || op == "==" || op == "!=")
+        {
+            // [[ ]] matches the right side as a pattern
+            bool equal = extended ? fnmatch(words[right].c_str(), a.c_str(), 0) == 0 : a == text(right);
+            return op == "!=" ? !equal : equal;
+        }
+        if (op == "=~")
+            return regex_match(a, right);
+        if (op == "<")
+            return a < text(right);
+        if (op == ">")
+            return a > text(right);
+        if (op == "-nt" || op == "-ot" || op == "-ef")
+        {
+            const struct stat *first = cached_stat(a, true);
+            const struct stat *second = cached_stat(text(right), true);
+            if (op == "-ef")
+                return first && second && first->st_dev == second->st_dev && first->st_ino == second->st_ino;
+            // A file that does not exist is older than one that does
+            if (!first || !second)
+                return op == "-nt" ? first != nullptr : second != nullptr;
+            return op == "-nt" ? newer(*first, *second) : newer(*second, *first);
+        }
+
+        long long x, y;
+        if (!integer(left, x) || !integer(right, y))
+            return false;
+        if (op == "-eq")
+            return x == y;
+        if (op == "-ne")
+            return x != y;
+        if (op == "-lt")
+            return x < y;
+        if (op == "-le")
+            return x <= y;
+        if (op == "-gt")
+            return x > y;
+        return x >= y;
+    }
+
+    const char *name;
+    const vector<string> &words;
+    bool extended; // [[ ]]: && || ( ) and patterns instead of -a -o
+    size_t position = 0;
+    string error;
+};
+
+// test expr, [ expr ] and [[ expr ]]: 0 when true, 1 when false, 2 on a usage error
+int builtin_test(BuiltinArgs args)
+{
+    // Only the operands of one test share a stat; any command, or another process,
+    // may change the files before the next test, even within one compiled loop
+    file_cache.clear();
+
+    string cmd = args[0];
+    size_t count = 0;
+    while (count < args.size() && args[count] != nullptr)
+        count++;
+
+    const char *closing = cmd == "[" ? "]" : (cmd == "[[" ? "]]" : nullptr);
+    if (closing)
+    {
+        if (count < 2 || strcmp(args[count - 1], closing) != 0)
+        {
+            cerr << "shell: " << cmd << ": missing `" << closing << "'" << endl;
+            return 2;
+        }
+        count--;
+    }
+
+    vector<string> words(args.begin() + 1, args.begin() + count);
+    TestParser parser(cmd.c_str(), words, cmd == "[[");
+    return parser.run();
+}
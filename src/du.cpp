@@ -0,0 +1,390 @@
+#include "du.h"
+#include "walker.h"
+#include "textutils.h"
+#include "redirection.h"
+#include "trace.h"
+#include <iostream>
+#include <vector>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <unordered_set>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <cerrno>
+#include <cmath>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+using namespace std;
+
+static const size_t DEFAULT_TOP = 10;
+static const size_t INODE_SHARDS = 64;
+
+struct DuOptions
+{
+    bool summarize = false;      // -s: only the operand's total
+    bool one_filesystem = false; // -x
+    bool human = false;          // -h
+    size_t top = DEFAULT_TOP;    // -n N: largest subtrees listed per operand
+    vector<const char *> paths;
+};
+
+// du [-sxhk] [-n N] [path...]; anything else runs the external du
+static bool parse_du_command(const vector<char *> &args, DuOptions &options)
+{
+    if (args.empty() || args[0] == nullptr || strcmp(args[0], "du") != 0)
+    {
+        return false;
+    }
+
+    bool options_done = false;
+    for (size_t i = 1; i < args.size() && args[i] != nullptr; i++)
+    {
+        const char *arg = args[i];
+        if (is_redirection_word(arg))
+        {
+            i++;
+            if (i >= args.size() || args[i] == nullptr)
+            {
+                return false;
+            }
+            continue;
+        }
+
+        if (options_done || arg[0] != '-' || arg[1] == '\0')
+        {
+            options.paths.push_back(arg);
+            continue;
+        }
+        if (strcmp(arg, "--") == 0)
+        {
+            options_done = true;
+            continue;
+        }
+
+        for (const char *flag = arg + 1; *flag; flag++)
+        {
+            if (*flag == 's')
+                options.summarize = true;
+            else if (*flag == 'x')
+                options.one_filesystem = true;
+            else if (*flag == 'h')
+                options.human = true;
+            else if (*flag == 'k')
+                options.human = false;
+            else if (*flag == 'n')
+            {
+                const char *value = flag[1] ? flag + 1 : (i + 1 < args.size() ? args[++i] : nullptr);
+                char *end = nullptr;
+                long top = value ? strtol(value, &end, 10) : 0;
+                if (top <= 0 || *end != '\0')
+                {
+                    return false;
+                }
+                options.top = top;
+                break;
+            }
+            else
+                return false;
+        }
+    }
+    return true;
+}
+
+// Switched together with the text tools by set -o text-builtins
+bool du_builtin_supported(const vector<char *> &args)
+{
+    if (!get_text_builtins())
+    {
+        return false;
+    }
+    DuOptions options;
+    return parse_du_command(args, options);
+}
+
+// Files with more than one link are counted once, by device and inode; the set is
+// split into shards so walkers rarely wait on each other
+class InodeSet
+{
+public:
+    bool insert(uint64_t dev, uint64_t ino)
+    {
+        uint64_t key = ino * 0x9e3779b97f4a7c15ULL ^ dev;
+        Shard &shard = shards[key % INODE_SHARDS];
+        lock_guard<mutex> lock(shard.lock);
+        return shard.ids.insert(FileId{dev, ino}).second;
+    }
+
+private:
+    struct FileId
+    {
+        uint64_t dev;
+        uint64_t ino;
+        bool operator==(const FileId &other) const { return dev == other.dev && ino == other.ino; }
+    };
+    struct FileIdHash
+    {
+        size_t operator()(const FileId &id) const { return id.ino * 0x9e3779b97f4a7c15ULL ^ id.dev; }
+    };
+    struct Shard
+    {
+        mutex lock;
+        unordered_set<FileId, FileIdHash> ids;
+    };
+    Shard shards[INODE_SHARDS];
+};
+
+// A directory whose subtree is still being counted; freed as soon as its listing and
+// all its subdirectories are done, so memory follows the walk frontier, not the tree
+struct DuNode
+{
+    DuNode *parent;
+    string name;
+    atomic<uint64_t> blocks;  // 512-byte blocks counted so far
+    atomic<size_t> pending;   // own listing plus unfinished subdirectories
+};
+
+struct DuEntry
+{
+    uint64_t blocks;
+    string path;
+};
+
+// Larger first, ties in path order
+static bool ranks_before(const DuEntry &a, const DuEntry &b)
+{
+    return a.blocks != b.blocks ? a.blocks > b.blocks : a.path < b.path;
+}
+
+static string format_size(uint64_t blocks, bool human)
+{
+    if (!human)
+    {
+        return to_string((blocks + 1) / 2); // 1K units, rounded up like du
+    }
+
+    uint64_t bytes = blocks * 512;
+    if (bytes < 1024)
+    {
+        return to_string(bytes);
+    }
+    const char units[] = "KMGTPE";
+    double value = bytes;
+    int unit = -1;
+    while (value >= 1024 && unit < 5)
+    {
+        value /= 1024;
+        unit++;
+    }
+
+    char text[32];
+    double rounded = value < 10 ? ceil(value * 10) / 10 : ceil(value);
+    if (rounded >= 1024 && unit < 5)
+    {
+        snprintf(text, sizeof(text), "1.0%c", units[unit + 1]);
+    }
+    else if (rounded < 10)
+    {
+        snprintf(text, sizeof(text), "%.1f%c", rounded, units[unit]);
+    }
+    else
+    {
+        snprintf(text, sizeof(text), "%.0f%c", rounded, units[unit]);
+    }
+    return text;
+}
+
+// Sums one operand on the parallel walker and keeps the largest subtrees in a bounded heap
+class DiskUsage
+{
+public:
+    DiskUsage(const DuOptions &options, InodeSet &inodes) : options(options), inodes(inodes) {}
+
+    // Prints the operand's largest subtrees, or just its total with -s; false on any error
+    bool measure(const char *path)
+    {
+        struct statx st;
+        if (statx(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, STATX_TYPE | STATX_BLOCKS | STATX_INO | STATX_NLINK, &st) != 0)
+        {
+            cerr << "du: cannot access '" << path << "': " << strerror(errno) << endl;
+            return false;
+        }
+        root_dev = makedev(st.stx_dev_major, st.stx_dev_minor);
+
+        if (!S_ISDIR(st.stx_mode))
+        {
+            bool counted = st.stx_nlink <= 1 || inodes.insert(root_dev, st.stx_ino);
+            cout << format_size(counted ? st.stx_blocks : 0, options.human) << "\t" << path << endl;
+            return true;
+        }
+
+        TraceSpan span("du_walk");
+        span.command(path);
+        DuNode *root = new DuNode{nullptr, path, {st.stx_blocks}, {1}};
+        walk_tree(path, root, walk_default_threads(), [this](const WalkDir &dir, const vector<WalkEntry> &entries)
+                  { visit(dir, entries); });
+
+        if (text_builtins_interrupted())
+        {
+            return false;
+        }
+        sort(largest.begin(), largest.end(), ranks_before);
+        for (const DuEntry &entry : largest)
+        {
+            cout << format_size(entry.blocks, options.human) << "\t" << entry.path << "\n";
+        }
+        cout.flush();
+        return !failed;
+    }
+
+private:
+    void visit(const WalkDir &dir, const vector<WalkEntry> &entries)
+    {
+        DuNode *node = (DuNode *)dir.data;
+        if (dir.error != 0 && dir.error != ECANCELED)
+        {
+            cerr << "du: cannot read directory '" + dir.path + "': " + strerror(dir.error) + "\n"; // one write per line
+            failed = true;
+        }
+        if (dir.fd == -1)
+        {
+            finish(node);
+            return;
+        }
+        if (text_builtins_interrupted())
+        {
+            walk_stop();
+        }
+
+        uint64_t blocks = 0;
+        for (const WalkEntry &entry : entries)
+        {
+            // The type only needs asking when getdents did not report it
+            unsigned mask = STATX_BLOCKS | STATX_INO | STATX_NLINK | (entry.type == DT_UNKNOWN ? STATX_TYPE : 0);
+            struct statx st;
+            if (statx(dir.fd, entry.name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC | AT_NO_AUTOMOUNT, mask, &st) != 0)
+            {
+                cerr << "du: cannot access '" + walk_join(dir.path, entry.name) + "': " + strerror(errno) + "\n";
+                failed = true;
+                continue;
+            }
+
+            uint64_t dev = makedev(st.stx_dev_major, st.stx_dev_minor);
+            bool is_dir = entry.type == DT_DIR || (entry.type == DT_UNKNOWN && S_ISDIR(st.stx_mode));
+            if (is_dir)
+            {
+                if (options.one_filesystem && dev != root_dev)
+                {
+                    continue;
+                }
+                node->pending++;
+                walk_descend(dir, entry.name, new DuNode{node, entry.name, {st.stx_blocks}, {1}});
+                continue;
+            }
+
+            if (st.stx_nlink > 1 && !inodes.insert(dev, st.stx_ino))
+            {
+                continue;
+            }
+            blocks += st.stx_blocks;
+        }
+        node->blocks += blocks;
+        finish(node);
+    }
+
+    // Completes node and every ancestor whose last pending part this was
+    void finish(DuNode *node)
+    {
+        while (node && --node->pending == 0)
+        {
+            uint64_t blocks = node->blocks;
+            DuNode *parent = node->parent;
+            if (!options.summarize || parent == nullptr)
+            {
+                record(node, blocks);
+            }
+            if (parent)
+            {
+                parent->blocks += blocks;
+            }
+            delete node;
+            node = parent;
+        }
+    }
+
+    // Bounded heap with the entry that ranks last on top; the path is only built for
+    // subtrees large enough to enter it
+    void record(const DuNode *node, uint64_t blocks)
+    {
+        lock_guard<mutex> lock(largest_mutex);
+        if (largest.size() >= options.top && blocks < largest.front().blocks)
+        {
+            return;
+        }
+
+        DuEntry entry = {blocks, node_path(node)};
+        if (largest.size() < options.top)
+        {
+            largest.push_back(std::move(entry));
+            push_heap(largest.begin(), largest.end(), ranks_before);
+        }
+        else if (ranks_before(entry, largest.front()))
+        {
+            pop_heap(largest.begin(), largest.end(), ranks_before);
+            largest.back() = std::move(entry);
+            push_heap(largest.begin(), largest.end(), ranks_before);
+        }
+    }
+
+    // Ancestors are still alive while any of their subdirectories is
+    static string node_path(const DuNode *node)
+    {
+        if (node->parent == nullptr)
+        {
+            return node->name;
+        }
+        return walk_join(node_path(node->parent), node->name.c_str());
+    }
+
+    const DuOptions &options;
+    InodeSet &inodes;
+    uint64_t root_dev = 0;
+    atomic<bool> failed{false};
+    mutex largest_mutex;
+    vector<DuEntry> largest;
+};
+
+// Disk usage of each operand (default "."): its N largest directories, largest first,
+// the operand itself included; -s prints only the totals
+int builtin_du(vector<char *> args)
+{
+    DuOptions options;
+    if (!parse_du_command(args, options))
+    {
+        cerr << "du: usage: du [-sxhk] [-n N] [path ...]\n";
+        return 1;
+    }
+    if (options.paths.empty())
+    {
+        options.paths.push_back(".");
+    }
+
+    text_builtins_reset_interrupt();
+    InodeSet inodes;
+    bool ok = true;
+    for (const char *path : options.paths)
+    {
+        DiskUsage usage(options, inodes);
+        ok = usage.measure(path) && ok;
+        if (text_builtins_interrupted())
+        {
+            return 130;
+        }
+    }
+    return ok ? 0 : 1;
+}
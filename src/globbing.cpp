@@ -0,0 +1,542 @@
+#include "globbing.h"
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <bitset>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <unordered_map>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+using namespace std;
+
+// One piece of a compiled path segment
+struct GlobToken
+{
+    enum Kind
+    {
+        Literal,
+        AnyChar, // ?
+        Star,    // *
+        Class    // [...]
+    } kind;
+    char c = '\0';
+    bitset<256> set;
+};
+
+// Part of a pattern between two slashes
+struct GlobSegment
+{
+    bool literal = true;   // no wildcards, used as is
+    bool globstar = false; // exactly "**", any number of directories
+    bool match_dots = false; // pattern starts with '.', so hidden entries may match
+    string text;             // unescaped text of a literal segment
+    vector<GlobToken> tokens;
+};
+
+struct CompiledGlob
+{
+    bool absolute = false;
+    bool has_wildcards = false;
+    vector<GlobSegment> segments;
+};
+
+// A directory read once with getdents64; names are packed into one buffer and
+// the entries are sorted once, so every pattern walks them in order
+struct DirListing
+{
+    struct Entry
+    {
+        uint32_t offset;
+        uint32_t length;
+        unsigned char type; // d_type, DT_UNKNOWN is resolved lazily
+    };
+
+    string names;
+    vector<Entry> entries;
+
+    const char *name(const Entry &entry) const
+    {
+        return names.data() + entry.offset;
+    }
+};
+
+struct linux_dirent64_record
+{
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// Listings live for one command, bounded so a huge tree cannot pin memory
+static const size_t LISTING_CACHE_LIMIT = 64 << 20;
+static unordered_map<string, shared_ptr<const DirListing>> listing_cache;
+static size_t listing_cache_bytes = 0;
+static mutex listing_cache_mutex;
+
+// Compiled patterns are reused across commands (e.g. the same glob in a loop)
+static const size_t COMPILE_CACHE_LIMIT = 256;
+static unordered_map<string, shared_ptr<const CompiledGlob>> compile_cache;
+
+static const int MAX_WALK_THREADS = 8;
+
+// Parses a [...] class starting at pattern[i] == '['; returns false if it is not closed
+static bool parse_class(const string &pattern, size_t &i, GlobToken &token)
+{
+    size_t j = i + 1;
+    bool negate = false;
+    if (j < pattern.size() && (pattern[j] == '!' || pattern[j] == '^'))
+    {
+        negate = true;
+        j++;
+    }
+
+    bitset<256> set;
+    bool first = true;
+    while (j < pattern.size() && (pattern[j] != ']' || first))
+    {
+        unsigned char low = pattern[j];
+        if (low == '\\' && j + 1 < pattern.size())
+        {
+            low = pattern[++j];
+        }
+        unsigned char high = low;
+        if (j + 2 < pattern.size() && pattern[j + 1] == '-' && pattern[j + 2] != ']')
+        {
+            high = pattern[j + 2];
+            j += 2;
+        }
+        for (unsigned int c = low; c <= high; c++)
+        {
+            set.set(c);
+        }
+        first = false;
+        j++;
+    }
+
+    if (j >= pattern.size())
+    {
+        return false;
+    }
+
+    token.kind = GlobToken::Class;
+    token.set = negate ? ~set : set;
+    i = j;
+    return true;
+}
+
+static GlobSegment compile_segment(const string &text)
+{
+    GlobSegment segment;
+    if (text == "**")
+    {
+        segment.literal = false;
+        segment.globstar = true;
+        return segment;
+    }
+
+    segment.match_dots = !text.empty() && text[0] == '.';
+    for (size_t i = 0; i < text.size(); i++)
+    {
+        GlobToken token;
+        char c = text[i];
+        if (c == '\\' && i + 1 < text.size())
+        {
+            token.kind = GlobToken::Literal;
+            token.c = text[++i];
+        }
+        else if (c == '*')
+        {
+            // Consecutive stars match the same as one
+            if (!segment.tokens.empty() && segment.tokens.back().kind == GlobToken::Star)
+            {
+                continue;
+            }
+            token.kind = GlobToken::Star;
+            segment.literal = false;
+        }
+        else if (c == '?')
+        {
+            token.kind = GlobToken::AnyChar;
+            segment.literal = false;
+        }
+        else if (c == '[' && parse_class(text, i, token))
+        {
+            segment.literal = false;
+        }
+        else
+        {
+            token.kind = GlobToken::Literal;
+            token.c = c;
+        }
+        segment.tokens.push_back(token);
+        if (token.kind == GlobToken::Literal)
+        {
+            segment.text += token.c;
+        }
+    }
+    return segment;
+}
+
+static shared_ptr<const CompiledGlob> compile_glob(const string &pattern)
+{
+    auto cached = compile_cache.find(pattern);
+    if (cached != compile_cache.end())
+    {
+        return cached->second;
+    }
+
+    auto compiled = make_shared<CompiledGlob>();
+    compiled->absolute = !pattern.empty() && pattern[0] == '/';
+
+    size_t start = compiled->absolute ? 1 : 0;
+    while (start <= pattern.size())
+    {
+        size_t slash = pattern.find('/', start);
+        if (slash == string::npos)
+        {
+            slash = pattern.size();
+        }
+        compiled->segments.push_back(compile_segment(pattern.substr(start, slash - start)));
+        compiled->has_wildcards = compiled->has_wildcards || !compiled->segments.back().literal;
+        start = slash + 1;
+    }
+
+    if (compile_cache.size() >= COMPILE_CACHE_LIMIT)
+    {
+        compile_cache.clear();
+    }
+    compile_cache[pattern] = compiled;
+    return compiled;
+}
+
+// Wildcard match with single-star backtracking, linear for typical patterns
+static bool match_segment(const GlobSegment &segment, const char *name, size_t length)
+{
+    if (name[0] == '.' && !segment.match_dots)
+    {
+        return false;
+    }
+
+    const vector<GlobToken> &tokens = segment.tokens;
+    size_t t = 0, n = 0;
+    size_t star_token = string::npos, star_name = 0;
+
+    while (n < length)
+    {
+        if (t < tokens.size())
+        {
+            const GlobToken &token = tokens[t];
+            if (token.kind == GlobToken::Star)
+            {
+                star_token = t++;
+                star_name = n;
+                continue;
+            }
+            bool ok = (token.kind == GlobToken::AnyChar) ||
+                      (token.kind == GlobToken::Literal && token.c == name[n]) ||
+                      (token.kind == GlobToken::Class && token.set.test((unsigned char)name[n]));
+            if (ok)
+            {
+                t++;
+                n++;
+                continue;
+            }
+        }
+        if (star_token == string::npos)
+        {
+            return false;
+        }
+        // Let the last star absorb one more character and retry
+        t = star_token + 1;
+        n = ++star_name;
+    }
+
+    while (t < tokens.size() && tokens[t].kind == GlobToken::Star)
+        t++;
+    return t == tokens.size();
+}
+
+static shared_ptr<const DirListing> read_listing(const string &dir)
+{
+    auto listing = make_shared<DirListing>();
+    int fd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return listing;
+    }
+
+    vector<char> buffer(64 * 1024);
+    long count;
+    while ((count = syscall(SYS_getdents64, fd, buffer.data(), buffer.size())) > 0)
+    {
+        for (long pos = 0; pos < count;)
+        {
+            auto *record = reinterpret_cast<linux_dirent64_record *>(buffer.data() + pos);
+            pos += record->d_reclen;
+
+            const char *name = record->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            {
+                continue;
+            }
+
+            size_t length = strlen(name);
+            listing->entries.push_back({(uint32_t)listing->names.size(), (uint32_t)length, record->d_type});
+            listing->names.append(name, length + 1);
+        }
+    }
+    close(fd);
+
+    const char *names = listing->names.data();
+    sort(listing->entries.begin(), listing->entries.end(),
+         [names](const DirListing::Entry &a, const DirListing::Entry &b)
+         { return strcmp(names + a.offset, names + b.offset) < 0; });
+    return listing;
+}
+
+// Cached listing of dir ("" is the current directory)
+static shared_ptr<const DirListing> get_listing(const string &dir)
+{
+    {
+        lock_guard<mutex> lock(listing_cache_mutex);
+        auto cached = listing_cache.find(dir);
+        if (cached != listing_cache.end())
+        {
+            return cached->second;
+        }
+    }
+
+    shared_ptr<const DirListing> listing = read_listing(dir);
+
+    lock_guard<mutex> lock(listing_cache_mutex);
+    size_t bytes = listing->names.size() + listing->entries.size() * sizeof(DirListing::Entry);
+    if (listing_cache_bytes + bytes > LISTING_CACHE_LIMIT)
+    {
+        listing_cache.clear();
+        listing_cache_bytes = 0;
+    }
+    if (listing_cache.emplace(dir, listing).second)
+    {
+        listing_cache_bytes += bytes;
+    }
+    return listing;
+}
+
+static bool entry_is_dir(const string &path, unsigned char type, bool follow_links)
+{
+    if (type == DT_DIR)
+    {
+        return true;
+    }
+    if (type != DT_UNKNOWN && !(type == DT_LNK && follow_links))
+    {
+        return false;
+    }
+
+    struct stat st;
+    int result = follow_links ? stat(path.c_str(), &st) : lstat(path.c_str(), &st);
+    return result == 0 && S_ISDIR(st.st_mode);
+}
+
+// Lists every directory under root once, spreading the work over a few threads;
+// symlinked directories are not followed, as in bash's globstar
+static void prefetch_tree(const string &root)
+{
+    deque<string> queue = {root};
+    mutex queue_mutex;
+    condition_variable queue_ready;
+    int busy = 0;
+
+    auto worker = [&]()
+    {
+        unique_lock<mutex> lock(queue_mutex);
+        while (true)
+        {
+            queue_ready.wait(lock, [&]()
+                             { return !queue.empty() || busy == 0; });
+            if (queue.empty())
+            {
+                queue_ready.notify_all();
+                return;
+            }
+
+            string dir = queue.front();
+            queue.pop_front();
+            busy++;
+            lock.unlock();
+
+            shared_ptr<const DirListing> listing = get_listing(dir);
+            vector<string> subdirs;
+            for (const DirListing::Entry &entry : listing->entries)
+            {
+                const char *name = listing->name(entry);
+                string path = dir + name;
+                if (name[0] != '.' && entry_is_dir(path, entry.type, false))
+                {
+                    subdirs.push_back(path + "/");
+                }
+            }
+
+            lock.lock();
+            busy--;
+            for (string &subdir : subdirs)
+            {
+                queue.push_back(std::move(subdir));
+            }
+            queue_ready.notify_all();
+        }
+    };
+
+    unsigned int hardware = thread::hardware_concurrency();
+    int thread_count = max(1, min(MAX_WALK_THREADS, (int)hardware));
+    vector<thread> threads;
+    for (int i = 1; i < thread_count; i++)
+    {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (thread &t : threads)
+    {
+        t.join();
+    }
+}
+
+// Appends dir and every directory below it in sorted pre-order, using the prefetched
+// listings; with all_entries set, files are included and dir itself is not
+static void collect_tree(const string &dir, vector<string> &out, bool all_entries)
+{
+    if (!all_entries)
+    {
+        out.push_back(dir);
+    }
+
+    shared_ptr<const DirListing> listing = get_listing(dir);
+    for (const DirListing::Entry &entry : listing->entries)
+    {
+        const char *name = listing->name(entry);
+        if (name[0] == '.')
+        {
+            continue;
+        }
+
+        string path = dir + name;
+        bool is_dir = entry_is_dir(path, entry.type, false);
+        if (all_entries)
+        {
+            out.push_back(path);
+        }
+        if (is_dir)
+        {
+            collect_tree(path + "/", out, all_entries);
+        }
+    }
+}
+
+// Expands pattern into matches (sorted); returns false when nothing matched.
+// Quoted characters arrive backslash-escaped so they match literally
+bool glob_expand(const string &pattern, vector<string> &matches)
+{
+    shared_ptr<const CompiledGlob> glob = compile_glob(pattern);
+    if (!glob->has_wildcards)
+    {
+        return false;
+    }
+
+    // Prefixes matched so far, each ending in '/' (or "" for the current directory).
+    // Listings are sorted and prefixes are expanded in order, so results come out
+    // sorted; only ** mixes depths and needs one final sort
+    vector<string> prefixes = {glob->absolute ? "/" : ""};
+    bool crosses_levels = false;
+    for (size_t i = 0; i < glob->segments.size() && !prefixes.empty(); i++)
+    {
+        const GlobSegment &segment = glob->segments[i];
+        bool last = (i + 1 == glob->segments.size());
+        vector<string> next;
+
+        if (segment.globstar)
+        {
+            // A trailing ** matches every file and directory below the prefix
+            for (const string &prefix : prefixes)
+            {
+                prefetch_tree(prefix);
+                collect_tree(prefix, next, last);
+            }
+            crosses_levels = true;
+        }
+        else if (segment.literal)
+        {
+            for (const string &prefix : prefixes)
+            {
+                string path = prefix + segment.text;
+                struct stat st;
+                if (last)
+                {
+                    if (lstat(path.c_str(), &st) == 0)
+                        next.push_back(path);
+                }
+                else if (segment.text.empty())
+                {
+                    next.push_back(prefix); // a/ or a//b
+                }
+                else if (stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+                {
+                    next.push_back(path + "/");
+                }
+            }
+        }
+        else
+        {
+            for (const string &prefix : prefixes)
+            {
+                shared_ptr<const DirListing> listing = get_listing(prefix);
+                for (const DirListing::Entry &entry : listing->entries)
+                {
+                    const char *name = listing->name(entry);
+                    if (!match_segment(segment, name, entry.length))
+                    {
+                        continue;
+                    }
+
+                    string path = prefix + name;
+                    if (last)
+                    {
+                        next.push_back(path);
+                    }
+                    else if (entry_is_dir(path, entry.type, true))
+                    {
+                        next.push_back(path + "/");
+                    }
+                }
+            }
+        }
+        prefixes.swap(next);
+    }
+
+    if (crosses_levels)
+    {
+        sort(prefixes.begin(), prefixes.end());
+    }
+    matches.insert(matches.end(), prefixes.begin(), prefixes.end());
+    return !prefixes.empty();
+}
+
+// Directory contents may change between commands, listings are only shared within one
+void glob_reset_cache()
+{
+    lock_guard<mutex> lock(listing_cache_mutex);
+    listing_cache.clear();
+    listing_cache_bytes = 0;
+}
@@ -0,0 +1,345 @@
+#include "heredoc.h"
+#include "shell.h"
+#include <iostream>
+#include <vector>
+#include <string>
+#include <memory>
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+using namespace std;
+
+static HereDocList heredocs;         // bodies of the current line, in operator order
+static size_t collecting_index = 0;  // first body still being read
+static HereDocCursor cursor = {&heredocs, 0};
+static vector<int> temporaries;      // <<< words and expanded bodies, closed after the command
+
+// One << or <<- operator of a command line
+struct HereDocOperator
+{
+    size_t position;
+    string delimiter;
+    bool strip_tabs;
+    bool expand;
+};
+
+HereDoc::~HereDoc()
+{
+    if (fd != -1)
+    {
+        close(fd);
+    }
+}
+
+static int create_body_fd()
+{
+    int fd = memfd_create("heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1)
+    {
+        perror("heredoc: memfd_create");
+    }
+    return fd;
+}
+
+static void seal_body(int fd)
+{
+    if (fd != -1 && fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1)
+    {
+        perror("heredoc: seal");
+    }
+}
+
+// Delimiter word without its quotes and backslashes; any of them keeps the body literal
+static string strip_quotes(const string &word, bool &quoted)
+{
+    string result;
+    quoted = false;
+    for (char c : word)
+    {
+        if (c != '\'' && c != '"' && c != '\\')
+        {
+            result += c;
+        }
+        else
+        {
+            quoted = true;
+        }
+    }
+    return result;
+}
+
+// The << and <<- operators of text that start a body, in order. A delimiter ends at a
+// blank, a newline or an operator character
+static vector<HereDocOperator> find_operators(const string &text)
+{
+    vector<HereDocOperator> operators;
+    if (text.find("<<") == string::npos)
+    {
+        return operators;
+    }
+
+    char quote_char = '\0';
+    for (size_t i = 0; i < text.size(); i++)
+    {
+        char c = text[i];
+        if (quote_char)
+        {
+            if (c == quote_char)
+                quote_char = '\0';
+            continue;
+        }
+        if (c == '\'' || c == '"')
+        {
+            quote_char = c;
+            continue;
+        }
+        if (c == '(' && i + 1 < text.size() && text[i + 1] == '(')
+        {
+            // $(( )) and (( )) hold arithmetic, where << is a shift
+            int depth = 0;
+            for (; i < text.size(); i++)
+            {
+                depth += text[i] == '(' ? 1 : (text[i] == ')' ? -1 : 0);
+                if (depth == 0)
+                    break;
+            }
+            continue;
+        }
+        if (c != '<' || i + 1 >= text.size() || text[i + 1] != '<')
+        {
+            continue;
+        }
+        if (i + 2 < text.size() && text[i + 2] == '<')
+        {
+            i += 2; // <<< here-string, the word is on the same line
+            continue;
+        }
+
+        HereDocOperator op = {i, "", false, true};
+        i += 2;
+        if (i < text.size() && text[i] == '-')
+        {
+            op.strip_tabs = true;
+            i++;
+        }
+        while (i < text.size() && (text[i] == ' ' || text[i] == '\t'))
+            i++;
+
+        size_t start = i;
+        while (i < text.size() && !strchr(" \t\n;|<>&()", text[i]))
+            i++;
+        bool quoted;
+        op.delimiter = strip_quotes(text.substr(start, i - start), quoted);
+        op.expand = !quoted;
+        i--;
+
+        // Without a delimiter parse_redirection reports the syntax error
+        if (!op.delimiter.empty())
+        {
+            operators.push_back(move(op));
+        }
+    }
+    return operators;
+}
+
+// Offsets of the operators that take a body, for a compiled script to number its commands' bodies
+vector<size_t> heredoc_positions(const string &text)
+{
+    vector<size_t> positions;
+    for (const HereDocOperator &op : find_operators(text))
+    {
+        positions.push_back(op.position);
+    }
+    return positions;
+}
+
+// Opens a body for each << and <<- operator of a line typed after the ones before it; true
+// when bodies are to be read from the following lines
+bool heredoc_scan_line(const string &line)
+{
+    for (HereDocOperator &op : find_operators(line))
+    {
+        auto doc = make_shared<HereDoc>();
+        doc->delimiter = move(op.delimiter);
+        doc->strip_tabs = op.strip_tabs;
+        doc->expand = op.expand;
+        doc->fd = create_body_fd();
+        heredocs.push_back(move(doc));
+    }
+    return heredoc_collecting();
+}
+
+bool heredoc_collecting()
+{
+    return collecting_index < heredocs.size();
+}
+
+// Appends one input line to the body being read, returns true once all bodies are complete
+bool heredoc_feed_line(const char *line)
+{
+    if (!heredoc_collecting())
+    {
+        return true;
+    }
+
+    HereDoc &doc = *heredocs[collecting_index];
+    if (doc.strip_tabs)
+    {
+        while (*line == '\t')
+            line++;
+    }
+
+    if (doc.delimiter == line)
+    {
+        seal_body(doc.fd);
+        collecting_index++;
+        return !heredoc_collecting();
+    }
+
+    // Written from readline's buffer as is, no intermediate copy of the body
+    struct iovec parts[2];
+    parts[0].iov_base = const_cast<char *>(line);
+    parts[0].iov_len = strlen(line);
+    parts[1].iov_base = const_cast<char *>("\n");
+    parts[1].iov_len = 1;
+    if (doc.fd != -1 && writev(doc.fd, parts, 2) == -1)
+    {
+        perror("heredoc: write");
+    }
+    return false;
+}
+
+// End of input inside a body, the bodies read so far are kept like in bash
+void heredoc_finish_at_eof()
+{
+    if (!heredoc_collecting())
+    {
+        return;
+    }
+
+    cerr << "shell: warning: here-document delimited by end-of-file (wanted '"
+         << heredocs[collecting_index]->delimiter << "')\n";
+    while (heredoc_collecting())
+    {
+        seal_body(heredocs[collecting_index]->fd);
+        collecting_index++;
+    }
+}
+
+void heredoc_abort()
+{
+    heredoc_release();
+}
+
+// Sealed memfd holding text and, for a <<< word, a trailing newline
+static int temporary_body(const string &text, bool newline)
+{
+    int fd = create_body_fd();
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    struct iovec parts[2];
+    parts[0].iov_base = const_cast<char *>(text.data());
+    parts[0].iov_len = text.size();
+    parts[1].iov_base = const_cast<char *>("\n");
+    parts[1].iov_len = newline ? 1 : 0;
+    if (writev(fd, parts, 2) == -1)
+    {
+        perror("heredoc: write");
+    }
+    seal_body(fd);
+    temporaries.push_back(fd);
+    return fd;
+}
+
+// Body as read from the input
+static string read_body(int fd)
+{
+    string body;
+    char buffer[4096];
+    ssize_t count;
+    while ((count = pread(fd, buffer, sizeof(buffer), body.size())) > 0)
+    {
+        body.append(buffer, count);
+    }
+    return body;
+}
+
+// Hands the next count bodies from the cursor to a compiled script, which keeps them
+HereDocList heredoc_take_bodies(size_t count)
+{
+    const HereDocList &bodies = *cursor.bodies;
+    size_t first = min(cursor.next, bodies.size());
+    size_t last = min(first + count, bodies.size());
+    cursor.next = last;
+    return HereDocList(bodies.begin() + first, bodies.begin() + last);
+}
+
+// Points parse_redirection at other bodies, such as those of a script command run again,
+// and returns the cursor to restore afterwards
+HereDocCursor heredoc_select(HereDocCursor selected)
+{
+    HereDocCursor previous = cursor;
+    cursor = selected;
+    return previous;
+}
+
+// Body of the next << operator, -1 when there is none. An unquoted delimiter's body is
+// expanded now, so it sees the variables as the command runs
+int heredoc_next_body()
+{
+    if (cursor.next >= cursor.bodies->size() || heredoc_collecting())
+    {
+        return -1;
+    }
+    const HereDoc &doc = *(*cursor.bodies)[cursor.next++];
+    if (!doc.expand || doc.fd == -1)
+    {
+        return doc.fd;
+    }
+    string body = read_body(doc.fd);
+    if (body.find_first_of("$`\\") == string::npos)
+    {
+        return doc.fd;
+    }
+    return temporary_body(expand_heredoc_text(body), false);
+}
+
+// Sealed memfd holding a <<< word and its trailing newline
+int heredoc_from_string(const string &text)
+{
+    return temporary_body(text, true);
+}
+
+// Opening this path gives a new file description with its own offset, so every
+// command (and every retry of a builtin) reads the body from the start
+string heredoc_path(int fd)
+{
+    return "/proc/self/fd/" + to_string(fd);
+}
+
+// Once a command has started, its children and builtins have the files open already
+void heredoc_release_temporaries()
+{
+    for (int fd : temporaries)
+    {
+        close(fd);
+    }
+    temporaries.clear();
+}
+
+// Children opened their own copies at fork, the shell drops its fds once the line is done;
+// bodies a compiled script kept stay open with it
+void heredoc_release()
+{
+    heredoc_release_temporaries();
+    heredocs.clear();
+    collecting_index = 0;
+    cursor = {&heredocs, 0};
+}
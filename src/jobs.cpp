@@ -0,0 +1,1039 @@
+#include "jobs.h"
+#include "shell.h"
+#include "timing.h"
+#include "trace.h"
+#include "variables.h"
+#include "linereader.h"
+#include <iostream>
+#include <vector>
+#include <string>
+#include <map>
+#include <deque>
+#include <unordered_map>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <termios.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+using namespace std;
+
+bool job_control_enabled = false;
+
+// Job table ordered by job id, plus a pid index so reaping stays O(1) per child
+static map<int, Job> job_table;
+static unordered_map<pid_t, int> pid_to_job;
+
+// Exit statuses no job claimed: children reaped outside the job table and jobs already
+// reported, kept for a later wait PID; the oldest go first
+static const size_t UNCLAIMED_LIMIT = 256;
+static deque<pair<pid_t, int>> unclaimed_statuses;
+
+// Background scheduler: with max-jobs set, a job runs on the shell's implicit
+// slot or on a token from a GNU make compatible jobserver shared with children
+enum JobSlot
+{
+    SLOT_NONE = 0,
+    SLOT_IMPLICIT = 1,
+    SLOT_TOKEN = 2
+};
+
+static long max_background_jobs = 0; // 0 means unlimited
+static int jobserver_shell_fd = -1;   // non-blocking description used by the shell
+static int jobserver_child_fd = -1;   // blocking description inherited through MAKEFLAGS
+static bool implicit_slot_busy = false;
+static deque<int> job_queue;
+
+// Slot reserved for the launch in progress, claimed by the next add_job
+static bool launch_pending = false;
+static int launch_slot = SLOT_NONE;
+static int launch_id = 0;
+static bool launch_quiet = false;
+
+static int sigchld_fd = -1;
+static pid_t shell_pgid = -1;
+static struct termios shell_tmodes;
+
+void init_job_control()
+{
+    // SIGCHLD is only ever consumed through the signalfd from the main loop
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, nullptr) == -1)
+    {
+        perror("sigprocmask");
+    }
+
+    sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigchld_fd == -1)
+    {
+        perror("signalfd");
+    }
+    else
+    {
+        // Kept above 9 so redirections like >&3 never reach it
+        int high_fd = fcntl(sigchld_fd, F_DUPFD_CLOEXEC, 10);
+        if (high_fd != -1)
+        {
+            close(sigchld_fd);
+            sigchld_fd = high_fd;
+        }
+    }
+
+    // Job control needs a terminal we are in the foreground of
+    shell_pgid = getpgrp();
+    job_control_enabled = isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == shell_pgid;
+
+    if (job_control_enabled)
+    {
+        // Needed to take the terminal back after a foreground job
+        signal(SIGTTOU, SIG_IGN);
+        signal(SIGTTIN, SIG_IGN);
+        tcgetattr(STDIN_FILENO, &shell_tmodes);
+    }
+}
+
+int job_signal_fd()
+{
+    return sigchld_fd;
+}
+
+// Called in every forked child before exec or running a builtin
+void setup_child_process(pid_t pgid, bool foreground)
+{
+    trace_after_fork();
+    read_after_fork();
+
+    if (job_control_enabled)
+    {
+        pid_t pid = getpid();
+        if (pgid == 0)
+        {
+            pgid = pid;
+        }
+        setpgid(pid, pgid);
+
+        if (foreground)
+        {
+            tcsetpgrp(STDIN_FILENO, pgid);
+        }
+    }
+
+    // Restore default dispositions, ignored signals survive exec otherwise
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+
+    sigset_t empty;
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, nullptr);
+}
+
+// Parent side of setpgid, done in both processes to avoid racing the exec
+void place_in_job_group(pid_t pid, pid_t pgid)
+{
+    if (job_control_enabled)
+    {
+        setpgid(pid, pgid);
+    }
+}
+
+static void give_terminal_to(pid_t pgid)
+{
+    if (job_control_enabled)
+    {
+        tcsetpgrp(STDIN_FILENO, pgid);
+    }
+}
+
+static void reclaim_terminal()
+{
+    if (job_control_enabled)
+    {
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+    }
+}
+
+static void signal_job(const Job &job, int sig)
+{
+    if (job_control_enabled)
+    {
+        kill(-job.pgid, sig);
+        return;
+    }
+
+    for (pid_t pid : job.pids)
+    {
+        kill(pid, sig);
+    }
+}
+
+static string state_name(const Job &job)
+{
+    switch (job.state)
+    {
+    case JobState::Queued:
+        return "Queued";
+    case JobState::Running:
+        return "Running";
+    case JobState::Stopped:
+        return "Stopped";
+    case JobState::Done:
+        if (WIFSIGNALED(job.status))
+        {
+            return string("Terminated (") + strsignal(WTERMSIG(job.status)) + ")";
+        }
+        if (WIFEXITED(job.status) && WEXITSTATUS(job.status) != 0)
+        {
+            return "Exit " + to_string(WEXITSTATUS(job.status));
+        }
+        return "Done";
+    }
+    return "";
+}
+
+static int current_job_id()
+{
+    // Most recent stopped job first, otherwise the most recent job
+    for (auto it = job_table.rbegin(); it != job_table.rend(); ++it)
+    {
+        if (it->second.state == JobState::Stopped)
+        {
+            return it->first;
+        }
+    }
+    return job_table.empty() ? 0 : job_table.rbegin()->first;
+}
+
+static void print_job(const Job &job, bool show_pids)
+{
+    char marker = (job.id == current_job_id()) ? '+' : ' ';
+    cout << "[" << job.id << "]" << marker << "  ";
+    if (show_pids)
+    {
+        cout << job.pgid << " ";
+    }
+    cout << state_name(job);
+    for (size_t i = state_name(job).size(); i < 24; i++)
+    {
+        cout << ' ';
+    }
+    bool background = job.state == JobState::Running || job.state == JobState::Queued;
+    cout << job.command << (background ? " &" : "") << endl;
+}
+
+static void release_slot(int slot)
+{
+    if (slot == SLOT_IMPLICIT)
+    {
+        implicit_slot_busy = false;
+    }
+    else if (slot == SLOT_TOKEN && jobserver_shell_fd != -1)
+    {
+        // Hand the token back to the jobserver
+        if (write(jobserver_shell_fd, "+", 1) != 1)
+        {
+            perror("jobserver");
+        }
+    }
+}
+
+static int acquire_slot()
+{
+    if (max_background_jobs <= 0)
+    {
+        return SLOT_NONE;
+    }
+
+    if (!implicit_slot_busy)
+    {
+        implicit_slot_busy = true;
+        return SLOT_IMPLICIT;
+    }
+
+    char token;
+    if (jobserver_shell_fd != -1 && read(jobserver_shell_fd, &token, 1) == 1)
+    {
+        return SLOT_TOKEN;
+    }
+    return -1;
+}
+
+static void remember_status(pid_t pid, int status)
+{
+    if (unclaimed_statuses.size() == UNCLAIMED_LIMIT)
+    {
+        unclaimed_statuses.pop_front();
+    }
+    unclaimed_statuses.push_back({pid, status});
+}
+
+// Takes the remembered status of pid, false when none was kept
+static bool claim_status(pid_t pid, int &status)
+{
+    for (auto it = unclaimed_statuses.rbegin(); it != unclaimed_statuses.rend(); ++it)
+    {
+        if (it->first == pid)
+        {
+            status = it->second;
+            unclaimed_statuses.erase(next(it).base());
+            return true;
+        }
+    }
+    return false;
+}
+
+static void remove_job(int id)
+{
+    auto it = job_table.find(id);
+    if (it == job_table.end())
+    {
+        return;
+    }
+
+    if (it->second.state == JobState::Queued)
+    {
+        job_queue.erase(remove(job_queue.begin(), job_queue.end(), id), job_queue.end());
+    }
+
+    for (pid_t pid : it->second.pids)
+    {
+        pid_to_job.erase(pid);
+    }
+    job_table.erase(it);
+}
+
+int add_job(pid_t pgid, const vector<pid_t> &pids, const string &command, JobState state, int id)
+{
+    // A job started from the queue keeps the id it was queued under
+    bool claims_launch = launch_pending && state == JobState::Running;
+    if (id == 0 && claims_launch && launch_id != 0)
+    {
+        id = launch_id;
+    }
+
+    if (id == 0 || (job_table.count(id) && job_table[id].state != JobState::Queued))
+    {
+        id = job_table.empty() ? 1 : job_table.rbegin()->first + 1;
+    }
+    if (job_table.count(id))
+    {
+        remove_job(id);
+    }
+
+    Job &job = job_table[id];
+    job.id = id;
+    job.pgid = pgid;
+    job.pids = pids;
+    job.last_pid = pids.empty() ? pgid : pids.back();
+    job.command = command;
+    job.state = state;
+
+    if (claims_launch)
+    {
+        job.slot = launch_slot;
+        launch_pending = false;
+        launch_slot = SLOT_NONE;
+    }
+
+    for (pid_t pid : pids)
+    {
+        pid_to_job[pid] = id;
+    }
+
+    return id;
+}
+
+// Applies one wait status to the job owning pid
+static void update_job_status(pid_t pid, int status)
+{
+    auto owner = pid_to_job.find(pid);
+    if (owner == pid_to_job.end())
+    {
+        if (WIFEXITED(status) || WIFSIGNALED(status))
+        {
+            remember_status(pid, status);
+        }
+        return;
+    }
+
+    Job &job = job_table[owner->second];
+
+    if (WIFSTOPPED(status))
+    {
+        job.state = JobState::Stopped;
+        job.notified = false;
+        return;
+    }
+
+    if (WIFCONTINUED(status))
+    {
+        job.state = JobState::Running;
+        return;
+    }
+
+    // Exited or killed
+    if (pid == job.last_pid)
+    {
+        job.status = status;
+    }
+    job.pids.erase(remove(job.pids.begin(), job.pids.end(), pid), job.pids.end());
+    pid_to_job.erase(owner);
+
+    if (job.pids.empty())
+    {
+        job.state = JobState::Done;
+        job.notified = false;
+        release_slot(job.slot);
+        job.slot = SLOT_NONE;
+    }
+}
+
+// Drains the signalfd and collects every child that changed state
+void reap_children()
+{
+    if (sigchld_fd != -1)
+    {
+        struct signalfd_siginfo info;
+        while (read(sigchld_fd, &info, sizeof(info)) == sizeof(info))
+        {
+            // Signals coalesce, so the waitpid loop below is the source of truth
+        }
+    }
+
+    pid_t pid;
+    int status;
+    while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0)
+    {
+        update_job_status(pid, status);
+    }
+
+    start_queued_jobs();
+}
+
+// Called for every "cmd &": reserves a slot, or queues the line and returns false
+bool reserve_background_slot(const string &command_line)
+{
+    if (launch_pending)
+    {
+        // Launch of a queued job, its slot is already held
+        return true;
+    }
+
+    int slot = acquire_slot();
+    if (slot == -1 || !job_queue.empty())
+    {
+        if (slot > SLOT_NONE)
+        {
+            release_slot(slot); // keep FIFO order behind already queued jobs
+        }
+
+        int id = add_job(-1, {}, command_line, JobState::Queued);
+        job_table[id].launch_line = command_line;
+        job_queue.push_back(id);
+        cout << "[" << id << "] Queued: " << command_line << endl;
+        return false;
+    }
+
+    launch_pending = true;
+    launch_slot = slot;
+    launch_id = 0;
+    return true;
+}
+
+// Gives back a reserved slot when the launch did not produce a job
+void finish_background_launch()
+{
+    if (launch_pending)
+    {
+        release_slot(launch_slot);
+        launch_pending = false;
+        launch_slot = SLOT_NONE;
+    }
+}
+
+bool background_launch_quiet()
+{
+    return launch_quiet;
+}
+
+// Starts queued jobs in FIFO order while slots are free
+void start_queued_jobs()
+{
+    while (!job_queue.empty() && !launch_pending)
+    {
+        int slot = acquire_slot();
+        if (slot == -1)
+        {
+            return;
+        }
+
+        int id = job_queue.front();
+        job_queue.pop_front();
+        string line = job_table[id].launch_line;
+
+        launch_pending = true;
+        launch_slot = slot;
+        launch_id = id;
+        launch_quiet = true;
+        execute_background_line(line);
+        launch_quiet = false;
+        launch_id = 0;
+
+        // Nothing was started (e.g. a parse error), drop the queue entry
+        if (job_table.count(id) && job_table[id].state == JobState::Queued)
+        {
+            job_table.erase(id);
+        }
+        finish_background_launch();
+    }
+}
+
+static bool starts_with(const string &word, const char *prefix)
+{
+    return word.compare(0, strlen(prefix), prefix) == 0;
+}
+
+// The -j and jobserver words of MAKEFLAGS; a number after a bare -j is dropped by the caller
+static bool is_jobserver_flag(const string &word)
+{
+    return starts_with(word, "-j") || word == "--jobs" || starts_with(word, "--jobs=") ||
+           starts_with(word, "--jobserver-auth=") || starts_with(word, "--jobserver-fds=");
+}
+
+static bool is_number(const string &word)
+{
+    return !word.empty() && word.find_first_not_of("0123456789") == string::npos;
+}
+
+// Replaces only the -j and jobserver words of MAKEFLAGS with jobserver_flags, keeping
+// the user's other flags and the "-- VAR=value" assignments; unsets an emptied MAKEFLAGS
+static void update_makeflags(const string &jobserver_flags)
+{
+    const char *current = get_variable("MAKEFLAGS");
+    string text = current ? current : "";
+
+    // Variable assignments after a lone -- are kept verbatim, values may hold spaces
+    string assignments;
+    size_t dashes = text.find(" -- ");
+    if (text.compare(0, 3, "-- ") == 0)
+    {
+        dashes = 0;
+    }
+    if (dashes != string::npos)
+    {
+        assignments = text.substr(dashes == 0 ? 0 : dashes + 1);
+        text.erase(dashes);
+    }
+
+    string flags;
+    bool after_bare_j = false;
+    size_t pos = 0;
+    while ((pos = text.find_first_not_of(" \t", pos)) != string::npos)
+    {
+        size_t end = text.find_first_of(" \t", pos);
+        string word = text.substr(pos, end == string::npos ? string::npos : end - pos);
+        pos = end;
+
+        bool skip = is_jobserver_flag(word) || (after_bare_j && is_number(word));
+        after_bare_j = word == "-j" || word == "--jobs";
+        if (!skip)
+        {
+            flags += (flags.empty() ? "" : " ") + word;
+        }
+    }
+
+    if (!jobserver_flags.empty())
+    {
+        flags += (flags.empty() ? "" : " ") + jobserver_flags;
+    }
+    if (!assignments.empty())
+    {
+        flags += (flags.empty() ? "" : " ") + assignments;
+    }
+
+    if (flags.empty())
+    {
+        unset_variable("MAKEFLAGS");
+    }
+    else
+    {
+        set_variable("MAKEFLAGS", flags, true);
+    }
+    exported_environ();
+}
+
+static void close_jobserver()
+{
+    if (jobserver_shell_fd == -1 && jobserver_child_fd == -1)
+    {
+        return; // MAKEFLAGS is the user's until a jobserver exists
+    }
+    if (jobserver_shell_fd != -1)
+    {
+        close(jobserver_shell_fd);
+        jobserver_shell_fd = -1;
+    }
+    if (jobserver_child_fd != -1)
+    {
+        close(jobserver_child_fd);
+        jobserver_child_fd = -1;
+    }
+    update_makeflags("");
+}
+
+// A token a sub-make gives back wakes nobody, so the main loop polls the shell's end
+// of the jobserver while lines wait in the queue; -1 when there is nothing to wait for
+int jobserver_poll_fd()
+{
+    if (job_queue.empty() || launch_pending)
+    {
+        return -1;
+    }
+    return jobserver_shell_fd;
+}
+
+// Sets the background job limit and (re)creates the jobserver with max_jobs - 1 tokens
+bool set_max_jobs(long max_jobs)
+{
+    close_jobserver();
+
+    // Jobs running on the old budget no longer hold slots
+    for (auto &entry : job_table)
+    {
+        entry.second.slot = SLOT_NONE;
+    }
+    implicit_slot_busy = false;
+    max_background_jobs = max_jobs > 0 ? max_jobs : 0;
+
+    if (max_background_jobs == 0)
+    {
+        start_queued_jobs();
+        return true;
+    }
+
+    // A FIFO gives the shell and its children separate open file descriptions,
+    // so only the shell's end is non-blocking
+    char dir[] = "/tmp/shell-jobserver-XXXXXX";
+    if (!mkdtemp(dir))
+    {
+        perror("jobserver");
+        return false;
+    }
+    string fifo = string(dir) + "/fifo";
+    if (mkfifo(fifo.c_str(), 0600) == -1)
+    {
+        perror("jobserver");
+        rmdir(dir);
+        return false;
+    }
+
+    jobserver_child_fd = open(fifo.c_str(), O_RDWR);
+    jobserver_shell_fd = open(fifo.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    unlink(fifo.c_str());
+    rmdir(dir);
+
+    if (jobserver_child_fd == -1 || jobserver_shell_fd == -1)
+    {
+        perror("jobserver");
+        close_jobserver();
+        return false;
+    }
+
+    string tokens(max_background_jobs - 1, '+');
+    if (!tokens.empty() && write(jobserver_shell_fd, tokens.data(), tokens.size()) != (ssize_t)tokens.size())
+    {
+        perror("jobserver");
+    }
+
+    // Same format GNU make uses when it runs sub-makes
+    string fd = to_string(jobserver_child_fd);
+    update_makeflags("-j" + to_string(max_background_jobs) + " --jobserver-auth=" + fd + "," + fd);
+
+    start_queued_jobs();
+    return true;
+}
+
+long get_max_jobs()
+{
+    return max_background_jobs;
+}
+
+bool has_pending_notifications()
+{
+    for (const auto &entry : job_table)
+    {
+        if (!entry.second.notified)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Reports deferred job state changes, called only from the main loop
+void print_job_notifications()
+{
+    vector<int> finished;
+    for (auto &entry : job_table)
+    {
+        Job &job = entry.second;
+        if (job.notified)
+        {
+            continue;
+        }
+
+        print_job(job, false);
+        job.notified = true;
+
+        if (job.state == JobState::Done)
+        {
+            finished.push_back(job.id);
+        }
+    }
+
+    for (int id : finished)
+    {
+        remember_status(job_table[id].last_pid, job_table[id].status);
+        remove_job(id);
+    }
+}
+
+// Waits for a foreground job, moving it to the job table if it gets suspended
+int wait_for_foreground(pid_t pgid, const vector<pid_t> &pids, const string &command, int id)
+{
+    TraceSpan span("wait");
+    span.command(command);
+    span.child(pgid);
+
+    give_terminal_to(pgid);
+    foreground_pid = pids.empty() ? pgid : pids.back();
+
+    int last_status = 0;
+    vector<pid_t> remaining(pids.begin(), pids.end());
+    bool stopped = false;
+
+    // Reap in exit order so per-stage times are accurate. With job control only the job's
+    // group is waited for; without it any child may come back, and the exits of others
+    // go to the job table or are kept for wait PID
+    pid_t wait_for = job_control_enabled ? -pgid : -1;
+    while (!remaining.empty())
+    {
+        int status;
+        struct rusage usage;
+        pid_t pid = wait4(wait_for, &status, WUNTRACED, &usage);
+        if (pid == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != ECHILD)
+            {
+                perror("wait4");
+            }
+            break;
+        }
+
+        auto it = find(remaining.begin(), remaining.end(), pid);
+        if (it == remaining.end())
+        {
+            update_job_status(pid, status);
+            continue;
+        }
+
+        if (WIFSTOPPED(status))
+        {
+            // Every process not yet reaped belongs to the suspended job, $? becomes 128+signal
+            stopped = true;
+            last_status = status;
+            break;
+        }
+
+        remaining.erase(it);
+        timing_stage_reaped(pid, status, usage);
+        if (pid == pids.back())
+        {
+            last_status = status;
+        }
+    }
+
+    foreground_pid = -1;
+    reclaim_terminal();
+
+    if (stopped)
+    {
+        int job_id = add_job(pgid, remaining, command, JobState::Stopped, id);
+        Job &job = job_table[job_id];
+        job.last_pid = pids.back();
+        cout << endl;
+        print_job(job, false);
+        return last_status;
+    }
+
+    if (WIFSIGNALED(last_status) && WTERMSIG(last_status) == SIGINT)
+    {
+        cout << endl;
+    }
+
+    return last_status;
+}
+
+// Resolves "%n", "n" or an empty spec (current job) to a job id
+static int parse_job_spec(const char *spec, const char *builtin)
+{
+    if (spec == nullptr)
+    {
+        int id = current_job_id();
+        if (id == 0)
+        {
+            cerr << builtin << ": current: no such job\n";
+        }
+        return id;
+    }
+
+    const char *digits = (spec[0] == '%') ? spec + 1 : spec;
+    char *end = nullptr;
+    long id = strtol(digits, &end, 10);
+    if (*digits == '\0' || *end != '\0' || !job_table.count((int)id))
+    {
+        cerr << builtin << ": " << spec << ": no such job\n";
+        return 0;
+    }
+    return (int)id;
+}
+
+int builtin_jobs(BuiltinArgs args)
+{
+    bool show_pids = false;
+    for (size_t i = 1; i < args.size() && args[i] != nullptr; i++)
+    {
+        if (strcmp(args[i], "-l") == 0)
+        {
+            show_pids = true;
+        }
+        else
+        {
+            cerr << "jobs: invalid option " << args[i] << "\n";
+            return -1;
+        }
+    }
+
+    reap_children();
+    for (const auto &entry : job_table)
+    {
+        print_job(entry.second, show_pids);
+    }
+
+    // Everything listed is now reported
+    vector<int> finished;
+    for (auto &entry : job_table)
+    {
+        entry.second.notified = true;
+        if (entry.second.state == JobState::Done)
+        {
+            finished.push_back(entry.first);
+        }
+    }
+    for (int id : finished)
+    {
+        remove_job(id);
+    }
+    return 0;
+}
+
+int builtin_fg(BuiltinArgs args)
+{
+    reap_children();
+    int id = parse_job_spec(args.size() > 1 ? args[1] : nullptr, "fg");
+    if (id == 0)
+    {
+        return -1;
+    }
+
+    Job job = job_table[id];
+    if (job.state == JobState::Done)
+    {
+        print_job(job, false);
+        remove_job(id);
+        return 0;
+    }
+
+    if (job.state == JobState::Queued)
+    {
+        // Not started yet, run it in the foreground right away
+        cout << job.command << endl;
+        remove_job(id);
+        vector<char> buffer(job.launch_line.begin(), job.launch_line.end());
+        buffer.push_back('\0');
+        parse_and_execute(buffer.data());
+        return 0;
+    }
+
+    cout << job.command << endl;
+    release_slot(job.slot);
+    remove_job(id);
+
+    give_terminal_to(job.pgid);
+    signal_job(job, SIGCONT);
+
+    int status = wait_for_foreground(job.pgid, job.pids, job.command, id);
+    if (WIFSTOPPED(status))
+    {
+        return 128 + WSTOPSIG(status);
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+int builtin_bg(BuiltinArgs args)
+{
+    reap_children();
+    int id = parse_job_spec(args.size() > 1 ? args[1] : nullptr, "bg");
+    if (id == 0)
+    {
+        return -1;
+    }
+
+    Job &job = job_table[id];
+    if (job.state == JobState::Running)
+    {
+        cerr << "bg: job " << id << " already in background\n";
+        return 0;
+    }
+    if (job.state == JobState::Done)
+    {
+        cerr << "bg: job has terminated\n";
+        return -1;
+    }
+    if (job.state == JobState::Queued)
+    {
+        cerr << "bg: job " << id << " is queued and starts when a slot frees up\n";
+        return 0;
+    }
+
+    job.state = JobState::Running;
+    signal_job(job, SIGCONT);
+    cout << "[" << id << "] " << job.command << " &" << endl;
+    return 0;
+}
+
+// Blocks until the job finishes, Ctrl+C interrupts the wait
+static int wait_for_job(int id)
+{
+    while (job_table.count(id) && job_table[id].state != JobState::Done)
+    {
+        Job &job = job_table[id];
+        if (job.state == JobState::Stopped)
+        {
+            cerr << "wait: job " << id << " is stopped\n";
+            return -1;
+        }
+
+        // Any child may be the one that frees a slot for a queued job
+        int status;
+        pid_t pid = waitpid(-1, &status, WUNTRACED);
+        if (pid == -1)
+        {
+            if (errno == EINTR)
+            {
+                return -1;
+            }
+            if (errno == ECHILD)
+            {
+                break;
+            }
+            perror("wait");
+            return -1;
+        }
+        update_job_status(pid, status);
+        start_queued_jobs();
+    }
+
+    if (!job_table.count(id))
+    {
+        return 0;
+    }
+
+    int status = job_table[id].status;
+    remove_job(id);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+int builtin_wait(BuiltinArgs args)
+{
+    reap_children();
+
+    if (args.size() < 2 || args[1] == nullptr)
+    {
+        vector<int> ids;
+        for (const auto &entry : job_table)
+        {
+            if (entry.second.state == JobState::Running || entry.second.state == JobState::Queued)
+            {
+                ids.push_back(entry.first);
+            }
+        }
+        for (int id : ids)
+        {
+            wait_for_job(id);
+        }
+        return 0;
+    }
+
+    int result = 0;
+    for (size_t i = 1; i < args.size() && args[i] != nullptr; i++)
+    {
+        int id;
+        if (args[i][0] == '%')
+        {
+            id = parse_job_spec(args[i], "wait");
+        }
+        else
+        {
+            // A plain number is a pid, as in POSIX wait
+            pid_t pid = atoi(args[i]);
+            auto owner = pid_to_job.find(pid);
+            int status;
+            if (owner == pid_to_job.end() && claim_status(pid, status))
+            {
+                // Reaped already, by another wait or before its job was reported
+                result = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+                continue;
+            }
+            if (owner == pid_to_job.end())
+            {
+                // A finished job no longer indexes its pids, but still knows its last one
+                auto done = find_if(job_table.begin(), job_table.end(),
+                                    [pid](const pair<const int, Job> &entry) { return entry.second.last_pid == pid; });
+                if (done != job_table.end())
+                {
+                    int status = wait_for_job(done->first);
+                    result = status < 0 ? 1 : status;
+                    continue;
+                }
+                cerr << "wait: pid " << args[i] << " is not a child of this shell\n";
+                result = 127;
+                continue;
+            }
+            id = owner->second;
+        }
+
+        // As in POSIX, the status of the last operand
+        int status = id == 0 ? 127 : wait_for_job(id);
+        result = status < 0 ? 1 : status;
+    }
+    return result;
+}
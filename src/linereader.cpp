@@ -0,0 +1,406 @@
+#include "linereader.h"
+#include "variables.h"
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <unordered_map>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+static const size_t READ_BLOCK_SIZE = 64 * 1024; // bytes asked for per read(2) or pread(2)
+
+// Input of one descriptor read ahead of the records read has returned
+struct ReadBuffer
+{
+    enum Kind
+    {
+        UNKNOWN,
+        SEEKABLE,  // data is a cached block at offset, the fd's offset is put back after each record
+        PIPE,      // data is gone from the pipe, only read sees it; read ahead only by a loop condition
+        UNBUFFERED // the shell's own input, read a byte at a time
+    };
+
+    Kind kind = UNKNOWN;
+    string data;
+    size_t start = 0; // first byte not returned yet
+    off_t offset = 0; // SEEKABLE: file offset of data[0]
+};
+
+static unordered_map<int, ReadBuffer> buffers;
+static vector<pair<int, ReadBuffer>> saved_buffers; // set aside while a redirection replaces the fd
+static bool read_ahead = false; // the read runs as a while/until condition and may take a block of a pipe
+static int read_loops = 0;      // while/until loops with a read condition now running
+
+// The input the shell reads its command lines from, taken before any redirection
+struct ShellInput
+{
+    ShellInput()
+    {
+        struct stat st;
+        known = fstat(STDIN_FILENO, &st) == 0;
+        dev = known ? st.st_dev : 0;
+        ino = known ? st.st_ino : 0;
+    }
+
+    bool known;
+    dev_t dev;
+    ino_t ino;
+};
+
+static const ShellInput shell_input;
+
+static bool is_shell_input(int fd)
+{
+    struct stat st;
+    return shell_input.known && fstat(fd, &st) == 0 && st.st_dev == shell_input.dev && st.st_ino == shell_input.ino;
+}
+
+// A redirection is about to replace fd, so its buffer waits until the old file is back
+void read_buffer_save(int fd)
+{
+    auto it = buffers.find(fd);
+    if (it == buffers.end())
+    {
+        saved_buffers.push_back({fd, ReadBuffer()});
+        return;
+    }
+    saved_buffers.push_back({fd, move(it->second)});
+    buffers.erase(it);
+}
+
+// The redirection of fd is undone: what was read ahead of its file is dropped with it
+void read_buffer_restore(int fd)
+{
+    buffers.erase(fd);
+    for (auto it = saved_buffers.rbegin(); it != saved_buffers.rend(); ++it)
+    {
+        if (it->first == fd)
+        {
+            if (it->second.kind != ReadBuffer::UNKNOWN)
+                buffers[fd] = move(it->second);
+            saved_buffers.erase(next(it).base());
+            return;
+        }
+    }
+}
+
+// A forked child has its own descriptors, the parent's read-ahead is not its input
+void read_after_fork()
+{
+    buffers.clear();
+    saved_buffers.clear();
+    read_ahead = false;
+    read_loops = 0;
+}
+
+// Set around the condition of a while/until loop whose condition is read, returns the
+// previous setting; a read anywhere else takes a pipe a byte at a time, so the commands
+// after it find their input where the record ended
+bool read_ahead_select(bool enabled)
+{
+    bool previous = read_ahead;
+    read_ahead = enabled;
+    return previous;
+}
+
+void read_loop_begin()
+{
+    read_loops++;
+}
+
+// The outermost read loop is done: what was read ahead of a pipe belongs to no record, and
+// is dropped rather than handed to a later read
+void read_loop_end()
+{
+    if (--read_loops > 0)
+    {
+        return;
+    }
+    for (auto it = buffers.begin(); it != buffers.end();)
+    {
+        it = it->second.kind == ReadBuffer::PIPE ? buffers.erase(it) : next(it);
+    }
+}
+
+// Decides how fd is read and where its buffer starts; called before each record
+static void prepare(int fd, ReadBuffer &buffer)
+{
+    if (buffer.kind == ReadBuffer::PIPE || buffer.kind == ReadBuffer::UNBUFFERED)
+    {
+        return;
+    }
+    off_t current = lseek(fd, 0, SEEK_CUR);
+    if (buffer.kind == ReadBuffer::SEEKABLE && current >= buffer.offset && current <= buffer.offset + (off_t)buffer.data.size())
+    {
+        // Still within the cached block, unless a command in between moved the offset
+        buffer.start = current - buffer.offset;
+        return;
+    }
+
+    buffer = ReadBuffer();
+    if (is_shell_input(fd))
+    {
+        buffer.kind = ReadBuffer::UNBUFFERED;
+    }
+    else if (current != -1)
+    {
+        buffer.kind = ReadBuffer::SEEKABLE;
+        buffer.offset = current;
+    }
+    else
+    {
+        buffer.kind = ReadBuffer::PIPE;
+    }
+}
+
+// Replaces the consumed buffer with the next bytes of fd; the count, 0 at end of input
+// and -1 on an error or Ctrl+C
+static ssize_t fill(int fd, ReadBuffer &buffer)
+{
+    if (buffer.kind == ReadBuffer::SEEKABLE)
+    {
+        buffer.offset += buffer.data.size();
+    }
+    bool single = buffer.kind == ReadBuffer::UNBUFFERED || (buffer.kind == ReadBuffer::PIPE && !read_ahead);
+    size_t size = single ? 1 : READ_BLOCK_SIZE;
+    buffer.data.resize(size);
+    buffer.start = 0;
+    ssize_t n = buffer.kind == ReadBuffer::SEEKABLE ? pread(fd, &buffer.data[0], size, buffer.offset) : read(fd, &buffer.data[0], size);
+    buffer.data.resize(n > 0 ? n : 0);
+    return n;
+}
+
+enum ReadResult
+{
+    READ_DELIMITED,
+    READ_END,
+    READ_FAILED
+};
+
+// Appends the next record of fd up to delim, or limit characters when limit >= 0. Unless
+// raw, a backslash escapes the next character and backslash-newline is dropped; escapes
+// stay in the record for the field splitting
+static ReadResult read_record(int fd, char delim, long limit, bool raw, string &record)
+{
+    ReadBuffer &buffer = buffers[fd];
+    prepare(fd, buffer);
+
+    ReadResult result = READ_DELIMITED;
+    long count = 0;
+    bool escape = false;
+    while (limit < 0 || count < limit)
+    {
+        if (buffer.start == buffer.data.size())
+        {
+            ssize_t n = fill(fd, buffer);
+            if (n <= 0)
+            {
+                if (n < 0 && errno != EINTR)
+                    perror("read");
+                result = n == 0 ? READ_END : READ_FAILED;
+                break;
+            }
+        }
+
+        const char *p = buffer.data.data() + buffer.start;
+        const char *end = buffer.data.data() + buffer.data.size();
+        if (limit < 0 && !escape)
+        {
+            // Everything up to the delimiter or a backslash is copied at once
+            const char *stop = (const char *)memchr(p, delim, end - p);
+            const char *span_end = stop ? stop : end;
+            const char *backslash = raw ? nullptr : (const char *)memchr(p, '\\', span_end - p);
+            if (!backslash)
+            {
+                record.append(p, span_end - p);
+                buffer.start += span_end - p + (stop ? 1 : 0);
+                if (stop)
+                    break;
+                continue;
+            }
+            record.append(p, backslash - p);
+            buffer.start += backslash - p;
+            p = backslash;
+        }
+
+        char c = *p;
+        buffer.start++;
+        if (escape)
+        {
+            escape = false;
+            if (c == '\n')
+                continue;
+            record += '\\';
+            record += c;
+            count++;
+        }
+        else if (!raw && c == '\\')
+        {
+            escape = true;
+        }
+        else if (c == delim)
+        {
+            break;
+        }
+        else
+        {
+            record += c;
+            count++;
+        }
+    }
+
+    if (buffer.kind == ReadBuffer::SEEKABLE)
+    {
+        // The next reader of the file starts right after the record
+        lseek(fd, buffer.offset + buffer.start, SEEK_SET);
+    }
+    return result;
+}
+
+static bool is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n';
+}
+
+// Splits record into names by IFS: blanks in IFS separate runs, other IFS characters
+// separate single fields, and the last name takes the rest of the line
+static bool assign_fields(const string &record, bool raw, const vector<string> &names)
+{
+    static string text;
+    static vector<bool> literal; // escaped by a backslash, never a separator
+    text.clear();
+    literal.clear();
+    for (size_t i = 0; i < record.size(); i++)
+    {
+        bool escaped = !raw && record[i] == '\\' && i + 1 < record.size();
+        i += escaped ? 1 : 0;
+        text += record[i];
+        literal.push_back(escaped);
+    }
+
+    if (names.empty())
+    {
+        set_variable("REPLY", text);
+        return true;
+    }
+
+    const char *ifs_value = get_variable("IFS");
+    const char *ifs = ifs_value ? ifs_value : " \t\n";
+    auto separator = [&](size_t i) { return !literal[i] && *ifs && strchr(ifs, text[i]); };
+    auto blank_separator = [&](size_t i) { return separator(i) && is_blank(text[i]); };
+
+    bool ok = true;
+    size_t i = 0;
+    size_t n = text.size();
+    while (i < n && blank_separator(i))
+        i++;
+    for (size_t v = 0; v < names.size(); v++)
+    {
+        size_t begin = i;
+        size_t end;
+        if (v + 1 == names.size())
+        {
+            end = n;
+            while (end > begin && blank_separator(end - 1))
+                end--;
+        }
+        else
+        {
+            while (i < n && !separator(i))
+                i++;
+            end = i;
+            while (i < n && blank_separator(i))
+                i++;
+            if (i < n && separator(i))
+            {
+                i++;
+                while (i < n && blank_separator(i))
+                    i++;
+            }
+        }
+        if (!set_variable(names[v], text.substr(begin, end - begin)))
+        {
+            cerr << "read: `" << names[v] << "': not a valid identifier" << endl;
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+// read [-r] [-d delim] [-n nchars] [name ...]: 0 when a whole record was read, 1 at end
+// of input, 2 on a usage error
+int builtin_read(BuiltinArgs args)
+{
+    bool raw = false;
+    char delim = '\n';
+    long limit = -1;
+    vector<string> names;
+    size_t i = 1;
+    for (; i < args.size() && args[i] != nullptr && args[i][0] == '-' && args[i][1] != '\0'; i++)
+    {
+        if (strcmp(args[i], "--") == 0)
+        {
+            i++;
+            break;
+        }
+        for (const char *option = args[i] + 1; *option; option++)
+        {
+            if (*option == 'r')
+            {
+                raw = true;
+                continue;
+            }
+            if (*option != 'd' && *option != 'n')
+            {
+                cerr << "read: -" << *option << ": invalid option" << endl;
+                cerr << "read: usage: read [-r] [-d delim] [-n nchars] [name ...]" << endl;
+                return 2;
+            }
+            // The value is the rest of the word or the next word
+            const char *value = option[1] ? option + 1 : (i + 1 < args.size() ? args[++i] : nullptr);
+            if (value == nullptr)
+            {
+                cerr << "read: -" << *option << ": option requires an argument" << endl;
+                return 2;
+            }
+            if (*option == 'd')
+            {
+                delim = value[0];
+            }
+            else
+            {
+                char *end;
+                limit = strtol(value, &end, 10);
+                if (*end != '\0' || end == value || limit < 0)
+                {
+                    cerr << "read: " << value << ": invalid number" << endl;
+                    return 2;
+                }
+            }
+            break;
+        }
+    }
+    for (; i < args.size() && args[i] != nullptr; i++)
+    {
+        names.push_back(args[i]);
+    }
+
+    static string record;
+    record.clear();
+    cout.flush();
+    ReadResult result = read_record(STDIN_FILENO, delim, limit, raw, record);
+    if (result == READ_FAILED)
+    {
+        return 1;
+    }
+    if (!assign_fields(record, raw, names))
+    {
+        return 2;
+    }
+    return result == READ_DELIMITED ? 0 : 1;
+}
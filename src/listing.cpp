@@ -0,0 +1,326 @@
+#include "listing.h"
+#include "walker.h"
+#include "textutils.h"
+#include "trace.h"
+#include <iostream>
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <climits>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pwd.h>
+#include <grp.h>
+
+using namespace std;
+
+// Listed output that may wait for earlier directories before prefetching pauses
+static const size_t LS_BUFFER_LIMIT = 32 << 20;
+
+string get_permissions(mode_t mode)
+{
+    string perms(10, '-');
+    perms[0] = S_ISDIR(mode) ? 'd' : (S_ISLNK(mode) ? 'l' : '-');
+    perms[1] = (mode & S_IRUSR) ? 'r' : '-';
+    perms[2] = (mode & S_IWUSR) ? 'w' : '-';
+    perms[3] = (mode & S_IXUSR) ? 'x' : '-';
+    perms[4] = (mode & S_IRGRP) ? 'r' : '-';
+    perms[5] = (mode & S_IWGRP) ? 'w' : '-';
+    perms[6] = (mode & S_IXGRP) ? 'x' : '-';
+    perms[7] = (mode & S_IROTH) ? 'r' : '-';
+    perms[8] = (mode & S_IWOTH) ? 'w' : '-';
+    perms[9] = (mode & S_IXOTH) ? 'x' : '-';
+    return perms;
+}
+
+// Owner and group names are looked up once per thread; the _r calls keep listing threads apart
+static const string &user_name(uid_t uid)
+{
+    thread_local unordered_map<uid_t, string> names;
+    auto it = names.find(uid);
+    if (it != names.end())
+    {
+        return it->second;
+    }
+    struct passwd pw, *result = nullptr;
+    char buffer[4096];
+    getpwuid_r(uid, &pw, buffer, sizeof(buffer), &result);
+    return names.emplace(uid, result ? result->pw_name : "unknown").first->second;
+}
+
+static const string &group_name(gid_t gid)
+{
+    thread_local unordered_map<gid_t, string> names;
+    auto it = names.find(gid);
+    if (it != names.end())
+    {
+        return it->second;
+    }
+    struct group gr, *result = nullptr;
+    char buffer[4096];
+    getgrgid_r(gid, &gr, buffer, sizeof(buffer), &result);
+    return names.emplace(gid, result ? result->gr_name : "unknown").first->second;
+}
+
+// One ls -l line without the newline; path is resolved against dir_fd for the link target
+string format_long_entry(int dir_fd, const char *path, const char *filename, const struct stat &st)
+{
+    char fields[128];
+    snprintf(fields, sizeof(fields), "%s %3lu %8s %8s %8lld ", get_permissions(st.st_mode).c_str(), (unsigned long)st.st_nlink,
+             user_name(st.st_uid).c_str(), group_name(st.st_gid).c_str(), (long long)st.st_size);
+    string line = fields;
+
+    char timebuf[80];
+    struct tm tm_info;
+    if (localtime_r(&st.st_mtime, &tm_info))
+    {
+        strftime(timebuf, sizeof(timebuf), "%b %d %H:%M", &tm_info);
+        line += timebuf;
+        line += ' ';
+    }
+    else
+    {
+        line += "??? ?? ??:?? ";
+    }
+
+    line += filename;
+
+    if (S_ISLNK(st.st_mode))
+    {
+        char link_target[PATH_MAX];
+        ssize_t len = readlinkat(dir_fd, path, link_target, sizeof(link_target) - 1);
+        if (len != -1)
+        {
+            link_target[len] = '\0';
+            line += " -> ";
+            line += link_target;
+        }
+    }
+    return line;
+}
+
+// A directory of the walk; its listing is formatted by whichever thread claims it first
+struct ListNode
+{
+    enum State
+    {
+        PENDING,
+        CLAIMED,
+        LISTED
+    };
+
+    string path;
+    bool follow = false; // only the operand itself may be a link to a directory
+    atomic<int> state{PENDING};
+    string output;
+    string errors;
+    vector<shared_ptr<ListNode>> subdirs; // in name order
+};
+
+// The calling thread prints directories in the order of a sequential pre-order walk, while
+// workers list the directories likely to come next: newly found subdirectories go on top of
+// a stack, first child uppermost. Listed output is released as soon as it is printed and
+// workers pause while LS_BUFFER_LIMIT bytes are waiting, so memory does not grow with the
+// tree; the printer lists a directory itself when no worker has claimed it yet
+class RecursiveListing
+{
+public:
+    RecursiveListing(bool show_all, bool long_format) : show_all(show_all), long_format(long_format) {}
+
+    void run(const string &root_path)
+    {
+        shared_ptr<ListNode> root = make_shared<ListNode>();
+        root->path = root_path;
+        root->follow = true;
+
+        vector<thread> workers;
+        for (unsigned i = 0; i < walk_default_threads(); i++)
+        {
+            workers.emplace_back(&RecursiveListing::prefetch, this);
+        }
+
+        vector<shared_ptr<ListNode>> pending = {root};
+        bool first = true;
+        while (!pending.empty() && !text_builtins_interrupted())
+        {
+            shared_ptr<ListNode> node = std::move(pending.back());
+            pending.pop_back();
+            if (claim(*node))
+            {
+                list(*node);
+                publish(*node);
+            }
+            else
+            {
+                unique_lock<mutex> lock(state_mutex);
+                changed.wait(lock, [&]()
+                             { return node->state == ListNode::LISTED; });
+            }
+
+            cout << (first ? "" : "\n") << node->path << ":\n";
+            first = false;
+            if (!node->errors.empty())
+            {
+                cout.flush();
+                cerr << node->errors;
+            }
+            cout << node->output;
+
+            {
+                lock_guard<mutex> lock(state_mutex);
+                buffered -= node->output.size() + node->errors.size();
+                changed.notify_all();
+            }
+            string().swap(node->output);
+            string().swap(node->errors);
+            pending.insert(pending.end(), node->subdirs.rbegin(), node->subdirs.rend());
+            node->subdirs.clear();
+        }
+        cout.flush();
+
+        {
+            lock_guard<mutex> lock(state_mutex);
+            finished = true;
+            changed.notify_all();
+        }
+        for (thread &worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+private:
+    static bool claim(ListNode &node)
+    {
+        int expected = ListNode::PENDING;
+        return node.state.compare_exchange_strong(expected, ListNode::CLAIMED);
+    }
+
+    void prefetch()
+    {
+        unique_lock<mutex> lock(state_mutex);
+        while (true)
+        {
+            changed.wait(lock, [&]()
+                         { return finished || (!candidates.empty() && buffered < LS_BUFFER_LIMIT); });
+            if (finished)
+            {
+                return;
+            }
+            shared_ptr<ListNode> node = std::move(candidates.back());
+            candidates.pop_back();
+            if (!claim(*node))
+            {
+                continue; // the printer got there first
+            }
+            lock.unlock();
+            list(*node);
+            lock.lock();
+            publish_locked(*node);
+        }
+    }
+
+    void publish(ListNode &node)
+    {
+        lock_guard<mutex> lock(state_mutex);
+        publish_locked(node);
+    }
+
+    void publish_locked(ListNode &node)
+    {
+        buffered += node.output.size() + node.errors.size();
+        candidates.insert(candidates.end(), node.subdirs.rbegin(), node.subdirs.rend());
+        node.state = ListNode::LISTED;
+        changed.notify_all();
+    }
+
+    // Formats the directory like list_directory and records its subdirectories, which are
+    // told apart with lstat semantics so links to directories are listed but not entered
+    void list(ListNode &node)
+    {
+        int fd = open(node.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC | (node.follow ? 0 : O_NOFOLLOW));
+        DIR *dir = fd == -1 ? nullptr : fdopendir(fd);
+        if (!dir)
+        {
+            node.errors = "Cannot open directory: " + node.path + ": " + strerror(errno) + "\n";
+            if (fd != -1)
+            {
+                close(fd);
+            }
+            return;
+        }
+
+        vector<pair<string, unsigned char>> entries;
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != nullptr)
+        {
+            if (!show_all && entry->d_name[0] == '.')
+            {
+                continue;
+            }
+            entries.emplace_back(entry->d_name, entry->d_type);
+        }
+        sort(entries.begin(), entries.end());
+
+        for (const auto &item : entries)
+        {
+            const char *name = item.first.c_str();
+            bool is_dir = item.second == DT_DIR;
+            if (long_format || item.second == DT_UNKNOWN)
+            {
+                struct stat st;
+                bool found = fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+                if (!found && long_format)
+                {
+                    node.errors += "lstat: " + walk_join(node.path, name) + ": " + strerror(errno) + "\n";
+                    continue;
+                }
+                is_dir = found && S_ISDIR(st.st_mode);
+                node.output += long_format ? format_long_entry(fd, name, name, st) : item.first;
+            }
+            else
+            {
+                node.output += item.first;
+            }
+            node.output += '\n';
+
+            if (is_dir && strcmp(name, ".") != 0 && strcmp(name, "..") != 0)
+            {
+                shared_ptr<ListNode> child = make_shared<ListNode>();
+                child->path = walk_join(node.path, name);
+                node.subdirs.push_back(std::move(child));
+            }
+        }
+        closedir(dir);
+    }
+
+    bool show_all;
+    bool long_format;
+    mutex state_mutex;
+    condition_variable changed;
+    vector<shared_ptr<ListNode>> candidates; // under state_mutex; may hold already claimed nodes
+    size_t buffered = 0;                     // under state_mutex
+    bool finished = false;
+};
+
+// ls -R: every directory below path with a "path:" header, in sequential ls order
+void list_recursive(const string &path, bool show_all, bool long_format)
+{
+    TraceSpan span("ls_recursive");
+    span.command(path);
+    text_builtins_reset_interrupt();
+    tzset();
+    RecursiveListing listing(show_all, long_format);
+    listing.run(path);
+}
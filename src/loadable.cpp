@@ -0,0 +1,192 @@
+#include "loadable.h"
+#include "shell_builtin.h"
+#include "variables.h"
+#include "textutils.h"
+#include "trace.h"
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <dlfcn.h>
+#include <unistd.h>
+
+using namespace std;
+
+// A builtin from a shared object, registered under its name until enable -d
+struct LoadedBuiltin
+{
+    string name;
+    string path;
+    void *handle;
+    const shell_builtin *entry;
+    BuiltinDescriptor descriptor;
+};
+
+static vector<unique_ptr<LoadedBuiltin>> loaded_builtins;
+
+static const char *context_get_variable(const char *name)
+{
+    return name ? get_variable(name) : nullptr;
+}
+
+static int context_interrupted()
+{
+    return text_builtins_interrupted() ? 1 : 0;
+}
+
+// Descriptors of loaded builtins point here, the name in args[0] picks the library
+static int run_loaded(BuiltinArgs args)
+{
+    return run_loaded_builtin(args, STDIN_FILENO, STDOUT_FILENO);
+}
+
+static LoadedBuiltin *find_loaded(const char *name)
+{
+    for (auto &loaded : loaded_builtins)
+    {
+        if (loaded->name == name)
+        {
+            return loaded.get();
+        }
+    }
+    return nullptr;
+}
+
+// Checked by find_builtin after the compiled-in names; a few entries, so a plain scan
+const BuiltinDescriptor *find_loaded_builtin(const char *name)
+{
+    if (loaded_builtins.empty())
+    {
+        return nullptr;
+    }
+    LoadedBuiltin *loaded = find_loaded(name);
+    return loaded ? &loaded->descriptor : nullptr;
+}
+
+// Runs the loaded builtin named by args[0] with the given descriptors; a pipeline
+// stage calls this from its thread
+int run_loaded_builtin(BuiltinArgs args, int input_fd, int output_fd)
+{
+    LoadedBuiltin *loaded = args.empty() ? nullptr : find_loaded(args[0]);
+    if (loaded == nullptr)
+    {
+        return 127;
+    }
+
+    // The words may not end in NULL, the interface promises argv[argc] == NULL
+    vector<char *> argv(args.begin(), args.end());
+    argv.push_back(nullptr);
+
+    TraceSpan span("loaded_builtin");
+    span.command(loaded->name);
+    if (output_fd == STDOUT_FILENO)
+    {
+        cout.flush(); // earlier builtin output must come first
+    }
+    shell_builtin_context context = {input_fd, output_fd, STDERR_FILENO, context_get_variable, context_interrupted};
+    text_builtins_reset_interrupt();
+    return loaded->entry->run(&context, (int)args.size(), argv.data());
+}
+
+// Loads NAME_builtin from path and registers it, replacing an earlier load of the name
+static bool load_builtin(const string &path, const string &name)
+{
+    const BuiltinDescriptor *existing = find_builtin(name.c_str());
+    if (existing && !(existing->flags & BUILTIN_LOADED))
+    {
+        cerr << "enable: " << name << ": is a shell builtin" << endl;
+        return false;
+    }
+
+    void *handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (handle == nullptr)
+    {
+        cerr << "enable: " << dlerror() << endl;
+        return false;
+    }
+    string symbol = name + "_builtin";
+    const shell_builtin *entry = (const shell_builtin *)dlsym(handle, symbol.c_str());
+    if (entry == nullptr || entry->run == nullptr)
+    {
+        cerr << "enable: " << name << ": no " << symbol << " in " << path << endl;
+        dlclose(handle);
+        return false;
+    }
+    if (entry->abi_version != SHELL_BUILTIN_ABI_VERSION)
+    {
+        cerr << "enable: " << name << ": built for interface version " << entry->abi_version
+             << ", the shell has " << SHELL_BUILTIN_ABI_VERSION << endl;
+        dlclose(handle);
+        return false;
+    }
+
+    auto loaded = make_unique<LoadedBuiltin>();
+    loaded->name = name;
+    loaded->path = path;
+    loaded->handle = handle;
+    loaded->entry = entry;
+    loaded->descriptor = {nullptr, run_loaded, BUILTIN_PIPELINE_SAFE | BUILTIN_BACKGROUND_SAFE | BUILTIN_LOADED};
+
+    for (auto &slot : loaded_builtins)
+    {
+        if (slot->name == name)
+        {
+            dlclose(slot->handle);
+            slot = move(loaded);
+            slot->descriptor.name = slot->name.c_str();
+            return true;
+        }
+    }
+    loaded_builtins.push_back(move(loaded));
+    loaded_builtins.back()->descriptor.name = loaded_builtins.back()->name.c_str();
+    return true;
+}
+
+static bool unload_builtin(const string &name)
+{
+    for (auto it = loaded_builtins.begin(); it != loaded_builtins.end(); ++it)
+    {
+        if ((*it)->name == name)
+        {
+            dlclose((*it)->handle);
+            loaded_builtins.erase(it);
+            return true;
+        }
+    }
+    cerr << "enable: " << name << ": not a loaded builtin" << endl;
+    return false;
+}
+
+// enable -f lib.so name... loads builtins, enable -d name... unloads them and enable
+// alone lists what is loaded
+int builtin_enable(BuiltinArgs args)
+{
+    if (args.size() == 1)
+    {
+        for (auto &loaded : loaded_builtins)
+        {
+            cout << "enable -f " << loaded->path << " " << loaded->name << endl;
+        }
+        return 0;
+    }
+
+    bool load = strcmp(args[1], "-f") == 0;
+    bool unload = strcmp(args[1], "-d") == 0;
+    size_t first = load ? 3 : 2;
+    if ((!load && !unload) || args.size() <= first)
+    {
+        cerr << "enable: usage: enable [-f lib.so name ...] [-d name ...]" << endl;
+        return 2;
+    }
+
+    int status = 0;
+    for (size_t i = first; i < args.size(); i++)
+    {
+        if (!(load ? load_builtin(args[2], args[i]) : unload_builtin(args[i])))
+        {
+            status = 1;
+        }
+    }
+    return status;
+}
@@ -1,24 +1,196 @@
 #include "shell.h"
 #include "builtins.h"
 #include "autocomplete.h"
+#include "jobs.h"
+#include "trace.h"
+#include "heredoc.h"
+#include "arena.h"
+#include "variables.h"
+#include "textutils.h"
+#include "script.h"
 #include <iostream>
 #include <cstring>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <poll.h>
+#include <errno.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 #include <limits.h>
+#include <cstdio>
+#include <ctime>
+#include <vector>
+#include <string>
 
 using namespace std;
 
 // External declaration for shell home directory
 extern string shell_home_dir;
 
+// Readline history file, resolved against the shell's starting directory
+static string history_file;
+static bool history_loaded = false;
+
+// Loads the history file the first time history is actually used
+void load_history_file()
+{
+    if (history_loaded)
+    {
+        return;
+    }
+    history_loaded = true;
+
+    // Lines entered before the file was loaded stay the newest entries
+    vector<string> session;
+    HIST_ENTRY **entries = history_list();
+    for (int i = 0; entries && entries[i]; i++)
+    {
+        session.push_back(entries[i]->line);
+    }
+
+    clear_history();
+    read_history(history_file.c_str());
+    for (const auto &line : session)
+    {
+        add_history(line.c_str());
+    }
+    using_history();
+}
+
+void save_history_file()
+{
+    // An untouched file only needs this session's lines appended
+    if (!history_loaded && access(history_file.c_str(), F_OK) == 0)
+    {
+        append_history(history_length, history_file.c_str());
+        return;
+    }
+
+    load_history_file();
+    write_history(history_file.c_str());
+}
+
+// Readline history commands, wrapped so the first use loads the file
+static int lazy_previous_history(int count, int key)
+{
+    load_history_file();
+    return rl_get_previous_history(count, key);
+}
+
+static int lazy_beginning_of_history(int count, int key)
+{
+    load_history_file();
+    return rl_beginning_of_history(count, key);
+}
+
+static int lazy_reverse_search(int count, int key)
+{
+    load_history_file();
+    return rl_reverse_search_history(count, key);
+}
+
+static int lazy_forward_search(int count, int key)
+{
+    load_history_file();
+    return rl_forward_search_history(count, key);
+}
+
+static int lazy_history_search_backward(int count, int key)
+{
+    load_history_file();
+    return rl_history_search_backward(count, key);
+}
+
+static int lazy_noninc_reverse_search(int count, int key)
+{
+    load_history_file();
+    return rl_noninc_reverse_search(count, key);
+}
+
+// Rebinds every key sequence (including ones from inputrc) that reaches history
+void bind_lazy_history()
+{
+    struct
+    {
+        rl_command_func_t *original;
+        rl_command_func_t *lazy;
+    } wrappers[] = {
+        {rl_get_previous_history, lazy_previous_history},
+        {rl_beginning_of_history, lazy_beginning_of_history},
+        {rl_reverse_search_history, lazy_reverse_search},
+        {rl_forward_search_history, lazy_forward_search},
+        {rl_history_search_backward, lazy_history_search_backward},
+        {rl_noninc_reverse_search, lazy_noninc_reverse_search},
+    };
+
+    for (const auto &wrapper : wrappers)
+    {
+        char **sequences = rl_invoking_keyseqs(wrapper.original);
+        for (int i = 0; sequences && sequences[i]; i++)
+        {
+            rl_bind_keyseq(sequences[i], wrapper.lazy);
+            free(sequences[i]);
+        }
+        free(sequences);
+    }
+}
+
+// --startup-profile: time spent in each init phase before the first prompt
+struct StartupPhase
+{
+    const char *name;
+    double ms;
+    const char *note;
+};
+
+static bool startup_profile = false;
+static vector<StartupPhase> startup_phases;
+static struct timespec phase_start;
+
+static double elapsed_ms(const struct timespec &since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since.tv_sec) * 1e3 + (now.tv_nsec - since.tv_nsec) / 1e6;
+}
+
+static void end_phase(const char *name, const char *note = "")
+{
+    if (startup_profile)
+    {
+        startup_phases.push_back({name, elapsed_ms(phase_start), note});
+        clock_gettime(CLOCK_MONOTONIC, &phase_start);
+    }
+}
+
+static void print_startup_profile(const struct timespec &process_start)
+{
+    double total = elapsed_ms(process_start);
+
+    fprintf(stderr, "\nstartup profile (time to first prompt)\n");
+    for (const auto &phase : startup_phases)
+    {
+        fprintf(stderr, "  %-14s %9.3f ms  %s\n", phase.name, phase.ms, phase.note);
+    }
+    fprintf(stderr, "  %-14s %9.3f ms\n", "total", total);
+}
+
+// Set by the signal handlers when the prompt line has to be reset from the main loop
+static volatile sig_atomic_t prompt_interrupted = 0;
+static bool shell_running = true;
+
+// Command line waiting for its here-document bodies
+static string pending_heredoc_line;
+
+// Lines of a compound command that is not closed yet
+static string pending_script_lines;
+
 void sigint_handler(int sig)
 {
     (void)sig;
+    text_builtins_interrupt();
     if (foreground_pid > 0)
     {
         // Kill foreground process and show newline
@@ -28,11 +200,8 @@ void sigint_handler(int sig)
 
     else
     {
-        // At shell prompt - just show newline and redisplay
-        write(STDOUT_FILENO, "\n", 1);
-        rl_on_new_line();
-        rl_replace_line("", 0);
-        rl_redisplay();
+        // At shell prompt - the main loop clears the line, readline is not async-signal-safe
+        prompt_interrupted = 1;
     }
 }
 
@@ -41,62 +210,19 @@ void sigtstp_handler(int sig)
     (void)sig;
     if (foreground_pid > 0)
     {
-        // Suspend foreground process
+        // Suspend foreground process, wait_for_foreground reports it as a stopped job
         kill(foreground_pid, SIGTSTP);
-        char msg[100];
-        snprintf(msg, sizeof(msg), "\n[Process %d suspended]\n", foreground_pid);
-        write(STDOUT_FILENO, msg, strlen(msg));
-
-        // Reset foreground_pid since process is now suspended (background)
-        foreground_pid = -1;
-
-        // Redisplay prompt
-        rl_on_new_line();
-        rl_replace_line("", 0);
-        rl_redisplay();
     }
 
     else
     {
-        // At shell prompt - just show newline and redisplay
-        write(STDOUT_FILENO, "\n", 1);
-        rl_on_new_line();
-        rl_replace_line("", 0);
-        rl_redisplay();
-    }
-}
-
-void sigchld_handler(int sig)
-{
-    (void)sig;
-    pid_t pid;
-    int status;
-
-    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
-    {
-        if (pid == foreground_pid)
-        {
-            // Foreground process finished - don't print anything
-            foreground_pid = -1;
-        }
-        else
-        {
-            // Background process finished - only print if no foreground process
-            if (foreground_pid == -1 && !WIFSIGNALED(status))
-            {
-                char msg[100];
-                snprintf(msg, sizeof(msg), "\n[Background process %d finished]\n", pid);
-                write(STDOUT_FILENO, msg, strlen(msg));
-                rl_on_new_line();
-                rl_redisplay();
-            }
-        }
+        prompt_interrupted = 1;
     }
 }
 
 void setup_signal_handlers()
 {
-    struct sigaction sa_int, sa_tstp, sa_chld;
+    struct sigaction sa_int, sa_tstp;
 
     // SIGINT handler - Ctrl+C
     sa_int.sa_handler = sigint_handler;
@@ -110,100 +236,185 @@ void setup_signal_handlers()
     sa_tstp.sa_flags = SA_RESTART;
     sigaction(SIGTSTP, &sa_tstp, nullptr);
 
-    // SIGCHLD handler - Child process status changes
-    sa_chld.sa_handler = sigchld_handler;
-    sigemptyset(&sa_chld.sa_mask);
-    sa_chld.sa_flags = SA_RESTART | SA_NOCLDSTOP;
-    sigaction(SIGCHLD, &sa_chld, nullptr);
+    // SIGCHLD is blocked and read through a signalfd by the job table
+    init_job_control();
 
     // Ignore SIGPIPE to handle broken pipes gracefully
     signal(SIGPIPE, SIG_IGN);
 }
 
-void parse_semicolon_commands(char *input)
+// Clears the current input line after Ctrl+C / Ctrl+Z at the prompt
+void reset_prompt_line()
 {
-    if (input == nullptr || strlen(input) == 0)
+    prompt_interrupted = 0;
+    if (heredoc_collecting())
+    {
+        // Ctrl+C inside a here-document drops the whole command
+        heredoc_abort();
+        pending_heredoc_line.clear();
+        rl_set_prompt(get_prompt().c_str());
+    }
+    if (!pending_script_lines.empty())
+    {
+        // Ctrl+C inside a compound command drops the lines read so far and their bodies
+        heredoc_abort();
+        pending_script_lines.clear();
+        rl_set_prompt(get_prompt().c_str());
+    }
+    write(STDOUT_FILENO, "\n", 1);
+    rl_replace_line("", 0);
+    rl_on_new_line();
+    rl_redisplay();
+}
+
+// Prints job notifications that arrived while the user is idle at the prompt
+void report_jobs_at_prompt()
+{
+    if (!has_pending_notifications())
+    {
         return;
+    }
 
-    // Created a copy to work with
-    string input_str(input);
+    cout << endl;
+    print_job_notifications();
+    rl_on_new_line();
+    rl_redisplay();
+}
 
-    // Check for semicolons inside quotes and temporarily replace them
-    bool in_quotes = false;
-    char quote_char = '\0';
-    vector<size_t> protected_semicolons;
+// Runs a command line whose here-document bodies are complete
+static void run_line(char *line)
+{
+    line_arena.reset();
+    parse_semicolon_commands(line);
+    heredoc_release();
+}
 
-    for (size_t i = 0; i < input_str.length(); i++)
+// Readline callback, invoked once per complete input line
+void line_handler(char *input)
+{
+    if (heredoc_collecting())
     {
-        if (!in_quotes && (input_str[i] == '"' || input_str[i] == '\''))
+        // Body line of a here-document, the command runs after the last delimiter
+        bool complete = (input == nullptr);
+        if (input == nullptr)
         {
-            in_quotes = true;
-            quote_char = input_str[i];
+            heredoc_finish_at_eof();
         }
-        else if (in_quotes && input_str[i] == quote_char)
+        else
         {
-            in_quotes = false;
-            quote_char = '\0';
+            complete = heredoc_feed_line(input);
+            free(input);
         }
-        else if (in_quotes && input_str[i] == ';')
+
+        if (!complete)
         {
-            protected_semicolons.push_back(i);
-            input_str[i] = '\1'; // Temporary placeholder
+            return;
         }
-    }
 
-    // Split on semicolons
-    vector<string> commands;
-    size_t start = 0;
-    size_t pos = 0;
+        string text = pending_heredoc_line;
+        pending_heredoc_line.clear();
+        if (input != nullptr && script_incomplete(text))
+        {
+            // The compound command goes on after the bodies
+            pending_script_lines = text;
+            rl_set_prompt("> ");
+            return;
+        }
+        vector<char> line(text.begin(), text.end());
+        line.push_back('\0');
+        run_line(line.data());
+        if (input != nullptr)
+        {
+            input = strdup("");
+        }
+    }
 
-    while ((pos = input_str.find(';', start)) != string::npos)
+    // Handle Ctrl+D (EOF)
+    if (input == nullptr)
     {
-        if (pos > start)
+        if (!pending_script_lines.empty())
         {
-            commands.push_back(input_str.substr(start, pos - start));
+            cerr << "shell: syntax error: unexpected end of file" << endl;
         }
-        start = pos + 1;
+        cout << "Goodbye!\n";
+        rl_callback_handler_remove();
+        shell_running = false;
+        return;
     }
 
-    // Add the last command
-    if (start < input_str.length())
+    // << operators are looked for in the line just typed, the earlier lines of a compound
+    // command had their bodies read after them
+    bool has_heredocs = heredoc_scan_line(input);
+
+    if (!pending_script_lines.empty())
+    {
+        // Next line of an if, while, for, case or function body
+        string lines = pending_script_lines + "\n" + input;
+        if (strlen(input) > 0)
+        {
+            add_history(input);
+        }
+        free(input);
+        input = strdup(lines.c_str());
+        pending_script_lines.clear();
+    }
+    else if (strlen(input) > 0)
     {
-        commands.push_back(input_str.substr(start));
+        add_history(input);
     }
 
-    // Execute each command
-    for (auto &cmd : commands)
+    if (strlen(input) > 0)
     {
-        // Restore protected semicolons
-        for (size_t pos : protected_semicolons)
+        // << operators read their bodies from the following lines first
+        if (has_heredocs)
         {
-            if (pos < cmd.length())
-            {
-                cmd[pos] = ';';
-            }
+            pending_heredoc_line = input;
+            free(input);
+            rl_set_prompt("> ");
+            return;
         }
 
-        // Trim whitespace
-        size_t first = cmd.find_first_not_of(" \t\n");
-        if (first == string::npos)
-            continue;
-
-        size_t last = cmd.find_last_not_of(" \t\n");
-        cmd = cmd.substr(first, last - first + 1);
-
-        if (!cmd.empty())
+        // A compound command continues on the following lines until it is closed
+        if (script_incomplete(input))
         {
-            // Created a mutable copy for parse_and_execute
-            vector<char> cmd_buffer(cmd.begin(), cmd.end());
-            cmd_buffer.push_back('\0');
-            parse_and_execute(cmd_buffer.data());
+            pending_script_lines = input;
+            free(input);
+            rl_set_prompt("> ");
+            return;
         }
+
+        // Process semicolon-separated commands
+        run_line(input);
     }
+    free(input);
+    trace_flush();
+
+    // Deferred notifications are shown just before the next prompt
+    prompt_interrupted = 0;
+    reap_children();
+    print_job_notifications();
+    rl_set_prompt(get_prompt().c_str());
 }
 
-int main()
+int main(int argc, char *argv[])
 {
+    struct timespec process_start;
+    clock_gettime(CLOCK_MONOTONIC, &process_start);
+    phase_start = process_start;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--startup-profile") == 0)
+        {
+            startup_profile = true;
+        }
+        else
+        {
+            cerr << "usage: " << argv[0] << " [--startup-profile]\n";
+            return 1;
+        }
+    }
+
     // Initialized shell's home directory to current working directory
     char cwd[PATH_MAX];
     if (getcwd(cwd, sizeof(cwd)))
@@ -216,40 +427,95 @@ int main()
         perror("getcwd");
         shell_home_dir = "/"; // Fallback
     }
+    history_file = shell_home_dir + "/.shell_history";
+    end_phase("home_dir");
+
+    // Shell variables start as a copy of the inherited environment
+    init_variables();
+    end_phase("variables");
 
     setup_signal_handlers();
+    end_phase("signals_jobs");
+
+    // Tracing can be enabled for the whole session from the environment
+    const char *trace_env = getenv("SHELL_TRACE_FILE");
+    if (trace_env && *trace_env)
+    {
+        trace_open(trace_env);
+    }
+    end_phase("trace");
+
     setup_autocomplete(); // Initialized autocomplete functionality
-    read_history(".shell_history");
+    end_phase("autocomplete", "PATH index deferred to first TAB / background");
+
+    // History is read on first use (Up, Ctrl-R, ...), see bind_lazy_history
+    rl_change_environment = 0; // LINES/COLUMNS would bypass the variable store
+    rl_initialize();
+    bind_lazy_history();
+    end_phase("readline_init", "history file deferred to first use");
 
     cout << "Welcome to Ameya's Custom Shell! Type 'exit' to quit.\n";
 
-    while (true)
+    string first_prompt = get_prompt();
+    end_phase("prompt");
+
+    // Readline runs in callback mode so job events and input share one poll loop
+    rl_catch_signals = 0;
+    rl_callback_handler_install(first_prompt.c_str(), line_handler);
+    end_phase("first_prompt");
+
+    if (startup_profile)
     {
-        string prompt = get_prompt();
-        char *input = readline(prompt.c_str());
+        print_startup_profile(process_start);
+        rl_on_new_line();
+        rl_redisplay();
+    }
 
-        // Handle Ctrl+D (EOF)
-        if (input == nullptr)
+    // Build the completion index while the user is typing
+    prewarm_completion_index();
+
+    int child_fd = job_signal_fd();
+    while (shell_running)
+    {
+        // The jobserver is watched only while queued lines wait for a token
+        int token_fd = jobserver_poll_fd();
+        struct pollfd fds[3];
+        fds[0] = {STDIN_FILENO, POLLIN, 0};
+        fds[1] = {child_fd, POLLIN, 0};
+        fds[2] = {token_fd, POLLIN, 0};
+
+        int ready = poll(fds, 3, -1);
+        if (ready == -1)
         {
-            cout << "Goodbye!\n";
+            if (errno == EINTR)
+            {
+                if (prompt_interrupted)
+                {
+                    reset_prompt_line();
+                }
+                continue;
+            }
+            perror("poll");
             break;
         }
 
-        // Handle empty input
-        if (strlen(input) == 0)
+        if (child_fd != -1 && (fds[1].revents & POLLIN))
         {
-            free(input);
-            continue;
+            reap_children();
+            report_jobs_at_prompt();
         }
 
-        add_history(input);
-
-        // Process semicolon-separated commands
-        parse_semicolon_commands(input);
+        if (token_fd != -1 && (fds[2].revents & POLLIN))
+        {
+            start_queued_jobs();
+        }
 
-        free(input);
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            rl_callback_read_char();
+        }
     }
 
-    write_history(".shell_history");
+    save_history_file();
     return 0;
 }
\ No newline at end of file
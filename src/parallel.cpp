@@ -0,0 +1,608 @@
+#include "parallel.h"
+#include "jobs.h"
+#include "variables.h"
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+using namespace std;
+
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+// Placeholders understood in the command template
+enum class Placeholder
+{
+    None,
+    Arg,       // {}
+    NoExt,     // {.}
+    Basename,  // {/}
+    JobNumber  // {#}
+};
+
+struct TemplateSegment
+{
+    string text;
+    Placeholder kind = Placeholder::None;
+};
+
+// One argv word of the template, split once into literal text and placeholders
+struct TemplateWord
+{
+    vector<TemplateSegment> segments;
+};
+
+// A running job; the poll set is rebuilt from at most -j slots per iteration
+struct Slot
+{
+    bool busy = false;
+    pid_t pid = -1;
+    int pidfd = -1;
+    int out_fd = -1;
+    int err_fd = -1;
+    string out;
+    string err;
+    bool exited = false;
+    int status = 0;
+};
+
+// Feeds arguments from the ::: list or from stdin one line at a time
+class ArgSource
+{
+public:
+    ArgSource(const vector<string> *list) : list(list) {}
+
+    bool next(string &arg)
+    {
+        if (list)
+        {
+            if (index >= list->size())
+            {
+                return false;
+            }
+            arg = (*list)[index++];
+            return true;
+        }
+        return read_line(arg);
+    }
+
+private:
+    bool read_line(string &arg)
+    {
+        while (true)
+        {
+            size_t newline = buffer.find('\n', start);
+            if (newline != string::npos)
+            {
+                arg = buffer.substr(start, newline - start);
+                start = newline + 1;
+                return true;
+            }
+
+            if (eof)
+            {
+                if (start < buffer.size())
+                {
+                    arg = buffer.substr(start);
+                    start = buffer.size();
+                    return true;
+                }
+                return false;
+            }
+
+            buffer.erase(0, start);
+            start = 0;
+
+            char chunk[65536];
+            ssize_t n = read(STDIN_FILENO, chunk, sizeof(chunk));
+            if (n > 0)
+            {
+                buffer.append(chunk, n);
+            }
+            else if (n == 0 || errno != EINTR)
+            {
+                eof = true;
+            }
+        }
+    }
+
+    const vector<string> *list;
+    size_t index = 0;
+    string buffer;
+    size_t start = 0;
+    bool eof = false;
+};
+
+static vector<TemplateWord> compile_template(const vector<string> &words)
+{
+    vector<TemplateWord> compiled;
+    bool has_placeholder = false;
+
+    for (const string &word : words)
+    {
+        TemplateWord tw;
+        string literal;
+        for (size_t i = 0; i < word.size(); i++)
+        {
+            Placeholder kind = Placeholder::None;
+            size_t length = 0;
+            if (word.compare(i, 2, "{}") == 0)
+            {
+                kind = Placeholder::Arg;
+                length = 2;
+            }
+            else if (word.compare(i, 3, "{.}") == 0)
+            {
+                kind = Placeholder::NoExt;
+                length = 3;
+            }
+            else if (word.compare(i, 3, "{/}") == 0)
+            {
+                kind = Placeholder::Basename;
+                length = 3;
+            }
+            else if (word.compare(i, 3, "{#}") == 0)
+            {
+                kind = Placeholder::JobNumber;
+                length = 3;
+            }
+
+            if (kind == Placeholder::None)
+            {
+                literal += word[i];
+                continue;
+            }
+
+            if (!literal.empty())
+            {
+                tw.segments.push_back({literal, Placeholder::None});
+                literal.clear();
+            }
+            tw.segments.push_back({"", kind});
+            has_placeholder = true;
+            i += length - 1;
+        }
+        if (!literal.empty() || tw.segments.empty())
+        {
+            tw.segments.push_back({literal, Placeholder::None});
+        }
+        compiled.push_back(tw);
+    }
+
+    // Like GNU parallel, the argument goes last when the template does not place it
+    if (!has_placeholder)
+    {
+        TemplateWord tw;
+        tw.segments.push_back({"", Placeholder::Arg});
+        compiled.push_back(tw);
+    }
+    return compiled;
+}
+
+static vector<string> expand_template(const vector<TemplateWord> &compiled, const string &arg, size_t job_number)
+{
+    vector<string> argv;
+    argv.reserve(compiled.size());
+    for (const TemplateWord &word : compiled)
+    {
+        string out;
+        for (const TemplateSegment &segment : word.segments)
+        {
+            switch (segment.kind)
+            {
+            case Placeholder::None:
+                out += segment.text;
+                break;
+            case Placeholder::Arg:
+                out += arg;
+                break;
+            case Placeholder::NoExt:
+            {
+                size_t slash = arg.find_last_of('/');
+                size_t dot = arg.find_last_of('.');
+                out += (dot != string::npos && (slash == string::npos || dot > slash)) ? arg.substr(0, dot) : arg;
+                break;
+            }
+            case Placeholder::Basename:
+            {
+                size_t slash = arg.find_last_of('/');
+                out += slash == string::npos ? arg : arg.substr(slash + 1);
+                break;
+            }
+            case Placeholder::JobNumber:
+                out += to_string(job_number);
+                break;
+            }
+        }
+        argv.push_back(out);
+    }
+    return argv;
+}
+
+static void write_all(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t n = write(fd, data, length);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return;
+        }
+        data += n;
+        length -= n;
+    }
+}
+
+// Line-buffered mode: hand over every complete line as soon as it arrives
+static void flush_lines(string &buffer, int fd)
+{
+    size_t last_newline = buffer.find_last_of('\n');
+    if (last_newline == string::npos)
+    {
+        return;
+    }
+    write_all(fd, buffer.data(), last_newline + 1);
+    buffer.erase(0, last_newline + 1);
+}
+
+static bool spawn_job(Slot &slot, const vector<string> &argv, bool stdin_from_args)
+{
+    int out_pipe[2], err_pipe[2];
+    if (pipe2(out_pipe, O_CLOEXEC) == -1)
+    {
+        perror("parallel: pipe");
+        return false;
+    }
+    if (pipe2(err_pipe, O_CLOEXEC) == -1)
+    {
+        perror("parallel: pipe");
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("parallel: fork");
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        close(err_pipe[0]);
+        close(err_pipe[1]);
+        return false;
+    }
+
+    if (pid == 0)
+    {
+        // Jobs stay in the shell's process group so Ctrl+C reaches all of them
+        setup_child_process(getpgrp(), false);
+
+        dup2(out_pipe[1], STDOUT_FILENO);
+        dup2(err_pipe[1], STDERR_FILENO);
+        if (stdin_from_args)
+        {
+            int devnull = open("/dev/null", O_RDONLY);
+            if (devnull != -1)
+            {
+                dup2(devnull, STDIN_FILENO);
+                close(devnull);
+            }
+        }
+
+        vector<char *> exec_args;
+        for (const string &word : argv)
+        {
+            exec_args.push_back(const_cast<char *>(word.c_str()));
+        }
+        exec_args.push_back(nullptr);
+
+        execvpe(exec_args[0], exec_args.data(), exported_environ());
+        if (errno == ENOENT)
+        {
+            cerr << exec_args[0] << ": command not found" << endl;
+        }
+        else
+        {
+            perror("execvp");
+        }
+        _exit(127);
+    }
+
+    close(out_pipe[1]);
+    close(err_pipe[1]);
+
+    slot = Slot();
+    slot.busy = true;
+    slot.pid = pid;
+    slot.out_fd = out_pipe[0];
+    slot.err_fd = err_pipe[0];
+    slot.pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    return true;
+}
+
+static void read_into(int &fd, string &buffer)
+{
+    char chunk[65536];
+    ssize_t n = read(fd, chunk, sizeof(chunk));
+    if (n > 0)
+    {
+        buffer.append(chunk, n);
+    }
+    else if (n == 0 || errno != EINTR)
+    {
+        close(fd);
+        fd = -1;
+    }
+}
+
+static void collect_exit(Slot &slot)
+{
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+
+    int result;
+    if (slot.pidfd != -1)
+    {
+        result = waitid((idtype_t)P_PIDFD, slot.pidfd, &info, WEXITED | WNOHANG);
+    }
+    else
+    {
+        result = waitid(P_PID, slot.pid, &info, WEXITED | WNOHANG);
+    }
+
+    if (result == -1 || info.si_pid == 0)
+    {
+        return;
+    }
+
+    slot.exited = true;
+    slot.status = (info.si_code == CLD_EXITED) ? info.si_status : 128 + info.si_status;
+    if (slot.pidfd != -1)
+    {
+        close(slot.pidfd);
+        slot.pidfd = -1;
+    }
+}
+
+// parallel [-j N] [--line-buffer] command [args with {} {.} {/} {#}] [::: arg...]
+// Exit status of a usage error, apart from the 0-101 failed-job counts as in GNU parallel
+static const int PARALLEL_USAGE_ERROR = 255;
+static const long PARALLEL_MAX_JOBS = 4096; // each slot holds up to three descriptors
+
+// -j value: a whole number of slots, 0 for anything else
+static long parse_job_slots(const char *text)
+{
+    char *end;
+    errno = 0;
+    long value = strtol(text, &end, 10);
+    return end == text || *end != '\0' || errno == ERANGE ? 0 : value;
+}
+
+int builtin_parallel(BuiltinArgs args)
+{
+    long max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    bool line_buffer = false;
+    size_t i = 1;
+
+    for (; i < args.size() && args[i] != nullptr && args[i][0] == '-'; i++)
+    {
+        string opt = args[i];
+        if (opt == "-j" && i + 1 < args.size() && args[i + 1] != nullptr)
+        {
+            max_jobs = parse_job_slots(args[++i]);
+        }
+        else if (opt.compare(0, 2, "-j") == 0 && opt.size() > 2)
+        {
+            max_jobs = parse_job_slots(opt.c_str() + 2);
+        }
+        else if (opt == "--line-buffer" || opt == "--lb")
+        {
+            line_buffer = true;
+        }
+        else
+        {
+            cerr << "parallel: invalid option " << opt << "\n";
+            return PARALLEL_USAGE_ERROR;
+        }
+    }
+
+    if (max_jobs <= 0 || max_jobs > PARALLEL_MAX_JOBS)
+    {
+        cerr << "parallel: -j needs a number of job slots from 1 to " << PARALLEL_MAX_JOBS << "\n";
+        return PARALLEL_USAGE_ERROR;
+    }
+
+    vector<string> template_words;
+    vector<string> arg_list;
+    bool has_arg_list = false;
+    for (; i < args.size() && args[i] != nullptr; i++)
+    {
+        if (strcmp(args[i], ":::") == 0)
+        {
+            has_arg_list = true;
+            continue;
+        }
+        (has_arg_list ? arg_list : template_words).push_back(args[i]);
+    }
+
+    if (template_words.empty())
+    {
+        cerr << "parallel: usage: parallel [-j N] [--line-buffer] command [{}] [::: args...]\n";
+        return PARALLEL_USAGE_ERROR;
+    }
+
+    vector<TemplateWord> compiled = compile_template(template_words);
+    ArgSource source(has_arg_list ? &arg_list : nullptr);
+
+    cout.flush();
+
+    // No more slots than a ::: list has arguments
+    if (has_arg_list)
+    {
+        max_jobs = min(max_jobs, max((long)arg_list.size(), 1L));
+    }
+    vector<Slot> slots(max_jobs);
+    size_t running = 0;
+    size_t launched = 0;
+    size_t failed = 0;
+    bool inputs_left = true;
+    bool interrupted = false;
+
+    vector<struct pollfd> fds;
+    vector<size_t> fd_slot;
+
+    while (true)
+    {
+        // Refill free slots
+        for (size_t s = 0; s < slots.size() && inputs_left && !interrupted && running < slots.size(); s++)
+        {
+            if (slots[s].busy)
+            {
+                continue;
+            }
+
+            string arg;
+            if (!source.next(arg))
+            {
+                inputs_left = false;
+                break;
+            }
+
+            launched++;
+            if (spawn_job(slots[s], expand_template(compiled, arg, launched), !has_arg_list))
+            {
+                running++;
+            }
+            else
+            {
+                failed++;
+            }
+        }
+
+        if (running == 0)
+        {
+            break;
+        }
+
+        fds.clear();
+        fd_slot.clear();
+        for (size_t s = 0; s < slots.size(); s++)
+        {
+            Slot &slot = slots[s];
+            if (!slot.busy)
+            {
+                continue;
+            }
+            if (slot.out_fd != -1)
+            {
+                fds.push_back({slot.out_fd, POLLIN, 0});
+                fd_slot.push_back(s);
+            }
+            if (slot.err_fd != -1)
+            {
+                fds.push_back({slot.err_fd, POLLIN, 0});
+                fd_slot.push_back(s);
+            }
+            if (!slot.exited && slot.pidfd != -1)
+            {
+                fds.push_back({slot.pidfd, POLLIN, 0});
+                fd_slot.push_back(s);
+            }
+        }
+
+        // Without pidfds, exits are polled after the pipes close
+        int ready = poll(fds.data(), fds.size(), fds.empty() ? 10 : -1);
+        if (ready == -1 && errno != EINTR)
+        {
+            perror("parallel: poll");
+            break;
+        }
+
+        for (size_t f = 0; ready > 0 && f < fds.size(); f++)
+        {
+            if (!(fds[f].revents & (POLLIN | POLLHUP | POLLERR)))
+            {
+                continue;
+            }
+
+            Slot &slot = slots[fd_slot[f]];
+            if (fds[f].fd == slot.out_fd)
+            {
+                read_into(slot.out_fd, slot.out);
+                if (line_buffer)
+                {
+                    flush_lines(slot.out, STDOUT_FILENO);
+                }
+            }
+            else if (fds[f].fd == slot.err_fd)
+            {
+                read_into(slot.err_fd, slot.err);
+                if (line_buffer)
+                {
+                    flush_lines(slot.err, STDERR_FILENO);
+                }
+            }
+            else if (fds[f].fd == slot.pidfd)
+            {
+                collect_exit(slot);
+            }
+        }
+
+        // Finished jobs print their output as one group and free the slot
+        for (Slot &slot : slots)
+        {
+            if (!slot.busy || slot.out_fd != -1 || slot.err_fd != -1)
+            {
+                continue;
+            }
+            if (!slot.exited)
+            {
+                collect_exit(slot);
+                if (!slot.exited)
+                {
+                    continue;
+                }
+            }
+
+            write_all(STDOUT_FILENO, slot.out.data(), slot.out.size());
+            write_all(STDERR_FILENO, slot.err.data(), slot.err.size());
+
+            if (slot.status != 0)
+            {
+                failed++;
+                if (slot.status == 128 + SIGINT)
+                {
+                    // Ctrl+C: let running jobs finish, start no new ones
+                    interrupted = true;
+                }
+            }
+
+            slot = Slot();
+            running--;
+        }
+    }
+
+    if (interrupted)
+    {
+        cerr << "parallel: interrupted, " << launched << " jobs started\n";
+    }
+
+    // GNU parallel convention: number of failed jobs, capped at 101
+    return (int)min<size_t>(failed, 101);
+}
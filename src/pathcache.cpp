@@ -0,0 +1,175 @@
+#include "pathcache.h"
+#include "variables.h"
+#include <iostream>
+#include <iomanip>
+#include <deque>
+#include <unordered_map>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+// A command name and the program PATH resolved it to, as bash's hash table keeps them
+struct CommandEntry
+{
+    string name;
+    string program;          // empty when not found or not searched yet
+    unsigned generation = 0; // path_generation the program was found in
+    unsigned hits = 0;
+};
+
+// A deque, so handles and the program strings handed out stay put as names are added
+static deque<CommandEntry> entries;
+static unordered_map<string, CommandHandle> handles;
+static unsigned path_generation = 1; // bumped by every PATH change and hash -r
+static CommandHandle selected = NO_COMMAND;
+
+// Entry of name, added on first use; a name keeps its handle for the shell's lifetime
+CommandHandle command_handle(const string &name)
+{
+    auto it = handles.find(name);
+    if (it != handles.end())
+    {
+        return it->second;
+    }
+    CommandHandle handle = (CommandHandle)entries.size();
+    entries.emplace_back();
+    entries.back().name = name;
+    handles.emplace(name, handle);
+    return handle;
+}
+
+// The handle the next command_program call uses instead of hashing its name; a
+// compiled script command selects its own, returns the previous one
+CommandHandle command_select(CommandHandle handle)
+{
+    CommandHandle previous = selected;
+    selected = handle;
+    return previous;
+}
+
+// Searches PATH the way execvpe does; a cwd-relative directory reached before a match
+// gives up, since its answer changes with cd, and execvpe searches instead
+static string search_path(const string &name)
+{
+    exported_environ(); // environ holds the PATH the exec will see
+    const char *path = getenv("PATH");
+    string dirs = path ? path : "/bin:/usr/bin";
+
+    size_t start = 0;
+    while (true)
+    {
+        size_t end = dirs.find(':', start);
+        string dir = dirs.substr(start, end == string::npos ? string::npos : end - start);
+        if (dir.empty() || dir[0] != '/')
+        {
+            return "";
+        }
+
+        string candidate = dir + "/" + name;
+        struct stat info;
+        if (stat(candidate.c_str(), &info) == 0 && S_ISREG(info.st_mode) && access(candidate.c_str(), X_OK) == 0)
+        {
+            return candidate;
+        }
+        if (end == string::npos)
+        {
+            return "";
+        }
+        start = end + 1;
+    }
+}
+
+static const char *resolve(CommandEntry &entry)
+{
+    if (entry.generation != path_generation || entry.program.empty())
+    {
+        // Misses are not remembered, a program installed later is found on the next run
+        entry.program = search_path(entry.name);
+        entry.generation = path_generation;
+        entry.hits = 0;
+        if (entry.program.empty())
+        {
+            return nullptr;
+        }
+    }
+    entry.hits++;
+    return entry.program.c_str();
+}
+
+// Program to execv for name, nullptr when execvpe should search (a path, an unknown
+// command or a relative PATH entry); PATH is searched once per name until it changes
+const char *command_program(const char *name)
+{
+    if (name == nullptr || name[0] == '\0' || strchr(name, '/'))
+    {
+        return nullptr;
+    }
+    CommandHandle handle = selected;
+    if (handle == NO_COMMAND || entries[handle].name != name)
+    {
+        handle = command_handle(name);
+    }
+    return resolve(entries[handle]);
+}
+
+// Called when PATH is set or unset; every name is searched again on its next use
+void path_changed()
+{
+    path_generation++;
+}
+
+// hash lists the remembered programs, hash -r forgets them and hash name... looks the
+// names up now
+int builtin_hash(BuiltinArgs args)
+{
+    if (args.size() == 1)
+    {
+        bool empty = true;
+        for (const CommandEntry &entry : entries)
+        {
+            if (entry.generation != path_generation || entry.program.empty())
+            {
+                continue;
+            }
+            if (empty)
+            {
+                cout << "hits\tcommand" << endl;
+                empty = false;
+            }
+            cout << setw(4) << entry.hits << "\t" << entry.program << endl;
+        }
+        if (empty)
+        {
+            cout << "hash: hash table empty" << endl;
+        }
+        return 0;
+    }
+
+    if (strcmp(args[1], "-r") == 0)
+    {
+        path_changed();
+        return 0;
+    }
+
+    int status = 0;
+    for (size_t i = 1; i < args.size(); i++)
+    {
+        if (is_builtin_command(args[i]) || strchr(args[i], '/'))
+        {
+            continue;
+        }
+        CommandEntry &entry = entries[command_handle(args[i])];
+        if (resolve(entry) == nullptr)
+        {
+            cerr << "hash: " << args[i] << ": not found" << endl;
+            status = 1;
+            continue;
+        }
+        entry.hits = 0;
+    }
+    return status;
+}
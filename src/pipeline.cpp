@@ -1,46 +1,52 @@
 #include "pipeline.h"
 #include "redirection.h"
+#include "procsubst.h"
 #include "builtins.h"
 #include "shell.h"
+#include "jobs.h"
+#include "timing.h"
+#include "trace.h"
+#include "variables.h"
+#include "batch.h"
+#include "textutils.h"
+#include "du.h"
+#include "registry.h"
+#include "loadable.h"
+#include "pathcache.h"
 #include <iostream>
 #include <vector>
 #include <string>
+#include <memory>
+#include <thread>
 #include <cstring>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <signal.h>
 #include <errno.h>
+#include <fcntl.h>
 
 using namespace std;
 
 extern pid_t foreground_pid;
 
-// Check if command is a builtin
-bool is_builtin_command(const string &cmd)
-{
-    return (cmd == "cd" || cmd == "pwd" || cmd == "echo" || cmd == "ls" ||
-            cmd == "exit" || cmd == "pinfo" || cmd == "search" || cmd == "history");
-}
-
 // Parses pipeline from tokens
 Pipeline parse_pipeline(vector<char *> &args)
 {
+    TraceSpan span("parse_pipeline");
     Pipeline pipeline;
     Command current_command;
 
     for (size_t i = 0; i < args.size() && args[i] != nullptr; i++)
     {
-        string arg = args[i];
-
-        if (arg == "|")
+        // A quoted "|" is an argument, only the tokenizer's operator word splits commands
+        if (is_operator_word(args[i]) && strcmp(args[i], "|") == 0)
         {
             // End of current command, starting new one
             if (!current_command.args.empty())
             {
                 current_command.redirection = parse_redirection(current_command.args);
-                current_command.has_redirection = (current_command.redirection.has_input_redirect ||
-                                                   current_command.redirection.has_output_redirect);
+                current_command.has_redirection = !current_command.redirection.steps.empty();
 
                 if (current_command.has_redirection && !current_command.redirection.clean_args.empty())
                 {
@@ -69,8 +75,7 @@ Pipeline parse_pipeline(vector<char *> &args)
     if (!current_command.args.empty())
     {
         current_command.redirection = parse_redirection(current_command.args);
-        current_command.has_redirection = (current_command.redirection.has_input_redirect ||
-                                           current_command.redirection.has_output_redirect);
+        current_command.has_redirection = !current_command.redirection.steps.empty();
 
         if (current_command.has_redirection && !current_command.redirection.clean_args.empty())
         {
@@ -89,7 +94,7 @@ Pipeline parse_pipeline(vector<char *> &args)
 }
 
 // Executes a single command in the pipeline
-pid_t execute_command_in_pipeline(const Command &cmd, int input_fd, int output_fd)
+pid_t execute_command_in_pipeline(const Command &cmd, int input_fd, int output_fd, pid_t pgid, bool background, int stage)
 {
     if (cmd.args.empty() || cmd.args[0] == nullptr)
     {
@@ -99,16 +104,18 @@ pid_t execute_command_in_pipeline(const Command &cmd, int input_fd, int output_f
     string command_name = cmd.args[0];
 
     // Handling builtin commands differently
-    if (is_builtin_command(command_name))
+    if (is_builtin_command(command_name) || is_text_builtin(cmd.args) || du_builtin_supported(cmd.args))
     {
         // For builtins in a pipeline, we need to fork to avoid affecting the shell
+        TraceSpan fork_span("fork", stage);
+        fork_span.command(command_name);
         pid_t pid = fork();
         if (pid == 0)
         {
-            // Child process
-            signal(SIGINT, SIG_DFL);
-            signal(SIGTSTP, SIG_DFL);
-            signal(SIGCHLD, SIG_DFL);
+            // Child process - joins the pipeline's process group
+            setup_child_process(pgid, !background);
+            TraceSpan exec_span("exec", stage);
+            exec_span.command(command_name);
 
             // Setup pipe redirection
             if (input_fd != STDIN_FILENO)
@@ -128,27 +135,37 @@ pid_t execute_command_in_pipeline(const Command &cmd, int input_fd, int output_f
                 exit(EXIT_FAILURE);
             }
 
+            // Job control needs the shell's own children and terminal, not a stage's
+            const BuiltinDescriptor *builtin = find_builtin(cmd.args[0]);
+            if (builtin && !(builtin->flags & BUILTIN_PIPELINE_SAFE))
+            {
+                cerr << command_name << ": no job control in a pipeline" << endl;
+                exit(EXIT_FAILURE);
+            }
+
             // Execute builtin
-            vector<char *> builtin_args = cmd.args;
-            handle_builtin(builtin_args);
-            exit(EXIT_SUCCESS);
+            exit(handle_builtin(cmd.args));
         }
         else if (pid < 0)
         {
             perror("fork");
         }
+        fork_span.child(pid);
         return pid;
     }
     else
     {
-        // External command
+        // External command, its program looked up in the shell so the cache keeps it
+        const char *program = is_assignment(cmd.args[0]) ? nullptr : command_program(cmd.args[0]);
+        TraceSpan fork_span("fork", stage);
+        fork_span.command(command_name);
         pid_t pid = fork();
         if (pid == 0)
         {
-            // Child process
-            signal(SIGINT, SIG_DFL);
-            signal(SIGTSTP, SIG_DFL);
-            signal(SIGCHLD, SIG_DFL);
+            // Child process - joins the pipeline's process group
+            setup_child_process(pgid, !background);
+            TraceSpan exec_span("exec", stage);
+            exec_span.command(command_name);
 
             // Setup pipe redirection
             if (input_fd != STDIN_FILENO)
@@ -163,17 +180,50 @@ pid_t execute_command_in_pipeline(const Command &cmd, int input_fd, int output_f
             }
 
             // Setup file redirection if present
+            procsubst_inherit();
             if (cmd.has_redirection && !setup_redirection(cmd.redirection))
             {
                 exit(EXIT_FAILURE);
             }
 
+            // NAME=value prefixes only reach this command's environment
+            char **argv = const_cast<char **>(cmd.args.data());
+            char **envp = exported_environ();
+            if (is_assignment(argv[0]))
+            {
+                argv = apply_prefix_assignments(argv);
+                envp = exported_environ();
+                if (argv[0] == nullptr)
+                {
+                    exit(EXIT_SUCCESS);
+                }
+            }
+
+            // Oversized argument lists are split here, the stage's stdio is already in place
+            if (batch_requested() && exceeds_arg_max(argv, envp))
+            {
+                exec_span.finish();
+                int result = execute_batched_stage(argv, envp, command_name + " ...");
+                trace_flush();
+                _exit(result);
+            }
+
             // Execute external command
-            if (execvp(cmd.args[0], cmd.args.data()) == -1)
+            exec_span.finish();
+            trace_flush();
+            if (program)
+            {
+                execve(program, argv, envp); // on failure execvpe searches and reports as usual
+            }
+            if (execvpe(argv[0], argv, envp) == -1)
             {
                 if (errno == ENOENT)
                 {
-                    cerr << cmd.args[0] << ": command not found" << endl;
+                    cerr << argv[0] << ": command not found" << endl;
+                }
+                else if (errno == E2BIG)
+                {
+                    cerr << argv[0] << ": argument list too long (see 'batched' and 'set -o auto-batch')" << endl;
                 }
                 else
                 {
@@ -186,10 +236,96 @@ pid_t execute_command_in_pipeline(const Command &cmd, int input_fd, int output_f
         {
             perror("fork");
         }
+        fork_span.child(pid);
         return pid;
     }
 }
 
+// A text tool or loaded builtin stage run on a thread inside the shell instead of a
+// forked process
+struct ThreadStage
+{
+    vector<string> words;
+    bool loaded = false; // enable -f builtin rather than a text tool
+    RedirectionInfo redirection;
+    int input_fd = STDIN_FILENO;
+    int output_fd = STDOUT_FILENO;
+    int status = 0;
+    string text;         // the stage as typed, for time
+    int timing_row = -1; // row held for the stage in the time report, -1 when time is off
+    StageTiming timing;  // measured by the thread itself
+};
+
+// Thread body: applies the stage's own redirections, runs the tool and closes its
+// pipe ends so the neighbouring stages see EOF / EPIPE as with a process
+static void run_thread_stage(ThreadStage &stage)
+{
+    if (stage.timing_row != -1)
+    {
+        timing_thread_start(stage.timing, stage.text);
+    }
+    int input_fd = stage.input_fd;
+    int output_fd = stage.output_fd;
+    bool ready = true;
+    thread fanout_pump;
+
+    if (stage.redirection.has_input_redirect)
+    {
+        input_fd = open(stage.redirection.input_file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (input_fd == -1)
+        {
+            perror(("shell: " + stage.redirection.input_file).c_str());
+            ready = false;
+        }
+    }
+    if (stage.redirection.has_output_redirect)
+    {
+        output_fd = open_output_targets(stage.redirection, fanout_pump);
+        ready = ready && output_fd != -1;
+    }
+
+    if (ready)
+    {
+        vector<char *> argv;
+        for (string &word : stage.words)
+        {
+            argv.push_back(&word[0]);
+        }
+        argv.push_back(nullptr);
+        stage.status = stage.loaded ? run_loaded_builtin(argv, input_fd, output_fd) : run_text_builtin(argv, input_fd, output_fd);
+    }
+    else
+    {
+        stage.status = 1;
+    }
+
+    // Opened files first, then the pipe ends handed over by execute_pipeline
+    if (input_fd != stage.input_fd && input_fd != -1)
+    {
+        close(input_fd);
+    }
+    if (output_fd != stage.output_fd && output_fd != -1)
+    {
+        close(output_fd);
+    }
+    if (stage.input_fd != STDIN_FILENO)
+    {
+        close(stage.input_fd);
+    }
+    if (stage.output_fd != STDOUT_FILENO)
+    {
+        close(stage.output_fd);
+    }
+    if (fanout_pump.joinable())
+    {
+        fanout_pump.join();
+    }
+    if (stage.timing_row != -1)
+    {
+        timing_thread_stop(stage.timing, stage.status);
+    }
+}
+
 // Executing entire pipeline
 void execute_pipeline(const Pipeline &pipeline)
 {
@@ -197,9 +333,18 @@ void execute_pipeline(const Pipeline &pipeline)
     {
         return;
     }
+    for (const Command &cmd : pipeline.commands)
+    {
+        if (cmd.redirection.failed)
+        {
+            return; // reported by parse_redirection, which set $?
+        }
+    }
 
-    // Single command - no pipes needed
-    if (pipeline.commands.size() == 1)
+    // Single command - no pipes needed; a builtin sent to the background is forked below
+    const vector<char *> &first_args = pipeline.commands[0].args;
+    bool background_builtin = pipeline.background && !first_args.empty() && find_builtin(first_args[0]);
+    if (pipeline.commands.size() == 1 && !background_builtin)
     {
         const Command &cmd = pipeline.commands[0];
 
@@ -213,69 +358,33 @@ void execute_pipeline(const Pipeline &pipeline)
         // Handling builtin commands
         if (is_builtin_command(command_name))
         {
-            // Save original stdin/stdout for built-ins
-            int saved_stdin = -1, saved_stdout = -1;
-            if (cmd.has_redirection)
+            // Builtins redirect in the shell, saving only the descriptors the plan replaces
+            SavedFds saved;
+            if (cmd.has_redirection && !setup_builtin_redirection(cmd.redirection, saved))
             {
-                saved_stdin = dup(STDIN_FILENO);
-                saved_stdout = dup(STDOUT_FILENO);
-
-                if (!setup_redirection(cmd.redirection))
-                {
-                    restore_stdio(saved_stdin, saved_stdout);
-                    return;
-                }
+                restore_redirection(saved);
+                set_last_status(1);
+                return;
             }
 
             // Executing builtin
-            vector<char *> builtin_args = cmd.args;
-            handle_builtin(builtin_args);
+            timing_builtin_begin(command_name);
+            int status = handle_builtin(cmd.args);
+            timing_builtin_end(status);
+            set_last_status(status);
 
-            // Restoring stdio
-            restore_stdio(saved_stdin, saved_stdout);
+            restore_redirection(saved);
             return;
         }
         else
         {
-            // External command - used existing execute_command logic
-            vector<char *> external_args = cmd.args;
-            if (cmd.has_redirection)
+            // External command, the redirection is already parsed
+            string command_text;
+            for (size_t i = 0; i < cmd.args.size() && cmd.args[i] != nullptr; i++)
             {
-                // Reconstructed args with redirection for execute_command
-                vector<char *> full_args;
-                for (auto arg : cmd.args)
-                {
-                    if (arg != nullptr)
-                    {
-                        full_args.push_back(arg);
-                    }
-                }
-
-                // Added redirection operators back
-                if (cmd.redirection.has_input_redirect)
-                {
-                    full_args.push_back(const_cast<char *>("<"));
-                    full_args.push_back(const_cast<char *>(cmd.redirection.input_file.c_str()));
-                }
-                if (cmd.redirection.has_output_redirect)
-                {
-                    if (cmd.redirection.output_append)
-                    {
-                        full_args.push_back(const_cast<char *>(">>"));
-                    }
-                    else
-                    {
-                        full_args.push_back(const_cast<char *>(">"));
-                    }
-                    full_args.push_back(const_cast<char *>(cmd.redirection.output_file.c_str()));
-                }
-
-                execute_command(full_args, pipeline.background);
-            }
-            else
-            {
-                execute_command(external_args, pipeline.background);
+                command_text += (i > 0 ? " " : "") + string(cmd.args[i]);
             }
+            execute_redirected_command(cmd.redirection, command_text, pipeline.background);
             return;
         }
     }
@@ -284,11 +393,14 @@ void execute_pipeline(const Pipeline &pipeline)
     vector<pid_t> pids;
     vector<int> pipes;
 
+    // Refresh the cached envp once here rather than in every child
+    exported_environ();
+
     // Create pipes
     for (size_t i = 0; i < pipeline.commands.size() - 1; i++)
     {
         int pipefd[2];
-        if (pipe(pipefd) == -1)
+        if (pipe2(pipefd, O_CLOEXEC) == -1) // stray ends must not leak into other stages
         {
             perror("pipe");
             return;
@@ -297,9 +409,14 @@ void execute_pipeline(const Pipeline &pipeline)
         pipes.push_back(pipefd[1]); // write end
     }
 
-    // Execute each command in the pipeline
+    // Execute each command in the pipeline, the first child leads the process group
+    pid_t pgid = 0;
+    string command_text;
+    vector<shared_ptr<ThreadStage>> thread_stages;
+    shared_ptr<ThreadStage> last_thread_stage;
     for (size_t i = 0; i < pipeline.commands.size(); i++)
     {
+        const Command &command = pipeline.commands[i];
         int input_fd = STDIN_FILENO;
         int output_fd = STDOUT_FILENO;
 
@@ -307,18 +424,61 @@ void execute_pipeline(const Pipeline &pipeline)
         if (i > 0)
         {
             input_fd = pipes[(i - 1) * 2]; // read end of previous pipe
+            pipes[(i - 1) * 2] = -1;
         }
 
         // Setup output
         if (i < pipeline.commands.size() - 1)
         {
             output_fd = pipes[i * 2 + 1]; // write end of current pipe
+            pipes[i * 2 + 1] = -1;
         }
 
-        pid_t pid = execute_command_in_pipeline(pipeline.commands[i], input_fd, output_fd);
+        string stage_text;
+        for (size_t j = 0; j < command.args.size() && command.args[j] != nullptr; j++)
+        {
+            if (j > 0)
+                stage_text += " ";
+            stage_text += command.args[j];
+        }
+        command_text += (i > 0 ? " | " : "") + stage_text;
+
+        // Text tools and loaded builtins of a foreground pipeline run on threads, except
+        // a first stage that would read the terminal
+        bool first_reads_stdin = i == 0 && !command.redirection.has_input_redirect;
+        bool reads_terminal = first_reads_stdin && text_builtin_reads_stdin(command.args);
+        const BuiltinDescriptor *builtin = command.args.empty() ? nullptr : find_builtin(command.args[0]);
+        bool loaded = builtin && (builtin->flags & BUILTIN_LOADED) && !(first_reads_stdin && isatty(STDIN_FILENO));
+        if (!pipeline.background && command.redirection.stdio_only && (loaded || (!reads_terminal && is_text_builtin(command.args))))
+        {
+            auto stage = make_shared<ThreadStage>();
+            stage->loaded = loaded;
+            for (size_t j = 0; j < command.args.size() && command.args[j] != nullptr; j++)
+            {
+                stage->words.push_back(command.args[j]);
+            }
+            stage->redirection = command.redirection;
+            stage->redirection.clean_args.clear();
+            stage->input_fd = input_fd; // the thread owns and closes these ends
+            stage->output_fd = output_fd;
+            thread_stages.push_back(stage);
+            last_thread_stage = i == pipeline.commands.size() - 1 ? stage : nullptr;
+            stage->text = stage_text;
+            stage->timing_row = timing_reserve_stage(stage_text); // in pipeline order
+            continue;
+        }
+        last_thread_stage = nullptr;
+
+        pid_t pid = execute_command_in_pipeline(command, input_fd, output_fd, pgid, pipeline.background, (int)i);
         if (pid > 0)
         {
+            if (pgid == 0)
+            {
+                pgid = pid;
+            }
+            place_in_job_group(pid, pgid);
             pids.push_back(pid);
+            timing_stage_spawned(pid, stage_text);
         }
 
         // Close pipe ends in parent
@@ -335,33 +495,74 @@ void execute_pipeline(const Pipeline &pipeline)
     // Close all remaining pipe descriptors
     for (int fd : pipes)
     {
-        close(fd);
+        if (fd != -1)
+        {
+            close(fd);
+        }
+    }
+
+    // Threads start once every process is forked so no child inherits what they open
+    vector<thread> threads;
+    for (auto &stage : thread_stages)
+    {
+        threads.emplace_back([stage]
+                             { run_thread_stage(*stage); });
+    }
+
+    if (pids.empty() && threads.empty())
+    {
+        return;
     }
 
     // Wait for all processes
     if (!pipeline.background)
     {
-        if (!pids.empty())
+        int status = pids.empty() ? 0 : wait_for_foreground(pgid, pids, command_text);
+        if (WIFSTOPPED(status))
         {
-            foreground_pid = pids.back(); // Last process in pipeline is foreground
+            // The suspended job's processes stop feeding the threads, they finish when it resumes
+            for (thread &worker : threads)
+            {
+                worker.detach();
+            }
+            set_last_status_from_wait(status);
+            return;
         }
 
-        for (pid_t pid : pids)
+        for (thread &worker : threads)
+        {
+            worker.join();
+        }
+        for (auto &stage : thread_stages)
         {
-            int status;
-            if (waitpid(pid, &status, 0) == -1)
+            if (stage->timing_row != -1)
             {
-                if (errno != EINTR)
-                {
-                    perror("waitpid");
-                }
+                timing_fill_stage(stage->timing_row, stage->timing);
             }
         }
 
-        foreground_pid = -1;
+        if (last_thread_stage)
+        {
+            set_last_status(last_thread_stage->status);
+        }
+        else
+        {
+            set_last_status_from_wait(status);
+        }
     }
     else
     {
-        cout << "Background pipeline started" << endl;
+        bool quiet = background_launch_quiet();
+        int job_id = add_job(pgid, pids, command_text, JobState::Running);
+        if (!quiet && pipeline.commands.size() == 1)
+        {
+            cout << "[" << job_id << "] Background process started with PID: " << pids.back() << endl;
+        }
+        else if (!quiet)
+        {
+            cout << "[" << job_id << "] Background pipeline started" << endl;
+        }
+        set_last_background_pid(pids.back());
+        set_last_status(0);
     }
-}
\ No newline at end of file
+}
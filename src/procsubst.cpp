@@ -0,0 +1,157 @@
+#include "procsubst.h"
+#include "shell.h"
+#include "jobs.h"
+#include "trace.h"
+#include "variables.h"
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+static const int PROCSUBST_FD_BASE = 10; // clear of the descriptors scripts redirect
+
+// <(cmd) and >(cmd) of the current command: the shell keeps its end of each pipe open
+// close-on-exec, so only the consumer, which clears the flag after fork, inherits it
+struct ProcessSubstitution
+{
+    pid_t pid;
+    int fd;
+    bool output; // >(cmd)
+};
+
+static vector<ProcessSubstitution> substitutions;
+
+// Producer side, runs the command with the pipe as stdout (<) or stdin (>) and exits
+static void run_producer(const string &command, int pipe_end, bool output)
+{
+    // Its own process group, so the shell can interrupt it together with its children,
+    // but not a job: it never takes the terminal and its commands stay in its group
+    setpgid(0, 0);
+    job_control_enabled = false;
+    setup_child_process(0, false);
+
+    for (const ProcessSubstitution &other : substitutions)
+    {
+        close(other.fd);
+    }
+    substitutions.clear();
+
+    int target = output ? STDIN_FILENO : STDOUT_FILENO;
+    dup2(pipe_end, target);
+    close(pipe_end);
+
+    vector<char> buffer(command.begin(), command.end());
+    buffer.push_back('\0');
+    parse_semicolon_commands(buffer.data());
+
+    cout.flush();
+    trace_flush();
+    _exit(last_status());
+}
+
+// Starts command on a pipe and returns the /dev/fd path the consumer opens, empty on error.
+// output is true for >(cmd), whose command reads what the consumer writes
+string procsubst_start(const string &command, bool output)
+{
+    TraceSpan span("procsubst");
+    span.command(command);
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1)
+    {
+        perror("shell: pipe");
+        return "";
+    }
+    int shell_end = output ? fds[1] : fds[0];
+    int producer_end = output ? fds[0] : fds[1];
+
+    // Kept above the descriptors a redirection like 3< could replace
+    int high_fd = fcntl(shell_end, F_DUPFD_CLOEXEC, PROCSUBST_FD_BASE);
+    if (high_fd != -1)
+    {
+        close(shell_end);
+        shell_end = high_fd;
+    }
+
+    cout.flush();
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("fork");
+        close(shell_end);
+        close(producer_end);
+        return "";
+    }
+    if (pid == 0)
+    {
+        close(shell_end);
+        run_producer(command, producer_end, output);
+    }
+    span.child(pid);
+    setpgid(pid, pid);
+
+    close(producer_end);
+    substitutions.push_back({pid, shell_end, output});
+    return "/dev/fd/" + to_string(shell_end);
+}
+
+// Called in a forked consumer before exec so its /dev/fd paths stay valid
+void procsubst_inherit()
+{
+    for (const ProcessSubstitution &substitution : substitutions)
+    {
+        fcntl(substitution.fd, F_SETFD, 0);
+    }
+}
+
+// The same for a consumer started by posix_spawn: dup2 of a descriptor onto itself clears
+// close-on-exec
+bool procsubst_spawn_actions(posix_spawn_file_actions_t *actions)
+{
+    for (const ProcessSubstitution &substitution : substitutions)
+    {
+        if (posix_spawn_file_actions_adddup2(actions, substitution.fd, substitution.fd) != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Once the consumer has run, closes the shell's ends, so >(cmd) sees EOF and <(cmd) gets
+// EPIPE if it writes again. A foreground >(cmd) is waited for, as its output belongs to
+// the command; the others, which may never finish on their own, are left to reap_children.
+// Ctrl+C does not reach the producers' groups, so an interrupted consumer, or Ctrl+C during
+// the wait, is passed on to them
+void procsubst_finish(bool background)
+{
+    if (substitutions.empty())
+    {
+        return;
+    }
+
+    bool interrupted = !background && last_status() == 128 + SIGINT;
+    for (const ProcessSubstitution &substitution : substitutions)
+    {
+        close(substitution.fd);
+        if (interrupted)
+        {
+            killpg(substitution.pid, SIGINT);
+        }
+    }
+    for (const ProcessSubstitution &substitution : substitutions)
+    {
+        // ECHILD: already reaped while waiting for the consumer
+        while (!background && substitution.output && waitpid(substitution.pid, nullptr, 0) == -1 && errno == EINTR)
+        {
+            killpg(substitution.pid, SIGINT);
+        }
+    }
+    substitutions.clear();
+}
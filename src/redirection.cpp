@@ -1,15 +1,229 @@
 #include "redirection.h"
+#include "trace.h"
+#include "heredoc.h"
+#include "linereader.h"
+#include "variables.h"
 #include <iostream>
 #include <vector>
 #include <string>
 #include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <algorithm>
+#include <set>
+#include <string_view>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
 
 using namespace std;
 
-// Parse command arguments and extract redirection information
+static const int FANOUT_PIPE_SIZE = 1 << 20;
+static const size_t FANOUT_COPY_BUFFER = 64 * 1024;
+
+static const int SAVED_FD_BASE = 10; // builtins keep the shell's own descriptors from here up
+static const long MAX_REDIRECT_FD = 65535;
+
+// One stored copy of each operator spelling the tokenizer found unquoted. A quoted word
+// with the same text is another pointer, so it is never taken for an operator
+static set<string, less<>> operator_words;
+
+char *operator_word(const char *text, size_t length)
+{
+    auto it = operator_words.find(string_view(text, length));
+    if (it == operator_words.end())
+    {
+        it = operator_words.emplace(text, length).first;
+    }
+    return const_cast<char *>(it->c_str());
+}
+
+bool is_operator_word(const char *word)
+{
+    auto it = operator_words.find(string_view(word));
+    return it != operator_words.end() && it->c_str() == word;
+}
+
+// Splits an operator word such as 2>, >>, <&, 3<> or &> into the descriptor it applies to
+// and the operator; false for ordinary words, quoted ones included
+static bool split_operator(const char *word, int &fd, const char *&op)
+{
+    if (!is_operator_word(word))
+    {
+        return false;
+    }
+    static const char *const operators[] = {"<<<", "<<-", "<<", "<>", "<&", "<", ">>", ">&", ">", "&>>", "&>"};
+    const char *p = word;
+    long number = -1;
+    while (*p >= '0' && *p <= '9')
+    {
+        number = (number == -1 ? 0 : number * 10) + (*p++ - '0');
+        if (number > MAX_REDIRECT_FD)
+        {
+            return false;
+        }
+    }
+
+    for (const char *candidate : operators)
+    {
+        if (strcmp(p, candidate) == 0)
+        {
+            if (candidate[0] == '&' && number != -1)
+            {
+                return false;
+            }
+            op = candidate;
+            fd = number != -1 ? (int)number : (candidate[0] == '<' ? 0 : 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool is_redirection_word(const char *word)
+{
+    int fd;
+    const char *op;
+    return split_operator(word, fd, op);
+}
+
+static bool is_descriptor(const char *word)
+{
+    size_t length = strlen(word);
+    return length > 0 && length <= 5 && strspn(word, "0123456789") == length;
+}
+
+// Last step that sets fd, -1 when there is none or a dup copied fd after it
+static int last_writer(const vector<FdStep> &steps, int fd)
+{
+    for (int i = (int)steps.size() - 1; i >= 0; i--)
+    {
+        if (steps[i].kind == FdStep::DUP && steps[i].source == fd)
+        {
+            return -1;
+        }
+        if (steps[i].fd == fd)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static FdStep make_step(FdStep::Kind kind, int fd)
+{
+    FdStep step;
+    step.kind = kind;
+    step.fd = fd;
+    return step;
+}
+
+static void add_open(vector<FdStep> &steps, int fd, const string &file, int flags)
+{
+    FdStep step = make_step(FdStep::OPEN, fd);
+    step.file = file;
+    step.flags = flags;
+    steps.push_back(step);
+}
+
+// A file output joins the one the same descriptor already has unless a dup copied it in
+// between, so cmd > a > b writes everything to both files
+static void add_output(vector<FdStep> &steps, int fd, const string &file, bool append)
+{
+    int previous = last_writer(steps, fd);
+    if (previous != -1 && steps[previous].kind == FdStep::OPEN && (steps[previous].flags & O_ACCMODE) == O_WRONLY)
+    {
+        FdStep &step = steps[previous];
+        step.targets.push_back({step.file, (step.flags & O_APPEND) != 0});
+        step.kind = FdStep::FANOUT;
+        step.file.clear();
+        step.flags = 0;
+    }
+    if (previous != -1 && steps[previous].kind == FdStep::FANOUT)
+    {
+        steps[previous].targets.push_back({file, append});
+        return;
+    }
+    add_open(steps, fd, file, O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC));
+}
+
+static void add_dup(vector<FdStep> &steps, int fd, int source)
+{
+    FdStep step = make_step(FdStep::DUP, fd);
+    step.source = source;
+    steps.push_back(step);
+}
+
+// Drops steps whose effect never shows: a dup2 or close of a descriptor that a later step
+// replaces before anything copies it, and n>&n. Opens stay for their side effects. Then
+// records what the plan touches
+static void compile_plan(RedirectionInfo &redir)
+{
+    vector<FdStep> &steps = redir.steps;
+    vector<FdStep> kept;
+    for (size_t i = 0; i < steps.size(); i++)
+    {
+        const FdStep &step = steps[i];
+        bool removable = step.kind == FdStep::DUP || step.kind == FdStep::CLOSE;
+        bool dead = step.kind == FdStep::DUP && step.source == step.fd;
+        for (size_t j = i + 1; j < steps.size() && removable && !dead; j++)
+        {
+            if (steps[j].kind == FdStep::DUP && steps[j].source == step.fd)
+            {
+                break;
+            }
+            dead = steps[j].fd == step.fd;
+        }
+        if (!dead)
+        {
+            kept.push_back(step);
+        }
+    }
+    steps.swap(kept);
+
+    for (const FdStep &step : steps)
+    {
+        if (find(redir.touched.begin(), redir.touched.end(), step.fd) == redir.touched.end())
+        {
+            redir.touched.push_back(step.fd);
+        }
+        redir.has_input_redirect = redir.has_input_redirect || step.fd == 0;
+        redir.has_output_redirect = redir.has_output_redirect || step.fd == 1;
+
+        // Threaded text stages take plain files on stdin and stdout only
+        if (step.kind == FdStep::OPEN && step.fd == 0 && step.flags == O_RDONLY)
+        {
+            redir.input_file = step.file;
+        }
+        else if (step.kind == FdStep::OPEN && step.fd == 1 && (step.flags & O_ACCMODE) == O_WRONLY)
+        {
+            redir.outputs = {{step.file, (step.flags & O_APPEND) != 0}};
+        }
+        else if (step.kind == FdStep::FANOUT && step.fd == 1)
+        {
+            redir.outputs = step.targets;
+        }
+        else
+        {
+            redir.stdio_only = false;
+        }
+    }
+}
+
+// An empty plan marked failed; $? is set now, so && and || see the error
+static RedirectionInfo failed_redirection(int status)
+{
+    RedirectionInfo redir;
+    redir.failed = true;
+    set_last_status(status);
+    return redir;
+}
+
+// Parse command arguments into the redirection plan; operators are [n]<, [n]>, [n]>>,
+// [n]<>, [n]<&m, [n]>&m, [n]>&-, &>, &>>, here-documents and here-strings
 RedirectionInfo parse_redirection(vector<char *> &args)
 {
     RedirectionInfo redir;
@@ -17,138 +231,490 @@ RedirectionInfo parse_redirection(vector<char *> &args)
 
     for (size_t i = 0; i < args.size() && args[i] != nullptr; i++)
     {
-        string arg = args[i];
+        int fd;
+        const char *op;
+        if (!split_operator(args[i], fd, op))
+        {
+            // Regular argument
+            clean_args.push_back(args[i]);
+            continue;
+        }
+
+        string token = op;
+        int body_fd = -1;
+        if (token == "<<" || token == "<<-")
+        {
+            // Here-document, the body was read into a memfd after the command line
+            body_fd = heredoc_next_body();
+        }
+        if (i + 1 >= args.size() || args[i + 1] == nullptr || ((token == "<<" || token == "<<-") && body_fd == -1))
+        {
+            cerr << "shell: syntax error near unexpected token '" << args[i] << "'" << endl;
+            return failed_redirection(2);
+        }
+        const char *word = args[++i];
+
+        if (token == "<")
+        {
+            add_open(redir.steps, fd, word, O_RDONLY);
+        }
+        else if (token == "<<" || token == "<<-")
+        {
+            add_open(redir.steps, fd, heredoc_path(body_fd), O_RDONLY);
+        }
+        else if (token == "<<<")
+        {
+            // Here-string
+            body_fd = heredoc_from_string(word);
+            if (body_fd == -1)
+            {
+                return failed_redirection(1);
+            }
+            add_open(redir.steps, fd, heredoc_path(body_fd), O_RDONLY);
+        }
+        else if (token == "<>")
+        {
+            add_open(redir.steps, fd, word, O_RDWR | O_CREAT);
+        }
+        else if (token == ">" || token == ">>")
+        {
+            add_output(redir.steps, fd, word, token == ">>");
+        }
+        else if (token == "&>" || token == "&>>")
+        {
+            add_output(redir.steps, 1, word, token == "&>>");
+            add_dup(redir.steps, 2, 1);
+        }
+        else if (strcmp(word, "-") == 0)
+        {
+            redir.steps.push_back(make_step(FdStep::CLOSE, fd));
+        }
+        else if (is_descriptor(word))
+        {
+            add_dup(redir.steps, fd, atoi(word));
+        }
+        else if (strcmp(args[i - 1], ">&") == 0)
+        {
+            // >&file is &>file
+            add_output(redir.steps, 1, word, false);
+            add_dup(redir.steps, 2, 1);
+        }
+        else
+        {
+            cerr << "shell: " << word << ": ambiguous redirect" << endl;
+            return failed_redirection(1);
+        }
+    }
+
+    compile_plan(redir);
+
+    // Add null terminator for execvp
+    clean_args.push_back(nullptr);
+    redir.clean_args = clean_args;
+
+    return redir;
+}
+
+struct FanoutTarget
+{
+    string file;
+    int fd;
+    bool copy = false;   // splice refused (O_APPEND files, some devices), read and write instead
+    bool failed = false; // write error reported, its share is discarded
+};
+
+static int open_output_file(const OutputTarget &target)
+{
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (target.append ? O_APPEND : O_TRUNC);
+    int fd = open(target.file.c_str(), flags, 0644);
+    if (fd == -1)
+    {
+        perror(("shell: " + target.file).c_str());
+    }
+    return fd;
+}
 
-        if (arg == "<")
+static bool open_fanout_targets(const vector<OutputTarget> &outputs, vector<FanoutTarget> &targets)
+{
+    for (const OutputTarget &output : outputs)
+    {
+        int fd = open_output_file(output);
+        if (fd == -1)
         {
-            // Input redirection
-            if (i + 1 < args.size() && args[i + 1] != nullptr)
+            for (FanoutTarget &target : targets)
             {
-                redir.has_input_redirect = true;
-                redir.input_file = args[i + 1];
-                i++; // Skip the filename
+                close(target.fd);
             }
-            else
+            targets.clear();
+            return false;
+        }
+        targets.push_back({output.file, fd});
+    }
+    return true;
+}
+
+static void fail_target(FanoutTarget &target)
+{
+    perror(("shell: " + target.file).c_str());
+    target.failed = true;
+}
+
+// Moves count bytes from the pipe from into target, with splice when the target allows it
+static void drain_to_target(int from, FanoutTarget &target, size_t count, vector<char> &buffer)
+{
+    while (count > 0)
+    {
+        ssize_t n;
+        if (!target.failed && !target.copy)
+        {
+            n = splice(from, nullptr, target.fd, nullptr, count, SPLICE_F_MOVE);
+            if (n == -1 && errno == EINVAL)
             {
-                cerr << "shell: syntax error near unexpected token '<'" << endl;
-                redir = RedirectionInfo(); // Reset to empty
-                return redir;
+                target.copy = true;
+                continue;
             }
         }
-        else if (arg == ">")
+        else
         {
-            // Output redirection (overwrite)
-            if (i + 1 < args.size() && args[i + 1] != nullptr)
+            n = read(from, buffer.data(), min(count, buffer.size()));
+            for (ssize_t done = 0; n > 0 && !target.failed && done < n;)
             {
-                redir.has_output_redirect = true;
-                redir.output_append = false;
-                redir.output_file = args[i + 1];
-                i++; // Skip the filename
+                ssize_t written = write(target.fd, buffer.data() + done, n - done);
+                if (written == -1 && errno != EINTR)
+                {
+                    fail_target(target);
+                }
+                done += max(written, (ssize_t)0);
             }
-            else
+        }
+
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            if (target.failed)
             {
-                cerr << "shell: syntax error near unexpected token '>'" << endl;
-                redir = RedirectionInfo(); // Reset to empty
-                return redir;
+                return;
             }
+            fail_target(target);
+            continue;
         }
-        else if (arg == ">>")
+        count -= n;
+    }
+}
+
+// Copies everything written to the pipe in into every target. Each round tee(2)s the
+// buffered bytes into a side pipe once per target but the last and splices them out,
+// then splices the original bytes into the last target, so data never enters user space
+static void pump_fanout(int in, vector<FanoutTarget> targets)
+{
+    TraceSpan span("fanout");
+    int side[2] = {-1, -1};
+    if (targets.size() > 1 && pipe2(side, O_CLOEXEC) == -1)
+    {
+        perror("shell: fan-out pipe"); // only the last target is written
+    }
+    if (side[1] != -1)
+    {
+        fcntl(side[1], F_SETPIPE_SZ, FANOUT_PIPE_SIZE);
+    }
+    size_t capacity = side[0] != -1 ? fcntl(side[0], F_GETPIPE_SZ) : FANOUT_PIPE_SIZE;
+    vector<char> buffer(FANOUT_COPY_BUFFER);
+
+    while (true)
+    {
+        struct pollfd ready = {in, POLLIN, 0};
+        if (poll(&ready, 1, -1) == -1)
         {
-            // Output redirection (append)
-            if (i + 1 < args.size() && args[i + 1] != nullptr)
+            if (errno == EINTR)
             {
-                redir.has_output_redirect = true;
-                redir.output_append = true;
-                redir.output_file = args[i + 1];
-                i++; // Skip the filename
+                continue;
             }
-            else
+            break;
+        }
+        int available = 0;
+        if (ioctl(in, FIONREAD, &available) == -1 || available <= 0)
+        {
+            if (ready.revents & (POLLHUP | POLLERR))
             {
-                cerr << "shell: syntax error near unexpected token '>>'" << endl;
-                redir = RedirectionInfo(); // Reset to empty
-                return redir;
+                break; // every writer is gone
             }
+            continue;
         }
-        else
+
+        size_t count = min((size_t)available, capacity);
+        size_t last = targets.size() - 1;
+        while (last > 0 && targets[last].failed)
         {
-            // Regular argument
-            clean_args.push_back(args[i]);
+            last--;
+        }
+        for (size_t i = 0; i < last && side[0] != -1; i++)
+        {
+            if (targets[i].failed)
+            {
+                continue;
+            }
+            ssize_t copied = tee(in, side[1], count, 0);
+            if (copied <= 0)
+            {
+                fail_target(targets[i]);
+                continue;
+            }
+            count = copied; // later copies take exactly what the first one saw
+            drain_to_target(side[0], targets[i], copied, buffer);
         }
+        drain_to_target(in, targets[last], count, buffer);
     }
 
-    // Add null terminator for execvp
-    clean_args.push_back(nullptr);
-    redir.clean_args = clean_args;
-
-    return redir;
+    close(in);
+    if (side[0] != -1)
+    {
+        close(side[0]);
+        close(side[1]);
+    }
+    for (FanoutTarget &target : targets)
+    {
+        close(target.fd);
+    }
 }
 
-// Setup file redirection before executing command
-bool setup_redirection(const RedirectionInfo &redir)
+// Write end of a pipe whose contents pump copies into every target
+static int start_fanout(vector<FanoutTarget> &targets, int &read_end)
 {
-    // Handle input redirection
-    if (redir.has_input_redirect)
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1)
     {
-        int input_fd = open(redir.input_file.c_str(), O_RDONLY);
-        if (input_fd == -1)
+        perror("pipe");
+        for (FanoutTarget &target : targets)
         {
-            perror(("shell: " + redir.input_file).c_str());
-            return false;
+            close(target.fd);
         }
+        return -1;
+    }
+    fcntl(fds[1], F_SETPIPE_SZ, FANOUT_PIPE_SIZE);
+    read_end = fds[0];
+    return fds[1];
+}
+
+// Descriptor that writes to the redirection's output: the file itself, or for several
+// targets a pipe drained by a pump thread the caller joins after closing the descriptor
+int open_output_targets(const RedirectionInfo &redir, thread &pump)
+{
+    if (redir.outputs.size() == 1)
+    {
+        return open_output_file(redir.outputs[0]);
+    }
 
-        if (dup2(input_fd, STDIN_FILENO) == -1)
+    vector<FanoutTarget> targets;
+    if (!open_fanout_targets(redir.outputs, targets))
+    {
+        return -1;
+    }
+    int read_end;
+    int write_end = start_fanout(targets, read_end);
+    if (write_end != -1)
+    {
+        pump = thread(pump_fanout, read_end, std::move(targets));
+    }
+    return write_end;
+}
+
+// Points step.fd at a fan-out pipe. In the shell a thread drains it; in a child about to
+// exec, the command moves to a forked process and this one, the process the shell waits
+// for, drains the pipe and then exits with the command's status
+static bool setup_fanout(const FdStep &step, vector<thread> *pumps)
+{
+    vector<FanoutTarget> targets;
+    if (!open_fanout_targets(step.targets, targets))
+    {
+        return false;
+    }
+    int read_end;
+    int write_end = start_fanout(targets, read_end);
+    if (write_end == -1)
+    {
+        return false;
+    }
+
+    if (pumps)
+    {
+        dup2(write_end, step.fd);
+        close(write_end);
+        pumps->emplace_back(pump_fanout, read_end, std::move(targets));
+        return true;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("fork");
+        return false;
+    }
+    if (pid == 0)
+    {
+        close(read_end);
+        for (FanoutTarget &target : targets)
         {
-            perror("dup2 input");
-            close(input_fd);
-            return false;
+            close(target.fd);
         }
-        close(input_fd);
+        dup2(write_end, step.fd);
+        close(write_end);
+        return true;
+    }
+
+    // Holds no end of the command's input, so writers upstream see it exit
+    close(write_end);
+    close(STDIN_FILENO);
+    pump_fanout(read_end, std::move(targets));
+    int status = 0;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+    {
+    }
+    if (WIFSIGNALED(status))
+    {
+        signal(WTERMSIG(status), SIG_DFL);
+        raise(WTERMSIG(status));
     }
+    _exit(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+}
 
-    // Handle output redirection
-    if (redir.has_output_redirect)
+static bool apply_step(const FdStep &step, vector<thread> *pumps)
+{
+    switch (step.kind)
+    {
+    case FdStep::OPEN:
     {
-        int flags;
-        if (redir.output_append)
+        int fd = open(step.file.c_str(), step.flags | O_CLOEXEC, 0644);
+        if (fd == -1)
         {
-            flags = O_WRONLY | O_CREAT | O_APPEND;
+            perror(("shell: " + step.file).c_str());
+            return false;
         }
-        else
+        if (fd == step.fd)
         {
-            flags = O_WRONLY | O_CREAT | O_TRUNC;
+            fcntl(fd, F_SETFD, 0); // landed on the target, which must survive exec
+            return true;
         }
-
-        int output_fd = open(redir.output_file.c_str(), flags, 0644);
-        if (output_fd == -1)
+        bool moved = dup2(fd, step.fd) != -1;
+        if (!moved)
+        {
+            perror("shell: dup2");
+        }
+        close(fd);
+        return moved;
+    }
+    case FdStep::DUP:
+        if (dup2(step.source, step.fd) == -1)
         {
-            perror(("shell: " + redir.output_file).c_str());
+            cerr << "shell: " << step.source << ": " << strerror(errno) << endl;
             return false;
         }
+        return true;
+    case FdStep::CLOSE:
+        close(step.fd);
+        return true;
+    case FdStep::FANOUT:
+        return setup_fanout(step, pumps);
+    }
+    return false;
+}
 
-        if (dup2(output_fd, STDOUT_FILENO) == -1)
+// Applies the plan in a child before exec
+bool setup_redirection(const RedirectionInfo &redir)
+{
+    TraceSpan span("redirect");
+    for (const FdStep &step : redir.steps)
+    {
+        if (!apply_step(step, nullptr))
         {
-            perror("dup2 output");
-            close(output_fd);
             return false;
         }
-        close(output_fd);
     }
+    return true;
+}
 
+// Applies the plan in the shell for a builtin, first saving every descriptor it replaces
+// above SAVED_FD_BASE; restore_redirection undoes it even when this fails part way
+bool setup_builtin_redirection(const RedirectionInfo &redir, SavedFds &saved)
+{
+    TraceSpan span("redirect");
+    cout.flush(); // pending output belongs to the old stdout
+    for (int fd : redir.touched)
+    {
+        int copy = fcntl(fd, F_DUPFD_CLOEXEC, SAVED_FD_BASE);
+        while (copy != -1 && find(redir.touched.begin(), redir.touched.end(), copy) != redir.touched.end())
+        {
+            int next = fcntl(fd, F_DUPFD_CLOEXEC, copy + 1);
+            close(copy);
+            copy = next;
+        }
+        saved.saved.push_back({fd, copy});
+        read_buffer_save(fd);
+    }
+
+    for (const FdStep &step : redir.steps)
+    {
+        if (!apply_step(step, &saved.pumps))
+        {
+            return false;
+        }
+    }
     return true;
 }
 
-// Restore stdin and stdout
-void restore_stdio(int saved_stdin, int saved_stdout)
+// Puts back the descriptors a builtin redirection replaced, then waits for its fan-out pumps
+void restore_redirection(SavedFds &saved)
 {
-    if (saved_stdin != -1)
+    cout.flush();
+    for (auto it = saved.saved.rbegin(); it != saved.saved.rend(); ++it)
+    {
+        read_buffer_restore(it->first);
+        if (it->second == -1)
+        {
+            close(it->first);
+            continue;
+        }
+        dup2(it->second, it->first);
+        close(it->second);
+    }
+    saved.saved.clear();
+    cout.clear(); // writes to a closed descriptor leave the streams failed
+    cerr.clear();
+
+    for (thread &pump : saved.pumps)
     {
-        dup2(saved_stdin, STDIN_FILENO);
-        close(saved_stdin);
+        pump.join();
     }
+    saved.pumps.clear();
+}
 
-    if (saved_stdout != -1)
+// The plan as posix_spawn file actions; false when it needs a fan-out, which only the fork
+// path can run
+bool redirection_spawn_actions(const RedirectionInfo &redir, posix_spawn_file_actions_t *actions)
+{
+    for (const FdStep &step : redir.steps)
     {
-        dup2(saved_stdout, STDOUT_FILENO);
-        close(saved_stdout);
+        int result = 0;
+        switch (step.kind)
+        {
+        case FdStep::OPEN:
+            result = posix_spawn_file_actions_addopen(actions, step.fd, step.file.c_str(), step.flags, 0644);
+            break;
+        case FdStep::DUP:
+            result = posix_spawn_file_actions_adddup2(actions, step.source, step.fd);
+            break;
+        case FdStep::CLOSE:
+            result = posix_spawn_file_actions_addclose(actions, step.fd);
+            break;
+        case FdStep::FANOUT:
+            return false;
+        }
+        if (result != 0)
+        {
+            return false;
+        }
     }
-}
\ No newline at end of file
+    return true;
+}
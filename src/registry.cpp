@@ -0,0 +1,162 @@
+#include "registry.h"
+#include "builtins.h"
+#include "jobs.h"
+#include "parallel.h"
+#include "variables.h"
+#include "arith.h"
+#include "conditional.h"
+#include "script.h"
+#include "linereader.h"
+#include "loadable.h"
+#include "pathcache.h"
+#include <cstdint>
+#include <cstring>
+#include <cctype>
+
+using namespace std;
+
+static const unsigned SHELL = BUILTIN_MUTATES_SHELL | BUILTIN_PIPELINE_SAFE;
+static const unsigned PRINTS = BUILTIN_PIPELINE_SAFE | BUILTIN_BACKGROUND_SAFE;
+static const unsigned PURE = PRINTS | BUILTIN_CAPTURE_SAFE;
+
+// Every builtin the shell runs in place of a program; text tools and du stand in for
+// their programs only with the options they support and are checked separately
+static constexpr BuiltinDescriptor builtin_table[] = {
+    {"cd", builtin_cd, SHELL},
+    {"pwd", builtin_pwd, PURE},
+    {"echo", builtin_echo, PURE},
+    {"ls", builtin_ls, PRINTS},
+    {"exit", builtin_exit, SHELL},
+    {"pinfo", builtin_pinfo, PRINTS},
+    {"search", builtin_search, PRINTS},
+    {"history", builtin_history, PURE},
+    {"jobs", builtin_jobs, BUILTIN_PIPELINE_SAFE},
+    {"fg", builtin_fg, BUILTIN_MUTATES_SHELL},
+    {"bg", builtin_bg, BUILTIN_MUTATES_SHELL},
+    {"wait", builtin_wait, BUILTIN_MUTATES_SHELL},
+    {"set", builtin_set, SHELL},
+    {"parallel", builtin_parallel, PRINTS},
+    {"export", builtin_export, SHELL},
+    {"unset", builtin_unset, SHELL},
+    {"let", builtin_let, SHELL},
+    {"((", builtin_let, SHELL},
+    {"test", builtin_test, PURE},
+    {"[", builtin_test, PURE},
+    {"[[", builtin_test, PURE},
+    {"break", builtin_break, SHELL},
+    {"continue", builtin_break, SHELL},
+    {"return", builtin_return, SHELL},
+    {"true", builtin_true, PURE},
+    {"false", builtin_false, PURE},
+    {":", builtin_true, PURE},
+    {"read", builtin_read, SHELL},
+    {"enable", builtin_enable, SHELL},
+    {"hash", builtin_hash, SHELL},
+};
+
+static constexpr size_t BUILTIN_COUNT = sizeof(builtin_table) / sizeof(builtin_table[0]);
+static constexpr size_t SLOT_COUNT = 128; // power of two, a few times the table so a seed is found quickly
+
+// FNV-1a with the seed as offset basis, the same at compile time and at run time
+static constexpr uint32_t builtin_hash(const char *name, uint32_t seed)
+{
+    uint32_t hash = seed;
+    for (; *name; name++)
+    {
+        hash ^= (unsigned char)*name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// First seed from the FNV basis on that gives every name its own slot, 0 if none does
+static constexpr uint32_t find_seed()
+{
+    for (uint32_t seed = 2166136261u; seed < 2166136261u + 100000; seed++)
+    {
+        bool used[SLOT_COUNT] = {};
+        bool distinct = true;
+        for (size_t i = 0; i < BUILTIN_COUNT && distinct; i++)
+        {
+            size_t slot = builtin_hash(builtin_table[i].name, seed) & (SLOT_COUNT - 1);
+            distinct = !used[slot];
+            used[slot] = true;
+        }
+        if (distinct)
+        {
+            return seed;
+        }
+    }
+    return 0;
+}
+
+static constexpr uint32_t BUILTIN_SEED = find_seed();
+static_assert(BUILTIN_SEED != 0, "no perfect hash seed for the builtin names");
+
+// Slot -> table index + 1, 0 for an empty slot
+struct BuiltinSlots
+{
+    unsigned char entry[SLOT_COUNT];
+};
+
+static constexpr BuiltinSlots make_slots()
+{
+    BuiltinSlots slots = {};
+    for (size_t i = 0; i < BUILTIN_COUNT; i++)
+    {
+        slots.entry[builtin_hash(builtin_table[i].name, BUILTIN_SEED) & (SLOT_COUNT - 1)] = (unsigned char)(i + 1);
+    }
+    return slots;
+}
+
+static constexpr BuiltinSlots builtin_slots = make_slots();
+
+// A builtin that changes the shell loses its effect in a forked job
+static constexpr bool flags_consistent()
+{
+    for (const BuiltinDescriptor &builtin : builtin_table)
+    {
+        if ((builtin.flags & BUILTIN_MUTATES_SHELL) && (builtin.flags & (BUILTIN_BACKGROUND_SAFE | BUILTIN_CAPTURE_SAFE)))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(flags_consistent(), "a builtin that mutates the shell cannot run forked in the background or captured");
+
+// One hash and one strcmp, then the builtins loaded by enable -f; nullptr when name is
+// not a builtin
+const BuiltinDescriptor *find_builtin(const char *name)
+{
+    if (name == nullptr)
+    {
+        return nullptr;
+    }
+    unsigned char entry = builtin_slots.entry[builtin_hash(name, BUILTIN_SEED) & (SLOT_COUNT - 1)];
+    if (entry != 0 && strcmp(builtin_table[entry - 1].name, name) == 0)
+    {
+        return &builtin_table[entry - 1];
+    }
+    return find_loaded_builtin(name);
+}
+
+bool is_builtin_command(const string &cmd)
+{
+    return find_builtin(cmd.c_str()) != nullptr;
+}
+
+// Names a user types, for completion; the bracket and ':' spellings are left out
+vector<string> builtin_command_names()
+{
+    vector<string> names;
+    for (const BuiltinDescriptor &builtin : builtin_table)
+    {
+        if (isalpha((unsigned char)builtin.name[0]))
+        {
+            names.push_back(builtin.name);
+        }
+    }
+    return names;
+}
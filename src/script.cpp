@@ -0,0 +1,1413 @@
+#include "script.h"
+#include "shell.h"
+#include "pipeline.h"
+#include "builtins.h"
+#include "redirection.h"
+#include "variables.h"
+#include "textutils.h"
+#include "arena.h"
+#include "trace.h"
+#include "jobs.h"
+#include "heredoc.h"
+#include "linereader.h"
+#include "pathcache.h"
+#include <iostream>
+#include <vector>
+#include <string>
+#include <memory>
+#include <unordered_map>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <csignal>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+using namespace std;
+
+static const size_t SCRIPT_CACHE_LIMIT = 128; // compiled command lines kept before the cache is reset
+
+// One node of a compiled command line. Children are indices into the script's node list,
+// so a compiled script holds no pointers into itself and can be cached and shared as is
+struct ScriptNode
+{
+    enum Kind
+    {
+        SIMPLE,   // a command or pipeline, run through parse_and_execute
+        LIST,     // children run in order
+        AND,      // first && second
+        OR,       // first || second
+        NOT,      // ! first
+        IF,       // condition, body pairs, then the else body when the count is odd
+        WHILE,    // condition, body
+        UNTIL,    // condition, body
+        FOR,      // body
+        CASE,     // one body (or -1) per pattern group
+        GROUP,    // { list }
+        SUBSHELL, // ( list ), run in a forked child
+        PIPELINE, // stages of a pipeline with a compound command, each run in a forked child
+        FUNCTION  // name() body
+    };
+
+    Kind kind;
+    vector<int> children;
+    string text;          // SIMPLE: command line, FOR: variable, CASE: subject, FUNCTION: name,
+                          // SUBSHELL and PIPELINE: source, for the job table
+    vector<string> words; // SIMPLE: words when none needs expanding, FOR: items, CASE: patterns
+    vector<int> groups;   // CASE: number of patterns of each item
+    string redirections;  // redirection words after a compound command
+    bool builtin = false;    // SIMPLE: words[0] is a builtin, dispatched without the tokenizer
+    CommandHandle command = NO_COMMAND; // SIMPLE: path cache entry of words[0] when it is a program
+    bool background = false; // SIMPLE: ends with &
+    bool has_items = false;  // FOR: has an in list
+    size_t heredoc = 0;      // first body of the command's << operators (of the redirections
+                             // for a compound command) in the script's here-documents
+};
+
+struct Script : enable_shared_from_this<Script>
+{
+    vector<ScriptNode> nodes;
+    int root = -1;
+    HereDocList heredocs; // bodies of the text's << operators, reopened on every run
+};
+
+struct ScriptToken
+{
+    enum Kind
+    {
+        WORD,
+        OPERATOR, // ; ;; & && | || ( )
+        NEWLINE,
+        END
+    };
+
+    Kind kind;
+    string text;
+    bool complete = true; // false when a quote or parenthesis is still open at the end
+    bool after_comment = false;
+};
+
+static bool is_reserved_word(const string &word)
+{
+    static const char *const words[] = {"if", "then", "elif", "else", "fi", "while", "until", "do", "done",
+                                        "for", "case", "esac", "{", "}", "!", "function"};
+    for (const char *reserved : words)
+    {
+        if (word == reserved)
+            return true;
+    }
+    return false;
+}
+
+static bool is_name(const string &word)
+{
+    if (word.empty() || !(isalpha((unsigned char)word[0]) || word[0] == '_'))
+        return false;
+    for (char c : word)
+    {
+        if (!isalnum((unsigned char)c) && c != '_')
+            return false;
+    }
+    return true;
+}
+
+// Splits script text into words and operators. Words keep their quotes and expansions
+// as written, the tokenizer expands them when the command runs
+class ScriptLexer
+{
+public:
+    explicit ScriptLexer(const string &source) : source(source) {}
+
+    // Next token from at, which is moved past it. At the start of a command (( )) and
+    // [[ ]] are single words, so their operators are not taken for the shell's
+    ScriptToken scan(size_t &at, bool command_position) const
+    {
+        bool comment = false;
+        while (true)
+        {
+            while (at < source.size() && (source[at] == ' ' || source[at] == '\t'))
+                at++;
+            if (at + 1 < source.size() && source[at] == '\\' && source[at + 1] == '\n')
+            {
+                at += 2;
+                continue;
+            }
+            if (at < source.size() && source[at] == '#')
+            {
+                // Comment up to the end of the line
+                while (at < source.size() && source[at] != '\n')
+                    at++;
+                comment = true;
+                continue;
+            }
+            break;
+        }
+
+        ScriptToken token;
+        token.after_comment = comment;
+        if (at >= source.size())
+        {
+            token.kind = ScriptToken::END;
+            return token;
+        }
+
+        char c = source[at];
+        if (c == '\n')
+        {
+            token.kind = ScriptToken::NEWLINE;
+            at++;
+            return token;
+        }
+        if (command_position && source.compare(at, 2, "((") == 0)
+        {
+            return word(at, skip_parens(at + 1, token.complete), token);
+        }
+        if (command_position && source.compare(at, 2, "[[") == 0 && (at + 2 == source.size() || strchr(" \t\n", source[at + 2])))
+        {
+            return word(at, skip_double_bracket(at + 2, token.complete), token);
+        }
+        if (c == ';' || c == '|' || c == '(' || c == ')' || (c == '&' && source[at + 1] != '>'))
+        {
+            token.kind = ScriptToken::OPERATOR;
+            size_t length = (c == ';' || c == '|' || c == '&') && source[at + 1] == c ? 2 : 1;
+            token.text = source.substr(at, length);
+            at += length;
+            return token;
+        }
+        return word(at, skip_word(at, token.complete), token);
+    }
+
+private:
+    ScriptToken &word(size_t &at, size_t end, ScriptToken &token) const
+    {
+        token.kind = ScriptToken::WORD;
+        token.text = source.substr(at, end - at);
+        at = end;
+        return token;
+    }
+
+    // Position after the ) closing the ( before i
+    size_t skip_parens(size_t i, bool &complete) const
+    {
+        int depth = 1;
+        while (i < source.size())
+        {
+            char c = source[i];
+            if (c == '\'' || c == '"' || c == '`')
+            {
+                i = skip_quoted(i, complete);
+                continue;
+            }
+            if (c == '\\')
+                i++;
+            else if (c == '(')
+                depth++;
+            else if (c == ')' && --depth == 0)
+                return i + 1;
+            i++;
+        }
+        complete = false;
+        return source.size();
+    }
+
+    // Position after the quote closing the one at i
+    size_t skip_quoted(size_t i, bool &complete) const
+    {
+        char quote = source[i++];
+        while (i < source.size() && source[i] != quote)
+        {
+            if (quote != '\'' && source[i] == '\\')
+                i++;
+            else if (quote == '"' && source[i] == '$' && i + 1 < source.size() && source[i + 1] == '(')
+            {
+                i = skip_parens(i + 2, complete);
+                continue;
+            }
+            i++;
+        }
+        if (i >= source.size())
+        {
+            complete = false;
+            return source.size();
+        }
+        return i + 1;
+    }
+
+    size_t skip_word(size_t i, bool &complete) const
+    {
+        while (i < source.size())
+        {
+            char c = source[i];
+            char next = i + 1 < source.size() ? source[i + 1] : '\0';
+            if (strchr(" \t\n;|()", c) || (c == '&' && next != '>' && (i == 0 || !strchr("<>", source[i - 1]))))
+                break;
+            if (c == '\'' || c == '"' || c == '`')
+                i = skip_quoted(i, complete);
+            else if (c == '\\')
+                i += 2;
+            else if ((c == '$' || c == '<' || c == '>') && next == '(')
+                i = skip_parens(i + 2, complete);
+            else if (c == '$' && next == '{')
+            {
+                size_t close = source.find('}', i);
+                i = close == string::npos ? source.size() : close + 1;
+            }
+            else
+                i++;
+        }
+        return min(i, source.size());
+    }
+
+    // Position after the ]] word closing a [[ ]] test
+    size_t skip_double_bracket(size_t i, bool &complete) const
+    {
+        while (i < source.size())
+        {
+            while (i < source.size() && (source[i] == ' ' || source[i] == '\t'))
+                i++;
+            if (source.compare(i, 2, "]]") == 0 && (i + 2 == source.size() || strchr(" \t\n;&|)", source[i + 2])))
+                return i + 2;
+            if (i >= source.size() || source[i] == '\n')
+                break;
+            while (i < source.size() && !strchr(" \t\n", source[i]))
+            {
+                if (source[i] == '\'' || source[i] == '"' || source[i] == '`')
+                    i = skip_quoted(i, complete);
+                else if (source[i] == '$' && i + 1 < source.size() && source[i + 1] == '(')
+                    i = skip_parens(i + 2, complete);
+                else
+                    i += source[i] == '\\' ? 2 : 1;
+            }
+        }
+        complete = false;
+        return min(i, source.size());
+    }
+
+    const string &source;
+};
+
+// Recursive descent over the shell grammar, building the node list of a Script
+class ScriptParser
+{
+public:
+    ScriptParser(const string &source, Script &script)
+        : source(source), lexer(source), script(script), heredoc_at(heredoc_positions(source)) {}
+
+    bool parse()
+    {
+        // Nothing but comments and blank lines runs nothing
+        skip_newlines();
+        script.root = peek(true).kind == ScriptToken::END ? add(ScriptNode::LIST, {}) : parse_list({});
+        if (error.empty() && peek().kind != ScriptToken::END)
+            unexpected(take(false));
+        return error.empty() && !incomplete;
+    }
+
+    size_t heredoc_count() const
+    {
+        return heredoc_at.size();
+    }
+
+    string error;
+    bool incomplete = false; // the text ends inside a compound command, quote or parenthesis
+
+private:
+    ScriptToken peek(bool command_position = false)
+    {
+        size_t at = position;
+        return lexer.scan(at, command_position);
+    }
+
+    ScriptToken take(bool command_position)
+    {
+        ScriptToken token = lexer.scan(position, command_position);
+        incomplete = incomplete || !token.complete;
+        return token;
+    }
+
+    bool at_word(const char *word)
+    {
+        ScriptToken token = peek(true);
+        return token.kind == ScriptToken::WORD && token.text == word;
+    }
+
+    bool at_operator(const char *op)
+    {
+        ScriptToken token = peek();
+        return token.kind == ScriptToken::OPERATOR && token.text == op;
+    }
+
+    void skip_newlines()
+    {
+        while (peek().kind == ScriptToken::NEWLINE)
+            take(false);
+    }
+
+    void unexpected(const ScriptToken &token)
+    {
+        if (token.kind == ScriptToken::END)
+            incomplete = true;
+        else if (error.empty())
+            error = "syntax error near unexpected token `" + (token.kind == ScriptToken::NEWLINE ? string("newline") : token.text) + "'";
+    }
+
+    bool failed() const
+    {
+        return !error.empty() || incomplete;
+    }
+
+    bool expect(const char *word)
+    {
+        ScriptToken token = take(true);
+        if (token.kind != ScriptToken::WORD || token.text != word)
+        {
+            unexpected(token);
+            return false;
+        }
+        return true;
+    }
+
+    int add(ScriptNode::Kind kind, vector<int> children = {})
+    {
+        ScriptNode node;
+        node.kind = kind;
+        node.children = move(children);
+        script.nodes.push_back(move(node));
+        return (int)script.nodes.size() - 1;
+    }
+
+    // Commands separated by ; & or newlines, up to one of the terminator words
+    int parse_list(const vector<string> &terminators)
+    {
+        skip_newlines();
+        vector<int> items;
+        while (!failed())
+        {
+            ScriptToken token = peek(true);
+            if (token.kind == ScriptToken::END || (token.kind == ScriptToken::OPERATOR && (token.text == ")" || token.text == ";;")))
+                break;
+            bool terminator = false;
+            for (const string &word : terminators)
+                terminator = terminator || (token.kind == ScriptToken::WORD && token.text == word);
+            if (terminator)
+                break;
+
+            int item = parse_and_or();
+            if (failed())
+                return -1;
+            items.push_back(item);
+
+            token = peek();
+            if (token.kind == ScriptToken::OPERATOR && (token.text == ";" || token.text == "&"))
+            {
+                take(false);
+                if (token.text == "&")
+                {
+                    if (script.nodes[item].kind != ScriptNode::SIMPLE)
+                    {
+                        error = "background compound commands are not supported";
+                        return -1;
+                    }
+                    script.nodes[item].background = true;
+                }
+            }
+            else if (token.kind == ScriptToken::NEWLINE)
+            {
+                take(false);
+            }
+            else if (token.kind != ScriptToken::END && !(token.kind == ScriptToken::OPERATOR && (token.text == ")" || token.text == ";;")) &&
+                     !(token.kind == ScriptToken::WORD && is_reserved_word(token.text)))
+            {
+                unexpected(token);
+                return -1;
+            }
+            skip_newlines();
+        }
+        if (failed())
+            return -1;
+        if (items.empty())
+        {
+            unexpected(peek(true));
+            return -1;
+        }
+        return items.size() == 1 ? items[0] : add(ScriptNode::LIST, items);
+    }
+
+    int parse_and_or()
+    {
+        int left = parse_pipeline();
+        while (!failed() && (at_operator("&&") || at_operator("||")))
+        {
+            bool is_and = take(false).text == "&&";
+            skip_newlines();
+            int right = parse_pipeline();
+            if (failed())
+                return -1;
+            left = add(is_and ? ScriptNode::AND : ScriptNode::OR, {left, right});
+        }
+        return left;
+    }
+
+    int parse_pipeline()
+    {
+        bool negate = at_word("!");
+        if (negate)
+            take(true);
+        size_t begin = position;
+        vector<int> stages = {parse_command()};
+        while (!failed() && at_operator("|"))
+        {
+            take(false);
+            skip_newlines();
+            stages.push_back(parse_command());
+        }
+        if (failed())
+            return -1;
+
+        int node = stages[0];
+        bool simple = true;
+        for (int stage : stages)
+            simple = simple && script.nodes[stage].kind == ScriptNode::SIMPLE;
+        if (stages.size() > 1 && simple)
+        {
+            // Pipelines of simple commands run as one command line, threaded text tools and all
+            ScriptNode &first = script.nodes[node];
+            for (size_t i = 1; i < stages.size(); i++)
+                first.text += " | " + script.nodes[stages[i]].text;
+            first.words.clear();
+            first.builtin = false;
+            first.command = NO_COMMAND;
+        }
+        else if (stages.size() > 1)
+        {
+            node = add(ScriptNode::PIPELINE, stages);
+            size_t first = source.find_first_not_of(" \t\n", begin);
+            size_t last = source.find_last_not_of(" \t\n", position - 1);
+            script.nodes[node].text = source.substr(first, last + 1 - first);
+        }
+        return negate ? add(ScriptNode::NOT, {node}) : node;
+    }
+
+    int parse_command()
+    {
+        ScriptToken token = peek(true);
+        int node = -1;
+        if (token.kind == ScriptToken::OPERATOR && token.text == "(")
+        {
+            size_t begin = source.find('(', position);
+            take(true);
+            int body = parse_list({});
+            if (failed())
+                return -1;
+            ScriptToken close = take(false);
+            if (close.kind != ScriptToken::OPERATOR || close.text != ")")
+            {
+                unexpected(close);
+                return -1;
+            }
+            node = add(ScriptNode::SUBSHELL, {body});
+            script.nodes[node].text = source.substr(begin, position - begin);
+        }
+        else if (token.kind != ScriptToken::WORD)
+        {
+            take(true);
+            unexpected(token);
+            return -1;
+        }
+        else if (token.text == "if")
+            node = parse_if();
+        else if (token.text == "while" || token.text == "until")
+            node = parse_while();
+        else if (token.text == "for")
+            node = parse_for();
+        else if (token.text == "case")
+            node = parse_case();
+        else if (token.text == "{")
+        {
+            take(true);
+            int body = parse_list({"}"});
+            if (failed() || !expect("}"))
+                return -1;
+            node = add(ScriptNode::GROUP, {body});
+        }
+        else if (token.text == "function")
+        {
+            take(true);
+            return parse_function(take(false).text);
+        }
+        else if (is_reserved_word(token.text))
+        {
+            take(true);
+            unexpected(token);
+            return -1;
+        }
+        else
+        {
+            size_t at = position;
+            lexer.scan(at, true);
+            ScriptToken next = lexer.scan(at, false);
+            if (next.kind == ScriptToken::OPERATOR && next.text == "(" && is_name(token.text))
+            {
+                take(true);
+                return parse_function(token.text);
+            }
+            return parse_simple();
+        }
+
+        if (failed())
+            return -1;
+        parse_redirections(node);
+        return node;
+    }
+
+    // Number of here-document bodies before offset at, that is the index of the next one
+    size_t heredocs_before(size_t at) const
+    {
+        return lower_bound(heredoc_at.begin(), heredoc_at.end(), at) - heredoc_at.begin();
+    }
+
+    // Words after a compound command, applied around the whole command when it runs
+    void parse_redirections(int node)
+    {
+        script.nodes[node].heredoc = heredocs_before(position);
+        string redirections;
+        while (peek().kind == ScriptToken::WORD && !is_reserved_word(peek().text))
+        {
+            if (!redirections.empty())
+                redirections += ' ';
+            redirections += take(false).text;
+        }
+        script.nodes[node].redirections = redirections;
+    }
+
+    int parse_simple()
+    {
+        size_t begin = position;
+        string text;
+        vector<string> words;
+        bool plain = true; // no word needs the tokenizer
+        bool command_position = true;
+        while (true)
+        {
+            ScriptToken token = peek(command_position);
+            if (token.kind == ScriptToken::WORD)
+            {
+                take(command_position);
+                command_position = false;
+                if (!text.empty() && text.back() != ' ')
+                    text += ' ';
+                text += token.text;
+                words.push_back(token.text);
+                plain = plain && plain_word(token.text);
+            }
+            else
+            {
+                break;
+            }
+        }
+
+        int node = add(ScriptNode::SIMPLE);
+        ScriptNode &simple = script.nodes[node];
+        simple.text = text;
+        simple.heredoc = heredocs_before(begin);
+        if (plain && words[0] != "time" && words[0] != "batched" && !is_assignment(words[0].c_str()))
+        {
+            // Resolved once: the words are passed as they are and a builtin is called directly
+            simple.words = words;
+            simple.builtin = is_builtin_command(words[0]);
+            if (!simple.builtin)
+            {
+                simple.command = command_handle(words[0]);
+            }
+        }
+        return node;
+    }
+
+    // A word the tokenizer would return unchanged
+    static bool plain_word(const string &word)
+    {
+        if (word.size() > 1 && word.find('[') != string::npos)
+            return false;
+        return word.find_first_of("$`'\"\\*?{}~<>|&;()#") == string::npos;
+    }
+
+    int parse_if()
+    {
+        take(true);
+        vector<int> children;
+        while (true)
+        {
+            int condition = parse_list({"then"});
+            if (failed() || !expect("then"))
+                return -1;
+            int body = parse_list({"elif", "else", "fi"});
+            if (failed())
+                return -1;
+            children.push_back(condition);
+            children.push_back(body);
+
+            ScriptToken token = take(true);
+            if (token.text == "elif")
+                continue;
+            if (token.text == "else")
+            {
+                int otherwise = parse_list({"fi"});
+                if (failed() || !expect("fi"))
+                    return -1;
+                children.push_back(otherwise);
+            }
+            else if (token.kind != ScriptToken::WORD || token.text != "fi")
+            {
+                unexpected(token);
+                return -1;
+            }
+            break;
+        }
+        return add(ScriptNode::IF, children);
+    }
+
+    int parse_while()
+    {
+        bool until = take(true).text == "until";
+        int condition = parse_list({"do"});
+        if (failed() || !expect("do"))
+            return -1;
+        int body = parse_list({"done"});
+        if (failed() || !expect("done"))
+            return -1;
+        return add(until ? ScriptNode::UNTIL : ScriptNode::WHILE, {condition, body});
+    }
+
+    int parse_for()
+    {
+        take(true);
+        ScriptToken name = take(false);
+        if (name.kind != ScriptToken::WORD || !is_name(name.text))
+        {
+            unexpected(name);
+            return -1;
+        }
+
+        vector<string> items;
+        bool has_items = false;
+        skip_newlines();
+        if (at_word("in"))
+        {
+            take(true);
+            has_items = true;
+            while (peek().kind == ScriptToken::WORD)
+                items.push_back(take(false).text);
+        }
+        if (at_operator(";"))
+            take(false);
+        skip_newlines();
+        if (failed() || !expect("do"))
+            return -1;
+        int body = parse_list({"done"});
+        if (failed() || !expect("done"))
+            return -1;
+
+        int node = add(ScriptNode::FOR, {body});
+        script.nodes[node].text = name.text;
+        script.nodes[node].words = items;
+        script.nodes[node].has_items = has_items;
+        return node;
+    }
+
+    int parse_case()
+    {
+        take(true);
+        ScriptToken subject = take(false);
+        if (subject.kind != ScriptToken::WORD)
+        {
+            unexpected(subject);
+            return -1;
+        }
+        skip_newlines();
+        if (!expect("in"))
+            return -1;
+
+        vector<int> bodies;
+        vector<string> patterns;
+        vector<int> groups;
+        skip_newlines();
+        while (!at_word("esac"))
+        {
+            if (at_operator("("))
+                take(false);
+            int count = 0;
+            while (true)
+            {
+                ScriptToken pattern = take(false);
+                if (pattern.kind != ScriptToken::WORD)
+                {
+                    unexpected(pattern);
+                    return -1;
+                }
+                patterns.push_back(pattern.text);
+                count++;
+                if (!at_operator("|"))
+                    break;
+                take(false);
+            }
+            ScriptToken close = take(false);
+            if (close.kind != ScriptToken::OPERATOR || close.text != ")")
+            {
+                unexpected(close);
+                return -1;
+            }
+            groups.push_back(count);
+
+            // An item may have no commands
+            skip_newlines();
+            int body = at_operator(";;") || at_word("esac") ? -1 : parse_list({"esac"});
+            if (failed())
+                return -1;
+            bodies.push_back(body);
+            if (at_operator(";;"))
+            {
+                take(false);
+                skip_newlines();
+            }
+            else if (!at_word("esac"))
+            {
+                unexpected(take(true));
+                return -1;
+            }
+        }
+        take(true);
+
+        int node = add(ScriptNode::CASE, bodies);
+        script.nodes[node].text = subject.text;
+        script.nodes[node].words = patterns;
+        script.nodes[node].groups = groups;
+        return node;
+    }
+
+    // name() compound-command, or function name [()] compound-command
+    int parse_function(const string &name)
+    {
+        if (!is_name(name))
+        {
+            error = "`" + name + "': not a valid function name";
+            return -1;
+        }
+        if (at_operator("("))
+        {
+            take(false);
+            ScriptToken close = take(false);
+            if (close.kind != ScriptToken::OPERATOR || close.text != ")")
+            {
+                unexpected(close);
+                return -1;
+            }
+        }
+        skip_newlines();
+        ScriptToken token = peek(true);
+        if (token.kind == ScriptToken::WORD && (token.text == "{" || token.text == "if" || token.text == "while" ||
+                                                token.text == "until" || token.text == "for" || token.text == "case"))
+        {
+            int body = parse_command();
+            if (failed())
+                return -1;
+            int node = add(ScriptNode::FUNCTION, {body});
+            script.nodes[node].text = name;
+            return node;
+        }
+        take(true);
+        unexpected(token);
+        return -1;
+    }
+
+    const string &source;
+    ScriptLexer lexer;
+    Script &script;
+    vector<size_t> heredoc_at; // offsets of the << operators that take a body
+    size_t position = 0;
+};
+
+// True when the text has more than ; separated simple commands: control flow, functions,
+// && and ||, a & in the middle, or several lines
+bool script_needed(const string &text)
+{
+    ScriptLexer lexer(text);
+    size_t at = 0;
+    bool command_position = true;
+    bool after_ampersand = false;
+    while (true)
+    {
+        ScriptToken token = lexer.scan(at, command_position);
+        if (token.after_comment)
+            return true;
+        if (token.kind == ScriptToken::END)
+            return false;
+        if (after_ampersand || token.kind == ScriptToken::NEWLINE)
+            return true;
+        if (token.kind == ScriptToken::OPERATOR)
+        {
+            if (token.text == "&&" || token.text == "||" || token.text == "(" || token.text == ")" || token.text == ";;")
+                return true;
+            after_ampersand = token.text == "&";
+            command_position = true;
+            continue;
+        }
+        if (command_position && is_reserved_word(token.text))
+            return true;
+        command_position = false;
+    }
+}
+
+// True when text stops inside a compound command or quote, and more lines should be read
+bool script_incomplete(const string &text)
+{
+    if (!script_needed(text))
+        return false;
+    Script script;
+    ScriptParser parser(text, script);
+    parser.parse();
+    return parser.incomplete && parser.error.empty();
+}
+
+// Compiled command lines by text, so re-entering a loop or calling a function parses nothing
+static unordered_map<string, shared_ptr<Script>> compiled;
+
+// A text with here-documents takes its bodies with it and is not cached, the next time it
+// is typed it comes with other bodies
+static shared_ptr<Script> compile(const string &text)
+{
+    bool has_heredocs = text.find("<<") != string::npos;
+    auto it = has_heredocs ? compiled.end() : compiled.find(text);
+    if (it != compiled.end())
+    {
+        return it->second;
+    }
+
+    TraceSpan span("script_compile");
+    span.command(text);
+    shared_ptr<Script> script = make_shared<Script>();
+    ScriptParser parser(text, *script);
+    bool parsed = parser.parse();
+    script->heredocs = heredoc_take_bodies(parser.heredoc_count());
+    if (!parsed)
+    {
+        cerr << "shell: " << (parser.error.empty() ? "syntax error: unexpected end of file" : parser.error) << endl;
+        return nullptr;
+    }
+    if (has_heredocs)
+    {
+        return script;
+    }
+    if (compiled.size() >= SCRIPT_CACHE_LIMIT)
+    {
+        compiled.clear();
+    }
+    compiled.emplace(text, script);
+    return script;
+}
+
+struct ScriptFunction
+{
+    shared_ptr<const Script> script; // keeps the body alive after the cache lets go of it
+    int body;
+};
+
+static unordered_map<string, ScriptFunction> functions;
+
+// Unwinding state of break, continue and return, checked after every command
+static int loop_depth = 0;
+static int function_depth = 0;
+static int break_count = 0;
+static int continue_count = 0;
+static bool returning = false;
+static int return_status = 0;
+static bool aborted = false; // Ctrl+C, every enclosing loop and function stops
+
+static bool unwinding()
+{
+    if (!aborted && (text_builtins_interrupted() || last_status() == 128 + SIGINT))
+    {
+        aborted = true;
+    }
+    return aborted || break_count > 0 || continue_count > 0 || returning;
+}
+
+// Words of text after expansion, splitting and globbing, as a command would get them
+static vector<string> expand_words(const string &text)
+{
+    vector<char> buffer(text.begin(), text.end());
+    buffer.push_back('\0');
+    Arena::Mark mark = line_arena.mark();
+    vector<char *> tokens = tokenize_with_redirection(buffer.data());
+    vector<string> words(tokens.begin(), tokens.end());
+    line_arena.rewind(mark);
+    return words;
+}
+
+// Text as a [[ ]] operand: expanded without splitting, in glob pattern form
+static string expand_pattern(const string &text)
+{
+    vector<string> words = expand_words("[[ " + text + " ]]");
+    string pattern;
+    for (size_t i = 1; i + 1 < words.size(); i++)
+    {
+        if (i > 1)
+            pattern += ' ';
+        pattern += words[i];
+    }
+    return pattern;
+}
+
+static string unescape_pattern(const string &pattern)
+{
+    string text;
+    for (size_t i = 0; i < pattern.size(); i++)
+    {
+        if (pattern[i] == '\\' && i + 1 < pattern.size())
+            i++;
+        text += pattern[i];
+    }
+    return text;
+}
+
+static void run_node(const Script &script, int index);
+
+static void run_simple(const Script &script, const ScriptNode &node)
+{
+    // The command's << operators take the script's bodies, on every run
+    HereDocCursor outer = heredoc_select({&script.heredocs, node.heredoc});
+    Arena::Mark mark = line_arena.mark();
+    if (!node.words.empty() && !node.background && (functions.empty() || !functions.count(node.words[0])))
+    {
+        vector<char *> args;
+        for (const string &word : node.words)
+        {
+            args.push_back(line_arena.copy(word.data(), word.size()));
+        }
+        if (node.builtin)
+        {
+            set_last_status(handle_builtin(args));
+        }
+        else
+        {
+            // The program is searched once per PATH, not on every run of the command
+            CommandHandle outer = command_select(node.command);
+            execute_words(args);
+            command_select(outer);
+        }
+    }
+    else
+    {
+        string text = node.background ? node.text + " &" : node.text;
+        vector<char> buffer(text.begin(), text.end());
+        buffer.push_back('\0');
+        parse_and_execute(buffer.data());
+    }
+    line_arena.rewind(mark);
+    heredoc_release_temporaries();
+    heredoc_select(outer);
+}
+
+// A condition that is a read command, NAME=value prefixes aside; only such a read may
+// take a pipe a block at a time
+static bool condition_reads(const ScriptNode &node)
+{
+    if (node.kind != ScriptNode::SIMPLE)
+        return false;
+    size_t pos = 0;
+    while ((pos = node.text.find_first_not_of(" \t", pos)) != string::npos)
+    {
+        size_t end = node.text.find_first_of(" \t", pos);
+        string word = node.text.substr(pos, end == string::npos ? string::npos : end - pos);
+        if (!is_assignment(word.c_str()))
+            return word == "read";
+        pos = end;
+    }
+    return false;
+}
+
+// Runs a loop body; false when the loop has to stop. break and continue with a count
+// above one are passed on to the enclosing loop
+static bool run_loop_body(const Script &script, int body)
+{
+    run_node(script, body);
+    if (break_count > 0)
+    {
+        break_count--;
+        return false;
+    }
+    if (continue_count > 0)
+    {
+        continue_count--;
+        return continue_count == 0;
+    }
+    return !unwinding();
+}
+
+// ( list ): the list runs in a child, so cd, assignments and exit do not reach the shell
+static void run_subshell(const Script &script, const ScriptNode &node)
+{
+    cout.flush();
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        set_last_status(1);
+        return;
+    }
+    if (pid == 0)
+    {
+        // Commands of the list stay in the subshell's process group
+        setup_child_process(0, true);
+        job_control_enabled = false;
+        loop_depth = 0;
+        function_depth = 0;
+        run_node(script, node.children[0]);
+        cout.flush();
+        trace_flush();
+        _exit(last_status());
+    }
+    place_in_job_group(pid, pid);
+    set_last_status_from_wait(wait_for_foreground(pid, {pid}, node.text));
+}
+
+// cmd | while read ...: every stage is forked with its pipe ends on stdin and stdout and
+// runs its part of the tree, all of them in the first stage's process group
+static void run_pipeline(const Script &script, const ScriptNode &node)
+{
+    cout.flush();
+    vector<pid_t> pids;
+    pid_t pgid = 0;
+    int input = -1;
+    for (size_t i = 0; i < node.children.size(); i++)
+    {
+        bool last = i + 1 == node.children.size();
+        int fds[2] = {-1, -1};
+        if (!last && pipe2(fds, O_CLOEXEC) == -1)
+        {
+            perror("shell: pipe");
+            break;
+        }
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            perror("fork");
+            close(fds[0]);
+            close(fds[1]);
+            break;
+        }
+        if (pid == 0)
+        {
+            setup_child_process(pgid, true);
+            job_control_enabled = false;
+            if (input != -1)
+            {
+                dup2(input, STDIN_FILENO);
+                close(input);
+            }
+            if (!last)
+            {
+                dup2(fds[1], STDOUT_FILENO);
+                close(fds[0]);
+                close(fds[1]);
+            }
+            loop_depth = 0;
+            function_depth = 0;
+            run_node(script, node.children[i]);
+            cout.flush();
+            trace_flush();
+            _exit(last_status());
+        }
+        pgid = pgid == 0 ? pid : pgid;
+        place_in_job_group(pid, pgid);
+        pids.push_back(pid);
+        if (input != -1)
+            close(input);
+        input = fds[0];
+        if (!last)
+            close(fds[1]);
+    }
+    if (input != -1)
+        close(input);
+
+    if (pids.empty())
+    {
+        set_last_status(1);
+        return;
+    }
+    set_last_status_from_wait(wait_for_foreground(pgid, pids, node.text));
+}
+
+static void run_compound(const Script &script, const ScriptNode &node)
+{
+    switch (node.kind)
+    {
+    case ScriptNode::LIST:
+        for (int child : node.children)
+        {
+            run_node(script, child);
+            if (unwinding())
+                break;
+        }
+        break;
+    case ScriptNode::AND:
+    case ScriptNode::OR:
+        run_node(script, node.children[0]);
+        if (!unwinding() && (last_status() == 0) == (node.kind == ScriptNode::AND))
+            run_node(script, node.children[1]);
+        break;
+    case ScriptNode::NOT:
+        run_node(script, node.children[0]);
+        set_last_status(last_status() == 0 ? 1 : 0);
+        break;
+    case ScriptNode::IF:
+    {
+        size_t i = 0;
+        for (; i + 1 < node.children.size(); i += 2)
+        {
+            run_node(script, node.children[i]);
+            if (unwinding())
+                return;
+            if (last_status() == 0)
+            {
+                run_node(script, node.children[i + 1]);
+                return;
+            }
+        }
+        if (i < node.children.size())
+            run_node(script, node.children[i]);
+        else
+            set_last_status(0);
+        break;
+    }
+    case ScriptNode::WHILE:
+    case ScriptNode::UNTIL:
+    {
+        int status = 0;
+        bool reads = condition_reads(script.nodes[node.children[0]]);
+        if (reads)
+            read_loop_begin();
+        loop_depth++;
+        while (true)
+        {
+            bool outer = read_ahead_select(reads);
+            run_node(script, node.children[0]);
+            read_ahead_select(outer);
+            if (unwinding() || (last_status() == 0) != (node.kind == ScriptNode::WHILE))
+                break;
+            bool more = run_loop_body(script, node.children[1]);
+            status = last_status();
+            if (!more)
+                break;
+        }
+        loop_depth--;
+        if (reads)
+            read_loop_end();
+        if (!aborted && !returning)
+            set_last_status(status);
+        break;
+    }
+    case ScriptNode::FOR:
+    {
+        vector<string> items;
+        if (!node.has_items)
+        {
+            // for name; do ... iterates over $1, $2, ...
+            items = set_positional_parameters({});
+            set_positional_parameters(items);
+        }
+        for (const string &word : node.words)
+        {
+            for (string &item : expand_words(word))
+                items.push_back(move(item));
+        }
+
+        int status = 0;
+        loop_depth++;
+        for (const string &item : items)
+        {
+            set_variable(node.text, item);
+            bool more = run_loop_body(script, node.children[0]);
+            status = last_status();
+            if (!more)
+                break;
+        }
+        loop_depth--;
+        if (!aborted && !returning)
+            set_last_status(status);
+        break;
+    }
+    case ScriptNode::CASE:
+    {
+        string subject = unescape_pattern(expand_pattern(node.text));
+        size_t pattern = 0;
+        set_last_status(0);
+        for (size_t item = 0; item < node.groups.size(); item++)
+        {
+            bool matched = false;
+            for (int i = 0; i < node.groups[item]; i++, pattern++)
+            {
+                matched = matched || fnmatch(expand_pattern(node.words[pattern]).c_str(), subject.c_str(), 0) == 0;
+            }
+            if (matched)
+            {
+                if (node.children[item] != -1)
+                    run_node(script, node.children[item]);
+                break;
+            }
+        }
+        break;
+    }
+    case ScriptNode::GROUP:
+        run_node(script, node.children[0]);
+        break;
+    case ScriptNode::SUBSHELL:
+        run_subshell(script, node);
+        break;
+    case ScriptNode::PIPELINE:
+        run_pipeline(script, node);
+        break;
+    case ScriptNode::FUNCTION:
+        functions[node.text] = {script.shared_from_this(), node.children[0]};
+        set_last_status(0);
+        break;
+    case ScriptNode::SIMPLE:
+        run_simple(script, node);
+        break;
+    }
+}
+
+static void run_node(const Script &script, int index)
+{
+    const ScriptNode &node = script.nodes[index];
+    if (node.redirections.empty())
+    {
+        run_compound(script, node);
+        return;
+    }
+
+    // Redirections of a compound command stay in place while all of it runs
+    vector<char> buffer(node.redirections.begin(), node.redirections.end());
+    buffer.push_back('\0');
+    Arena::Mark mark = line_arena.mark();
+    vector<char *> tokens = tokenize_with_redirection(buffer.data());
+    HereDocCursor outer = heredoc_select({&script.heredocs, node.heredoc});
+    RedirectionInfo redir = parse_redirection(tokens);
+    heredoc_select(outer);
+    if (redir.failed)
+    {
+        line_arena.rewind(mark); // reported by parse_redirection, which set $?
+        return;
+    }
+    SavedFds saved;
+    if (!redir.clean_args.empty() && redir.clean_args[0] != nullptr)
+    {
+        cerr << "shell: syntax error near unexpected token `" << redir.clean_args[0] << "'" << endl;
+        set_last_status(2);
+    }
+    else if (setup_builtin_redirection(redir, saved))
+    {
+        run_compound(script, node);
+    }
+    else
+    {
+        set_last_status(1);
+    }
+    restore_redirection(saved);
+    line_arena.rewind(mark);
+}
+
+// Compiles text, from the cache when it was seen before, and runs it
+void run_script(const string &text)
+{
+    shared_ptr<Script> script = compile(text);
+    if (!script)
+    {
+        set_last_status(2);
+        return;
+    }
+
+    bool outermost = loop_depth == 0 && function_depth == 0;
+    if (outermost)
+    {
+        aborted = false;
+        text_builtins_reset_interrupt();
+    }
+    run_node(*script, script->root);
+    if (outermost)
+    {
+        break_count = 0;
+        continue_count = 0;
+    }
+}
+
+bool script_function_defined(const string &name)
+{
+    return !functions.empty() && functions.count(name) > 0;
+}
+
+// Runs a function with args[1...] as $1, $2, ...; break and continue do not reach the
+// caller's loops
+void script_call_function(const vector<char *> &args)
+{
+    ScriptFunction function = functions[args[0]];
+    vector<string> parameters;
+    for (size_t i = 1; i < args.size() && args[i] != nullptr; i++)
+    {
+        parameters.push_back(args[i]);
+    }
+
+    vector<string> saved_parameters = set_positional_parameters(parameters);
+    int saved_loop_depth = loop_depth;
+    loop_depth = 0;
+    function_depth++;
+
+    run_node(*function.script, function.body);
+    if (returning)
+    {
+        returning = false;
+        set_last_status(return_status);
+    }
+    break_count = 0;
+    continue_count = 0;
+
+    function_depth--;
+    loop_depth = saved_loop_depth;
+    set_positional_parameters(saved_parameters);
+}
+
+// break [n] and continue [n]
+int builtin_break(BuiltinArgs args)
+{
+    string cmd = args[0];
+    long count = args.size() > 1 && args[1] != nullptr ? strtol(args[1], nullptr, 10) : 1;
+    if (count < 1)
+    {
+        cerr << cmd << ": " << args[1] << ": loop count out of range" << endl;
+        return 1;
+    }
+    if (loop_depth == 0)
+    {
+        cerr << cmd << ": only meaningful in a `for', `while', or `until' loop" << endl;
+        return 0;
+    }
+    count = min<long>(count, loop_depth);
+    if (cmd == "break")
+        break_count = count;
+    else
+        continue_count = count;
+    return 0;
+}
+
+// return [n]: leaves the function with status n, or the last command's status
+int builtin_return(BuiltinArgs args)
+{
+    if (function_depth == 0)
+    {
+        cerr << "return: can only `return' from a function" << endl;
+        return 1;
+    }
+    return_status = args.size() > 1 && args[1] != nullptr ? (int)(strtol(args[1], nullptr, 10) & 0xff) : last_status();
+    returning = true;
+    return 0;
+}
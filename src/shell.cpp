@@ -2,10 +2,27 @@
 #include "builtins.h"
 #include "pipeline.h"
 #include "redirection.h"
+#include "jobs.h"
+#include "timing.h"
+#include "trace.h"
+#include "arena.h"
+#include "variables.h"
+#include "globbing.h"
+#include "batch.h"
+#include "textutils.h"
+#include "du.h"
+#include "procsubst.h"
+#include "cmdsubst.h"
+#include "arith.h"
+#include "conditional.h"
+#include "script.h"
+#include "registry.h"
+#include "pathcache.h"
 #include <iostream>
 #include <vector>
 #include <string>
 #include <cstring>
+#include <algorithm>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -21,14 +38,20 @@ string shell_home_dir = ""; // Global variable to store shell's starting directo
 
 string get_prompt() // generates a dynamic prompt string user_name@system_name:current_directory>
 {
-    struct passwd *pw = getpwuid(getuid());
-    string username = pw ? pw->pw_name : "user";
-
-    char hostname[HOST_NAME_MAX];
-    if (gethostname(hostname, sizeof(hostname)) != 0)
+    // User and host lookups (NSS) are done once per shell, only the directory changes
+    static string user_host;
+    if (user_host.empty())
     {
-        perror("gethostname");
-        strcpy(hostname, "host");
+        struct passwd *pw = getpwuid(getuid());
+        string username = pw ? pw->pw_name : "user";
+
+        char hostname[HOST_NAME_MAX];
+        if (gethostname(hostname, sizeof(hostname)) != 0)
+        {
+            perror("gethostname");
+            strcpy(hostname, "host");
+        }
+        user_host = username + "@" + hostname + ":";
     }
 
     char cwd[PATH_MAX];
@@ -55,92 +78,443 @@ string get_prompt() // generates a dynamic prompt string user_name@system_name:c
         // If outside shell home tree, we show full absolute path (no change to dir)
     }
 
-    return username + "@" + hostname + ":" + dir + "> ";
+    return user_host + dir + "> ";
+}
+
+static bool is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n';
+}
+
+static bool is_name_char(char c)
+{
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+// Appends the value of $NAME, ${NAME}, $?, $$, $!, $#, $@ or $1 to $9 and returns the text after it;
+// a $ that starts none of these is kept as is
+static const char *expand_variable(const char *p, string &out)
+{
+    if (expand_special_variable(p[1], out))
+    {
+        return p + 2;
+    }
+
+    const char *name = p + 1;
+    const char *end = name;
+    if (*name == '{')
+    {
+        name++;
+        end = strchr(name, '}');
+        if (end == nullptr)
+        {
+            out += '$';
+            return p + 1;
+        }
+    }
+    else
+    {
+        while (is_name_char(*end))
+            end++;
+    }
+
+    if (end == name)
+    {
+        out += '$';
+        return p + 1;
+    }
+
+    const char *value = get_variable(string(name, end - name));
+    if (value)
+    {
+        out += value;
+    }
+    return *end == '}' ? end + 1 : end;
 }
 
+// Longest redirection operator at p, nullptr when there is none. <( and >( start a word
+static const char *match_redirection_operator(const char *p)
+{
+    if ((p[0] == '<' || p[0] == '>') && p[1] == '(')
+    {
+        return nullptr;
+    }
+    static const char *const operators[] = {"<<<", "<<-", "<<", "<>", "<&", "<", ">>", ">&", ">", "&>>", "&>"};
+    for (const char *op : operators)
+    {
+        if (strncmp(p, op, strlen(op)) == 0)
+        {
+            return op;
+        }
+    }
+    return nullptr;
+}
+
+// Matching ) of the ( before p, skipping quoted text and nested parentheses; nullptr
+// when the line ends first
+static const char *find_closing_paren(const char *p)
+{
+    int depth = 1;
+    char quote_char = '\0';
+    for (; *p; p++)
+    {
+        if (quote_char)
+        {
+            if (*p == quote_char)
+                quote_char = '\0';
+            else if (quote_char == '"' && *p == '\\' && p[1])
+                p++;
+        }
+        else if (*p == '\\' && p[1])
+            p++;
+        else if (*p == '\'' || *p == '"')
+            quote_char = *p;
+        else if (*p == '(')
+            depth++;
+        else if (*p == ')' && --depth == 0)
+            return p;
+    }
+    return nullptr;
+}
+
+// First ) of the )) closing $(( or ((, nullptr when the parentheses do not close that way,
+// as in $((cd /tmp); ls) which is a command substitution
+static const char *arith_end(const char *p)
+{
+    const char *end = find_closing_paren(p);
+    return end && end[1] == ')' ? end : nullptr;
+}
+
+// Closing ` of a backquoted command starting at p, nullptr when the line ends first. The
+// command is stored with the backslash of \`, \$ and a doubled backslash removed
+static const char *find_closing_backtick(const char *p, string &command)
+{
+    for (; *p; p++)
+    {
+        if (*p == '`')
+            return p;
+        if (*p == '\\' && (p[1] == '`' || p[1] == '\\' || p[1] == '$'))
+            p++;
+        command += *p;
+    }
+    return nullptr;
+}
+
+// Splits a command line into words and operators. Quotes are removed, $ expansions
+// are applied (unquoted results are split on blanks), unquoted wildcards are
+// expanded against the filesystem and the words are stored in line_arena, so they
+// stay valid until the next command line
 vector<char *> tokenize_with_redirection(char *command)
 {
     vector<char *> tokens;
-    vector<string> temp_tokens; // To store tokens as strings first
-    char *start = command;
+    static string word;    // reused between calls, tokenizing does not allocate once warm
+    static string pattern; // word with quoted characters escaped, for globbing
+    static vector<string> matches;
+    bool has_word = false;  // "" is a word even though it is empty
+    bool has_wildcard = false;
+    bool double_bracket = false; // inside [[ ]], words are kept whole in pattern form
+    const char *p = command;
+    word.clear(); // a process substitution's child starts here mid-word
+    pattern.clear();
+
+    // Directories are listed and files tested at most once per command
+    glob_reset_cache();
+    command_substitution_reset();
+
+    auto add_quoted = [&](char c)
+    {
+        word += c;
+        // [[ ]] also escapes regular expression characters, for =~
+        if (c == '*' || c == '?' || c == '[' || c == ']' || c == '\\' || (double_bracket && ispunct((unsigned char)c)))
+            pattern += '\\';
+        pattern += c;
+    };
+
+    auto add_unquoted = [&](char c)
+    {
+        word += c;
+        pattern += c;
+        has_wildcard = has_wildcard || c == '*' || c == '?' || c == '[';
+    };
+
+    auto emit_word = [&]()
+    {
+        // Redirection targets, leading assignments and the [[ keyword are not globbed
+        bool after_operator = !tokens.empty() && is_redirection_word(tokens.back());
+        bool opens_bracket = tokens.empty() && word == "[[" && !has_word;
+        bool assignment = is_assignment(word.c_str()) && (tokens.empty() || is_assignment(tokens.back()));
+
+        matches.clear();
+        if (double_bracket)
+        {
+            // [[ ]] is not globbed; its == matches the pattern form, quoting included
+            tokens.push_back(line_arena.copy(pattern.data(), pattern.size()));
+            double_bracket = pattern != "]]";
+        }
+        else if (has_wildcard && !after_operator && !assignment && !opens_bracket && glob_expand(pattern, matches))
+        {
+            for (const string &match : matches)
+            {
+                tokens.push_back(line_arena.copy(match.data(), match.size()));
+            }
+        }
+        else if (!word.empty() || has_word)
+        {
+            tokens.push_back(line_arena.copy(word.data(), word.size()));
+            double_bracket = opens_bracket;
+        }
+        word.clear();
+        pattern.clear();
+        has_word = false;
+        has_wildcard = false;
+    };
+
+    // Unquoted expansions are split into words on blanks and globbed, except in the value
+    // of a leading NAME=value word
+    auto add_expansion = [&](const string &value, char quote_char)
+    {
+        bool assignment = is_assignment(word.c_str()) && (tokens.empty() || is_assignment(tokens.back()));
+        for (char v : value)
+        {
+            if (quote_char)
+                add_quoted(v);
+            else if (double_bracket)
+                add_unquoted(v);
+            else if (assignment)
+                add_quoted(v);
+            else if (is_blank(v))
+                emit_word();
+            else
+                add_unquoted(v);
+        }
+    };
 
-    while (*start)
+    while (*p)
     {
         // Skip whitespace
-        while (*start && (*start == ' ' || *start == '\t' || *start == '\n'))
-            start++;
+        while (is_blank(*p))
+            p++;
 
-        if (*start == '\0')
+        if (*p == '\0')
             break;
 
-        // Check for redirection operators
-        if (*start == '>' && *(start + 1) == '>')
+        // Redirection operators, with an io-number such as the 2 of 2>&1 in front. The
+        // word after >& or <& is a descriptor even when an operator follows it
+        size_t digits = 0;
+        const char *previous = tokens.empty() ? "" : tokens.back();
+        bool after_dup = is_redirection_word(previous) && previous[strlen(previous) - 1] == '&';
+        while (!after_dup && p[digits] >= '0' && p[digits] <= '9')
+            digits++;
+        const char *op = double_bracket ? nullptr : match_redirection_operator(p + digits);
+        if (op && (digits == 0 || op[0] != '&'))
         {
-            // >> operator
-            temp_tokens.push_back(">>");
-            start += 2;
+            size_t length = digits + strlen(op);
+            tokens.push_back(operator_word(p, length));
+            p += length;
         }
-        else if (*start == '<' || *start == '>')
+        else if (tokens.empty() && p[0] == '(' && p[1] == '(')
         {
-            // < or > operator
-            temp_tokens.push_back(string(1, *start));
-            start++;
+            // (( expression )) at the start of a command, the builtin gets the text as one word
+            const char *end = find_closing_paren(p + 2);
+            if (!end || end[1] != ')')
+            {
+                cerr << "shell: syntax error: missing '))'" << endl;
+                set_last_status(2);
+                tokens.clear();
+                return tokens;
+            }
+            tokens.push_back(const_cast<char *>("(("));
+            tokens.push_back(line_arena.copy(p + 2, end - p - 2));
+            p = end + 2;
+        }
+        else if (double_bracket && p[0] == '|' && p[1] == '|')
+        {
+            tokens.push_back(const_cast<char *>("||"));
+            p += 2;
         }
-        else if (*start == '|')
+        else if (*p == '|')
         {
             // | operator
-            temp_tokens.push_back("|");
-            start++;
+            tokens.push_back(operator_word(p, 1));
+            p++;
         }
         else
         {
-            // Regular token
-            char *token_start = start;
-
-            // Find end of token
-            while (*start && *start != ' ' && *start != '\t' && *start != '\n' &&
-                   *start != '<' && *start != '>' && *start != '|')
-                start++;
-
-            // Add token
-            if (start > token_start)
+            // Regular word, runs until an unquoted blank or operator
+            char quote_char = '\0';
+            while (*p && (quote_char || (!is_blank(*p) && ((*p != '<' && *p != '>') || p[1] == '(' || double_bracket) && *p != '|' && !(*p == '&' && p[1] == '>'))))
             {
-                temp_tokens.push_back(string(token_start, start - token_start));
+                char c = *p;
+                if (double_bracket && (c == '<' || c == '>'))
+                {
+                    // String comparison in [[ ]], escaped so it is not taken for a redirection
+                    add_quoted(c);
+                    p++;
+                }
+                else if (quote_char == '\0' && (c == '<' || c == '>') && p[1] == '(')
+                {
+                    // Process substitution, the word gets the /dev/fd path of a pipe to the command
+                    const char *end = find_closing_paren(p + 2);
+                    string path = end ? procsubst_start(string(p + 2, end - p - 2), c == '>') : "";
+                    if (path.empty())
+                    {
+                        if (!end)
+                            cerr << "shell: syntax error: missing ')' after " << c << "(" << endl;
+                        set_last_status(end ? 1 : 2);
+                        tokens.clear();
+                        return tokens;
+                    }
+                    for (char v : path)
+                        add_quoted(v);
+                    has_word = true;
+                    p = end + 1;
+                }
+                else if (quote_char == '\'')
+                {
+                    // Single quotes keep everything literally
+                    if (c == '\'')
+                        quote_char = '\0';
+                    else
+                        add_quoted(c);
+                    p++;
+                }
+                else if (c == '\\' && p[1] != '\0')
+                {
+                    // Inside double quotes only \$ \" \\ and \` are escapes
+                    if (quote_char == '"' && !strchr("$\"\\`", p[1]))
+                        add_quoted(c);
+                    add_quoted(p[1]);
+                    p += 2;
+                }
+                else if (c == '$' && p[1] == '(' && p[2] == '(' && arith_end(p + 3))
+                {
+                    // Arithmetic expansion, evaluated in-process
+                    const char *end = arith_end(p + 3);
+                    long long result;
+                    if (!arith_evaluate(string(p + 3, end - p - 3), result))
+                    {
+                        set_last_status(1);
+                        tokens.clear();
+                        return tokens;
+                    }
+                    add_expansion(to_string(result), quote_char);
+                    p = end + 2;
+                }
+                else if ((c == '$' && p[1] == '(') || (c == '`' && quote_char != '\''))
+                {
+                    // Command substitution, its output is expanded like a variable
+                    string command;
+                    const char *end = c == '`' ? find_closing_backtick(p + 1, command) : find_closing_paren(p + 2);
+                    if (!end)
+                    {
+                        cerr << "shell: syntax error: missing " << (c == '`' ? "closing `" : "')' after $(") << endl;
+                        set_last_status(2);
+                        tokens.clear();
+                        return tokens;
+                    }
+                    if (c == '$')
+                        command.assign(p + 2, end - p - 2);
+                    static string value;
+                    value.clear();
+                    if (!command_substitution(command, value))
+                    {
+                        tokens.clear(); // interrupted, the line is abandoned
+                        return tokens;
+                    }
+                    add_expansion(value, quote_char);
+                    p = end + 1;
+                }
+                else if (c == '$')
+                {
+                    static string value;
+                    value.clear();
+                    p = expand_variable(p, value);
+                    add_expansion(value, quote_char);
+                }
+                else if (quote_char == '\0' && (c == '"' || c == '\''))
+                {
+                    quote_char = c;
+                    has_word = true;
+                    p++;
+                }
+                else if (quote_char == '"' && c == '"')
+                {
+                    quote_char = '\0';
+                    p++;
+                }
+                else
+                {
+                    if (quote_char)
+                        add_quoted(c);
+                    else
+                        add_unquoted(c);
+                    p++;
+                }
             }
+            emit_word();
         }
     }
 
-    // Convert back to char* vector
-    static vector<string> stored_tokens;
-    stored_tokens = temp_tokens;
-
-    for (auto &token : stored_tokens)
-    {
-        tokens.push_back(const_cast<char *>(token.c_str()));
-    }
-
     return tokens;
 }
 
+// Kept for callers that tokenize plain command lines, the lexer handles both forms
 vector<char *> tokenize_simple(char *command)
 {
-    // Check if command contains redirection operators
-    if (strstr(command, "<") || strstr(command, ">") || strstr(command, "|"))
-    {
-        return tokenize_with_redirection(command);
-    }
-    else
-    {
-        vector<char *> tokens;
-        char *token = strtok(command, " \t\n");
+    return tokenize_with_redirection(command);
+}
 
-        while (token != nullptr)
+// Body of a here-document with an unquoted delimiter as the command reads it: $ and `
+// expansions are applied, \ only escapes $ ` \ and a newline, quotes are ordinary text
+string expand_heredoc_text(const string &text)
+{
+    string out;
+    const char *p = text.c_str();
+    while (*p)
+    {
+        if (p[0] == '\\' && p[1] == '\n')
+        {
+            p += 2;
+        }
+        else if (p[0] == '\\' && (p[1] == '$' || p[1] == '`' || p[1] == '\\'))
         {
-            tokens.push_back(token);
-            token = strtok(nullptr, " \t\n");
+            out += p[1];
+            p += 2;
+        }
+        else if (p[0] == '$' && p[1] == '(' && p[2] == '(' && arith_end(p + 3))
+        {
+            const char *end = arith_end(p + 3);
+            long long result;
+            if (arith_evaluate(string(p + 3, end - p - 3), result))
+                out += to_string(result);
+            p = end + 2;
+        }
+        else if ((p[0] == '$' && p[1] == '(') || p[0] == '`')
+        {
+            string command;
+            const char *end = p[0] == '`' ? find_closing_backtick(p + 1, command) : find_closing_paren(p + 2);
+            if (!end)
+            {
+                // Unterminated, kept as written
+                out += p;
+                break;
+            }
+            if (p[0] == '$')
+                command.assign(p + 2, end - p - 2);
+            if (!command_substitution(command, out))
+                break;
+            p = end + 1;
+        }
+        else if (p[0] == '$')
+        {
+            p = expand_variable(p, out);
+        }
+        else
+        {
+            out += *p++;
         }
-        return tokens;
     }
+    return out;
 }
 
 void execute_command(vector<char *> &args, bool background)
@@ -148,11 +522,39 @@ void execute_command(vector<char *> &args, bool background)
     // Parse redirection before executing
     RedirectionInfo redir = parse_redirection(args);
 
+    string command_text;
+    for (size_t i = 0; i < args.size() && args[i] != nullptr; i++)
+    {
+        if (i > 0)
+            command_text += " ";
+        command_text += args[i];
+    }
+    execute_redirected_command(redir, command_text, background);
+}
+
+// Forks and execs a command whose redirection plan is already compiled
+void execute_redirected_command(const RedirectionInfo &redir, const string &command_text, bool background)
+{
     if (redir.clean_args.empty() || redir.clean_args[0] == nullptr)
     {
         return;
     }
 
+    // Resolved and built before fork so children exec the cached program and array as is
+    const char *program = is_assignment(redir.clean_args[0]) ? nullptr : command_program(redir.clean_args[0]);
+    char **envp = exported_environ();
+
+    // Argument lists beyond ARG_MAX run as several execs when batching is on
+    if (batch_requested() && !is_assignment(redir.clean_args[0]) && exceeds_arg_max(redir.clean_args.data(), envp))
+    {
+        string batch_text = redir.clean_args[0];
+        batch_text += " ...";
+        execute_batched(redir, background, envp, batch_text);
+        return;
+    }
+
+    TraceSpan fork_span("fork", 0);
+    fork_span.command(redir.clean_args[0]);
     pid_t pid = fork();
     if (pid < 0)
     {
@@ -161,22 +563,45 @@ void execute_command(vector<char *> &args, bool background)
     }
     else if (pid == 0)
     {
-        // Child process - restore default signal handlers
-        signal(SIGINT, SIG_DFL);
-        signal(SIGTSTP, SIG_DFL);
-        signal(SIGCHLD, SIG_DFL);
+        // Child process - own process group, default signal handlers
+        setup_child_process(0, !background);
+        TraceSpan exec_span("exec", 0);
+        exec_span.command(redir.clean_args[0]);
 
         // Setup redirection in child process
+        procsubst_inherit();
         if (!setup_redirection(redir))
         {
             exit(EXIT_FAILURE);
         }
 
-        if (execvp(redir.clean_args[0], redir.clean_args.data()) == -1)
+        // NAME=value prefixes only reach this command's environment
+        char **argv = const_cast<char **>(redir.clean_args.data());
+        if (is_assignment(argv[0]))
+        {
+            argv = apply_prefix_assignments(argv);
+            envp = exported_environ();
+            if (argv[0] == nullptr)
+            {
+                exit(EXIT_SUCCESS);
+            }
+        }
+
+        exec_span.finish();
+        trace_flush();
+        if (program)
+        {
+            execve(program, argv, envp); // on failure execvpe searches and reports as usual
+        }
+        if (execvpe(argv[0], argv, envp) == -1)
         {
             if (errno == ENOENT)
             {
-                cerr << redir.clean_args[0] << ": command not found" << endl;
+                cerr << argv[0] << ": command not found" << endl;
+            }
+            else if (errno == E2BIG)
+            {
+                cerr << argv[0] << ": argument list too long (see 'batched' and 'set -o auto-batch')" << endl;
             }
             else
             {
@@ -187,22 +612,118 @@ void execute_command(vector<char *> &args, bool background)
     }
     else
     {
+        fork_span.child(pid);
+        fork_span.finish();
+        place_in_job_group(pid, pid);
+        timing_stage_spawned(pid, command_text);
+
         if (background)
         {
-            cout << "Background process started with PID: " << pid << endl;
+            bool quiet = background_launch_quiet();
+            int job_id = add_job(pid, {pid}, command_text, JobState::Running);
+            if (!quiet)
+            {
+                cout << "[" << job_id << "] Background process started with PID: " << pid << endl;
+            }
+            set_last_background_pid(pid);
+            set_last_status(0);
         }
         else
         {
-            foreground_pid = pid;
-            int status;
-            if (waitpid(pid, &status, 0) == -1)
-            {
-                if (errno != EINTR)
-                {
-                    perror("waitpid");
-                }
-            }
-            foreground_pid = -1;
+            set_last_status_from_wait(wait_for_foreground(pid, {pid}, command_text));
+        }
+    }
+}
+
+static void execute_tokens(vector<char *> &tokens, bool background);
+
+void parse_semicolon_commands(char *input)
+{
+    if (input == nullptr || strlen(input) == 0)
+        return;
+
+    // Control flow, functions, && and || go through the compiled script representation
+    if (script_needed(input))
+    {
+        run_script(input);
+        return;
+    }
+
+    TraceSpan parse_span("parse");
+    parse_span.command(input);
+
+    // Created a copy to work with
+    string input_str(input);
+
+    // Check for semicolons inside quotes, backquotes, $(...) or <(...) and temporarily replace them
+    bool in_quotes = false;
+    char quote_char = '\0';
+    int paren_depth = 0;
+
+    for (size_t i = 0; i < input_str.length(); i++)
+    {
+        if (!in_quotes && (input_str[i] == '"' || input_str[i] == '\'' || input_str[i] == '`'))
+        {
+            in_quotes = true;
+            quote_char = input_str[i];
+        }
+        else if (in_quotes && input_str[i] == quote_char)
+        {
+            in_quotes = false;
+            quote_char = '\0';
+        }
+        else if (!in_quotes && (input_str[i] == '(' || input_str[i] == ')'))
+        {
+            paren_depth = max(0, paren_depth + (input_str[i] == '(' ? 1 : -1));
+        }
+        else if ((in_quotes || paren_depth > 0) && input_str[i] == ';')
+        {
+            input_str[i] = '\1'; // Temporary placeholder
+        }
+    }
+
+    // Split on semicolons
+    vector<string> commands;
+    size_t start = 0;
+    size_t pos = 0;
+
+    while ((pos = input_str.find(';', start)) != string::npos)
+    {
+        if (pos > start)
+        {
+            commands.push_back(input_str.substr(start, pos - start));
+        }
+        start = pos + 1;
+    }
+
+    // Add the last command
+    if (start < input_str.length())
+    {
+        commands.push_back(input_str.substr(start));
+    }
+
+    parse_span.finish();
+
+    // Execute each command
+    for (auto &cmd : commands)
+    {
+        // Restore protected semicolons, the positions are in the whole line
+        replace(cmd.begin(), cmd.end(), '\1', ';');
+
+        // Trim whitespace
+        size_t first = cmd.find_first_not_of(" \t\n");
+        if (first == string::npos)
+            continue;
+
+        size_t last = cmd.find_last_not_of(" \t\n");
+        cmd = cmd.substr(first, last - first + 1);
+
+        if (!cmd.empty())
+        {
+            // Created a mutable copy for parse_and_execute
+            vector<char> cmd_buffer(cmd.begin(), cmd.end());
+            cmd_buffer.push_back('\0');
+            parse_and_execute(cmd_buffer.data());
         }
     }
 }
@@ -266,25 +787,124 @@ void parse_and_execute(char *command_line)
         }
     }
 
+    // With max-jobs set, a background line may have to wait for a free slot
+    if (background && !reserve_background_slot(command_line))
+    {
+        return;
+    }
+
     // Make a copy for tokenization
     string command_copy(command_line);
     vector<char> command_buffer(command_copy.begin(), command_copy.end());
     command_buffer.push_back('\0'); // Null terminate
 
+    TraceSpan tokenize_span("tokenize");
+    tokenize_span.command(command_line);
     vector<char *> tokens = tokenize_simple(command_buffer.data());
+    tokenize_span.finish();
+
+    // time keyword: run the rest of the line and report what each stage cost
+    if (parse_time_prefix(tokens) && background)
+    {
+        cerr << "time: not supported for background jobs\n";
+    }
 
-    if (tokens.empty())
+    // batched prefix: split oversized argument lists instead of failing with E2BIG
+    parse_batch_prefix(tokens);
+
+    execute_tokens(tokens, background);
+    procsubst_finish(background);
+    timing_finish();
+    batch_finish();
+
+    if (background)
+    {
+        finish_background_launch();
+    }
+}
+
+// Runs words that need no expansion, as compiled script commands hold them
+void execute_words(vector<char *> &words)
+{
+    execute_tokens(words, false);
+    procsubst_finish(false);
+}
+
+// Starts a line that was queued by the background scheduler
+void execute_background_line(const string &line)
+{
+    string text = line + " &";
+    vector<char> buffer(text.begin(), text.end());
+    buffer.push_back('\0');
+    parse_and_execute(buffer.data());
+}
+
+// Runs one tokenized command or pipeline
+static void execute_tokens(vector<char *> &tokens, bool background)
+{
+    if (tokens.empty() || tokens[0] == nullptr)
     {
         return;
     }
 
+    // A line of NAME=value words only sets shell variables; $? is that of the last
+    // substitution in the values, if any
+    if (apply_assignments(tokens, false))
+    {
+        if (!command_substitution_ran())
+            set_last_status(0);
+        return;
+    }
+
+    // NAME=value in front of a builtin or function, as in IFS=: read a b, only holds while
+    // it runs
+    if (is_assignment(tokens[0]))
+    {
+        size_t i = 0;
+        while (i < tokens.size() && tokens[i] != nullptr && is_assignment(tokens[i]))
+            i++;
+        if (i < tokens.size() && tokens[i] != nullptr && (is_builtin_command(tokens[i]) || script_function_defined(tokens[i])))
+        {
+            vector<SavedVariable> saved = apply_temporary_assignments(tokens);
+            execute_tokens(tokens, background);
+            restore_variables(saved);
+            return;
+        }
+    }
+
     string cmd(tokens[0]);
 
+    // Shell functions come before builtins and commands of the same name
+    if (script_function_defined(cmd))
+    {
+        if (background)
+        {
+            cerr << "Background execution not supported for shell functions\n";
+            return;
+        }
+        RedirectionInfo redir = parse_redirection(tokens);
+        SavedFds saved;
+        if (redir.failed)
+        {
+            return;
+        }
+        if (redir.steps.empty() || setup_builtin_redirection(redir, saved))
+        {
+            script_call_function(redir.clean_args);
+        }
+        else
+        {
+            set_last_status(1);
+        }
+        restore_redirection(saved);
+        return;
+    }
+
     // Check for pipelines
     bool has_pipe = false;
     for (char *token : tokens)
     {
-        if (token && string(token) == "|")
+        if (token && is_operator_word(token) && strcmp(token, "|") == 0)
         {
             has_pipe = true;
             break;
@@ -310,15 +930,26 @@ void parse_and_execute(char *command_line)
         return;
     }
 
-    // Check for builtins that don't support background
-    if (background && (cmd == "cd" || cmd == "pwd" || cmd == "echo" || cmd == "ls" || cmd == "pinfo" || cmd == "search" || cmd == "history"))
+    // A builtin in the background is forked as a job when it leaves the shell alone
+    const BuiltinDescriptor *builtin = find_builtin(tokens[0]);
+    if (background && builtin)
     {
-        cerr << "Background execution not supported for built-in commands\n";
+        if (!(builtin->flags & BUILTIN_BACKGROUND_SAFE))
+        {
+            cerr << "Background execution not supported for built-in commands\n";
+            return;
+        }
+        Pipeline pipeline = parse_pipeline(tokens);
+        pipeline.background = true;
+        execute_pipeline(pipeline);
         return;
     }
 
+    // In-process text tools and du; background jobs and other options run the real tool
+    bool text_builtin = !background && (is_text_builtin(tokens) || du_builtin_supported(tokens));
+
     // Check if it's a builtin
-    if (cmd == "cd" || cmd == "pwd" || cmd == "echo" || cmd == "ls" || cmd == "exit" || cmd == "pinfo" || cmd == "search" || cmd == "history")
+    if (builtin || text_builtin)
     {
         RedirectionInfo redir = parse_redirection(tokens);
 
@@ -327,26 +958,22 @@ void parse_and_execute(char *command_line)
             return;
         }
 
-        // Save original stdin/stdout for built-ins
-        int saved_stdin = -1, saved_stdout = -1;
-        if (redir.has_input_redirect || redir.has_output_redirect)
+        // Only the descriptors the plan replaces are saved and restored
+        SavedFds saved;
+        if (!redir.steps.empty() && !setup_builtin_redirection(redir, saved))
         {
-            saved_stdin = dup(STDIN_FILENO);
-            saved_stdout = dup(STDOUT_FILENO);
-
-            if (!setup_redirection(redir))
-            {
-                // Restore if redirection failed
-                restore_stdio(saved_stdin, saved_stdout);
-                return;
-            }
+            restore_redirection(saved);
+            set_last_status(1);
+            return;
         }
 
         // Execute builtin with clean arguments
-        handle_builtin(redir.clean_args);
+        timing_builtin_begin(cmd);
+        int status = handle_builtin(redir.clean_args);
+        timing_builtin_end(status);
+        set_last_status(status);
 
-        // Restore original stdin/stdout
-        restore_stdio(saved_stdin, saved_stdout);
+        restore_redirection(saved);
         return;
     }
 
@@ -0,0 +1,1287 @@
+#include "sort.h"
+#include "variables.h"
+#include "redirection.h"
+#include "trace.h"
+#include <iostream>
+#include <vector>
+#include <string>
+#include <memory>
+#include <thread>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+// set -o sort-buffer=SIZE; 0 uses a quarter of physical memory, capped at 2 GiB
+static size_t sort_buffer_setting = 0;
+
+static const size_t READ_BLOCK = 1 << 20;
+static const size_t MAX_MERGE_WAYS = 64;
+static const size_t PARALLEL_MIN_LINES = 1 << 16;
+static const size_t RADIX_MIN_GROUP = 32;
+
+// One -k key; field 0 stands for the whole line
+struct SortKey
+{
+    size_t start_field = 0;
+    size_t end_field = 0; // 0: to the end of the line
+    bool numeric = false;
+    bool reverse = false;
+    bool skip_blanks = false;
+    bool has_modifiers = false; // keys without n/r/b take the global options
+};
+
+struct SortOptions
+{
+    vector<SortKey> keys;
+    bool numeric = false;
+    bool reverse = false;
+    bool unique = false;
+    bool stable = false;
+    bool skip_blanks = false;
+    int separator = -1; // -t, -1 splits at blank-to-nonblank transitions
+    size_t buffer_size = 0;
+    unsigned threads = 0;
+    string temp_dir;
+    vector<const char *> files;
+};
+
+// A line of the current chunk or run; the first key's position and its first
+// 8 bytes are cached so most comparisons never rescan the fields
+struct SortLine
+{
+    const char *data;
+    uint32_t length;
+    uint32_t key_start;
+    uint32_t key_length;
+    uint64_t prefix;
+};
+
+// K (the default unit), M, G, T or b suffixes, as sort -S takes them
+static bool parse_size(const char *text, size_t &size)
+{
+    char *end = nullptr;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (end == text || errno != 0)
+    {
+        return false;
+    }
+
+    unsigned long long unit = 1024;
+    if (*end != '\0')
+    {
+        switch (*end)
+        {
+        case 'b':
+            unit = 1;
+            break;
+        case 'k':
+        case 'K':
+            unit = 1024;
+            break;
+        case 'M':
+            unit = 1024ULL * 1024;
+            break;
+        case 'G':
+            unit = 1024ULL * 1024 * 1024;
+            break;
+        case 'T':
+            unit = 1024ULL * 1024 * 1024 * 1024;
+            break;
+        default:
+            return false;
+        }
+        if (end[1] != '\0')
+        {
+            return false;
+        }
+    }
+    size = value * unit;
+    return size > 0;
+}
+
+// F[,F] with n, r and b modifiers; character offsets (F.C) go to the real sort
+static bool parse_key(const char *spec, SortKey &key)
+{
+    const char *p = spec;
+    for (int part = 0; part < 2; part++)
+    {
+        size_t field = 0;
+        const char *digits = p;
+        while (*p >= '0' && *p <= '9')
+        {
+            field = field * 10 + (*p++ - '0');
+        }
+        if (p == digits || field == 0)
+        {
+            return false;
+        }
+        (part == 0 ? key.start_field : key.end_field) = field;
+
+        for (; *p && *p != ','; p++)
+        {
+            if (*p == 'n')
+                key.numeric = true;
+            else if (*p == 'r')
+                key.reverse = true;
+            else if (*p == 'b')
+                key.skip_blanks = true;
+            else
+                return false;
+            key.has_modifiers = true;
+        }
+        if (*p != ',')
+        {
+            break;
+        }
+        p++;
+    }
+    return *p == '\0';
+}
+
+// The builtin orders bytes, which is what sort does only under C-like collation
+static bool byte_collation()
+{
+    for (const char *name : {"LC_ALL", "LC_COLLATE", "LANG"})
+    {
+        const char *value = get_variable(name);
+        if (value && *value)
+        {
+            return strcmp(value, "C") == 0 || strcmp(value, "POSIX") == 0 || strncmp(value, "C.", 2) == 0;
+        }
+    }
+    return true;
+}
+
+static bool parse_sort_command(const vector<char *> &args, SortOptions &options)
+{
+    if (args.empty() || args[0] == nullptr || strcmp(args[0], "sort") != 0)
+    {
+        return false;
+    }
+
+    bool options_done = false;
+    for (size_t i = 1; i < args.size() && args[i] != nullptr; i++)
+    {
+        const char *arg = args[i];
+        if (is_redirection_word(arg))
+        {
+            i++;
+            if (i >= args.size() || args[i] == nullptr)
+            {
+                return false;
+            }
+            continue;
+        }
+
+        if (options_done || arg[0] != '-' || arg[1] == '\0')
+        {
+            options.files.push_back(arg);
+            continue;
+        }
+        if (strcmp(arg, "--") == 0)
+        {
+            options_done = true;
+            continue;
+        }
+        if (strncmp(arg, "--parallel=", 11) == 0)
+        {
+            long threads = atol(arg + 11);
+            if (threads <= 0)
+            {
+                return false;
+            }
+            options.threads = threads;
+            continue;
+        }
+        if (arg[1] == '-')
+        {
+            return false;
+        }
+
+        for (const char *flag = arg + 1; *flag; flag++)
+        {
+            if (*flag == 'n')
+                options.numeric = true;
+            else if (*flag == 'r')
+                options.reverse = true;
+            else if (*flag == 'u')
+                options.unique = true;
+            else if (*flag == 's')
+                options.stable = true;
+            else if (*flag == 'b')
+                options.skip_blanks = true;
+            else if (*flag == 'k' || *flag == 't' || *flag == 'S' || *flag == 'T')
+            {
+                const char *value = flag[1] ? flag + 1 : (i + 1 < args.size() ? args[++i] : nullptr);
+                if (value == nullptr)
+                {
+                    return false;
+                }
+                if (*flag == 'k')
+                {
+                    SortKey key;
+                    if (!parse_key(value, key))
+                    {
+                        return false;
+                    }
+                    options.keys.push_back(key);
+                }
+                else if (*flag == 't')
+                {
+                    if (value[0] == '\0' || value[1] != '\0')
+                    {
+                        return false;
+                    }
+                    options.separator = (unsigned char)value[0];
+                }
+                else if (*flag == 'S')
+                {
+                    if (!parse_size(value, options.buffer_size))
+                    {
+                        return false;
+                    }
+                }
+                else
+                {
+                    options.temp_dir = value;
+                }
+                break;
+            }
+            else
+                return false;
+        }
+    }
+    return true;
+}
+
+bool sort_builtin_supported(const vector<char *> &args)
+{
+    SortOptions options;
+    return parse_sort_command(args, options) && byte_collation();
+}
+
+bool sort_reads_stdin(const vector<char *> &args)
+{
+    SortOptions options;
+    if (!parse_sort_command(args, options) || options.files.empty())
+    {
+        return true;
+    }
+    for (const char *file : options.files)
+    {
+        if (strcmp(file, "-") == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool set_sort_buffer(const string &size)
+{
+    if (size.empty())
+    {
+        sort_buffer_setting = 0;
+        return true;
+    }
+    return parse_size(size.c_str(), sort_buffer_setting);
+}
+
+string get_sort_buffer()
+{
+    if (sort_buffer_setting == 0)
+    {
+        return "auto";
+    }
+    if (sort_buffer_setting % (1 << 20) == 0)
+    {
+        return to_string(sort_buffer_setting >> 20) + "M";
+    }
+    return to_string(sort_buffer_setting >> 10) + "K";
+}
+
+static size_t default_buffer_size()
+{
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t physical = pages > 0 && page_size > 0 ? (size_t)pages * page_size : (1UL << 30);
+    return max<size_t>(64UL << 20, min<size_t>(physical / 4, 2UL << 30));
+}
+
+static bool is_blank(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+static int compare_bytes(const char *a, size_t a_length, const char *b, size_t b_length)
+{
+    size_t common = min(a_length, b_length);
+    int c = common ? memcmp(a, b, common) : 0;
+    if (c != 0)
+    {
+        return c;
+    }
+    return a_length < b_length ? -1 : (a_length > b_length ? 1 : 0);
+}
+
+// sort -n in the C locale: optional '-', digits, optional fraction; anything else
+// counts as zero. Compared digit by digit, so length is not limited
+static int compare_numbers(const char *a, size_t a_length, const char *b, size_t b_length)
+{
+    struct Number
+    {
+        bool negative = false;
+        const char *integer = nullptr;
+        size_t integer_length = 0;
+        const char *fraction = nullptr;
+        size_t fraction_length = 0;
+    };
+
+    auto parse = [](const char *p, size_t length)
+    {
+        Number number;
+        const char *end = p + length;
+        while (p < end && is_blank(*p))
+            p++;
+        if (p < end && *p == '-')
+        {
+            number.negative = true;
+            p++;
+        }
+        while (p < end && *p == '0')
+            p++;
+        number.integer = p;
+        while (p < end && *p >= '0' && *p <= '9')
+            p++;
+        number.integer_length = p - number.integer;
+        if (p < end && *p == '.')
+        {
+            number.fraction = ++p;
+            while (p < end && *p >= '0' && *p <= '9')
+                p++;
+            number.fraction_length = p - number.fraction;
+            while (number.fraction_length > 0 && number.fraction[number.fraction_length - 1] == '0')
+                number.fraction_length--;
+        }
+        if (number.integer_length == 0 && number.fraction_length == 0)
+        {
+            number.negative = false; // -0 is 0
+        }
+        return number;
+    };
+
+    Number x = parse(a, a_length);
+    Number y = parse(b, b_length);
+    if (x.negative != y.negative)
+    {
+        return x.negative ? -1 : 1;
+    }
+
+    int c;
+    if (x.integer_length != y.integer_length)
+    {
+        c = x.integer_length < y.integer_length ? -1 : 1;
+    }
+    else
+    {
+        c = memcmp(x.integer, y.integer, x.integer_length);
+        if (c == 0)
+        {
+            c = compare_bytes(x.fraction, x.fraction_length, y.fraction, y.fraction_length);
+        }
+    }
+    return x.negative ? -c : c;
+}
+
+// Order-preserving 64-bit image of a sort -n number: integers beyond 15 digits saturate
+// and fraction digits beyond 15 are cut, both only make more lines tie on the prefix
+static uint64_t numeric_prefix(const char *p, size_t length)
+{
+    const char *end = p + length;
+    while (p < end && is_blank(*p))
+        p++;
+    bool negative = p < end && *p == '-';
+    if (negative)
+        p++;
+    while (p < end && *p == '0')
+        p++;
+
+    uint64_t integer = 0;
+    int digits = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+    {
+        if (digits < 15)
+            integer = integer * 10 + (*p - '0');
+    }
+
+    double value = 1e15;
+    if (digits <= 15)
+    {
+        uint64_t fraction = 0;
+        int fraction_digits = 0;
+        if (p < end && *p == '.')
+        {
+            for (p++; p < end && *p >= '0' && *p <= '9' && fraction_digits < 15; p++, fraction_digits++)
+                fraction = fraction * 10 + (*p - '0');
+        }
+        for (; fraction_digits < 15; fraction_digits++)
+            fraction *= 10;
+        value = (double)integer + (double)fraction / 1e15;
+    }
+
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    const uint64_t sign = 1ULL << 63;
+    return negative && value != 0 ? ~bits & ~sign : bits | sign; // -0 is 0
+}
+
+// Total order of the command line's keys, with the whole line as the last resort
+class LineOrder
+{
+public:
+    explicit LineOrder(const SortOptions &options) : options(options)
+    {
+        keys = options.keys;
+        if (keys.empty())
+        {
+            keys.push_back(SortKey()); // whole line
+        }
+        for (SortKey &key : keys)
+        {
+            if (!key.has_modifiers)
+            {
+                key.numeric = options.numeric;
+                key.reverse = options.reverse;
+                key.skip_blanks = options.skip_blanks;
+            }
+        }
+
+        // -s and -u compare keys only; a plain whole-line key needs no tie-break
+        last_resort = !options.stable && !options.unique &&
+                      !(options.keys.empty() && !options.numeric && !options.skip_blanks);
+    }
+
+    void prepare(SortLine &line) const
+    {
+        size_t start, end;
+        key_range(line.data, line.length, keys[0], start, end);
+        line.key_start = start;
+        line.key_length = end - start;
+
+        if (keys[0].numeric)
+        {
+            uint64_t prefix = numeric_prefix(line.data + start, end - start);
+            line.prefix = keys[0].reverse ? ~prefix : prefix;
+        }
+        else
+        {
+            line.prefix = key_bytes(line, 0);
+        }
+    }
+
+    // Bytes offset..offset+7 of the first key, big-endian and zero padded, inverted
+    // under -r so prefixes always ascend in output order
+    uint64_t key_bytes(const SortLine &line, size_t offset) const
+    {
+        uint64_t prefix = 0;
+        size_t n = line.key_length > offset ? min<size_t>(8, line.key_length - offset) : 0;
+        const char *key = line.data + line.key_start + offset;
+        for (size_t i = 0; i < n; i++)
+        {
+            prefix |= (uint64_t)(unsigned char)key[i] << (56 - 8 * i);
+        }
+        return keys[0].reverse ? ~prefix : prefix;
+    }
+
+    // Lines tied on the prefix can be split further by the next key bytes
+    bool byte_key() const
+    {
+        return !keys[0].numeric;
+    }
+
+    int compare(const SortLine &a, const SortLine &b) const
+    {
+        for (size_t k = 0; k < keys.size(); k++)
+        {
+            const SortKey &key = keys[k];
+            size_t a_start = a.key_start, a_end = a.key_start + a.key_length;
+            size_t b_start = b.key_start, b_end = b.key_start + b.key_length;
+            if (k > 0)
+            {
+                key_range(a.data, a.length, key, a_start, a_end);
+                key_range(b.data, b.length, key, b_start, b_end);
+            }
+
+            if (k == 0 && a.prefix != b.prefix)
+            {
+                return a.prefix < b.prefix ? -1 : 1;
+            }
+
+            int c;
+            if (key.numeric)
+            {
+                c = compare_numbers(a.data + a_start, a_end - a_start, b.data + b_start, b_end - b_start);
+            }
+            else
+            {
+                c = compare_bytes(a.data + a_start, a_end - a_start, b.data + b_start, b_end - b_start);
+            }
+            if (c != 0)
+            {
+                return key.reverse ? -c : c;
+            }
+        }
+
+        if (!last_resort)
+        {
+            return 0;
+        }
+        int c = compare_bytes(a.data, a.length, b.data, b.length);
+        return options.reverse ? -c : c;
+    }
+
+    bool operator()(const SortLine &a, const SortLine &b) const
+    {
+        if (a.prefix != b.prefix)
+        {
+            return a.prefix < b.prefix;
+        }
+        return compare(a, b) < 0;
+    }
+
+private:
+    // Start of field `target`, walking on from position pos in field `field`
+    size_t field_start(const char *data, size_t length, size_t pos, size_t field, size_t target) const
+    {
+        for (; field < target && pos < length; field++)
+        {
+            if (options.separator < 0)
+            {
+                while (pos < length && is_blank(data[pos]))
+                    pos++;
+                while (pos < length && !is_blank(data[pos]))
+                    pos++;
+            }
+            else
+            {
+                const char *next = (const char *)memchr(data + pos, options.separator, length - pos);
+                pos = next ? next - data + 1 : length;
+            }
+        }
+        return pos;
+    }
+
+    // Without -t a field keeps its leading blanks, as in sort
+    void key_range(const char *data, size_t length, const SortKey &key, size_t &start, size_t &end) const
+    {
+        if (key.start_field == 0)
+        {
+            start = 0;
+            end = length;
+        }
+        else
+        {
+            start = field_start(data, length, 0, 1, key.start_field);
+            if (key.end_field == 0)
+            {
+                end = length;
+            }
+            else
+            {
+                size_t pos = key.end_field >= key.start_field
+                                 ? field_start(data, length, start, key.start_field, key.end_field)
+                                 : field_start(data, length, 0, 1, key.end_field);
+                if (options.separator < 0)
+                {
+                    while (pos < length && is_blank(data[pos]))
+                        pos++;
+                    while (pos < length && !is_blank(data[pos]))
+                        pos++;
+                }
+                else
+                {
+                    const char *next = (const char *)memchr(data + pos, options.separator, length - pos);
+                    pos = next ? next - data : length;
+                }
+                end = pos;
+            }
+        }
+
+        if (key.skip_blanks)
+        {
+            while (start < end && is_blank(data[start]))
+                start++;
+        }
+        if (end < start)
+        {
+            end = start;
+        }
+    }
+
+    const SortOptions &options;
+    vector<SortKey> keys;
+    bool last_resort;
+};
+
+// Stable insertion sort for the small buckets the radix sort leaves behind; the
+// prefix test is inline, the full comparison only runs on equal prefixes
+static void insertion_sort(SortLine *first, size_t count, const LineOrder &order)
+{
+    for (size_t i = 1; i < count; i++)
+    {
+        SortLine line = first[i];
+        size_t j = i;
+        while (j > 0 && (line.prefix < first[j - 1].prefix ||
+                         (line.prefix == first[j - 1].prefix && order.compare(line, first[j - 1]) < 0)))
+        {
+            first[j] = first[j - 1];
+            j--;
+        }
+        first[j] = line;
+    }
+}
+
+// MSD radix sort on the key prefix, a byte per level, so only buckets that are still
+// large get another pass. When a string key's 8 prefix bytes run out the next 8 are
+// loaded (deepened is set so the caller can restore the first prefix); lines whose keys
+// end there are ordered by the full comparison. Counting passes and insertion sort are
+// stable, so -s holds
+static void radix_sort(SortLine *first, size_t count, SortLine *scratch, const LineOrder &order, bool stable,
+                       size_t depth, int shift, bool &deepened)
+{
+    while (count > RADIX_MIN_GROUP)
+    {
+        if (shift < 0)
+        {
+            bool longer = false;
+            for (size_t i = 0; i < count && !longer; i++)
+            {
+                longer = first[i].key_length > (depth + 1) * 8;
+            }
+            if (!longer || !order.byte_key())
+            {
+                if (stable)
+                    std::stable_sort(first, first + count, order);
+                else
+                    std::sort(first, first + count, order);
+                return;
+            }
+
+            depth++;
+            shift = 56;
+            deepened = true;
+            for (size_t i = 0; i < count; i++)
+            {
+                first[i].prefix = order.key_bytes(first[i], depth * 8);
+            }
+            continue;
+        }
+
+        size_t offsets[256] = {};
+        for (size_t i = 0; i < count; i++)
+        {
+            offsets[first[i].prefix >> shift & 0xff]++;
+        }
+        if (offsets[first[0].prefix >> shift & 0xff] == count)
+        {
+            shift -= 8; // every line has this byte
+            continue;
+        }
+
+        size_t starts[256];
+        size_t offset = 0;
+        for (int b = 0; b < 256; b++)
+        {
+            starts[b] = offset;
+            offset += offsets[b];
+            offsets[b] = starts[b];
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+            scratch[offsets[first[i].prefix >> shift & 0xff]++] = first[i];
+        }
+        memcpy(first, scratch, count * sizeof(SortLine));
+
+        // The largest bucket stays in this loop, so at most log2(count) calls are nested
+        int largest = 0;
+        for (int b = 1; b < 256; b++)
+        {
+            if (offsets[b] - starts[b] > offsets[largest] - starts[largest])
+            {
+                largest = b;
+            }
+        }
+        for (int b = 0; b < 256; b++)
+        {
+            size_t n = offsets[b] - starts[b];
+            if (b != largest && n > 1)
+            {
+                radix_sort(first + starts[b], n, scratch + starts[b], order, stable, depth, shift - 8, deepened);
+            }
+        }
+        first += starts[largest];
+        scratch += starts[largest];
+        count = offsets[largest] - starts[largest];
+        shift -= 8;
+    }
+    insertion_sort(first, count, order);
+}
+
+// Sorts equal slices on separate threads, then merges neighbours pairwise with
+// every level's merges running in parallel
+static void parallel_sort(vector<SortLine> &lines, const LineOrder &order, unsigned threads, bool stable)
+{
+    auto sort_range = [&](SortLine *first, SortLine *last)
+    {
+        vector<SortLine> scratch(last - first);
+        bool deepened = false;
+        radix_sort(first, last - first, scratch.data(), order, stable, 0, 56, deepened);
+        for (SortLine *line = first; deepened && line != last; line++)
+        {
+            line->prefix = order.key_bytes(*line, 0);
+        }
+    };
+
+    size_t count = lines.size();
+    if (threads <= 1 || count < PARALLEL_MIN_LINES)
+    {
+        sort_range(lines.data(), lines.data() + count);
+        return;
+    }
+
+    vector<size_t> bounds;
+    for (unsigned t = 0; t <= threads; t++)
+    {
+        bounds.push_back(count * t / threads);
+    }
+
+    vector<thread> workers;
+    for (unsigned t = 0; t < threads; t++)
+    {
+        workers.emplace_back(sort_range, lines.data() + bounds[t], lines.data() + bounds[t + 1]);
+    }
+    for (thread &worker : workers)
+    {
+        worker.join();
+    }
+
+    vector<SortLine> scratch(count);
+    SortLine *source = lines.data();
+    SortLine *target = scratch.data();
+    while (bounds.size() > 2)
+    {
+        vector<size_t> merged;
+        workers.clear();
+        for (size_t i = 0; i + 1 < bounds.size(); i += 2)
+        {
+            size_t lo = bounds[i];
+            size_t mid = bounds[i + 1];
+            size_t hi = i + 2 < bounds.size() ? bounds[i + 2] : mid;
+            merged.push_back(lo);
+            workers.emplace_back([=, &order]
+                                 { std::merge(source + lo, source + mid, source + mid, source + hi, target + lo, order); });
+        }
+        merged.push_back(count);
+        for (thread &worker : workers)
+        {
+            worker.join();
+        }
+        swap(source, target);
+        bounds.swap(merged);
+    }
+
+    if (source != lines.data())
+    {
+        copy(source, source + count, lines.data());
+    }
+}
+
+// Appends lines with their newline, dropping repeats of the previous line under -u
+class LineWriter
+{
+public:
+    LineWriter(TextOutput &out, const LineOrder &order, bool unique) : out(out), order(order), unique(unique) {}
+
+    bool add(const SortLine &line)
+    {
+        if (unique)
+        {
+            if (have_last && order.compare(last, line) == 0)
+            {
+                return out.ok();
+            }
+            last_text.assign(line.data, line.length);
+            last = line;
+            last.data = last_text.data();
+            have_last = true;
+        }
+        return out.write_line(line.data, line.length);
+    }
+
+private:
+    TextOutput &out;
+    const LineOrder &order;
+    bool unique;
+    bool have_last = false;
+    string last_text;
+    SortLine last = {};
+};
+
+// Sequential reader over one sorted run file
+class RunReader
+{
+public:
+    RunReader(int fd, size_t buffer_size, const LineOrder &order) : fd(fd), buffer(buffer_size), order(order) {}
+
+    // Moves current to the next line, false at the end of the run or on error
+    bool next()
+    {
+        while (true)
+        {
+            const char *newline = (const char *)memchr(buffer.data() + start, '\n', end - start);
+            if (newline)
+            {
+                current.data = buffer.data() + start;
+                current.length = newline - current.data;
+                order.prepare(current);
+                start = newline - buffer.data() + 1;
+                return true;
+            }
+            if (eof)
+            {
+                return false;
+            }
+
+            memmove(buffer.data(), buffer.data() + start, end - start);
+            end -= start;
+            start = 0;
+            if (end == buffer.size())
+            {
+                buffer.resize(buffer.size() * 2);
+            }
+
+            ssize_t n = read(fd, buffer.data() + end, buffer.size() - end);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n < 0)
+            {
+                perror("sort: read");
+                failed = true;
+            }
+            if (n <= 0)
+            {
+                eof = true;
+            }
+            else
+            {
+                end += n;
+            }
+        }
+    }
+
+    SortLine current = {};
+    bool failed = false;
+
+private:
+    int fd;
+    vector<char> buffer;
+    size_t start = 0;
+    size_t end = 0;
+    bool eof = false;
+    const LineOrder &order;
+};
+
+// Tournament over the current lines of the runs; inner nodes keep the loser of their
+// match and a finished run (null head) loses every match
+class LoserTree
+{
+public:
+    LoserTree(const vector<RunReader *> &heads, const LineOrder &order) : heads(heads.data()), count(heads.size()), order(order), losers(heads.size())
+    {
+        losers[0] = count > 1 ? play(1) : 0;
+    }
+
+    size_t winner() const
+    {
+        return losers[0];
+    }
+
+    // Replays the path from the advanced run to the root
+    size_t replay(size_t run)
+    {
+        size_t *nodes = losers.data();
+        for (size_t node = (run + count) / 2; node > 0; node /= 2)
+        {
+            if (beats(nodes[node], run))
+            {
+                swap(nodes[node], run);
+            }
+        }
+        nodes[0] = run;
+        return run;
+    }
+
+private:
+    size_t play(size_t node)
+    {
+        if (node >= count)
+        {
+            return node - count;
+        }
+        size_t left = play(2 * node);
+        size_t right = play(2 * node + 1);
+        bool left_wins = beats(left, right);
+        losers[node] = left_wins ? right : left;
+        return left_wins ? left : right;
+    }
+
+    bool beats(size_t a, size_t b) const
+    {
+        if (heads[a] == nullptr || heads[b] == nullptr)
+        {
+            return heads[b] == nullptr && (heads[a] != nullptr || a < b);
+        }
+        const SortLine &x = heads[a]->current;
+        const SortLine &y = heads[b]->current;
+        if (x.prefix != y.prefix)
+        {
+            return x.prefix < y.prefix;
+        }
+        int c = order.compare(x, y);
+        return c != 0 ? c < 0 : a < b;
+    }
+
+    RunReader *const *heads;
+    size_t count;
+    const LineOrder &order;
+    vector<size_t> losers;
+};
+
+// Reads input into a chunk buffer of line slices; a full chunk is sorted on all
+// cores and spilled to an unlinked temp file, and the runs are k-way merged at the end
+class ExternalSort
+{
+public:
+    ExternalSort(const SortOptions &options, const LineOrder &order) : options(options), order(order)
+    {
+        budget = options.buffer_size ? options.buffer_size : (sort_buffer_setting ? sort_buffer_setting : default_buffer_size());
+        threads = options.threads ? options.threads : max(1u, thread::hardware_concurrency());
+        capacity = max<size_t>(READ_BLOCK, budget / 2);
+        buffer.reset(new char[capacity]); // untouched pages cost nothing for small inputs
+        temp_dir = options.temp_dir;
+        if (temp_dir.empty())
+        {
+            const char *tmpdir = get_variable("TMPDIR");
+            temp_dir = tmpdir && *tmpdir ? tmpdir : "/tmp";
+        }
+    }
+
+    ~ExternalSort()
+    {
+        for (int fd : runs)
+        {
+            close(fd);
+        }
+    }
+
+    bool add_input(int fd, const string &name)
+    {
+        while (true)
+        {
+            if (text_builtins_interrupted())
+            {
+                return false;
+            }
+            if (used == capacity)
+            {
+                if (lines.empty())
+                {
+                    grow(); // one line longer than the whole chunk
+                }
+                else if (!spill())
+                {
+                    return false;
+                }
+            }
+
+            ssize_t n = read(fd, buffer.get() + used, min(capacity - used, READ_BLOCK));
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                cerr << "sort: read failed: " << name << ": " << strerror(errno) << endl;
+                return false;
+            }
+            if (n == 0)
+            {
+                // A last line without '\n' still ends at the end of its file
+                if (line_start < used)
+                {
+                    add_line(used);
+                    line_start = used;
+                }
+                return true;
+            }
+
+            const char *scan = buffer.get() + used;
+            const char *scan_end = scan + n;
+            while (const char *newline = (const char *)memchr(scan, '\n', scan_end - scan))
+            {
+                add_line(newline - buffer.get());
+                line_start = newline - buffer.get() + 1;
+                scan = newline + 1;
+            }
+            used += n;
+
+            // Line slices and the merge scratch count against the budget too
+            if (used + lines.size() * sizeof(SortLine) * 2 > budget && !spill())
+            {
+                return false;
+            }
+        }
+    }
+
+    bool finish(TextOutput &out)
+    {
+        if (runs.empty())
+        {
+            parallel_sort(lines, order, threads, options.stable || options.unique);
+            LineWriter writer(out, order, options.unique);
+            for (size_t i = 0; i < lines.size(); i++)
+            {
+                if ((i % 65536 == 0 && text_builtins_interrupted()) || !writer.add(lines[i]))
+                {
+                    break;
+                }
+            }
+            return out.flush();
+        }
+
+        if (!lines.empty() && !spill())
+        {
+            return false;
+        }
+        lines = vector<SortLine>();
+        buffer.reset();
+
+        // More runs than merge ways are merged into fewer, longer runs first
+        while (runs.size() > MAX_MERGE_WAYS)
+        {
+            int merged = create_run();
+            if (merged == -1)
+            {
+                return false;
+            }
+            vector<int> group(runs.begin(), runs.begin() + MAX_MERGE_WAYS);
+            runs.erase(runs.begin(), runs.begin() + MAX_MERGE_WAYS);
+            TextOutput run_out(merged);
+            bool ok = merge(group, run_out) && run_out.flush();
+            for (int fd : group)
+            {
+                close(fd);
+            }
+            lseek(merged, 0, SEEK_SET);
+            runs.push_back(merged);
+            if (!ok)
+            {
+                return false;
+            }
+        }
+        return merge(runs, out) && out.flush();
+    }
+
+private:
+    void add_line(size_t end)
+    {
+        SortLine line;
+        line.data = buffer.get() + line_start;
+        line.length = end - line_start;
+        order.prepare(line);
+        lines.push_back(line);
+    }
+
+    void grow()
+    {
+        size_t new_capacity = capacity * 2;
+        char *bigger = new char[new_capacity];
+        memcpy(bigger, buffer.get(), used);
+        buffer.reset(bigger);
+        capacity = new_capacity;
+    }
+
+    int create_run()
+    {
+        int fd = open(temp_dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (fd == -1)
+        {
+            string path = temp_dir + "/sort-XXXXXX";
+            fd = mkostemp(&path[0], O_CLOEXEC);
+            if (fd != -1)
+            {
+                unlink(path.c_str());
+            }
+        }
+        if (fd == -1)
+        {
+            cerr << "sort: cannot create temporary file in '" << temp_dir << "': " << strerror(errno) << endl;
+        }
+        return fd;
+    }
+
+    // Sorts the complete lines of the chunk into a new run and keeps the partial last line
+    bool spill()
+    {
+        TraceSpan span("sort_spill");
+        int fd = create_run();
+        if (fd == -1)
+        {
+            return false;
+        }
+        parallel_sort(lines, order, threads, options.stable || options.unique);
+        if (text_builtins_interrupted())
+        {
+            close(fd);
+            return false;
+        }
+
+        bool ok;
+        {
+            TextOutput run_out(fd);
+            LineWriter writer(run_out, order, options.unique);
+            for (const SortLine &line : lines)
+            {
+                writer.add(line);
+            }
+            ok = run_out.flush();
+        }
+        lseek(fd, 0, SEEK_SET);
+        runs.push_back(fd);
+
+        memmove(buffer.get(), buffer.get() + line_start, used - line_start);
+        used -= line_start;
+        line_start = 0;
+        lines.clear();
+        return ok;
+    }
+
+    // Loser-tree merge: each line costs log2(runs) matches, ties go to the earlier run
+    // so equal lines keep input order
+    bool merge(const vector<int> &fds, TextOutput &out)
+    {
+        TraceSpan span("sort_merge");
+        size_t reader_buffer = min<size_t>(8 << 20, max<size_t>(64 << 10, budget / (fds.size() + 1)));
+        vector<unique_ptr<RunReader>> readers;
+        vector<RunReader *> heads;
+        for (int fd : fds)
+        {
+            readers.emplace_back(new RunReader(fd, reader_buffer, order));
+            heads.push_back(readers.back()->next() ? readers.back().get() : nullptr);
+        }
+
+        LoserTree tree(heads, order);
+        LineWriter writer(out, order, options.unique);
+        size_t written = 0;
+        for (size_t run = tree.winner(); heads[run] != nullptr; run = tree.replay(run))
+        {
+            if (!writer.add(heads[run]->current))
+            {
+                return false;
+            }
+            if (!heads[run]->next())
+            {
+                heads[run] = nullptr;
+            }
+            if (++written % 65536 == 0 && text_builtins_interrupted())
+            {
+                return false;
+            }
+        }
+
+        for (auto &reader : readers)
+        {
+            if (reader->failed)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const SortOptions &options;
+    const LineOrder &order;
+    size_t budget;
+    unsigned threads;
+    string temp_dir;
+
+    unique_ptr<char[]> buffer;
+    size_t capacity = 0;
+    size_t used = 0;
+    size_t line_start = 0; // start of the line being read
+    vector<SortLine> lines;
+    vector<int> runs;
+};
+
+// sort with -n, -r, -u, -s, -b, -k, -t, -S, -T and --parallel; returns 2 on errors like sort
+int run_sort(const vector<char *> &args, int input_fd, TextOutput &out)
+{
+    SortOptions options;
+    if (!parse_sort_command(args, options))
+    {
+        return 2;
+    }
+    if (options.files.empty())
+    {
+        options.files.push_back("-");
+    }
+
+    // Every input is opened before sorting starts, a missing file produces no output
+    vector<int> fds;
+    for (const char *file : options.files)
+    {
+        int fd = strcmp(file, "-") == 0 ? input_fd : open(file, O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            cerr << "sort: cannot read: " << file << ": " << strerror(errno) << endl;
+            for (size_t i = 0; i < fds.size(); i++)
+            {
+                if (fds[i] != input_fd)
+                    close(fds[i]);
+            }
+            return 2;
+        }
+        fds.push_back(fd);
+    }
+
+    LineOrder order(options);
+    ExternalSort sorter(options, order);
+    bool ok = true;
+    for (size_t i = 0; i < fds.size() && ok; i++)
+    {
+        ok = sorter.add_input(fds[i], options.files[i]);
+    }
+    for (int fd : fds)
+    {
+        if (fd != input_fd)
+        {
+            close(fd);
+        }
+    }
+
+    if (ok)
+    {
+        ok = sorter.finish(out);
+    }
+    return ok || !out.ok() ? 0 : 2;
+}
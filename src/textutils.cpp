@@ -0,0 +1,1168 @@
+#include "textutils.h"
+#include "redirection.h"
+#include "sort.h"
+#include "trace.h"
+#include <iostream>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+using namespace std;
+
+// set -o text-builtins; off runs the external cat, wc, head, tail and grep
+static bool text_builtins_enabled = true;
+
+// Set from the SIGINT handler, checked between blocks
+static atomic<bool> interrupted(false);
+
+static const size_t STREAM_BLOCK = 256 * 1024;
+
+// Parsed command line of one of the text tools
+struct TextCommand
+{
+    string tool;
+    vector<const char *> files;
+
+    // wc
+    bool lines = false;
+    bool words = false;
+    bool bytes = false;
+
+    // head, tail
+    long long count = 10;
+    bool count_bytes = false;
+    bool from_start = false; // tail -n +N
+
+    // grep
+    string pattern;
+    bool have_pattern = false;
+    bool fixed = false;
+    bool invert = false;
+    bool count_only = false;
+    bool line_numbers = false;
+    bool quiet = false;
+    bool no_messages = false;
+};
+
+static bool parse_count(const char *text, long long &count)
+{
+    if (*text == '\0')
+    {
+        return false;
+    }
+    long long value = 0;
+    for (const char *p = text; *p; p++)
+    {
+        if (*p < '0' || *p > '9' || value > (1LL << 58))
+        {
+            return false;
+        }
+        value = value * 10 + (*p - '0');
+    }
+    count = value;
+    return true;
+}
+
+// head/tail -n N, -c N and tail's +N
+static bool parse_head_tail_value(TextCommand &command, const char *value, bool bytes)
+{
+    command.count_bytes = bytes;
+    if (command.tool == "tail" && value[0] == '+')
+    {
+        command.from_start = true;
+        value++;
+    }
+    return parse_count(value, command.count);
+}
+
+// Fills command from argv, false when it uses anything the in-process version does not
+// implement so the caller runs the real tool instead. Redirection words are skipped
+static bool parse_text_command(const vector<char *> &args, TextCommand &command)
+{
+    if (args.empty() || args[0] == nullptr)
+    {
+        return false;
+    }
+
+    command.tool = args[0];
+    const string &tool = command.tool;
+    if (tool != "cat" && tool != "wc" && tool != "head" && tool != "tail" && tool != "grep")
+    {
+        return false;
+    }
+
+    bool options_done = false;
+    for (size_t i = 1; i < args.size() && args[i] != nullptr; i++)
+    {
+        const char *arg = args[i];
+        if (is_redirection_word(arg))
+        {
+            i++;
+            if (i >= args.size() || args[i] == nullptr)
+            {
+                return false;
+            }
+            continue;
+        }
+
+        if (options_done || arg[0] != '-' || arg[1] == '\0')
+        {
+            if (tool == "grep" && !command.have_pattern)
+            {
+                command.pattern = arg;
+                command.have_pattern = true;
+            }
+            else
+            {
+                command.files.push_back(arg);
+            }
+            continue;
+        }
+        if (strcmp(arg, "--") == 0)
+        {
+            options_done = true;
+            continue;
+        }
+        if (arg[1] == '-' || tool == "cat")
+        {
+            return false;
+        }
+
+        // -5 is head/tail -n 5
+        if ((tool == "head" || tool == "tail") && arg[1] >= '0' && arg[1] <= '9')
+        {
+            if (!parse_head_tail_value(command, arg + 1, false))
+            {
+                return false;
+            }
+            continue;
+        }
+
+        for (const char *flag = arg + 1; *flag; flag++)
+        {
+            if (tool == "wc")
+            {
+                if (*flag == 'l')
+                    command.lines = true;
+                else if (*flag == 'w')
+                    command.words = true;
+                else if (*flag == 'c')
+                    command.bytes = true;
+                else
+                    return false;
+            }
+            else if (tool == "head" || tool == "tail")
+            {
+                if (*flag != 'n' && *flag != 'c')
+                {
+                    return false;
+                }
+                const char *value = flag[1] ? flag + 1 : (i + 1 < args.size() ? args[++i] : nullptr);
+                if (value == nullptr || !parse_head_tail_value(command, value, *flag == 'c'))
+                {
+                    return false;
+                }
+                break;
+            }
+            else if (*flag == 'e')
+            {
+                const char *value = flag[1] ? flag + 1 : (i + 1 < args.size() ? args[++i] : nullptr);
+                if (value == nullptr || command.have_pattern)
+                {
+                    return false;
+                }
+                command.pattern = value;
+                command.have_pattern = true;
+                break;
+            }
+            else if (*flag == 'F')
+                command.fixed = true;
+            else if (*flag == 'v')
+                command.invert = true;
+            else if (*flag == 'c')
+                command.count_only = true;
+            else if (*flag == 'n')
+                command.line_numbers = true;
+            else if (*flag == 'q')
+                command.quiet = true;
+            else if (*flag == 's')
+                command.no_messages = true;
+            else
+                return false;
+        }
+    }
+
+    if (tool == "wc" && !command.lines && !command.words && !command.bytes)
+    {
+        command.lines = command.words = command.bytes = true;
+    }
+
+    if (tool == "grep")
+    {
+        // Several patterns or a basic regex that is not a plain literal go to grep
+        if (!command.have_pattern || command.pattern.find('\n') != string::npos)
+        {
+            return false;
+        }
+        if (!command.fixed && command.pattern.find_first_of(".[*^$\\") != string::npos)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool is_text_builtin(const vector<char *> &args)
+{
+    TextCommand command;
+    if (!text_builtins_enabled)
+    {
+        return false;
+    }
+    return parse_text_command(args, command) || sort_builtin_supported(args);
+}
+
+// True when the command has no file operands (or "-") and so reads its stdin
+bool text_builtin_reads_stdin(const vector<char *> &args)
+{
+    if (!args.empty() && args[0] && strcmp(args[0], "sort") == 0)
+    {
+        return sort_reads_stdin(args);
+    }
+
+    TextCommand command;
+    if (!parse_text_command(args, command) || command.files.empty())
+    {
+        return true;
+    }
+    for (const char *file : command.files)
+    {
+        if (strcmp(file, "-") == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void text_builtins_interrupt()
+{
+    interrupted.store(true, memory_order_relaxed);
+}
+
+// For other long-running builtins (du) that stop on the same Ctrl+C
+void text_builtins_reset_interrupt()
+{
+    interrupted.store(false, memory_order_relaxed);
+}
+
+bool text_builtins_interrupted()
+{
+    return interrupted.load(memory_order_relaxed);
+}
+
+void set_text_builtins(bool enabled)
+{
+    text_builtins_enabled = enabled;
+}
+
+bool get_text_builtins()
+{
+    return text_builtins_enabled;
+}
+
+#ifdef HAVE_X86_SIMD
+// Compare results (-1 per hit) are summed into byte lanes for up to 255 vectors,
+// then folded with one sum-of-absolute-differences
+__attribute__((target("avx2"))) static size_t count_newlines_avx2(const char *data, size_t size, size_t &i)
+{
+    size_t count = 0;
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i zero = _mm256_setzero_si256();
+    while (i + 32 <= size)
+    {
+        __m256i lanes = zero;
+        size_t stop = min(size - 31, i + 255 * 32);
+        for (; i < stop; i += 32)
+        {
+            lanes = _mm256_sub_epi8(lanes, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i)), newline));
+        }
+        __m256i sums = _mm256_sad_epu8(lanes, zero);
+        count += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+                 _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+    }
+    return count;
+}
+
+static size_t count_newlines_sse2(const char *data, size_t size, size_t &i)
+{
+    size_t count = 0;
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    while (i + 16 <= size)
+    {
+        __m128i lanes = zero;
+        size_t stop = min(size - 15, i + 255 * 16);
+        for (; i < stop; i += 16)
+        {
+            lanes = _mm_sub_epi8(lanes, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i)), newline));
+        }
+        __m128i sums = _mm_sad_epu8(lanes, zero);
+        count += _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sums, sums));
+    }
+    return count;
+}
+
+// Tests the needle's first and last byte at 32 positions per step, candidates are
+// confirmed with memcmp; returns the offset of the first match or size
+__attribute__((target("avx2"))) static size_t find_literal_avx2(const char *data, size_t size, const string &needle, size_t &i)
+{
+    size_t length = needle.size();
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[length - 1]);
+    for (; i + length - 1 + 32 <= size; i += 32)
+    {
+        __m256i head = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i tail = _mm256_loadu_si256((const __m256i *)(data + i + length - 1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(head, first), _mm256_cmpeq_epi8(tail, last)));
+        while (mask)
+        {
+            unsigned bit = __builtin_ctz(mask);
+            if (memcmp(data + i + bit + 1, needle.data() + 1, length - 2) == 0)
+            {
+                return i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return size;
+}
+
+static size_t find_literal_sse2(const char *data, size_t size, const string &needle, size_t &i)
+{
+    size_t length = needle.size();
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[length - 1]);
+    for (; i + length - 1 + 16 <= size; i += 16)
+    {
+        __m128i head = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i tail = _mm_loadu_si128((const __m128i *)(data + i + length - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last)));
+        while (mask)
+        {
+            unsigned bit = __builtin_ctz(mask);
+            if (memcmp(data + i + bit + 1, needle.data() + 1, length - 2) == 0)
+            {
+                return i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return size;
+}
+
+static const bool have_avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+// Counts '\n' bytes, AVX2 or SSE2 for the bulk and a scalar tail
+static size_t count_newlines(const char *data, size_t size)
+{
+    size_t count = 0;
+    size_t i = 0;
+#ifdef HAVE_X86_SIMD
+    count = have_avx2 ? count_newlines_avx2(data, size, i) : count_newlines_sse2(data, size, i);
+#endif
+    for (; i < size; i++)
+    {
+        count += data[i] == '\n';
+    }
+    return count;
+}
+
+// Finds needle in [data, data + size): a vector scan on the first and last byte,
+// memmem for whatever is left at the end
+static const char *find_literal(const char *data, size_t size, const string &needle)
+{
+    size_t length = needle.size();
+    if (length == 0)
+    {
+        return data;
+    }
+    if (length == 1)
+    {
+        return (const char *)memchr(data, needle[0], size);
+    }
+    if (size < length)
+    {
+        return nullptr;
+    }
+
+    size_t i = 0;
+#ifdef HAVE_X86_SIMD
+    size_t found = have_avx2 ? find_literal_avx2(data, size, needle, i) : find_literal_sse2(data, size, needle, i);
+    if (found != size)
+    {
+        return data + found;
+    }
+#endif
+    return (const char *)memmem(data + i, size - i, needle.data(), length);
+}
+
+TextOutput::TextOutput(int fd) : fd(fd)
+{
+    buffer.reserve(OUTPUT_BUFFER);
+}
+
+TextOutput::~TextOutput()
+{
+    flush();
+}
+
+bool TextOutput::write(const char *data, size_t size)
+{
+    if (failed)
+    {
+        return false;
+    }
+    if (buffer.size() + size > OUTPUT_BUFFER)
+    {
+        flush();
+        if (size >= OUTPUT_BUFFER)
+        {
+            return write_all(data, size);
+        }
+    }
+    buffer.append(data, size);
+    return !failed;
+}
+
+bool TextOutput::write_line(const char *data, size_t size)
+{
+    if (failed || buffer.size() + size + 1 > OUTPUT_BUFFER)
+    {
+        return write(data, size) && write("\n", 1);
+    }
+    buffer.append(data, size);
+    buffer += '\n';
+    return true;
+}
+
+bool TextOutput::flush()
+{
+    if (!buffer.empty() && !failed)
+    {
+        write_all(buffer.data(), buffer.size());
+    }
+    buffer.clear();
+    return !failed;
+}
+
+bool TextOutput::write_all(const char *data, size_t size)
+{
+    while (size > 0 && !failed)
+    {
+        ssize_t n = ::write(fd, data, size);
+        if (n < 0)
+        {
+            if (errno == EINTR && !interrupted.load(memory_order_relaxed))
+            {
+                continue;
+            }
+            if (errno != EPIPE && errno != EINTR)
+            {
+                perror("write");
+            }
+            failed = true;
+            break;
+        }
+        data += n;
+        size -= n;
+    }
+    return !failed;
+}
+
+// One input operand: regular files are mapped, pipes and terminals are streamed
+struct Input
+{
+    string name;
+    int fd = -1;
+    bool owned = false;
+    const char *map = nullptr;
+    size_t size = 0;
+    bool regular = false;
+    const char *mapping = nullptr; // whole file, map starts at the offset standard input was at
+    size_t mapped = 0;
+    off_t start = 0;
+    size_t consumed = SIZE_MAX; // bytes used from map, standard input's offset is left after them
+};
+
+static bool open_input(const TextCommand &command, const char *file, int input_fd, Input &input)
+{
+    bool from_stdin = strcmp(file, "-") == 0;
+    input.name = from_stdin ? "standard input" : file;
+    input.fd = from_stdin ? input_fd : open(file, O_RDONLY | O_CLOEXEC);
+    input.owned = !from_stdin;
+
+    struct stat st;
+    if (input.fd == -1 || fstat(input.fd, &st) == -1)
+    {
+        if (!command.no_messages)
+        {
+            cerr << command.tool << ": " << file << ": " << strerror(errno) << endl;
+        }
+        if (input.fd != -1 && input.owned)
+        {
+            close(input.fd);
+        }
+        return false;
+    }
+    if (S_ISDIR(st.st_mode))
+    {
+        if (!command.no_messages)
+        {
+            cerr << command.tool << ": " << file << ": Is a directory" << endl;
+        }
+        if (input.owned)
+        {
+            close(input.fd);
+        }
+        return false;
+    }
+
+    input.regular = S_ISREG(st.st_mode);
+    // Files that report size 0 (procfs and friends) are streamed
+    // Standard input goes on from its offset, where a read in a while loop left it
+    off_t start = from_stdin && input.regular ? max<off_t>(lseek(input.fd, 0, SEEK_CUR), 0) : 0;
+    if (input.regular && st.st_size > start)
+    {
+        void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, input.fd, 0);
+        if (map != MAP_FAILED)
+        {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            input.mapping = (const char *)map;
+            input.mapped = st.st_size;
+            input.start = start;
+            input.map = input.mapping + start;
+            input.size = st.st_size - start;
+        }
+    }
+    return true;
+}
+
+static void close_input(Input &input)
+{
+    if (input.mapping)
+    {
+        if (!input.owned)
+        {
+            lseek(input.fd, input.start + min(input.consumed, input.size), SEEK_SET);
+        }
+        munmap((void *)input.mapping, input.mapped);
+    }
+    if (input.owned && input.fd != -1)
+    {
+        close(input.fd);
+    }
+}
+
+// Hands the input to fn in blocks, a mapped file as a single block. With whole_lines
+// every block but the last ends in '\n'. fn returns false to stop early;
+// the result is false on a read error or Ctrl+C. What fn wrote for a block read from a
+// pipe or terminal is flushed before the next read, which may wait for more input
+template <typename Fn>
+static bool for_each_block(Input &input, bool whole_lines, TextOutput &out, Fn fn)
+{
+    if (input.map)
+    {
+        fn(input.map, input.size);
+        return true;
+    }
+
+    vector<char> buffer(STREAM_BLOCK);
+    size_t carry = 0;
+    while (true)
+    {
+        if (interrupted.load(memory_order_relaxed))
+        {
+            return false;
+        }
+        if (carry == buffer.size())
+        {
+            buffer.resize(buffer.size() * 2); // a line longer than the buffer
+        }
+
+        ssize_t n = read(input.fd, buffer.data() + carry, buffer.size() - carry);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            cerr << input.name << ": " << strerror(errno) << endl;
+            return false;
+        }
+        if (n == 0)
+        {
+            if (carry > 0)
+            {
+                fn(buffer.data(), carry);
+            }
+            out.flush();
+            return true;
+        }
+
+        size_t total = carry + n;
+        size_t length = total;
+        if (whole_lines)
+        {
+            const char *end = (const char *)memrchr(buffer.data(), '\n', total);
+            if (end == nullptr)
+            {
+                carry = total;
+                continue;
+            }
+            length = end - buffer.data() + 1;
+        }
+        if (!fn(buffer.data(), length))
+        {
+            out.flush();
+            return true;
+        }
+        out.flush();
+        carry = total - length;
+        memmove(buffer.data(), buffer.data() + length, carry);
+    }
+}
+
+static int run_cat(const TextCommand &command, int input_fd, TextOutput &out)
+{
+    int result = 0;
+    for (const char *file : command.files)
+    {
+        Input input;
+        if (!open_input(command, file, input_fd, input))
+        {
+            result = 1;
+            continue;
+        }
+        bool ok = for_each_block(input, false, out, [&](const char *data, size_t size)
+                                 { return out.write(data, size); });
+        close_input(input);
+        if (!ok)
+        {
+            result = 1;
+        }
+        if (!out.ok())
+        {
+            break;
+        }
+    }
+    return result;
+}
+
+struct WcCounts
+{
+    size_t lines = 0;
+    size_t words = 0;
+    size_t bytes = 0;
+};
+
+// Blanks as in the C locale's isspace
+struct BlankTable
+{
+    bool blank[256] = {};
+
+    BlankTable()
+    {
+        for (const char *c = " \t\n\v\f\r"; *c; c++)
+        {
+            blank[(unsigned char)*c] = true;
+        }
+    }
+};
+
+static const BlankTable blanks;
+
+// Words are runs of non-blank bytes
+static size_t count_words(const char *data, size_t size, bool &in_word)
+{
+    size_t words = 0;
+    bool inside = in_word;
+    for (size_t i = 0; i < size; i++)
+    {
+        bool is_blank = blanks.blank[(unsigned char)data[i]];
+        words += !is_blank && !inside;
+        inside = !is_blank;
+    }
+    in_word = inside;
+    return words;
+}
+
+static int run_wc(const TextCommand &command, int input_fd, TextOutput &out)
+{
+    vector<WcCounts> rows;
+    vector<string> names;
+    WcCounts total;
+    size_t size_hint = 0;
+    bool streamed = false;
+    int result = 0;
+
+    for (const char *file : command.files)
+    {
+        Input input;
+        if (!open_input(command, file, input_fd, input))
+        {
+            result = 1;
+            continue;
+        }
+
+        WcCounts counts;
+        bool in_word = false;
+        bool ok = true;
+        if (!command.lines && !command.words && input.map)
+        {
+            counts.bytes = input.size;
+        }
+        else
+        {
+            ok = for_each_block(input, false, out, [&](const char *data, size_t size)
+                                {
+                counts.bytes += size;
+                if (command.lines)
+                    counts.lines += count_newlines(data, size);
+                if (command.words)
+                    counts.words += count_words(data, size, in_word);
+                return true; });
+        }
+        streamed = streamed || !input.regular;
+        size_hint += input.size;
+        close_input(input);
+        if (!ok)
+        {
+            result = 1;
+            continue;
+        }
+
+        rows.push_back(counts);
+        names.push_back(strcmp(file, "-") == 0 ? "" : file);
+        total.lines += counts.lines;
+        total.words += counts.words;
+        total.bytes += counts.bytes;
+    }
+
+    if (command.files.size() > 1)
+    {
+        rows.push_back(total);
+        names.push_back("total");
+    }
+
+    // Column width as coreutils picks it: digits of the total size, 7 for pipes,
+    // unpadded for a single number
+    int columns = command.lines + command.words + command.bytes;
+    size_t width = to_string(max(size_hint, total.bytes)).size();
+    if (streamed)
+    {
+        width = max<size_t>(width, 7);
+    }
+    if (columns == 1 && rows.size() == 1)
+    {
+        width = 1;
+    }
+
+    for (size_t r = 0; r < rows.size(); r++)
+    {
+        string line;
+        auto add = [&](size_t value)
+        {
+            string number = to_string(value);
+            if (!line.empty())
+                line += ' ';
+            if (number.size() < width)
+                line.append(width - number.size(), ' ');
+            line += number;
+        };
+        if (command.lines)
+            add(rows[r].lines);
+        if (command.words)
+            add(rows[r].words);
+        if (command.bytes)
+            add(rows[r].bytes);
+        if (!names[r].empty())
+        {
+            line += ' ' + names[r];
+        }
+        line += '\n';
+        out.write(line);
+    }
+    return result;
+}
+
+// "==> name <==" between files like head and tail do
+static void write_header(const TextCommand &command, const Input &input, bool first, TextOutput &out)
+{
+    if (command.files.size() > 1)
+    {
+        out.write((first ? "" : "\n") + string("==> ") + input.name + " <==\n");
+    }
+}
+
+static bool head_input(const TextCommand &command, Input &input, TextOutput &out)
+{
+    long long remaining = command.count;
+    input.consumed = 0;
+    return for_each_block(input, false, out, [&](const char *data, size_t size)
+                          {
+        if (remaining <= 0)
+            return false;
+        size_t length = size;
+        if (command.count_bytes)
+        {
+            length = min<size_t>(size, remaining);
+            remaining -= length;
+        }
+        else
+        {
+            const char *p = data;
+            const char *end = data + size;
+            while (remaining > 0 && p < end)
+            {
+                const char *newline = (const char *)memchr(p, '\n', end - p);
+                if (newline == nullptr)
+                {
+                    p = end;
+                    break;
+                }
+                p = newline + 1;
+                remaining--;
+            }
+            length = p - data;
+        }
+        input.consumed += length;
+        return out.write(data, length) && remaining > 0; });
+}
+
+// Start of the last count lines (or bytes) of [data, data + size)
+static size_t tail_start(const TextCommand &command, const char *data, size_t size)
+{
+    if (command.count_bytes)
+    {
+        return size > (size_t)command.count ? size - command.count : 0;
+    }
+
+    if (command.count <= 0)
+    {
+        return size;
+    }
+
+    // A final line without '\n' still counts as a line
+    size_t search_end = size > 0 && data[size - 1] == '\n' ? size - 1 : size;
+    for (long long n = 0; n < command.count; n++)
+    {
+        const char *newline = (const char *)memrchr(data, '\n', search_end);
+        if (newline == nullptr)
+        {
+            return 0;
+        }
+        search_end = newline - data;
+    }
+    return search_end + 1;
+}
+
+static bool tail_input(const TextCommand &command, Input &input, TextOutput &out)
+{
+    // tail -n +N: skip to line (or byte) N and copy the rest
+    if (command.from_start)
+    {
+        long long skip = command.count > 0 ? command.count - 1 : 0;
+        return for_each_block(input, false, out, [&](const char *data, size_t size)
+                              {
+            const char *p = data;
+            const char *end = data + size;
+            if (command.count_bytes)
+            {
+                size_t n = min<size_t>(size, skip);
+                p += n;
+                skip -= n;
+            }
+            while (skip > 0 && p < end)
+            {
+                const char *newline = (const char *)memchr(p, '\n', end - p);
+                if (newline == nullptr)
+                {
+                    p = end;
+                    break;
+                }
+                p = newline + 1;
+                skip--;
+            }
+            return out.write(p, end - p); });
+    }
+
+    if (input.map)
+    {
+        size_t start = tail_start(command, input.map, input.size);
+        return out.write(input.map + start, input.size - start);
+    }
+
+    // Streams keep a window that is trimmed to the last count lines as it grows
+    string window;
+    size_t trim_at = 4 * STREAM_BLOCK;
+    bool ok = for_each_block(input, false, out, [&](const char *data, size_t size)
+                             {
+        window.append(data, size);
+        if (window.size() >= trim_at)
+        {
+            window.erase(0, tail_start(command, window.data(), window.size()));
+            trim_at = max(trim_at, window.size() * 2);
+        }
+        return true; });
+    size_t start = tail_start(command, window.data(), window.size());
+    out.write(window.data() + start, window.size() - start);
+    return ok;
+}
+
+static int run_head_tail(const TextCommand &command, int input_fd, TextOutput &out)
+{
+    int result = 0;
+    bool first = true;
+    for (const char *file : command.files)
+    {
+        Input input;
+        if (!open_input(command, file, input_fd, input))
+        {
+            result = 1;
+            continue;
+        }
+        write_header(command, input, first, out);
+        first = false;
+
+        bool ok = command.tool == "head" ? head_input(command, input, out) : tail_input(command, input, out);
+        close_input(input);
+        if (!ok && !interrupted.load(memory_order_relaxed) && out.ok() && command.tool == "tail")
+        {
+            result = 1;
+        }
+        if (!out.ok())
+        {
+            break;
+        }
+    }
+    return result;
+}
+
+// grep state carried across the blocks of one input
+struct GrepScan
+{
+    const TextCommand *command;
+    TextOutput *out;
+    string prefix; // "file:" when several files are searched
+    size_t matches = 0;
+    size_t line_number = 0; // lines before the current block
+    bool stop = false;
+};
+
+static void grep_emit(GrepScan &scan, const char *start, const char *end, size_t line_number)
+{
+    scan.matches++;
+    const TextCommand &command = *scan.command;
+    if (command.quiet)
+    {
+        scan.stop = true;
+        return;
+    }
+    if (command.count_only)
+    {
+        return;
+    }
+
+    if (!scan.prefix.empty())
+    {
+        scan.out->write(scan.prefix);
+    }
+    if (command.line_numbers)
+    {
+        scan.out->write(to_string(line_number) + ":");
+    }
+    scan.out->write(start, end - start);
+    if (end == start || end[-1] != '\n')
+    {
+        scan.out->write("\n", 1);
+    }
+    if (!scan.out->ok())
+    {
+        scan.stop = true;
+    }
+}
+
+// Block of whole lines; matches are found across the block and then widened to
+// their line, so lines without a candidate are never visited one by one
+static bool grep_block(GrepScan &scan, const char *data, size_t size)
+{
+    const TextCommand &command = *scan.command;
+    const char *p = data;
+    const char *end = data + size;
+    const char *counted = data; // line_number covers everything before this point
+
+    auto line_number_at = [&](const char *line)
+    {
+        scan.line_number += count_newlines(counted, line - counted);
+        counted = line;
+        return scan.line_number + 1;
+    };
+
+    while (p < end && !scan.stop)
+    {
+        const char *hit = find_literal(p, end - p, command.pattern);
+        const char *hit_line = end;
+        if (hit)
+        {
+            const char *newline = hit > p ? (const char *)memrchr(p, '\n', hit - p) : nullptr;
+            hit_line = newline ? newline + 1 : p;
+        }
+
+        if (command.invert)
+        {
+            // Every line before the hit's line is a non-matching line
+            while (p < hit_line && !scan.stop)
+            {
+                const char *newline = (const char *)memchr(p, '\n', hit_line - p);
+                const char *line_end = newline ? newline + 1 : hit_line;
+                grep_emit(scan, p, line_end, command.line_numbers ? line_number_at(p) : 0);
+                p = line_end;
+            }
+        }
+        if (!hit || scan.stop)
+        {
+            break;
+        }
+
+        const char *newline = (const char *)memchr(hit, '\n', end - hit);
+        const char *line_end = newline ? newline + 1 : end;
+        if (!command.invert)
+        {
+            grep_emit(scan, hit_line, line_end, command.line_numbers ? line_number_at(hit_line) : 0);
+        }
+        p = line_end;
+    }
+
+    if (command.line_numbers)
+    {
+        scan.line_number += count_newlines(counted, end - counted);
+    }
+    return !scan.stop;
+}
+
+// Exit status as grep: 0 a line was selected, 1 none, 2 an error
+static int run_grep(const TextCommand &command, int input_fd, TextOutput &out)
+{
+    bool error = false;
+    bool selected = false;
+    for (const char *file : command.files)
+    {
+        Input input;
+        if (!open_input(command, file, input_fd, input))
+        {
+            error = true;
+            continue;
+        }
+
+        GrepScan scan;
+        scan.command = &command;
+        scan.out = &out;
+        if (command.files.size() > 1)
+        {
+            scan.prefix = input.name + ":";
+        }
+
+        bool ok = for_each_block(input, true, out, [&](const char *data, size_t size)
+                                 { return grep_block(scan, data, size); });
+        close_input(input);
+        error = error || !ok;
+        selected = selected || scan.matches > 0;
+
+        if (command.count_only && !command.quiet)
+        {
+            out.write(scan.prefix + to_string(scan.matches) + "\n");
+        }
+        if ((command.quiet && selected) || !out.ok())
+        {
+            break;
+        }
+    }
+
+    if (command.quiet && selected)
+    {
+        return 0;
+    }
+    return error ? 2 : (selected ? 0 : 1);
+}
+
+// Runs cat, wc, head, tail, grep -F or sort inside the shell, reading input_fd for "-" or
+// no operands and writing output_fd. Used for builtins and for in-process pipeline stages
+int run_text_builtin(const vector<char *> &args, int input_fd, int output_fd)
+{
+    TextCommand command;
+    bool sort = !args.empty() && args[0] && strcmp(args[0], "sort") == 0;
+    if (!sort && !parse_text_command(args, command))
+    {
+        return 2;
+    }
+    if (command.files.empty())
+    {
+        command.files.push_back("-");
+    }
+
+    TraceSpan span("text_builtin");
+    span.command(sort ? string("sort") : command.tool);
+    interrupted.store(false, memory_order_relaxed);
+    if (output_fd == STDOUT_FILENO)
+    {
+        cout.flush(); // earlier builtin output must come first
+    }
+
+    TextOutput out(output_fd);
+    int result;
+    if (sort)
+    {
+        result = run_sort(args, input_fd, out);
+    }
+    else if (command.tool == "cat")
+    {
+        result = run_cat(command, input_fd, out);
+    }
+    else if (command.tool == "wc")
+    {
+        result = run_wc(command, input_fd, out);
+    }
+    else if (command.tool == "grep")
+    {
+        result = run_grep(command, input_fd, out);
+    }
+    else
+    {
+        result = run_head_tail(command, input_fd, out);
+    }
+    out.flush();
+
+    // Ctrl+C ends the tool like a killed process, the prompt starts on a new line
+    if (interrupted.load(memory_order_relaxed))
+    {
+        if (isatty(output_fd) && ::write(output_fd, "\n", 1) < 0)
+        {
+            perror("write");
+        }
+        return 128 + SIGINT;
+    }
+    return result;
+}
@@ -0,0 +1,353 @@
+#include "timing.h"
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+// Report being collected for the current command line, if it started with time
+static bool collecting = false;
+static TimingFormat report_format = TimingFormat::Table;
+static vector<StageTiming> stages;
+static struct rusage builtin_usage_before;
+
+static struct timespec now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts;
+}
+
+static double seconds_between(const struct timespec &from, const struct timespec &to)
+{
+    return (to.tv_sec - from.tv_sec) + (to.tv_nsec - from.tv_nsec) / 1e9;
+}
+
+static double seconds(const struct timeval &tv)
+{
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static struct timeval timeval_diff(const struct timeval &after, const struct timeval &before)
+{
+    struct timeval diff;
+    timersub(&after, &before, &diff);
+    return diff;
+}
+
+// Strips "time [-p|-j]" from the front of a command and starts a report
+bool parse_time_prefix(vector<char *> &tokens)
+{
+    if (tokens.empty() || tokens[0] == nullptr || strcmp(tokens[0], "time") != 0)
+    {
+        return false;
+    }
+
+    TimingFormat format = TimingFormat::Table;
+    size_t consumed = 1;
+    while (consumed < tokens.size() && tokens[consumed] != nullptr && tokens[consumed][0] == '-')
+    {
+        if (strcmp(tokens[consumed], "-p") == 0)
+        {
+            format = TimingFormat::Posix;
+        }
+        else if (strcmp(tokens[consumed], "-j") == 0)
+        {
+            format = TimingFormat::Json;
+        }
+        else
+        {
+            break;
+        }
+        consumed++;
+    }
+
+    tokens.erase(tokens.begin(), tokens.begin() + consumed);
+
+    collecting = true;
+    report_format = format;
+    stages.clear();
+    return true;
+}
+
+bool timing_active()
+{
+    return collecting;
+}
+
+void timing_stage_spawned(pid_t pid, const string &command)
+{
+    if (!collecting)
+    {
+        return;
+    }
+
+    StageTiming stage;
+    stage.command = command;
+    stage.pid = pid;
+    stage.started = now();
+    stages.push_back(stage);
+}
+
+void timing_stage_reaped(pid_t pid, int status, const struct rusage &usage)
+{
+    if (!collecting)
+    {
+        return;
+    }
+
+    for (auto &stage : stages)
+    {
+        if (stage.pid == pid && !stage.done)
+        {
+            stage.finished = now();
+            stage.usage = usage;
+            stage.status = status;
+            stage.done = true;
+            return;
+        }
+    }
+}
+
+void timing_builtin_begin(const string &command)
+{
+    if (!collecting)
+    {
+        return;
+    }
+
+    StageTiming stage;
+    stage.command = command;
+    stage.started = now();
+    stages.push_back(stage);
+    getrusage(RUSAGE_SELF, &builtin_usage_before);
+}
+
+// Usage between two getrusage calls; maxrss is the peak so far
+static struct rusage usage_diff(const struct rusage &after, const struct rusage &before)
+{
+    struct rusage usage = {};
+    usage.ru_utime = timeval_diff(after.ru_utime, before.ru_utime);
+    usage.ru_stime = timeval_diff(after.ru_stime, before.ru_stime);
+    usage.ru_maxrss = after.ru_maxrss;
+    usage.ru_minflt = after.ru_minflt - before.ru_minflt;
+    usage.ru_majflt = after.ru_majflt - before.ru_majflt;
+    usage.ru_nvcsw = after.ru_nvcsw - before.ru_nvcsw;
+    usage.ru_nivcsw = after.ru_nivcsw - before.ru_nivcsw;
+    return usage;
+}
+
+void timing_builtin_end(int status)
+{
+    if (!collecting || stages.empty())
+    {
+        return;
+    }
+
+    StageTiming &stage = stages.back();
+    struct rusage after;
+    getrusage(RUSAGE_SELF, &after);
+
+    stage.finished = now();
+    stage.usage = usage_diff(after, builtin_usage_before);
+    stage.status = (status & 0xff) << 8;
+    stage.done = true;
+}
+
+// Called on a pipeline stage's own thread, so RUSAGE_THREAD counts that stage alone; the
+// row reserved for it is filled in once the thread is joined
+void timing_thread_start(StageTiming &stage, const string &command)
+{
+    stage.command = command;
+    stage.started = now();
+    getrusage(RUSAGE_THREAD, &stage.usage);
+}
+
+void timing_thread_stop(StageTiming &stage, int status)
+{
+    struct rusage after;
+    getrusage(RUSAGE_THREAD, &after);
+    stage.finished = now();
+    stage.usage = usage_diff(after, stage.usage);
+    stage.status = (status & 0xff) << 8;
+    stage.done = true;
+}
+
+// Holds the report row of a thread stage where the stage sits in the pipeline, so rows
+// stay in pipeline order next to forked stages; -1 when no report is being collected
+int timing_reserve_stage(const string &command)
+{
+    if (!collecting)
+    {
+        return -1;
+    }
+    StageTiming stage;
+    stage.command = command;
+    stage.started = now();
+    stages.push_back(stage);
+    return (int)stages.size() - 1;
+}
+
+void timing_fill_stage(int row, const StageTiming &stage)
+{
+    if (collecting && row >= 0 && row < (int)stages.size())
+    {
+        stages[row] = stage;
+    }
+}
+
+static string status_text(const StageTiming &stage)
+{
+    if (!stage.done)
+    {
+        return "running";
+    }
+    if (WIFSIGNALED(stage.status))
+    {
+        return "signal " + to_string(WTERMSIG(stage.status));
+    }
+    return to_string(WEXITSTATUS(stage.status));
+}
+
+// value with a fixed number of decimals, as %.Nf prints it
+static string fixed_text(double value, int decimals)
+{
+    ostringstream out;
+    out << fixed << setprecision(decimals) << value;
+    return out.str();
+}
+
+// Table columns before COMMAND, a negative width is left-aligned
+static const int column_widths[] = {-6, -8, 9, 9, 9, 10, 8, 7, 7, 7};
+
+// One table row; cells are padded but never cut, so a long command is printed whole
+static void print_row(const vector<string> &cells, const string &command)
+{
+    ostringstream line;
+    for (size_t i = 0; i < cells.size(); i++)
+    {
+        int width = column_widths[i];
+        line << (i ? " " : "") << (width < 0 ? left : right) << setw(abs(width)) << cells[i];
+    }
+    line << "  " << command << "\n";
+    cerr << line.str();
+}
+
+static vector<string> usage_cells(const string &label, const string &pid, double real, const struct rusage &usage)
+{
+    return {label, pid, fixed_text(real, 3) + "s", fixed_text(seconds(usage.ru_utime), 3) + "s",
+            fixed_text(seconds(usage.ru_stime), 3) + "s", to_string(usage.ru_maxrss) + "KB",
+            to_string(usage.ru_minflt), to_string(usage.ru_majflt), to_string(usage.ru_nvcsw),
+            to_string(usage.ru_nivcsw)};
+}
+
+static string json_escape(const string &text)
+{
+    string out;
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += c;
+        }
+        else if ((unsigned char)c < 0x20)
+        {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        }
+        else
+        {
+            out += c;
+        }
+    }
+    return out;
+}
+
+// Prints the report for the command that just finished and stops collecting
+void timing_finish()
+{
+    if (!collecting)
+    {
+        return;
+    }
+    collecting = false;
+
+    // Totals: wall clock from first spawn to last exit, resources summed per stage
+    struct timespec first = {0, 0}, last = {0, 0};
+    StageTiming total;
+    bool have_first = false;
+    for (const auto &stage : stages)
+    {
+        if (!have_first || seconds_between(stage.started, first) > 0)
+        {
+            first = stage.started;
+            have_first = true;
+        }
+        if (stage.done && seconds_between(last, stage.finished) > 0)
+        {
+            last = stage.finished;
+        }
+        timeradd(&total.usage.ru_utime, &stage.usage.ru_utime, &total.usage.ru_utime);
+        timeradd(&total.usage.ru_stime, &stage.usage.ru_stime, &total.usage.ru_stime);
+        total.usage.ru_maxrss = max(total.usage.ru_maxrss, stage.usage.ru_maxrss);
+        total.usage.ru_minflt += stage.usage.ru_minflt;
+        total.usage.ru_majflt += stage.usage.ru_majflt;
+        total.usage.ru_nvcsw += stage.usage.ru_nvcsw;
+        total.usage.ru_nivcsw += stage.usage.ru_nivcsw;
+    }
+    double real = have_first ? max(0.0, seconds_between(first, last)) : 0.0;
+
+    if (report_format == TimingFormat::Posix)
+    {
+        cerr << "real " << fixed_text(real, 2) << "\nuser " << fixed_text(seconds(total.usage.ru_utime), 2)
+             << "\nsys " << fixed_text(seconds(total.usage.ru_stime), 2) << "\n";
+        return;
+    }
+
+    if (report_format == TimingFormat::Json)
+    {
+        cerr << "{\"real\":" << real
+             << ",\"user\":" << seconds(total.usage.ru_utime)
+             << ",\"sys\":" << seconds(total.usage.ru_stime)
+             << ",\"maxrss_kb\":" << total.usage.ru_maxrss
+             << ",\"stages\":[";
+        for (size_t i = 0; i < stages.size(); i++)
+        {
+            const StageTiming &stage = stages[i];
+            cerr << (i ? "," : "") << "{\"index\":" << i
+                 << ",\"command\":\"" << json_escape(stage.command) << "\""
+                 << ",\"pid\":" << stage.pid
+                 << ",\"builtin\":" << (stage.pid == -1 ? "true" : "false")
+                 << ",\"status\":\"" << status_text(stage) << "\""
+                 << ",\"real\":" << (stage.done ? seconds_between(stage.started, stage.finished) : 0.0)
+                 << ",\"user\":" << seconds(stage.usage.ru_utime)
+                 << ",\"sys\":" << seconds(stage.usage.ru_stime)
+                 << ",\"maxrss_kb\":" << stage.usage.ru_maxrss
+                 << ",\"minflt\":" << stage.usage.ru_minflt
+                 << ",\"majflt\":" << stage.usage.ru_majflt
+                 << ",\"nvcsw\":" << stage.usage.ru_nvcsw
+                 << ",\"nivcsw\":" << stage.usage.ru_nivcsw << "}";
+        }
+        cerr << "]}" << endl;
+        return;
+    }
+
+    print_row({"STAGE", "PID", "REAL", "USER", "SYS", "MAXRSS", "MINFLT", "MAJFLT", "VCSW", "IVCSW"}, "COMMAND");
+    for (size_t i = 0; i < stages.size(); i++)
+    {
+        const StageTiming &stage = stages[i];
+        string pid = stage.pid == -1 ? "builtin" : to_string(stage.pid);
+        double stage_real = stage.done ? seconds_between(stage.started, stage.finished) : 0.0;
+        print_row(usage_cells(to_string(i), pid, stage_real, stage.usage), stage.command + (stage.done ? "" : " (running)"));
+    }
+    print_row(usage_cells("total", "", real, total.usage), "");
+}
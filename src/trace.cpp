@@ -0,0 +1,203 @@
+#include "trace.h"
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+
+using namespace std;
+
+bool trace_enabled = false;
+
+static int trace_fd = -1;
+static pid_t trace_owner = -1; // only the shell that opened the file closes the array
+static string trace_file;
+static bool close_registered = false;
+
+// Events are kept per thread and appended to the file with a single O_APPEND write,
+// so recording threads never share a lock; forked children append their own spans
+static const size_t FLUSH_THRESHOLD = 1024;
+
+struct ThreadBuffer
+{
+    vector<TraceEvent> events;
+    pid_t tid = 0;
+
+    ~ThreadBuffer()
+    {
+        trace_flush();
+    }
+};
+
+static thread_local ThreadBuffer thread_buffer;
+
+uint64_t trace_now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void append_json_string(string &out, const string &text)
+{
+    out += '"';
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += c;
+        }
+        else if ((unsigned char)c < 0x20)
+        {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        }
+        else
+        {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+static void write_all(const string &data)
+{
+    if (trace_fd == -1 || data.empty())
+    {
+        return;
+    }
+
+    // One write keeps concurrent appends from interleaving mid-event
+    if (write(trace_fd, data.data(), data.size()) != (ssize_t)data.size())
+    {
+        perror("trace");
+    }
+}
+
+void trace_record(const TraceEvent &event)
+{
+    if (thread_buffer.tid == 0)
+    {
+        thread_buffer.tid = (pid_t)syscall(SYS_gettid);
+    }
+
+    thread_buffer.events.push_back(event);
+    if (thread_buffer.events.size() >= FLUSH_THRESHOLD)
+    {
+        trace_flush();
+    }
+}
+
+// Serializes the calling thread's buffer as Chrome trace-event JSON array entries
+void trace_flush()
+{
+    if (thread_buffer.events.empty())
+    {
+        return;
+    }
+
+    string out;
+    out.reserve(thread_buffer.events.size() * 128);
+    pid_t pid = getpid();
+    for (const TraceEvent &event : thread_buffer.events)
+    {
+        out += "{\"name\":\"";
+        out += event.name;
+        out += "\",\"cat\":\"shell\",\"ph\":\"X\",\"ts\":" + to_string(event.start_us) +
+               ",\"dur\":" + to_string(event.duration_us) +
+               ",\"pid\":" + to_string(pid) +
+               ",\"tid\":" + to_string(thread_buffer.tid) + ",\"args\":{";
+
+        bool first = true;
+        if (event.stage >= 0)
+        {
+            out += "\"stage\":" + to_string(event.stage);
+            first = false;
+        }
+        if (event.child > 0)
+        {
+            out += string(first ? "" : ",") + "\"child_pid\":" + to_string(event.child);
+            first = false;
+        }
+        if (!event.command.empty())
+        {
+            out += string(first ? "" : ",") + "\"command\":";
+            append_json_string(out, event.command);
+        }
+        out += "}},\n";
+    }
+
+    thread_buffer.events.clear();
+    write_all(out);
+}
+
+// Forked children start with a copy of the parent's unflushed events
+void trace_after_fork()
+{
+    thread_buffer.events.clear();
+    thread_buffer.tid = 0;
+}
+
+bool trace_open(const string &path)
+{
+    trace_close();
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        perror(("trace: " + path).c_str());
+        return false;
+    }
+
+    trace_fd = fd;
+    trace_owner = getpid();
+    trace_file = path;
+    trace_enabled = true;
+
+    // JSON array format, the closing bracket is optional for trace viewers
+    write_all("[\n");
+
+    if (!close_registered)
+    {
+        atexit(trace_close);
+        close_registered = true;
+    }
+    return true;
+}
+
+void trace_close()
+{
+    if (trace_fd == -1)
+    {
+        return;
+    }
+
+    trace_flush();
+
+    if (getpid() != trace_owner)
+    {
+        // A forked child exiting, leave the file to the shell
+        return;
+    }
+
+    string metadata = "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" + to_string(getpid()) +
+                      ",\"args\":{\"name\":\"shell\"}}\n]\n";
+    write_all(metadata);
+
+    close(trace_fd);
+    trace_fd = -1;
+    trace_enabled = false;
+    trace_file.clear();
+}
+
+const string &trace_path()
+{
+    return trace_file;
+}
@@ -0,0 +1,498 @@
+#include "variables.h"
+#include "pathcache.h"
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+extern char **environ;
+
+// Shell variables live in an open-addressing table with linear probing;
+// erased entries leave tombstones so probe chains stay intact
+struct VariableSlot
+{
+    string name;
+    string value;
+    uint32_t hash = 0;
+    bool used = false;
+    bool deleted = false;
+    bool exported = false;
+};
+
+static vector<VariableSlot> slots(64);
+static size_t occupied = 0; // live entries plus tombstones
+
+// envp handed to every spawned command, rebuilt only after an exported variable changes
+static vector<string> env_strings;
+static vector<char *> env_pointers;
+static vector<string> retired_env_strings; // previous generation, may still be read by getenv
+static vector<char *> retired_env_pointers;
+static bool env_dirty = true;
+
+static int exit_status = 0;
+static pid_t background_pid = -1;
+static vector<string> positional; // $1, $2, ... of the running function
+
+static uint32_t hash_name(const char *name, size_t length)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Slot holding name, or the slot where it should be inserted
+static size_t find_slot(const char *name, size_t length, uint32_t hash)
+{
+    size_t mask = slots.size() - 1;
+    size_t index = hash & mask;
+    size_t first_tombstone = slots.size();
+
+    while (slots[index].used || slots[index].deleted)
+    {
+        VariableSlot &slot = slots[index];
+        if (slot.deleted)
+        {
+            if (first_tombstone == slots.size())
+            {
+                first_tombstone = index;
+            }
+        }
+        else if (slot.hash == hash && slot.name.size() == length &&
+                 memcmp(slot.name.data(), name, length) == 0)
+        {
+            return index;
+        }
+        index = (index + 1) & mask;
+    }
+
+    return first_tombstone != slots.size() ? first_tombstone : index;
+}
+
+static void grow_table()
+{
+    vector<VariableSlot> old_slots;
+    old_slots.swap(slots);
+    slots.resize(old_slots.size() * 2);
+    occupied = 0;
+
+    for (VariableSlot &slot : old_slots)
+    {
+        if (slot.used)
+        {
+            size_t index = find_slot(slot.name.data(), slot.name.size(), slot.hash);
+            slots[index] = std::move(slot);
+            occupied++;
+        }
+    }
+}
+
+static VariableSlot *lookup(const char *name, size_t length)
+{
+    size_t index = find_slot(name, length, hash_name(name, length));
+    return slots[index].used ? &slots[index] : nullptr;
+}
+
+static bool valid_name(const string &name)
+{
+    if (name.empty() || !(isalpha((unsigned char)name[0]) || name[0] == '_'))
+    {
+        return false;
+    }
+    for (char c : name)
+    {
+        if (!isalnum((unsigned char)c) && c != '_')
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Imports the inherited environment as exported variables
+void init_variables()
+{
+    for (char **entry = environ; entry && *entry; entry++)
+    {
+        const char *eq = strchr(*entry, '=');
+        if (eq)
+        {
+            set_variable(string(*entry, eq - *entry), eq + 1, true);
+        }
+    }
+    exported_environ();
+}
+
+const char *get_variable(const string &name)
+{
+    VariableSlot *slot = lookup(name.data(), name.size());
+    return slot ? slot->value.c_str() : nullptr;
+}
+
+bool set_variable(const string &name, const string &value, bool exported)
+{
+    if (!valid_name(name))
+    {
+        return false;
+    }
+    if (name == "PATH")
+    {
+        path_changed();
+    }
+
+    uint32_t hash = hash_name(name.data(), name.size());
+    size_t index = find_slot(name.data(), name.size(), hash);
+    VariableSlot &slot = slots[index];
+
+    if (slot.used)
+    {
+        if (slot.exported && slot.value != value)
+        {
+            env_dirty = true;
+        }
+        slot.value = value;
+        if (exported && !slot.exported)
+        {
+            slot.exported = true;
+            env_dirty = true;
+        }
+        return true;
+    }
+
+    if (!slot.deleted)
+    {
+        occupied++;
+    }
+    slot.name = name;
+    slot.value = value;
+    slot.hash = hash;
+    slot.used = true;
+    slot.deleted = false;
+    slot.exported = exported;
+    env_dirty = env_dirty || exported;
+
+    // Keep the load factor (tombstones included) under 3/4
+    if (occupied * 4 >= slots.size() * 3)
+    {
+        grow_table();
+    }
+    return true;
+}
+
+void unset_variable(const string &name)
+{
+    VariableSlot *slot = lookup(name.data(), name.size());
+    if (!slot)
+    {
+        return;
+    }
+    if (name == "PATH")
+    {
+        path_changed();
+    }
+
+    env_dirty = env_dirty || slot->exported;
+    slot->used = false;
+    slot->deleted = true;
+    slot->exported = false;
+    slot->name.clear();
+    slot->value.clear();
+}
+
+static bool export_variable(const string &name)
+{
+    VariableSlot *slot = lookup(name.data(), name.size());
+    if (!slot)
+    {
+        // An unset NAME is exported as an empty variable
+        return set_variable(name, "", true);
+    }
+    if (!slot->exported)
+    {
+        slot->exported = true;
+        env_dirty = true;
+        if (name == "PATH")
+        {
+            path_changed();
+        }
+    }
+    return true;
+}
+
+// Cached NULL-terminated envp; also installed as environ so getenv and the
+// PATH search in execvpe see the same variables
+char **exported_environ()
+{
+    if (!env_dirty)
+    {
+        return env_pointers.data();
+    }
+
+    retired_env_strings.swap(env_strings);
+    retired_env_pointers.swap(env_pointers);
+    env_strings.clear();
+    env_pointers.clear();
+    for (const VariableSlot &slot : slots)
+    {
+        if (slot.used && slot.exported)
+        {
+            env_strings.push_back(slot.name + "=" + slot.value);
+        }
+    }
+
+    for (string &entry : env_strings)
+    {
+        env_pointers.push_back(&entry[0]);
+    }
+    env_pointers.push_back(nullptr);
+
+    environ = env_pointers.data();
+    env_dirty = false;
+    return env_pointers.data();
+}
+
+void set_last_status(int exit_code)
+{
+    exit_status = exit_code;
+}
+
+void set_last_status_from_wait(int status)
+{
+    if (WIFEXITED(status))
+    {
+        exit_status = WEXITSTATUS(status);
+    }
+    else if (WIFSIGNALED(status))
+    {
+        exit_status = 128 + WTERMSIG(status);
+    }
+    else if (WIFSTOPPED(status))
+    {
+        exit_status = 128 + WSTOPSIG(status);
+    }
+}
+
+int last_status()
+{
+    return exit_status;
+}
+
+void set_last_background_pid(pid_t pid)
+{
+    background_pid = pid;
+}
+
+// $?, $$ and $!
+bool expand_special_variable(char name, string &out)
+{
+    switch (name)
+    {
+    case '?':
+        out += to_string(exit_status);
+        return true;
+    case '$':
+        out += to_string(getpid());
+        return true;
+    case '!':
+        if (background_pid > 0)
+        {
+            out += to_string(background_pid);
+        }
+        return true;
+    case '#':
+        out += to_string(positional.size());
+        return true;
+    case '@':
+    case '*':
+        for (size_t i = 0; i < positional.size(); i++)
+        {
+            if (i > 0)
+                out += ' ';
+            out += positional[i];
+        }
+        return true;
+    case '0':
+        out += "shell";
+        return true;
+    case '1':
+    case '2':
+    case '3':
+    case '4':
+    case '5':
+    case '6':
+    case '7':
+    case '8':
+    case '9':
+        if ((size_t)(name - '0') <= positional.size())
+        {
+            out += positional[name - '1'];
+        }
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Replaces $1, $2, ... and returns the previous ones, for a function call to restore
+vector<string> set_positional_parameters(vector<string> parameters)
+{
+    positional.swap(parameters);
+    return parameters;
+}
+
+bool is_assignment(const char *word)
+{
+    if (word == nullptr || !(isalpha((unsigned char)word[0]) || word[0] == '_'))
+    {
+        return false;
+    }
+    for (const char *p = word + 1; *p; p++)
+    {
+        if (*p == '=')
+        {
+            return true;
+        }
+        if (!isalnum((unsigned char)*p) && *p != '_')
+        {
+            return false;
+        }
+    }
+    return false;
+}
+
+static void assign(const char *word, bool exported)
+{
+    const char *eq = strchr(word, '=');
+    set_variable(string(word, eq - word), eq + 1, exported);
+}
+
+// Applies a command made only of NAME=value words, returns false for anything else
+bool apply_assignments(vector<char *> &args, bool exported)
+{
+    if (args.empty() || args[0] == nullptr)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < args.size() && args[i] != nullptr; i++)
+    {
+        if (!is_assignment(args[i]))
+        {
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < args.size() && args[i] != nullptr; i++)
+    {
+        assign(args[i], exported);
+    }
+    exported_environ();
+    return true;
+}
+
+// NAME=value words in front of a command only apply to that command, so they
+// are set in the forked child just before exec
+char **apply_prefix_assignments(char **argv)
+{
+    while (*argv && is_assignment(*argv))
+    {
+        assign(*argv, true);
+        argv++;
+    }
+    return argv;
+}
+
+// NAME=value words in front of a builtin or function hold only while it runs. They are
+// taken out of args and the values they replaced are returned for restore_variables
+vector<SavedVariable> apply_temporary_assignments(vector<char *> &args)
+{
+    vector<SavedVariable> saved;
+    size_t count = 0;
+    while (count < args.size() && args[count] != nullptr && is_assignment(args[count]))
+    {
+        const char *eq = strchr(args[count], '=');
+        string name(args[count], eq - args[count]);
+        const char *value = get_variable(name);
+        saved.push_back({name, value != nullptr, value ? value : ""});
+        set_variable(name, eq + 1);
+        count++;
+    }
+    args.erase(args.begin(), args.begin() + count);
+    exported_environ();
+    return saved;
+}
+
+void restore_variables(const vector<SavedVariable> &saved)
+{
+    for (auto it = saved.rbegin(); it != saved.rend(); ++it)
+    {
+        if (it->was_set)
+            set_variable(it->name, it->value);
+        else
+            unset_variable(it->name);
+    }
+    exported_environ();
+}
+
+int builtin_export(BuiltinArgs args)
+{
+    int argc = 0;
+    while (argc < (int)args.size() && args[argc] != nullptr)
+        argc++;
+
+    if (argc == 1)
+    {
+        vector<const VariableSlot *> exported;
+        for (const VariableSlot &slot : slots)
+        {
+            if (slot.used && slot.exported)
+            {
+                exported.push_back(&slot);
+            }
+        }
+        sort(exported.begin(), exported.end(), [](const VariableSlot *a, const VariableSlot *b)
+             { return a->name < b->name; });
+        for (const VariableSlot *slot : exported)
+        {
+            cout << "export " << slot->name << "=\"" << slot->value << "\"" << endl;
+        }
+        return 0;
+    }
+
+    int result = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (is_assignment(args[i]))
+        {
+            assign(args[i], true);
+        }
+        else if (!export_variable(args[i]))
+        {
+            cerr << "export: '" << args[i] << "': not a valid identifier\n";
+            result = -1;
+        }
+    }
+
+    exported_environ();
+    return result;
+}
+
+int builtin_unset(BuiltinArgs args)
+{
+    for (size_t i = 1; i < args.size() && args[i] != nullptr; i++)
+    {
+        unset_variable(args[i]);
+    }
+
+    exported_environ();
+    return 0;
+}
@@ -0,0 +1,278 @@
+#include "walker.h"
+#include <vector>
+#include <string>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+
+using namespace std;
+
+static const unsigned MAX_WALKERS = 16;
+static const size_t DIRENT_BUFFER = 64 * 1024;
+
+struct WalkTask
+{
+    string path;
+    int depth;
+    void *data;
+};
+
+struct walk_dirent64
+{
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// Each worker pops the newest directory of its own deque, which keeps the walk close to
+// depth-first and the queued frontier small, and steals the oldest one of another worker
+// when its own runs dry; idle workers sleep until something is queued or all are idle
+class TreeWalk
+{
+public:
+    TreeWalk(unsigned threads, const WalkVisitor &visit) : visit(visit)
+    {
+        for (unsigned i = 0; i < threads; i++)
+        {
+            workers.emplace_back(new Worker());
+        }
+    }
+
+    void run(WalkTask root)
+    {
+        push(0, std::move(root));
+        vector<thread> threads;
+        for (size_t i = 1; i < workers.size(); i++)
+        {
+            threads.emplace_back(&TreeWalk::work, this, i);
+        }
+        work(0);
+        for (thread &t : threads)
+        {
+            t.join();
+        }
+    }
+
+    void push(size_t self, WalkTask task)
+    {
+        {
+            lock_guard<mutex> lock(workers[self]->lock);
+            workers[self]->tasks.push_back(std::move(task));
+        }
+        queued++;
+        if (sleeping > 0)
+        {
+            lock_guard<mutex> lock(idle_mutex);
+            idle_ready.notify_one();
+        }
+    }
+
+    void stop()
+    {
+        stopped = true;
+    }
+
+private:
+    struct Worker
+    {
+        mutex lock;
+        deque<WalkTask> tasks;
+    };
+
+    bool pop(size_t self, WalkTask &task)
+    {
+        for (size_t n = 0; n < workers.size(); n++)
+        {
+            size_t victim = (self + n) % workers.size();
+            lock_guard<mutex> lock(workers[victim]->lock);
+            deque<WalkTask> &tasks = workers[victim]->tasks;
+            if (tasks.empty())
+            {
+                continue;
+            }
+            if (victim == self)
+            {
+                task = std::move(tasks.back());
+                tasks.pop_back();
+            }
+            else
+            {
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            queued--;
+            return true;
+        }
+        return false;
+    }
+
+    void work(size_t self);
+    void visit_task(WalkTask &task, string &names, vector<size_t> &offsets, vector<WalkEntry> &entries);
+
+    vector<unique_ptr<Worker>> workers;
+    const WalkVisitor &visit;
+    atomic<size_t> queued{0};
+    atomic<size_t> sleeping{0};
+    atomic<bool> stopped{false};
+    mutex idle_mutex;
+    condition_variable idle_ready;
+    size_t idle = 0; // under idle_mutex
+    bool done = false;
+};
+
+// The walk and worker the current thread belongs to, for walk_descend and walk_stop
+static thread_local TreeWalk *current_walk = nullptr;
+static thread_local size_t current_worker = 0;
+
+void TreeWalk::work(size_t self)
+{
+    current_walk = this;
+    current_worker = self;
+
+    string names;
+    vector<size_t> offsets;
+    vector<WalkEntry> entries;
+    while (true)
+    {
+        WalkTask task;
+        if (pop(self, task))
+        {
+            visit_task(task, names, offsets, entries);
+            continue;
+        }
+
+        unique_lock<mutex> lock(idle_mutex);
+        idle++;
+        sleeping++;
+        if (idle == workers.size() && queued == 0)
+        {
+            done = true;
+            idle_ready.notify_all();
+        }
+        idle_ready.wait(lock, [&]()
+                        { return done || queued > 0; });
+        sleeping--;
+        if (done)
+        {
+            break;
+        }
+        idle--;
+    }
+
+    current_walk = nullptr;
+}
+
+// Lists the directory with getdents64 and hands it to the visitor; after walk_stop the
+// visitor still sees every queued directory, with error ECANCELED, so it can release its state
+void TreeWalk::visit_task(WalkTask &task, string &names, vector<size_t> &offsets, vector<WalkEntry> &entries)
+{
+    WalkDir dir = {task.path, -1, 0, task.depth, task.data};
+    names.clear();
+    offsets.clear();
+    entries.clear();
+
+    if (stopped)
+    {
+        dir.error = ECANCELED;
+        visit(dir, entries);
+        return;
+    }
+
+    // Subdirectories are opened without following links, the root as given
+    int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC | (task.depth > 0 ? O_NOFOLLOW : 0);
+    dir.fd = open(task.path.c_str(), flags);
+    if (dir.fd == -1)
+    {
+        dir.error = errno;
+        visit(dir, entries);
+        return;
+    }
+
+    char buffer[DIRENT_BUFFER];
+    while (true)
+    {
+        long n = syscall(SYS_getdents64, dir.fd, buffer, sizeof(buffer));
+        if (n < 0)
+        {
+            dir.error = errno;
+            break;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        for (long pos = 0; pos < n;)
+        {
+            walk_dirent64 *record = (walk_dirent64 *)(buffer + pos);
+            pos += record->d_reclen;
+            const char *name = record->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            {
+                continue;
+            }
+            offsets.push_back(names.size());
+            names += (char)record->d_type;
+            names.append(name, strlen(name) + 1);
+        }
+    }
+
+    for (size_t offset : offsets)
+    {
+        entries.push_back({names.data() + offset + 1, (unsigned char)names[offset]});
+    }
+    visit(dir, entries);
+    close(dir.fd);
+}
+
+// Walks root and every directory the visitor queues with walk_descend
+void walk_tree(const string &root, void *root_data, unsigned threads, const WalkVisitor &visit)
+{
+    TreeWalk walk(max(1u, threads), visit);
+    walk.run({root, 0, root_data});
+}
+
+// Queues a subdirectory of the directory being visited; only valid inside a visitor
+void walk_descend(const WalkDir &parent, const char *name, void *data)
+{
+    if (current_walk)
+    {
+        current_walk->push(current_worker, {walk_join(parent.path, name), parent.depth + 1, data});
+    }
+}
+
+// Ends the walk early, directories already queued are reported with ECANCELED
+void walk_stop()
+{
+    if (current_walk)
+    {
+        current_walk->stop();
+    }
+}
+
+string walk_join(const string &dir, const char *name)
+{
+    string path = dir;
+    if (path.empty() || path.back() != '/')
+    {
+        path += '/';
+    }
+    return path + name;
+}
+
+// Directory reads mostly wait on the disk, so even small machines get a few walkers
+unsigned walk_default_threads()
+{
+    return min(MAX_WALKERS, max(4u, thread::hardware_concurrency()));
+}